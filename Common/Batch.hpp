@@ -0,0 +1,208 @@
+//*** BATCH PROCESSING OF A LIST OF IMAGES
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// In batch processing the reading and decoding of the input files
+// and the encoding and writing of the output files take a similar
+// time to the colour transfer itself.  The three activities are
+// therefore run concurrently, each in its own pool of threads,
+// with bounded queues between them (see 'Pipeline.hpp').  The
+// number of images held at once, queued or being worked on, is
+// limited so that they fit within 'MemoryBudgetMB' (as estimated
+// from the size of the first target image).  On completion the
+// utilisation of each pool
+// and the number of times each waited on a full or empty queue
+// are reported.  A pool which is busy nearly all of the time is
+// the bottleneck and should be given more threads, while one
+// which often waits on an empty input queue can be given fewer.
+//
+// Sharded Batch Processing.
+// -------------------------
+// When 'ShardedBatch' is 'true' any number of copies of a program
+// may be run on the same batch list, on one machine or on several
+// machines sharing the folder of the list, and the items are shared
+// out between them.  Each copy claims a chunk of 'ShardChunkItems'
+// items at a time, through a lease file in the folder
+// '<batch list>.work', and runs the usual pipeline over the chunk
+// (see 'WorkManifest.hpp').  For example, on Linux
+//
+//     for i in 1 2 3 4; do ./ColourTransfer & done; wait
+//
+// runs four copies, each of which may then be given fewer threads.
+// If a copy stops, its unfinished items are taken over by another
+// copy, or by a rerun, once its lease has not been renewed for
+// 'LeaseSeconds', and items already finished are not repeated.
+// Each copy writes a log of its chunks, their throughput and its
+// failed items to the work folder.  Delete the work folder to
+// process the list again from the start.
+//
+// 'RunBatch' reads the target images and releases all the images
+// of an item once it is written, and each program supplies the
+// remaining work of the three stages for its own items.  If the
+// machine is tuned, each item carries the tuned settings for the
+// size of its own target image, and its transfer is run with the
+// tuned block size (see 'Tuning.hpp').
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <opencv2/core/core.hpp>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "ImageIO.hpp"
+#include "MemoryTracker.hpp"
+#include "Pipeline.hpp"
+#include "Tuning.hpp"
+#include "WorkManifest.hpp"
+
+// A work item for batch processing.  A program derives its own
+// items from this, adding any further fields.  An item whose
+// 'targetf' is empty has failed.
+struct BatchItem
+{
+    std::string outputname;
+    cv::Mat     targetf, sourcef;
+    MappedImage mapped;
+    int         targetdepth;
+    int         index;
+    const TuningConfig *tuning;     // For its size, or NULL.
+    bool        written;            // The output file was written.
+    BatchItem() : targetdepth(8), index(-1), tuning(NULL), written(false) {}
+};
+
+// The batch list and the settings of the batch processing.
+struct BatchSettings
+{
+    std::string listname;        // The batch list file.
+    int    decodeThreads;        // Threads reading images.
+    int    transferThreads;      // Threads transferring colour.
+    int    encodeThreads;        // Threads writing images.
+    double memoryBudgetMB;       // Memory for images in flight.
+    bool   sharded;              // Share the list between processes.
+    double leaseSeconds;         // Time before a stopped process's
+                                 // items are taken over.
+    int    chunkItems;           // Items claimed at a time.
+    const BatchTuning *tuning;   // Tuned settings, or NULL.
+
+    BatchSettings() : decodeThreads(2), transferThreads(2),
+                      encodeThreads(2), memoryBudgetMB(1024),
+                      sharded(false), leaseSeconds(600), chunkItems(64),
+                      tuning(NULL) {}
+};
+
+// Estimates the memory held by one batch item (the float target
+// and source images and the processed image) from the size of a
+// target image.  The source image is assumed to be no larger.
+inline size_t EstimateItemBytes(std::string targetname)
+{
+    int width, height;
+    if(!ReadJpegSize(targetname, width, height))
+        return PipelineSettings().itemBytes;
+    return (size_t)width*height*3*sizeof(float)*3;
+}
+
+// Writes the processed image of an item in the selected bit depth.
+// Throws if the file cannot be written, which fails the item.
+inline void WriteBatchItem(const BatchItem &item, int outputDepth)
+{
+    if(!WriteImageFloat(item.outputname, item.targetf,
+                        outputDepth==0 ? item.targetdepth : outputDepth,
+                        !item.mapped.image.empty()))
+        throw std::runtime_error("cannot write "+item.outputname);
+}
+
+// Processes the items of the batch list (of which 'targets' and
+// 'outputs' are the target and output file names) in the pipeline,
+// or the share of them claimed by this process if the list is
+// sharded, and prints the pipeline and memory reports.
+//
+// For each item the target image is read, the tuned settings for
+// its size chosen, and then
+//   decode(item, i)    reads the source image of item 'i' (and
+//                      anything else the item needs) and returns
+//                      false on failure,
+//   transfer(item)     transfers the colour to 'item.targetf', with
+//                      the tuned block size,
+//   encode(item)       writes the output file.
+// 'transfer' and 'encode' are only called for items which have not
+// failed, and an exception in any stage fails the item.  (So an
+// 'encode' which cannot write the output file must throw, as
+// 'WriteBatchItem' does.)  In a sharded batch an item is recorded as
+// finished only once its output is written.
+template<class Item, class Decode, class Transfer, class Encode>
+void RunBatch(const BatchSettings &batch,
+              const std::vector<std::string> &targets,
+              const std::vector<std::string> &outputs,
+              Decode decode, Transfer transfer, Encode encode)
+{
+    PipelineSettings settings;
+    settings.decodeThreads  =batch.decodeThreads;
+    settings.transferThreads=batch.transferThreads;
+    settings.encodeThreads  =batch.encodeThreads;
+    settings.memoryBudget   =(size_t)(batch.memoryBudgetMB*1048576);
+    settings.itemBytes      =EstimateItemBytes(targets[0]);
+    ShardSettings shard;
+    shard.chunkItems  =batch.chunkItems;
+    shard.leaseSeconds=batch.leaseSeconds;
+
+    auto decodeItem=[&](size_t i)
+    {
+        MemoryScope scope("Decode", (int)i);
+        Item item;
+        item.index=(int)i;
+        item.outputname=outputs[i];
+        try
+        {
+            item.targetf=ReadImageFloat(targets[i], item.mapped,
+                                        item.targetdepth);
+            if(batch.tuning)
+                item.tuning=batch.tuning->For((double)item.targetf.total());
+            if(!item.targetf.empty() && !decode(item, i))
+                item.targetf.release();
+        }
+        catch(...) {item.targetf.release();}
+        return item;
+    };
+    auto transferItem=[&](Item &item)
+    {
+        MemoryScope scope("Transfer", item.index);
+        if(item.targetf.empty()) return;
+        try
+        {
+            TuningScope tuned(item.tuning);
+            transfer(item);
+        }
+        catch(...) {item.targetf.release();}
+    };
+    auto encodeItem=[&](Item &item)
+    {
+        MemoryScope scope("Encode", item.index);
+        if(!item.targetf.empty())
+        {
+            try {encode(item); item.written=true;}
+            catch(...) {item.targetf.release();}
+        }
+        if(!item.written) std::cout<<"Failed: "<<item.outputname<<"\n";
+        item.targetf.release();
+        item.sourcef.release();
+        UnmapImage(item.mapped);
+        PrintMemoryReport(item.index, item.outputname);
+    };
+
+    PipelineReport report = batch.sharded
+        ? RunShardedPipeline<Item>(batch.listname, outputs, decodeItem,
+                                   transferItem, encodeItem,
+                                   [](const Item &item)
+                                   {return item.written;},
+                                   settings, shard)
+        : RunPipeline<Item>(targets.size(), decodeItem, transferItem,
+                            encodeItem, settings);
+
+    PrintPipelineReport(report);
+    PrintMemoryReport(-1, "other threads");
+}
+
+#endif
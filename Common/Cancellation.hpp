@@ -0,0 +1,130 @@
+//*** COOPERATIVE CANCELLATION AND PROGRESS
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// A job run in the background (see 'CTSubmit' in
+// 'Library/ColourTransfer.h') carries a 'CancelToken' which is made
+// current on the thread running it by a 'CancelScope'.  The
+// processing calls 'CancelPoint' at safe points between its stages
+// and iterations, which records the progress made and throws
+// 'TransferCancelled' once the job has been cancelled.  The
+// parallel loops of the transfer kernel, of the moment accumulators
+// and of the strips ('ForEachStrip') stop taking new blocks of rows
+// as soon as the job is cancelled, so within those an abandoned job
+// stops using the processors within a block or two of work.
+//
+// Some stages of the enhanced program are still made of OpenCV
+// operations over the whole image: the colour conversions and
+// statistics of 'SaturationProcessing', the grey conversions and
+// statistics of 'FullShading', the cross products of
+// 'adjust_covariance' and the re-standardisation of
+// 'ChannelCondition'.  Cancellation is checked between those
+// operations, so the worst case is one such operation over the whole
+// image, the longest being a colour conversion to or from HSV.  (With
+// strip scheduling, see 'StripScheduler.hpp', the refinements are
+// made in strips and are checked for each strip.)
+//
+// Progress runs from 0 to 1.  A 'ProgressStage' maps the progress
+// reported within a stage onto its part of the whole, so each
+// routine reports its own progress from 0 to 1 however it is
+// called.  With no current token (as in the programs themselves)
+// each check is a single thread local read.
+
+#ifndef CANCELLATION_HPP
+#define CANCELLATION_HPP
+
+#include <atomic>
+#include <exception>
+
+struct CancelToken
+{
+    std::atomic<bool>  cancelled;
+    std::atomic<float> progress;    // Fraction of the work done.
+    float base, span;               // Mapping of the current stage.
+    CancelToken() : cancelled(false), progress(0.0f), base(0.0f),
+                    span(1.0f) {}
+};
+
+// Thrown at a 'CancelPoint' of a cancelled job.
+struct TransferCancelled : public std::exception
+{
+    const char *what() const throw() {return "colour transfer cancelled";}
+};
+
+// The token of the job running on this thread (NULL if none).
+inline CancelToken *&CurrentCancelToken()
+{
+    static thread_local CancelToken *token=NULL;
+    return token;
+}
+
+// Makes 'token' current on this thread for the lifetime of the
+// object.
+class CancelScope
+{
+public:
+    explicit CancelScope(CancelToken *token) : saved(CurrentCancelToken())
+    {
+        CurrentCancelToken()=token;
+    }
+    ~CancelScope() {CurrentCancelToken()=saved;}
+private:
+    CancelToken *saved;
+    CancelScope(const CancelScope &);
+    CancelScope &operator=(const CancelScope &);
+};
+
+// Maps the progress reported within a stage onto the fraction
+// 'from' to 'to' of the enclosing stage, for the lifetime of the
+// object.
+class ProgressStage
+{
+public:
+    ProgressStage(float from, float to) : token(CurrentCancelToken())
+    {
+        if(!token) return;
+        savedBase=token->base;
+        savedSpan=token->span;
+        token->base=savedBase+savedSpan*from;
+        token->span=savedSpan*(to-from);
+    }
+    ~ProgressStage()
+    {
+        if(!token) return;
+        token->base=savedBase;
+        token->span=savedSpan;
+    }
+private:
+    CancelToken *token;
+    float savedBase, savedSpan;
+    ProgressStage(const ProgressStage &);
+    ProgressStage &operator=(const ProgressStage &);
+};
+
+// True if the job of 'token' has been cancelled.  (Parallel loop
+// bodies run on OpenCV's worker threads, which have no current
+// token, so the token is read before the loop and passed in.)
+inline bool Cancelled(const CancelToken *token)
+{
+    return token && token->cancelled.load(std::memory_order_relaxed);
+}
+
+inline void ThrowIfCancelled()
+{
+    if(Cancelled(CurrentCancelToken())) throw TransferCancelled();
+}
+
+// A safe point 'fraction' of the way through the current stage.
+// (Progress never goes backwards.)
+inline void CancelPoint(float fraction)
+{
+    CancelToken *token=CurrentCancelToken();
+    if(!token) return;
+    if(Cancelled(token)) throw TransferCancelled();
+    float done=token->base+token->span*fraction;
+    if(done>token->progress.load(std::memory_order_relaxed))
+        token->progress.store(done, std::memory_order_relaxed);
+}
+
+#endif
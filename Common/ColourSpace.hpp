@@ -0,0 +1,662 @@
+//*** COLOUR SPACE POLICIES FOR THE COLOUR TRANSFER KERNEL
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// Each policy converts rows of 32 bit float BGR pixels (nominally
+// in the range 0 to 1) to and from a three channel colour space in
+// which channel 0 is the lightness and channels 1 and 2 carry the
+// colour.  The transfer kernel (see 'TransferKernel.hpp') is a
+// template on the policy, so the conversion code is compiled into
+// its per-pixel loops and there is no per-pixel function dispatch.
+//
+// A policy provides:
+//   ForwardRow(bgr, out, n)   converts 'n' BGR pixels,
+//   InverseRow(in, bgr, n)    converts 'n' pixels back to BGR,
+//   RescaleLimits(mid, half, colourMax)
+//                             returns false if the colour space has
+//                             no fixed range, otherwise the centre and
+//                             half range of the lightness channel and
+//                             the largest permitted colour value.
+//
+// Policies are provided for CIELAB (as implemented in OpenCV), for
+// the L-alpha-beta space of Ruderman et al., for YCbCr and for Oklab.
+// 'RgbOrder' adapts any of them to read RGB rather than BGR pixels.
+
+#ifndef COLOURSPACE_HPP
+#define COLOURSPACE_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+inline float ClipUnit(float v)
+{
+    return v<0.0f ? 0.0f : v>1.0f ? 1.0f : v;
+}
+
+// sRGB transfer function and its inverse.
+inline float SrgbToLinear(float v)
+{
+    return v<=0.04045f ? v/12.92f : std::pow((v+0.055f)/1.055f, 2.4f);
+}
+
+inline float LinearToSrgb(float v)
+{
+    return v<=0.0031308f ? 12.92f*v : 1.055f*std::pow(v, 1.0f/2.4f)-0.055f;
+}
+
+// Applies the 3x3 matrix 'm' (row major) to 'v'.
+inline void Apply3x3(const float *m, const float *v, float *out)
+{
+    out[0]=m[0]*v[0]+m[1]*v[1]+m[2]*v[2];
+    out[1]=m[3]*v[0]+m[4]*v[1]+m[5]*v[2];
+    out[2]=m[6]*v[0]+m[7]*v[1]+m[8]*v[2];
+}
+
+// Fast approximations of log2(x) (for x>0) and 2^x.  The exponent
+// is handled exactly by manipulating the floating point
+// representation and the mantissa by a polynomial of degree 'D',
+// so the functions are branch free and the loops that call them
+// can be vectorised by the compiler.  The polynomials interpolate
+// log2(1+t) and 2^t at the Chebyshev nodes on [0,1].
+template<int D> struct FastPoly;
+template<> struct FastPoly<3>
+{
+    static const float *Log()
+    {
+        static const float c[]={8.254628229e-04f, 1.415653190e+00f,
+                               -5.687040530e-01f, 1.527002848e-01f};
+        return c;
+    }
+    static const float *Exp()
+    {
+        static const float c[]={9.999002882e-01f, 6.963247711e-01f,
+                                2.246931558e-01f, 7.896725704e-02f};
+        return c;
+    }
+};
+template<> struct FastPoly<5>
+{
+    static const float *Log()
+    {
+        static const float c[]={1.651467088e-05f, 1.441492412e+00f,
+                               -7.064864491e-01f, 4.094702987e-01f,
+                               -1.874886046e-01f, 4.300495779e-02f};
+        return c;
+    }
+    static const float *Exp()
+    {
+        static const float c[]={9.999998984e-01f, 6.931544897e-01f,
+                                2.401418182e-01f, 5.586033708e-02f,
+                                8.949590423e-03f, 1.893754058e-03f};
+        return c;
+    }
+};
+template<> struct FastPoly<7>
+{
+    static const float *Log()
+    {
+        static const float c[]={3.685614096e-07f, 1.442647549e+00f,
+                               -7.203160644e-01f, 4.720869162e-01f,
+                               -3.219602855e-01f, 1.887527377e-01f,
+                               -7.565137468e-02f, 1.444035249e-02f};
+        return c;
+    }
+    static const float *Exp()
+    {
+        static const float c[]={9.999999999e-01f, 6.931471876e-01f,
+                                2.402263595e-01f, 5.550528168e-02f,
+                                9.613565206e-03f, 1.342937766e-03f,
+                                1.430255530e-04f, 2.164270164e-05f};
+        return c;
+    }
+};
+
+template<int D>
+inline float FastLog2(float x)
+{
+    const float *c=FastPoly<D>::Log();
+    int32_t i;
+    std::memcpy(&i, &x, sizeof(i));
+    float e=(float)((i>>23)-127);
+    i=(i&0x007FFFFF)|0x3F800000;
+    float t;
+    std::memcpy(&t, &i, sizeof(t));
+    t-=1.0f;
+    float p=c[D];
+    for(int j=D-1;j>=0;j--) p=p*t+c[j];
+    return e+p;
+}
+
+// (FastExp2InRange requires -126<=x<=127.  The floor of x is found
+// in integer arithmetic, and the range is not checked, so that the
+// loops which call it are vectorised.)
+template<int D>
+inline float FastExp2InRange(float x)
+{
+    const float *c=FastPoly<D>::Exp();
+    int32_t fl=(int32_t)x;
+    fl-=x<(float)fl;
+    float t=x-(float)fl;
+    float p=c[D];
+    for(int j=D-1;j>=0;j--) p=p*t+c[j];
+    int32_t i=(fl+127)<<23;
+    float scale;
+    std::memcpy(&scale, &i, sizeof(scale));
+    return p*scale;
+}
+
+template<int D>
+inline float FastExp2(float x)
+{
+    return FastExp2InRange<D>(std::min(std::max(x, -126.0f), 127.0f));
+}
+
+// Largest errors of the approximations above for each degree
+// (absolute error in log2, relative error in 2^x).
+inline float FastLog2Error(int degree)
+{
+    return degree==3 ? 8.3e-4f : degree==5 ? 1.7e-5f : 3.7e-7f;
+}
+
+inline float FastExp2Error(int degree)
+{
+    return degree==3 ? 1.2e-4f : degree==5 ? 1.2e-7f : 6.0e-11f;
+}
+
+// Inverts the 3x3 matrix 'm' (row major).
+inline void Invert3x3(const float *m, float *inv)
+{
+    double c[9];
+    c[0]=(double)m[4]*m[8]-(double)m[5]*m[7];
+    c[1]=(double)m[2]*m[7]-(double)m[1]*m[8];
+    c[2]=(double)m[1]*m[5]-(double)m[2]*m[4];
+    c[3]=(double)m[5]*m[6]-(double)m[3]*m[8];
+    c[4]=(double)m[0]*m[8]-(double)m[2]*m[6];
+    c[5]=(double)m[2]*m[3]-(double)m[0]*m[5];
+    c[6]=(double)m[3]*m[7]-(double)m[4]*m[6];
+    c[7]=(double)m[1]*m[6]-(double)m[0]*m[7];
+    c[8]=(double)m[0]*m[4]-(double)m[1]*m[3];
+    double det=m[0]*c[0]+m[1]*c[3]+m[2]*c[6];
+    for(int i=0;i<9;i++) inv[i]=(float)(c[i]/det);
+}
+
+
+
+// ##########################################################################
+// ############################   CIELAB   #################################
+// ##########################################################################
+// CIE L*a*b* with the D65 white point and the sRGB transfer function,
+// following the definitions used by OpenCV for float images
+// (L from 0 to 100, a and b nominally from -127 to 127).  Input and
+// output BGR values are clipped to the range 0 to 1 as in OpenCV.
+//
+// The powers of the sRGB transfer function and the cube roots
+// dominate the cost of the conversions.  If 'maxError' is at least
+// 'CielabFastError' they are replaced by the fast approximations
+// above (of degree 5), in branch free loops with the 3x3 matrices
+// fused in, so that the compiler vectorises the row conversions.
+// 'CielabFastError' is the largest round trip error in the BGR
+// output (in the range 0 to 1) measured over the whole colour cube
+// by 'MeasureCielabFastError', which also gives the largest colour
+// difference (delta E) of the fast forward conversion.
+
+const float CielabFastError = 0.1f/255;
+
+// Returns 'a' if 'c' is set and otherwise 'b', by masking the bits.
+// (The compiler will not vectorise a conditional expression between
+// floating point results, since it must not raise floating point
+// exceptions which the conditional code would not.)
+inline float SelectFloat(bool c, float a, float b)
+{
+    int32_t ia, ib, mask=-(int32_t)c;
+    std::memcpy(&ia, &a, sizeof(ia));
+    std::memcpy(&ib, &b, sizeof(ib));
+    int32_t r=(ia&mask)|(ib&~mask);
+    float f;
+    std::memcpy(&f, &r, sizeof(f));
+    return f;
+}
+
+inline float SelectClipUnit(float v)
+{
+    v=SelectFloat(v>0.0f, v, 0.0f);
+    return SelectFloat(v<1.0f, v, 1.0f);
+}
+
+// Branch free sRGB transfer functions and cube root, for values
+// from 0 to 1 (or a little above for the cube root).
+inline float FastSrgbToLinear(float v)
+{
+    float p=FastExp2InRange<5>(2.4f*FastLog2<5>((v+0.055f)*(1.0f/1.055f)));
+    return SelectFloat(v<=0.04045f, v*(1.0f/12.92f), p);
+}
+
+inline float FastLinearToSrgb(float v)
+{
+    float p=1.055f*FastExp2InRange<5>(FastLog2<5>(v)*(1.0f/2.4f))-0.055f;
+    return SelectFloat(v<=0.0031308f, 12.92f*v, p);
+}
+
+inline float FastCbrt(float v)
+{
+    return FastExp2InRange<5>(FastLog2<5>(v)*(1.0f/3.0f));
+}
+
+struct CielabSpace
+{
+    bool fast;
+
+    explicit CielabSpace(float maxError=0.0f)
+        : fast(maxError>=CielabFastError) {}
+
+    static float F(float t)
+    {
+        return t>0.008856f ? std::cbrt(t) : 7.787f*t+16.0f/116.0f;
+    }
+
+    static float FInverse(float f)
+    {
+        return f>0.206893f ? f*f*f : (f-16.0f/116.0f)/7.787f;
+    }
+
+    void Forward(const float *bgr, float *lab) const
+    {
+        static const float M[9]={0.412453f/0.950456f, 0.357580f/0.950456f,
+                                  0.180423f/0.950456f,
+                                  0.212671f, 0.715160f, 0.072169f,
+                                  0.019334f/1.088754f, 0.119193f/1.088754f,
+                                  0.950227f/1.088754f};
+        float rgb[3], xyz[3];
+        rgb[0]=SrgbToLinear(ClipUnit(bgr[2]));
+        rgb[1]=SrgbToLinear(ClipUnit(bgr[1]));
+        rgb[2]=SrgbToLinear(ClipUnit(bgr[0]));
+        Apply3x3(M, rgb, xyz);
+        float fx=F(xyz[0]), fy=F(xyz[1]), fz=F(xyz[2]);
+        lab[0]=xyz[1]>0.008856f ? 116.0f*fy-16.0f : 903.3f*xyz[1];
+        lab[1]=500.0f*(fx-fy);
+        lab[2]=200.0f*(fy-fz);
+    }
+
+    void Inverse(const float *lab, float *bgr) const
+    {
+        static const float M[9]={ 3.240479f*0.950456f, -1.53715f,
+                                 -0.498535f*1.088754f,
+                                 -0.969256f*0.950456f,  1.875991f,
+                                  0.041556f*1.088754f,
+                                  0.055648f*0.950456f, -0.204043f,
+                                  1.057311f*1.088754f};
+        float fy, xyz[3], rgb[3];
+        if(lab[0]<=7.9996f) {xyz[1]=lab[0]/903.3f; fy=7.787f*xyz[1]+16.0f/116.0f;}
+        else                {fy=(lab[0]+16.0f)/116.0f; xyz[1]=fy*fy*fy;}
+        xyz[0]=FInverse(lab[1]/500.0f+fy);
+        xyz[2]=FInverse(fy-lab[2]/200.0f);
+        Apply3x3(M, xyz, rgb);
+        bgr[0]=LinearToSrgb(ClipUnit(rgb[2]));
+        bgr[1]=LinearToSrgb(ClipUnit(rgb[1]));
+        bgr[2]=LinearToSrgb(ClipUnit(rgb[0]));
+    }
+
+    // (The matrices are those of 'Forward' and 'Inverse'.)
+    static void ForwardFastRow(const float *bgr, float *lab, int n)
+    {
+        for(int x=0;x<n;x++)
+        {
+            float r=FastSrgbToLinear(SelectClipUnit(bgr[3*x+2]));
+            float g=FastSrgbToLinear(SelectClipUnit(bgr[3*x+1]));
+            float b=FastSrgbToLinear(SelectClipUnit(bgr[3*x]));
+            float X=(0.412453f/0.950456f)*r+(0.357580f/0.950456f)*g
+                   +(0.180423f/0.950456f)*b;
+            float Y=0.212671f*r+0.715160f*g+0.072169f*b;
+            float Z=(0.019334f/1.088754f)*r+(0.119193f/1.088754f)*g
+                   +(0.950227f/1.088754f)*b;
+            float fx=SelectFloat(X>0.008856f, FastCbrt(X), 7.787f*X+16.0f/116.0f);
+            float fy=SelectFloat(Y>0.008856f, FastCbrt(Y), 7.787f*Y+16.0f/116.0f);
+            float fz=SelectFloat(Z>0.008856f, FastCbrt(Z), 7.787f*Z+16.0f/116.0f);
+            lab[3*x]  =SelectFloat(Y>0.008856f, 116.0f*fy-16.0f, 903.3f*Y);
+            lab[3*x+1]=500.0f*(fx-fy);
+            lab[3*x+2]=200.0f*(fy-fz);
+        }
+    }
+
+    static void InverseFastRow(const float *lab, float *bgr, int n)
+    {
+        for(int x=0;x<n;x++)
+        {
+            float L=lab[3*x];
+            float Yl=L*(1.0f/903.3f), fyc=(L+16.0f)*(1.0f/116.0f);
+            float Y =SelectFloat(L<=7.9996f, Yl, fyc*fyc*fyc);
+            float fy=SelectFloat(L<=7.9996f, 7.787f*Yl+16.0f/116.0f, fyc);
+            float fx=lab[3*x+1]*(1.0f/500.0f)+fy;
+            float fz=fy-lab[3*x+2]*(1.0f/200.0f);
+            float X=SelectFloat(fx>0.206893f, fx*fx*fx,
+                                (fx-16.0f/116.0f)*(1.0f/7.787f));
+            float Z=SelectFloat(fz>0.206893f, fz*fz*fz,
+                                (fz-16.0f/116.0f)*(1.0f/7.787f));
+            float r= (3.240479f*0.950456f)*X-1.53715f*Y
+                    -(0.498535f*1.088754f)*Z;
+            float g=-(0.969256f*0.950456f)*X+1.875991f*Y
+                    +(0.041556f*1.088754f)*Z;
+            float b= (0.055648f*0.950456f)*X-0.204043f*Y
+                    +(1.057311f*1.088754f)*Z;
+            bgr[3*x]  =FastLinearToSrgb(SelectClipUnit(b));
+            bgr[3*x+1]=FastLinearToSrgb(SelectClipUnit(g));
+            bgr[3*x+2]=FastLinearToSrgb(SelectClipUnit(r));
+        }
+    }
+
+    void ForwardRow(const float *bgr, float *lab, int n) const
+    {
+        if(fast) ForwardFastRow(bgr, lab, n);
+        else for(int x=0;x<n;x++) Forward(bgr+3*x, lab+3*x);
+    }
+
+    void InverseRow(const float *lab, float *bgr, int n) const
+    {
+        if(fast) InverseFastRow(lab, bgr, n);
+        else for(int x=0;x<n;x++) Inverse(lab+3*x, bgr+3*x);
+    }
+
+    bool RescaleLimits(float &mid, float &half, float &colourMax) const
+    {
+        mid=50.0f; half=50.0f; colourMax=127.0f;
+        return true;
+    }
+};
+
+// Measures the fast CIELAB conversions against the exact ones over
+// a grid of 'steps' levels per channel spanning the colour cube.
+// 'deltaE' is the largest colour difference (CIE 1976) of the fast
+// forward conversion and 'bgrError' the largest difference in the
+// BGR values after a fast round trip.
+inline void MeasureCielabFastError(float &deltaE, float &bgrError,
+                                   int steps=65)
+{
+    CielabSpace exact, fast(CielabFastError);
+    std::vector<float> bgr(3*steps), lab(3*steps), fastLab(3*steps),
+                       back(3*steps);
+    deltaE=0; bgrError=0;
+    for(int b=0;b<steps;b++)
+    for(int g=0;g<steps;g++)
+    {
+        for(int r=0;r<steps;r++)
+        {
+            bgr[3*r]=(float)b/(steps-1);
+            bgr[3*r+1]=(float)g/(steps-1);
+            bgr[3*r+2]=(float)r/(steps-1);
+        }
+        exact.ForwardRow(&bgr[0], &lab[0], steps);
+        fast.ForwardRow(&bgr[0], &fastLab[0], steps);
+        fast.InverseRow(&fastLab[0], &back[0], steps);
+        for(int x=0;x<steps;x++)
+        {
+            float d0=fastLab[3*x]-lab[3*x], d1=fastLab[3*x+1]-lab[3*x+1],
+                  d2=fastLab[3*x+2]-lab[3*x+2];
+            deltaE=std::max(deltaE, std::sqrt(d0*d0+d1*d1+d2*d2));
+            for(int c=0;c<3;c++)
+                bgrError=std::max(bgrError,
+                                  std::abs(back[3*x+c]-bgr[3*x+c]));
+        }
+    }
+}
+
+
+
+// ##########################################################################
+// #########################   L-ALPHA-BETA   ##############################
+// ##########################################################################
+// The L-alpha-beta colour space of Ruderman et al. as used by Reinhard
+// et al.  Coding of the transforms adapted from
+// https://github.com/ZZPot/Color-transfer (credit to 'ZZPot').
+// LMS values are limited below by 'epsilon' before the logarithm.
+//
+// The logarithms and powers of ten dominate the cost of the
+// conversions.  If 'maxError' is greater than zero they are replaced
+// by the fast approximations above, using the lowest polynomial
+// degree for which the predicted error in the BGR output (in the
+// range 0 to 1) after a round trip is within 'maxError'.  The
+// prediction is a worst case bound; if no degree meets it the exact
+// functions are kept.  'fastDegree' is zero for the exact functions.
+//
+// A colour transfer between the conversions scales the error of the
+// forward conversion by its gain, which may well exceed one, so the
+// degree is selected again for each transfer map (see
+// 'FitFastMathToMap' in 'TransferKernel.hpp').
+
+struct LalphabetaSpace
+{
+    float epsilon;
+    float RGB_to_LMS[9], LMS_to_RGB[9];
+    float LMS_to_lab[9], lab_to_LMS[9];
+    float maxError;
+    int   fastDegree;
+    float predictedError;
+
+    explicit LalphabetaSpace(float epsilon_=1.0f/255, float maxError_=0.0f)
+        : epsilon(epsilon_), maxError(maxError_), fastDegree(0),
+          predictedError(0.0f)
+    {
+        static const float A[9]={0.3811f, 0.5783f, 0.0402f,
+                                 0.1967f, 0.7244f, 0.0782f,
+                                 0.0241f, 0.1288f, 0.8444f};
+        float i3=1/sqrt(3.0f), i6=1/sqrt(6.0f), i2=1/sqrt(2.0f);
+        float B[9]={i3, i3, i3,
+                    i6, i6, -2*i6,
+                    i2, -i2, 0};
+        for(int i=0;i<9;i++) {RGB_to_LMS[i]=A[i]; LMS_to_lab[i]=B[i];}
+        Invert3x3(RGB_to_LMS, LMS_to_RGB);
+        Invert3x3(LMS_to_lab, lab_to_LMS);
+        SelectDegree(1.0f);
+    }
+
+    // Selects the degree for a round trip in which the errors of the
+    // forward conversion, in the logarithms of the LMS values, are
+    // multiplied by at most 'mapGain' before the inverse.
+    //
+    // An error e in log2 becomes a relative error e*ln(2) in the
+    // LMS values after the round trip (the lab transform is
+    // orthonormal), to which the error of 2^x adds.  The LMS to
+    // RGB transform amplifies the error by at most its largest
+    // absolute row sum (LMS values are at most about 1).
+    void SelectDegree(float mapGain)
+    {
+        fastDegree=0;
+        predictedError=0.0f;
+        if(maxError<=0) return;
+        float gain=0;
+        for(int r=0;r<3;r++)
+            gain=std::max(gain, std::abs(LMS_to_RGB[3*r])
+                               +std::abs(LMS_to_RGB[3*r+1])
+                               +std::abs(LMS_to_RGB[3*r+2]));
+        for(int degree=3;degree<=7 && fastDegree==0;degree+=2)
+        {
+            float bound=gain*(FastLog2Error(degree)*0.6931472f*mapGain
+                             +FastExp2Error(degree));
+            if(bound<=maxError) {fastDegree=degree; predictedError=bound;}
+        }
+    }
+
+    void Forward(const float *bgr, float *lab) const
+    {
+        float rgb[3]={bgr[2], bgr[1], bgr[0]}, lms[3];
+        Apply3x3(RGB_to_LMS, rgb, lms);
+        for(int c=0;c<3;c++) lms[c]=std::log10(std::max(lms[c], epsilon));
+        Apply3x3(LMS_to_lab, lms, lab);
+    }
+
+    void Inverse(const float *lab, float *bgr) const
+    {
+        float lms[3], rgb[3];
+        Apply3x3(lab_to_LMS, lab, lms);
+        for(int c=0;c<3;c++) lms[c]=std::pow(10.0f, lms[c]);
+        Apply3x3(LMS_to_RGB, lms, rgb);
+        bgr[0]=rgb[2]; bgr[1]=rgb[1]; bgr[2]=rgb[0];
+    }
+
+    // log10(x)=log2(x)*log10(2) and 10^x=2^(x*log2(10)).
+    template<int D>
+    void ForwardFast(const float *bgr, float *lab) const
+    {
+        float rgb[3]={bgr[2], bgr[1], bgr[0]}, lms[3];
+        Apply3x3(RGB_to_LMS, rgb, lms);
+        for(int c=0;c<3;c++)
+            lms[c]=0.30103f*FastLog2<D>(std::max(lms[c], epsilon));
+        Apply3x3(LMS_to_lab, lms, lab);
+    }
+
+    template<int D>
+    void InverseFast(const float *lab, float *bgr) const
+    {
+        float lms[3], rgb[3];
+        Apply3x3(lab_to_LMS, lab, lms);
+        for(int c=0;c<3;c++) lms[c]=FastExp2<D>(3.3219281f*lms[c]);
+        Apply3x3(LMS_to_RGB, lms, rgb);
+        bgr[0]=rgb[2]; bgr[1]=rgb[1]; bgr[2]=rgb[0];
+    }
+
+    void ForwardRow(const float *bgr, float *lab, int n) const
+    {
+        // (The degree is selected once per row, not per pixel.)
+        switch(fastDegree)
+        {
+        case 3:  for(int x=0;x<n;x++) ForwardFast<3>(bgr+3*x, lab+3*x); break;
+        case 5:  for(int x=0;x<n;x++) ForwardFast<5>(bgr+3*x, lab+3*x); break;
+        case 7:  for(int x=0;x<n;x++) ForwardFast<7>(bgr+3*x, lab+3*x); break;
+        default: for(int x=0;x<n;x++) Forward(bgr+3*x, lab+3*x);
+        }
+    }
+
+    void InverseRow(const float *lab, float *bgr, int n) const
+    {
+        switch(fastDegree)
+        {
+        case 3:  for(int x=0;x<n;x++) InverseFast<3>(lab+3*x, bgr+3*x); break;
+        case 5:  for(int x=0;x<n;x++) InverseFast<5>(lab+3*x, bgr+3*x); break;
+        case 7:  for(int x=0;x<n;x++) InverseFast<7>(lab+3*x, bgr+3*x); break;
+        default: for(int x=0;x<n;x++) Inverse(lab+3*x, bgr+3*x);
+        }
+    }
+
+    bool RescaleLimits(float &, float &, float &) const {return false;}
+};
+
+
+
+// ##########################################################################
+// ############################   YCbCr   ##################################
+// ##########################################################################
+// Full range ITU-R BT.601 YCbCr with Y from 0 to 1 and Cb and Cr from
+// -0.5 to 0.5.
+
+struct YCbCrSpace
+{
+    void ForwardRow(const float *bgr, float *ycc, int n) const
+    {
+        for(int x=0;x<n;x++, bgr+=3, ycc+=3)
+        {
+            float y=0.299f*bgr[2]+0.587f*bgr[1]+0.114f*bgr[0];
+            ycc[0]=y;
+            ycc[1]=(bgr[0]-y)/1.772f;
+            ycc[2]=(bgr[2]-y)/1.402f;
+        }
+    }
+
+    void InverseRow(const float *ycc, float *bgr, int n) const
+    {
+        for(int x=0;x<n;x++, bgr+=3, ycc+=3)
+        {
+            bgr[0]=ycc[0]+1.772f*ycc[1];
+            bgr[1]=ycc[0]-(0.114f*1.772f/0.587f)*ycc[1]
+                         -(0.299f*1.402f/0.587f)*ycc[2];
+            bgr[2]=ycc[0]+1.402f*ycc[2];
+        }
+    }
+
+    bool RescaleLimits(float &mid, float &half, float &colourMax) const
+    {
+        mid=0.5f; half=0.5f; colourMax=0.5f;
+        return true;
+    }
+};
+
+
+
+// ##########################################################################
+// ############################   OKLAB   ##################################
+// ##########################################################################
+// The Oklab colour space of B Ottosson (2020), from linear sRGB.
+
+struct OklabSpace
+{
+    void ForwardRow(const float *bgr, float *lab, int n) const
+    {
+        for(int x=0;x<n;x++, bgr+=3, lab+=3)
+        {
+            float r=SrgbToLinear(bgr[2]), g=SrgbToLinear(bgr[1]),
+                  b=SrgbToLinear(bgr[0]);
+            float l=std::cbrt(0.4122214708f*r+0.5363325363f*g+0.0514459929f*b);
+            float m=std::cbrt(0.2119034982f*r+0.6806995451f*g+0.1073969566f*b);
+            float s=std::cbrt(0.0883024619f*r+0.2817188376f*g+0.6299787005f*b);
+            lab[0]=0.2104542553f*l+0.7936177850f*m-0.0040720468f*s;
+            lab[1]=1.9779984951f*l-2.4285922050f*m+0.4505937099f*s;
+            lab[2]=0.0259040371f*l+0.7827717662f*m-0.8086757660f*s;
+        }
+    }
+
+    void InverseRow(const float *lab, float *bgr, int n) const
+    {
+        for(int x=0;x<n;x++, bgr+=3, lab+=3)
+        {
+            float l=lab[0]+0.3963377774f*lab[1]+0.2158037573f*lab[2];
+            float m=lab[0]-0.1055613458f*lab[1]-0.0638541728f*lab[2];
+            float s=lab[0]-0.0894841775f*lab[1]-1.2914855480f*lab[2];
+            l=l*l*l; m=m*m*m; s=s*s*s;
+            bgr[2]=LinearToSrgb(ClipUnit( 4.0767416621f*l-3.3077115913f*m+0.2309699292f*s));
+            bgr[1]=LinearToSrgb(ClipUnit(-1.2684380046f*l+2.6097574011f*m-0.3413193965f*s));
+            bgr[0]=LinearToSrgb(ClipUnit(-0.0041960863f*l-0.7034186147f*m+1.7076147010f*s));
+        }
+    }
+
+    bool RescaleLimits(float &, float &, float &) const {return false;}
+};
+
+
+
+// ##########################################################################
+// ##########################   RGB ORDER   ################################
+// ##########################################################################
+// Converts as 'Space' does, but 'ForwardRow' reads its pixels in RGB
+// rather than BGR order (as a mapped PFM image holds them).  The
+// pixels are swapped 'RgbOrderRun' at a time into a buffer on the
+// stack, so an RGB image is read without being copied.
+
+const int RgbOrderRun = 256;
+
+template<class Space>
+struct RgbOrder : public Space
+{
+    explicit RgbOrder(const Space &space) : Space(space) {}
+
+    void ForwardRow(const float *rgb, float *out, int n) const
+    {
+        float bgr[3*RgbOrderRun];
+        for(int x=0;x<n;x+=RgbOrderRun)
+        {
+            int m=std::min(RgbOrderRun, n-x);
+            const float *p=rgb+3*x;
+            for(int k=0;k<3*m;k+=3)
+            {
+                bgr[k]  =p[k+2];
+                bgr[k+1]=p[k+1];
+                bgr[k+2]=p[k];
+            }
+            Space::ForwardRow(bgr, out+3*x, m);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,231 @@
+//*** DEADLINE PLANNING
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// A cost model of the further enhanced processing and the choice of
+// processing reductions (a 'degradation ladder') which lets an
+// image be processed within a deadline.  The costs are measured by
+// the processing program itself (see 'CalibrateDeadlineCosts' and
+// 'DeadlineTransfer' in 'Further Enhanced Processing/Main.cpp'),
+// which also applies the plan.  The deadlines met and missed are
+// counted, and a cost model which misses more than an occasional
+// deadline is reported.
+
+#ifndef DEADLINE_HPP
+#define DEADLINE_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// Processing reductions chosen to meet a deadline.
+struct DeadlinePlan
+{
+    int    sourceStep;          // Statistics from every n-th source pixel
+                                // of every n-th row.
+    int    reshapingIterations;
+    int    pyramidLevel;        // Processing at 1/2^level scale.
+    bool   skipSaturation;
+    double predictedSeconds;
+    double actualSeconds;
+    int    reshapingIterationsUsed;     // Fewer than planned if the
+                                        // reshaping converged early.
+    bool   missed;                      // The deadline was missed.
+    DeadlinePlan() : sourceStep(1), reshapingIterations(0), pyramidLevel(0),
+                     skipSaturation(false), predictedSeconds(0),
+                     actualSeconds(0), reshapingIterationsUsed(0),
+                     missed(false) {}
+};
+
+// Processing times per pixel measured on this machine.  'core' and
+// 'reshaping' (each iteration) are per target and source pixel and
+// the others per target pixel.  'correction' is the ratio of the
+// actual to the predicted times, updated after each use.
+struct DeadlineCosts
+{
+    double core, reshaping, saturation, refinement, resampling;
+    double correction;
+    DeadlineCosts() : core(0), reshaping(0), saturation(0), refinement(0),
+                      resampling(0), correction(1) {}
+};
+
+// Guards the measured costs, which are shared between threads.
+inline std::mutex &DeadlineCostsMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+// Size of the last level cache (8 MB if unknown).
+inline size_t LastLevelCacheBytes()
+{
+    static const size_t bytes=[]()
+    {
+        long size=0;
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+        size=sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+        if(size<=0) size=sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        return size>0 ? (size_t)size : (size_t)8*1024*1024;
+    }();
+    return bytes;
+}
+
+// Size of the synthetic images on which the costs are measured.
+// Each float BGR image is twice the size of the last level cache,
+// so that the stages stream through memory as they do for real
+// images rather than running from the cache, but is no smaller
+// than 640x480 and no larger than 4096x4096.
+inline cv::Size DeadlineCalibrationSize()
+{
+    double pixels=2.0*LastLevelCacheBytes()/(3*sizeof(float));
+    pixels=std::min(std::max(pixels, 640.0*480), 4096.0*4096);
+    int cols=(int)std::ceil(std::sqrt(pixels*4/3));
+    return cv::Size(cols, (int)std::ceil(pixels/cols));
+}
+
+// Predicts the processing time for the image sizes given.
+inline double PredictDeadlineSeconds(const DeadlineCosts &costs,
+                                     const DeadlinePlan &plan,
+                                     cv::Size target, cv::Size source)
+{
+    double fullPixels=(double)target.area();
+    double tpixels=fullPixels/(1<<(2*plan.pyramidLevel));
+    double spixels=(double)source.area()/(plan.sourceStep*plan.sourceStep);
+    double seconds=(tpixels+spixels)*(costs.core+plan.reshapingIterations*
+                                                 costs.reshaping)
+                  +tpixels*(costs.refinement+
+                            (plan.skipSaturation ? 0 : costs.saturation));
+    if(plan.pyramidLevel>0) seconds+=fullPixels*costs.resampling;
+    return seconds*costs.correction;
+}
+
+// Chooses the processing reductions needed for the predicted time
+// to be within 80% of the deadline.  The reductions are made in
+// turn, each only as far as needed, in the following order.
+//   1. Sampling the source image for its statistics (but keeping
+//      at least 65536 pixels).
+//   2. Fewer reshaping iterations.
+//   3. Processing a reduced copy of the target image (to at most
+//      1/8 scale and at least 128 pixels across) and applying the
+//      change made to it, enlarged, to the full image.
+//   4. Leaving out the saturation processing.
+// If the deadline cannot be met, all the reductions are made.
+inline DeadlinePlan PlanDeadline(const DeadlineCosts &costs,
+                                 cv::Size target, cv::Size source,
+                                 int ReshapingIterations,
+                                 float PercentSaturationShift,
+                                 double DeadlineSeconds)
+{
+    DeadlinePlan plan;
+    plan.reshapingIterations=ReshapingIterations;
+    plan.predictedSeconds=PredictDeadlineSeconds(costs, plan, target,
+                                                 source);
+    if(DeadlineSeconds<=0) return plan;
+
+    double budget=0.8*DeadlineSeconds;
+    auto over=[&]()
+    {
+        plan.predictedSeconds=PredictDeadlineSeconds(costs, plan, target,
+                                                     source);
+        return plan.predictedSeconds>budget;
+    };
+
+    while(over() && plan.sourceStep<8 &&
+          (double)source.area()/(4*plan.sourceStep*plan.sourceStep)>=65536)
+        plan.sourceStep*=2;
+    while(over() && plan.reshapingIterations>0)
+        plan.reshapingIterations--;
+    while(over() && plan.pyramidLevel<3 &&
+          std::min(target.width, target.height)>>(plan.pyramidLevel+1)>=128)
+        plan.pyramidLevel++;
+    if(over() && PercentSaturationShift!=100)
+    {
+        plan.skipSaturation=true;
+        over();
+    }
+    return plan;
+}
+
+// Counts of the images processed to a deadline and of the deadlines
+// missed.  The first few images are not counted, while the
+// correction of the costs settles.
+const int DeadlineSettlingImages = 5;
+
+struct DeadlineRecord
+{
+    long images, missed, settling;
+    DeadlineRecord() : images(0), missed(0), settling(0) {}
+};
+
+inline DeadlineRecord &DeadlineHistory()
+{
+    static DeadlineRecord record;
+    return record;
+}
+
+// Records whether the deadline of 'plan' was met.
+inline void RecordDeadline(const DeadlinePlan &plan)
+{
+    std::lock_guard<std::mutex> lock(DeadlineCostsMutex());
+    DeadlineRecord &record=DeadlineHistory();
+    if(record.settling<DeadlineSettlingImages)
+    {
+        record.settling++;
+        return;
+    }
+    record.images++;
+    if(plan.missed) record.missed++;
+}
+
+// Reports the deadlines missed (nothing if none were counted).
+// Misses should be rare once the costs have settled; if more than
+// one in twenty of at least twenty images missed, the cost model
+// does not fit this machine and that is reported.  Returns false
+// in that case.
+inline bool CheckDeadlineRecord()
+{
+    DeadlineRecord record;
+    {
+        std::lock_guard<std::mutex> lock(DeadlineCostsMutex());
+        record=DeadlineHistory();
+    }
+    if(record.images==0) return true;
+    std::cout<<"Deadlines missed: "<<record.missed<<" of "<<record.images
+             <<" (after the first "<<DeadlineSettlingImages<<")\n";
+    if(record.images<20 || record.missed*20<=record.images) return true;
+    std::cout<<"The processing cost model does not fit this machine: "
+             <<"deadlines are missed too often\n";
+    return false;
+}
+
+// Lists the processing reductions of 'plan' ("none" if none).
+inline std::string DescribeDeadlinePlan(const DeadlinePlan &plan,
+                                        int ReshapingIterations)
+{
+    std::ostringstream text;
+    if(plan.sourceStep>1)
+        text<<"source statistics sampled 1 in "
+            <<plan.sourceStep*plan.sourceStep<<"; ";
+    if(plan.reshapingIterations<ReshapingIterations)
+        text<<"reshaping iterations "<<plan.reshapingIterations<<" of "
+            <<ReshapingIterations<<"; ";
+    if(plan.pyramidLevel>0)
+        text<<"processed at 1/"<<(1<<plan.pyramidLevel)<<" scale; ";
+    if(plan.skipSaturation) text<<"saturation processing skipped; ";
+    std::string s=text.str();
+    if(s.empty()) return "none";
+    return s.substr(0, s.size()-2);
+}
+
+#endif
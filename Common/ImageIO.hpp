@@ -0,0 +1,452 @@
+//*** IMAGE FILE INPUT AND OUTPUT IN 32 BIT FLOAT FORMAT
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// Images are processed as 32 bit floating point data.  8 bit and
+// 16 bit target images are scaled to the range 0 to 1 and float
+// images (EXR, TIFF, PFM) are used directly, so 16 bit and float
+// masters keep their full precision.  The output bit depth may be
+// 8, 16 or 32 bits, or may follow the target image.  JPEG output
+// is always 8 bit.
+//
+// Uncompressed PFM files are handled without any intermediate
+// copy.  A PFM target image is memory mapped, read only, and the
+// mapping is used as the input image, and a PFM output file is
+// created at full size, memory mapped and written directly.  PFM
+// stores RGB rows from the bottom of the image upwards.  The mapped
+// input is flagged as RGB and the transfer kernel reads it in that
+// order (see 'RgbOrder' in 'ColourSpace.hpp'), so its pages are only
+// read; the channels of the output are swapped as it is written,
+// and the image is only turned the right way up when it is written
+// in another format (or displayed).  Processing which needs the
+// target in BGR order takes a copy instead ('CopyMappedImage').
+//
+// Reduced Resolution Decoding.
+// ----------------------------
+// The source image is used only to supply global statistics
+// (channel means, standard deviations and cross correlation).
+// These are estimated from a very large population of pixels
+// and a subsample gives almost the same values.  JPEG decoders
+// can produce 1/2, 1/4 or 1/8 scale images directly from the
+// compressed data at a fraction of the cost of a full decode,
+// and the subsequent float conversions then work on fewer
+// pixels too.
+//
+// A reduced image is not a subsample, however.  The decoder scales
+// at the DCT stage, which averages each block of 2x2, 4x4 or 8x8
+// pixels, so detail finer than the block is lost and the standard
+// deviations (and the cross correlation) are biased downward by an
+// amount which depends on the image content: a finely textured
+// source loses more than a smooth one, and the bias does not fall
+// as the number of pixels rises.  'SourceAccuracy' only selects the
+// reduction, as the largest which retains at least
+// 1/(SourceAccuracy^2) pixels, and does not bound this bias.
+// Reduced decoding is therefore off by default ('SourceAccuracy'
+// is zero).  Setting 'ReportDecodeDrift' to 'true' decodes the
+// image in full as well and reports the change in the means,
+// standard deviations and cross correlation in the working colour
+// space, which shows whether the bias is acceptable for a given
+// kind of source image.
+
+#ifndef IMAGEIO_HPP
+#define IMAGEIO_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "MemoryTracker.hpp"
+#include "PerfCounters.hpp"
+#include "TransferKernel.hpp"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// A memory mapped image file.
+struct MappedImage
+{
+    cv::Mat image;      // Header over the mapped pixel data.
+    void   *base;       // Start of the mapping.
+    size_t  length;     // Length of the mapping in bytes.
+    bool    rgb;        // The channels are in RGB order.
+    MappedImage() : base(NULL), length(0), rgb(false) {}
+};
+
+// Reads the image dimensions from the frame header of a JPEG
+// file without decoding the image.  Returns false if the file
+// is not a JPEG file or if the header cannot be read.
+inline bool ReadJpegSize(std::string filename, int &width, int &height)
+{
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    unsigned char buf[5];
+
+    // A JPEG file begins with the 'start of image' marker.
+    if(!file.read((char*)buf,2) || buf[0]!=0xFF || buf[1]!=0xD8)
+        return false;
+
+    // Step through the marker segments until a 'start of frame'
+    // marker (C0 to CF, other than C4, C8 and CC) is found.
+    while(file.read((char*)buf,2))
+    {
+        if(buf[0]!=0xFF) return false;
+        unsigned char marker=buf[1];
+
+        // Skip fill bytes and markers which have no segment.
+        if(marker==0xFF) {file.seekg(-1, std::ios::cur); continue;}
+        if(marker==0x01 || (marker>=0xD0 && marker<=0xD8)) continue;
+
+        // The image data has been reached without a frame header.
+        if(marker==0xD9 || marker==0xDA) return false;
+
+        if(!file.read((char*)buf,2)) return false;
+        int length=(buf[0]<<8)+buf[1];
+
+        if(marker>=0xC0 && marker<=0xCF &&
+           marker!=0xC4 && marker!=0xC8 && marker!=0xCC)
+        {
+            // Frame header: precision, then height and width.
+            if(!file.read((char*)buf,5)) return false;
+            height=(buf[1]<<8)+buf[2];
+            width =(buf[3]<<8)+buf[4];
+            return width>0 && height>0;
+        }
+        file.seekg(length-2, std::ios::cur);
+    }
+    return false;
+}
+
+// Converts an 8 bit, 16 bit or float image to 32 bit float
+// format with values nominally in the range 0 to 1.  A float
+// image is returned as it is, without a copy.
+inline cv::Mat ConvertToFloat(cv::Mat image)
+{
+    cv::Mat imagef;
+
+    if(image.depth()==CV_32F) return image;
+    if(image.depth()==CV_16U) image.convertTo(imagef, CV_32FC3, 1/65535.0);
+    else                      image.convertTo(imagef, CV_32FC3, 1/255.0);
+    return imagef;
+}
+
+// Reports the change in the statistics of a source image, in the
+// colour space of 'space', when it is decoded at reduced resolution
+// ('reduced') rather than in full.
+template<class Space>
+void PrintDecodeDrift(const Space &space, std::string filename,
+                      const cv::Mat &reduced)
+{
+    cv::Mat full=cv::imread(filename, cv::IMREAD_ANYDEPTH |
+                                      cv::IMREAD_COLOR);
+    if(full.empty()) return;
+    ColourStatistics r=ConvertForward(space, ConvertToFloat(reduced), NULL);
+    ColourStatistics f=ConvertForward(space, ConvertToFloat(full), NULL);
+    for(int c=0;c<3;c++)
+    {
+        std::cout<<"   channel "<<c
+                 <<"  mean drift "<<r.mean[c]-f.mean[c]
+                 <<"  deviation drift "<<r.dev[c]-f.dev[c]
+                 <<" ("<<100*(r.dev[c]-f.dev[c])/std::max(f.dev[c],1e-12)
+                 <<"%)\n";
+    }
+    std::cout<<"   correlation drift "<<r.corr-f.corr<<"\n";
+}
+
+// Reads the source image, decoding it at reduced resolution if
+// 'accuracy' is greater than zero (see the notes above).  If
+// 'reportDrift' is set and the image is reduced, the drift of its
+// statistics in the colour space of 'space' is reported.
+template<class Space>
+cv::Mat ReadSourceImage(const Space &space, std::string filename,
+                        float accuracy, bool reportDrift)
+{
+    MemoryScope scope("Decode");
+
+    // Declare variables
+    int width, height, factor=1;
+    cv::Mat source;
+
+    // The reduction must retain this number of pixels.  (This
+    // does not bound the bias of the averaging.)
+    double minPixels=1.0/((double)accuracy*accuracy);
+
+    // Reduced decoding is implemented within the JPEG decoder
+    // (by scaling at the DCT stage) so it is only attempted for
+    // JPEG files whose dimensions can be read from the header.
+    // The largest reduction which retains the minimum pixel
+    // count is selected.
+    if(accuracy>0 && ReadJpegSize(filename, width, height))
+    {
+        double pixels=(double)width*height;
+        while(factor<8 && pixels/(4.0*factor*factor)>=minPixels)
+            factor*=2;
+    }
+
+    if     (factor==8) source=cv::imread(filename, cv::IMREAD_REDUCED_COLOR_8);
+    else if(factor==4) source=cv::imread(filename, cv::IMREAD_REDUCED_COLOR_4);
+    else if(factor==2) source=cv::imread(filename, cv::IMREAD_REDUCED_COLOR_2);
+    else               source=cv::imread(filename, cv::IMREAD_ANYDEPTH |
+                                                   cv::IMREAD_COLOR);
+
+    if(factor>1)
+    {
+        std::cout<<"Source decoded at 1/"<<factor<<" scale\n";
+        if(reportDrift && !source.empty())
+            PrintDecodeDrift(space, filename, source);
+    }
+
+    return source;
+}
+
+// Copies the rows of a float three channel image to 'dst', swapping
+// the first and third channels (BGR to RGB and back) and, if 'flip'
+// is set, turning the image upside down.  'dst' may be 'src' itself
+// (when 'flip' is not set), so the channels are swapped in place
+// without the copy that 'cv::cvtColor' would make.
+inline void SwapRedBlue(const cv::Mat &src, cv::Mat &dst, bool flip)
+{
+    CV_Assert(src.type()==CV_32FC3 && dst.type()==CV_32FC3 &&
+              src.size()==dst.size() && (!flip || src.data!=dst.data));
+    cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &range)
+    {
+        for(int y=range.start;y<range.end;y++)
+        {
+            const float *s=src.ptr<float>(y);
+            float *d=dst.ptr<float>(flip ? src.rows-1-y : y);
+            for(int x=0;x<3*src.cols;x+=3)
+            {
+                float b=s[x];
+                d[x+1]=s[x+1];
+                d[x]=s[x+2];
+                d[x+2]=b;
+            }
+        }
+    });
+}
+
+// Releases a mapping made by 'MapPfmImage' or 'CreatePfmImage'.
+// Written data is flushed to the file by the operating system.
+inline void UnmapImage(MappedImage &mapped)
+{
+    if(mapped.base==NULL) return;
+    mapped.image.release();
+#ifdef _WIN32
+    UnmapViewOfFile(mapped.base);
+#else
+    munmap(mapped.base, mapped.length);
+#endif
+    mapped.base=NULL;
+    mapped.length=0;
+    mapped.rgb=false;
+}
+
+// Memory maps a colour PFM file, read only, and sets 'mapped.image'
+// to a CV_32FC3 header over its pixel data (in RGB order).
+// Returns false, without mapping, for any other file, for
+// big-endian PFM data and for pixel data which does not start on a
+// four byte boundary (so that it may be read as floats).
+inline bool MapPfmImage(std::string filename, MappedImage &mapped)
+{
+    // Read and check the header.
+    // ("PF", width, height, scale; a negative scale denotes
+    // little-endian data.)
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    std::string magic;
+    int width=0, height=0;
+    double scale=0;
+    if(!(file>>magic) || magic!="PF") return false;
+    if(!(file>>width>>height>>scale)) return false;
+    if(width<=0 || height<=0 || scale>=0) return false;
+    file.get();  // Single whitespace character ends the header.
+    size_t offset=(size_t)file.tellg();
+    if(offset%sizeof(float)!=0) return false;
+    size_t bytes=(size_t)width*height*3*sizeof(float);
+    file.seekg(0, std::ios::end);
+    size_t length=(size_t)file.tellg();
+    file.close();
+    if(length<offset+bytes) return false;
+
+    // Map the file.
+#ifdef _WIN32
+    HANDLE hfile=CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                             NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hfile==INVALID_HANDLE_VALUE) return false;
+    HANDLE hmap=CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hfile);
+    if(hmap==NULL) return false;
+    void *base=MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hmap);
+    if(base==NULL) return false;
+#else
+    int fd=open(filename.c_str(), O_RDONLY);
+    if(fd<0) return false;
+    void *base=mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base==MAP_FAILED) return false;
+#endif
+
+    mapped.base=base;
+    mapped.length=length;
+    mapped.rgb=true;
+    mapped.image=cv::Mat(height, width, CV_32FC3, (char*)base+offset);
+    return true;
+}
+
+// Creates a little-endian colour PFM file of the specified
+// size, memory maps it (shared, so that writes reach the file)
+// and sets 'mapped.image' to a CV_32FC3 header over its pixel
+// data.  The scale is written with as many zeros as are needed
+// for the pixel data to start on a four byte boundary.
+inline bool CreatePfmImage(std::string filename, cv::Size size,
+                           MappedImage &mapped)
+{
+    char header[64];
+    int offset=sprintf(header, "PF\n%d %d\n-1.", size.width, size.height);
+    do header[offset++]='0'; while((offset+1)%sizeof(float)!=0);
+    header[offset++]='\n';
+    size_t length=offset+(size_t)size.area()*3*sizeof(float);
+
+#ifdef _WIN32
+    HANDLE hfile=CreateFileA(filename.c_str(), GENERIC_READ|GENERIC_WRITE, 0,
+                             NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hfile==INVALID_HANDLE_VALUE) return false;
+    HANDLE hmap=CreateFileMappingA(hfile, NULL, PAGE_READWRITE,
+                                   (DWORD)((unsigned long long)length>>32),
+                                   (DWORD)length, NULL);
+    CloseHandle(hfile);
+    if(hmap==NULL) return false;
+    void *base=MapViewOfFile(hmap, FILE_MAP_WRITE, 0, 0, 0);
+    CloseHandle(hmap);
+    if(base==NULL) return false;
+#else
+    int fd=open(filename.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if(fd<0) return false;
+    if(ftruncate(fd, length)!=0) {close(fd); return false;}
+    void *base=mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base==MAP_FAILED) return false;
+#endif
+
+    memcpy(base, header, offset);
+    mapped.base=base;
+    mapped.length=length;
+    mapped.rgb=true;
+    mapped.image=cv::Mat(size, CV_32FC3, (char*)base+offset);
+    return true;
+}
+
+// Reads an image and returns it in 32 bit float BGR format with
+// values nominally in the range 0 to 1.
+//
+// 8 bit and 16 bit images are scaled accordingly and 32 bit float
+// images (such as EXR or TIFF) are used as they are.  An
+// uncompressed little-endian PFM file is memory mapped, read only,
+// and the mapping itself is returned so that no copy is made.  Its
+// channels are then in RGB order, as 'mapped.rgb' records, and must
+// be read as such (see 'TransferOptions::rgbTarget'), or the image
+// copied by 'CopyMappedImage'.  It must not be written.  PFM rows
+// are stored bottom to top and the mapped image is therefore upside
+// down.  This does not affect the processing, which treats each
+// pixel independently.
+//
+// 'depth' returns the bit depth of the image file (8, 16 or 32).
+inline cv::Mat ReadImageFloat(std::string filename, MappedImage &mapped,
+                              int &depth)
+{
+    MemoryScope scope("Decode");
+
+    cv::Mat image;
+
+    if(MapPfmImage(filename, mapped))
+    {
+        depth=32;
+        return mapped.image;
+    }
+
+    image = cv::imread(filename, cv::IMREAD_ANYDEPTH | cv::IMREAD_COLOR);
+    depth = image.depth()==CV_32F ? 32 : image.depth()==CV_16U ? 16 : 8;
+    return ConvertToFloat(image);
+}
+
+// Returns 'imagef' as read by 'ReadImageFloat' in BGR order, the
+// right way up and in memory of its own.  A mapped PFM image is
+// copied in one pass and the mapping released; any other image is
+// returned as it is.
+inline cv::Mat CopyMappedImage(cv::Mat imagef, MappedImage &mapped)
+{
+    if(mapped.base==NULL) return imagef;
+    cv::Mat bgr(mapped.image.size(), CV_32FC3);
+    SwapRedBlue(mapped.image, bgr, true);
+    UnmapImage(mapped);
+    return bgr;
+}
+
+// Writes a 32 bit float BGR image with the specified bit depth
+// (8, 16 or 32) and returns false if the file could not be written.
+// The image as written, the right way up, is returned in 'display'
+// if it is not NULL.  'bottomUp' indicates that the rows of the
+// image are stored bottom to top (as for a mapped PFM image).
+// 'imagef' itself is never altered.
+//
+// A PFM output file is created at its full size and memory
+// mapped and the image is converted directly into the mapping.
+// Otherwise JPEG files are always written with 8 bit depth and
+// the remaining formats with the specified depth (16 bit for
+// PNG or TIFF, 32 bit for EXR or TIFF).
+inline bool WriteImageFloat(std::string filename, cv::Mat imagef,
+                            int depth, bool bottomUp, cv::Mat *display=NULL)
+{
+    MemoryScope scope("Encode");
+    PerfScope perf("Encode", imagef.total());
+
+    cv::Mat result;
+    MappedImage output;
+    std::string ext=filename.substr(filename.find_last_of('.')+1);
+    for(size_t i=0;i<ext.size();i++) ext[i]=tolower(ext[i]);
+
+    if(ext=="pfm" && CreatePfmImage(filename, imagef.size(), output))
+    {
+        // Match the RGB channel order and the bottom to top row
+        // order of the PFM file.
+        SwapRedBlue(imagef, output.image, !bottomUp);
+        UnmapImage(output);
+        if(display)
+        {
+            if(bottomUp) cv::flip(imagef, *display, 0);
+            else         *display=imagef;
+        }
+        return true;
+    }
+
+    // (A 32 bit image is flipped into a new buffer, since 'result'
+    // would otherwise share the caller's.)
+    if(ext=="jpg" || ext=="jpeg") depth=8;
+    if(depth==32)
+    {
+        if(bottomUp) cv::flip(imagef, result, 0);
+        else         result=imagef;
+    }
+    else
+    {
+        if(depth==16) imagef.convertTo(result, CV_16UC3, 65535.0);
+        else          imagef.convertTo(result, CV_8UC3, 255.0);
+        if(bottomUp) cv::flip(result, result, 0);
+    }
+
+    bool written=false;
+    try {written=cv::imwrite(filename, result);}
+    catch(const cv::Exception &) {}
+    if(display) *display=result;
+    return written;
+}
+
+#endif
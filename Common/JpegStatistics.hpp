@@ -0,0 +1,402 @@
+//*** SOURCE IMAGE STATISTICS FROM JPEG DCT COEFFICIENTS
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// When only the global statistics of a JPEG source image are
+// needed they can be estimated from its quantised DCT coefficients,
+// read by libjpeg without the inverse DCT, upsampling and colour
+// conversion of a full decode.
+//
+// For each minimum coded unit (MCU, 8x8 pixels or 16x16 pixels
+// with the usual chroma subsampling) the mean of each of the Y, Cb
+// and Cr channels is given by the DC coefficients and, since the
+// DCT preserves the sum of squares, the variance by the energy of
+// all the coefficients.  The covariance of two channels sampled on
+// the same grid is given likewise by the products of their
+// coefficients.  For channels sampled on different grids only the
+// covariance of the means of the 8x8 pixel cells of the MCU is
+// used, the mean of the subsampled channel over each cell being
+// found from its coefficients, and any finer correlation between
+// luminance and chrominance is taken as zero.
+//
+// The pixels of each MCU are then taken as normally distributed
+// with this mean and covariance, and their statistics in the colour
+// space of the processing are found by the unscented transform:
+// seven 'sigma point' colours are converted, so each MCU costs no
+// more than seven pixels.  The statistics are also found by
+// linearising the colour space functions about the means of the
+// MCUs, and the difference between the two is returned as an
+// estimate of the error, since both the error of the normal model
+// and that of the linearisation grow with the non-linearity of the
+// colour space over the range of colours within each MCU.
+//
+// MCUs which extend beyond the image edges (at most one column and
+// one row) are left out.  Only 8 bit three component YCbCr images
+// are handled.  The program must be linked with libjpeg ('-ljpeg'),
+// so this header is only included when 'USE_LIBJPEG' is defined.
+
+#ifndef JPEGSTATISTICS_HPP
+#define JPEGSTATISTICS_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <jpeglib.h>
+#include "TransferKernel.hpp"
+
+// Mean and covariance of the Y, Cb and Cr samples (less 128) of an
+// MCU.  The covariances are in the order YY, CbCb, CrCr, YCb, YCr
+// and CbCr.
+struct McuMoments
+{
+    double mean[3];
+    double cov[6];
+};
+
+// A libjpeg error handler which returns to the caller rather than
+// ending the program.
+struct JpegErrorJump
+{
+    struct jpeg_error_mgr manager;
+    jmp_buf               jump;
+};
+
+inline void JpegErrorExit(j_common_ptr cinfo)
+{
+    longjmp(((JpegErrorJump *)cinfo->err)->jump, 1);
+}
+
+// Mean of each DCT basis function over each of 'split' equal
+// segments of the block, for splits of 1, 2 and 4:
+// JpegSegmentMean(split)[segment*8+u].
+struct JpegSegmentTable
+{
+    double mean[3][32];
+    JpegSegmentTable()
+    {
+        for(int s=0;s<3;s++)
+        {
+            int n=1<<s, width=8/n;
+            for(int i=0;i<n;i++)
+                for(int u=0;u<8;u++)
+                {
+                    double sum=0, scale=(u==0 ? std::sqrt(0.5) : 1.0)/2;
+                    for(int x=i*width;x<(i+1)*width;x++)
+                        sum+=scale*std::cos((2*x+1)*u*CV_PI/16);
+                    mean[s][i*8+u]=sum/width;
+                }
+        }
+    }
+};
+
+inline const double *JpegSegmentMean(int split)
+{
+    static const JpegSegmentTable table;
+    return table.mean[split==1 ? 0 : split==2 ? 1 : 2];
+}
+
+// Summarises one MCU.  'blocks[c]' are the dequantised coefficient
+// blocks of channel c (h[c] by v[c] of them, in rows) and 'H' by 'V'
+// is the size of the MCU in 8x8 pixel cells.
+inline McuMoments SummariseMcu(const std::vector<double> blocks[3],
+                               const int h[3], const int v[3],
+                               int H, int V)
+{
+    McuMoments m;
+    int cells=H*V;
+    double cellMean[3][16];
+
+    for(int c=0;c<3;c++)
+    {
+        int sx=H/h[c], sy=V/v[c], n=h[c]*v[c];
+        const double *mx=JpegSegmentMean(sx), *my=JpegSegmentMean(sy);
+        double energy=0;
+        for(int b=0;b<n;b++)
+        {
+            const double *F=&blocks[c][64*b];
+            for(int k=0;k<64;k++) energy+=F[k]*F[k];
+            int bx=b%h[c], by=b/h[c];
+            for(int j=0;j<sy;j++)
+                for(int i=0;i<sx;i++)
+                {
+                    double sum=0;
+                    for(int y=0;y<8;y++)
+                    {
+                        double row=0;
+                        for(int x=0;x<8;x++) row+=F[8*y+x]*mx[8*i+x];
+                        sum+=row*my[8*j+y];
+                    }
+                    cellMean[c][(by*sy+j)*H+bx*sx+i]=sum;
+                }
+        }
+        double mean=0;
+        for(int k=0;k<cells;k++) mean+=cellMean[c][k];
+        m.mean[c]=mean/cells;
+        m.cov[c]=energy/(64.0*n)-m.mean[c]*m.mean[c];
+    }
+
+    const int pair[3][2]={{0,1}, {0,2}, {1,2}};
+    for(int p=0;p<3;p++)
+    {
+        int c=pair[p][0], d=pair[p][1];
+        double sum=0;
+        if(h[c]==h[d] && v[c]==v[d])
+        {
+            int n=h[c]*v[c];
+            for(int k=0;k<64*n;k++) sum+=blocks[c][k]*blocks[d][k];
+            sum/=64.0*n;
+        }
+        else
+        {
+            for(int k=0;k<cells;k++) sum+=cellMean[c][k]*cellMean[d][k];
+            sum/=cells;
+        }
+        m.cov[3+p]=sum-m.mean[c]*m.mean[d];
+    }
+    return m;
+}
+
+// The libjpeg calls are made in functions in which no local
+// variable is changed after the 'setjmp' to which an error returns.
+
+// Reads the header and the coefficients of an 8 bit three component
+// YCbCr image.  Returns NULL on an error or for any other image.
+inline jvirt_barray_ptr *ReadJpegCoefficients(j_decompress_ptr cinfo,
+                                              JpegErrorJump &error,
+                                              FILE *file)
+{
+    if(setjmp(error.jump)) return NULL;
+    jpeg_create_decompress(cinfo);
+    jpeg_stdio_src(cinfo, file);
+    jpeg_read_header(cinfo, TRUE);
+    if(cinfo->num_components!=3 || cinfo->jpeg_color_space!=JCS_YCbCr ||
+       cinfo->data_precision!=8) return NULL;
+    return jpeg_read_coefficients(cinfo);
+}
+
+// Summarises the 'cols' by 'rows' complete MCUs into 'mcus', using
+// 'blocks' as scratch space.  Returns false on an error.
+inline bool SummariseJpegMcus(j_decompress_ptr cinfo, JpegErrorJump &error,
+                              jvirt_barray_ptr *coefficients,
+                              const int h[3], const int v[3],
+                              int cols, int rows,
+                              std::vector<double> blocks[3],
+                              std::vector<McuMoments> &mcus)
+{
+    if(setjmp(error.jump)) return false;
+    for(int my=0;my<rows;my++)
+    {
+        JBLOCKARRAY band[3];
+        for(int c=0;c<3;c++)
+            band[c]=(*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo,
+                    coefficients[c], my*v[c], v[c], FALSE);
+        for(int mx=0;mx<cols;mx++)
+        {
+            for(int c=0;c<3;c++)
+            {
+                const UINT16 *q=cinfo->comp_info[c].quant_table->quantval;
+                for(int b=0;b<h[c]*v[c];b++)
+                {
+                    const JCOEF *F=band[c][b/h[c]][mx*h[c]+b%h[c]];
+                    double *G=&blocks[c][64*b];
+                    for(int k=0;k<64;k++) G[k]=(double)F[k]*q[k];
+                }
+            }
+            mcus[(size_t)my*cols+mx]=SummariseMcu(blocks, h, v,
+                                                  cinfo->max_h_samp_factor,
+                                                  cinfo->max_v_samp_factor);
+        }
+    }
+    return true;
+}
+
+// Reads the coefficients of JPEG file 'filename' and summarises its
+// complete MCUs, each of 'mcuPixels' pixels.  Returns false if the
+// file cannot be read or is not of a type handled.
+inline bool ReadMcuMoments(const std::string &filename,
+                           std::vector<McuMoments> &mcus, int &mcuPixels)
+{
+    FILE *file=fopen(filename.c_str(), "rb");
+    if(!file) return false;
+
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorJump error;
+    memset(&cinfo, 0, sizeof(cinfo));
+    cinfo.err=jpeg_std_error(&error.manager);
+    error.manager.error_exit=JpegErrorExit;
+    jvirt_barray_ptr *coefficients=ReadJpegCoefficients(&cinfo, error, file);
+
+    bool handled=coefficients!=NULL;
+    int H=cinfo.max_h_samp_factor, V=cinfo.max_v_samp_factor;
+    int h[3], v[3];
+    for(int c=0;c<3 && handled;c++)
+    {
+        h[c]=cinfo.comp_info[c].h_samp_factor;
+        v[c]=cinfo.comp_info[c].v_samp_factor;
+        int sx=H/h[c], sy=V/v[c];
+        handled=H%h[c]==0 && V%v[c]==0 && (sx==1 || sx==2 || sx==4) &&
+                (sy==1 || sy==2 || sy==4) &&
+                cinfo.comp_info[c].quant_table!=NULL;
+    }
+    int cols=handled ? cinfo.image_width/(8*H)  : 0;
+    int rows=handled ? cinfo.image_height/(8*V) : 0;
+    handled=handled && cols>0 && rows>0;
+    if(handled)
+    {
+        std::vector<double> blocks[3];
+        for(int c=0;c<3;c++) blocks[c].resize(64*h[c]*v[c]);
+        mcus.resize((size_t)cols*rows);
+        mcuPixels=64*H*V;
+        handled=SummariseJpegMcus(&cinfo, error, coefficients, h, v,
+                                  cols, rows, blocks, mcus);
+    }
+
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    if(!handled) mcus.clear();
+    return handled;
+}
+
+// Lower triangular 'L' with L*L' equal to the covariance of 'm'.
+// (Negative pivots, possible from the approximate covariances of
+// subsampled channels, are taken as zero.)
+inline void McuCholesky(const McuMoments &m, double L[3][3])
+{
+    const double *a=m.cov;
+    L[0][1]=L[0][2]=L[1][2]=0;
+    L[0][0]=std::sqrt(std::max(a[0], 0.0));
+    L[1][0]=L[0][0]>0 ? a[3]/L[0][0] : 0;
+    L[2][0]=L[0][0]>0 ? a[4]/L[0][0] : 0;
+    L[1][1]=std::sqrt(std::max(a[1]-L[1][0]*L[1][0], 0.0));
+    L[2][1]=L[1][1]>0 ? (a[5]-L[2][0]*L[1][0])/L[1][1] : 0;
+    L[2][2]=std::sqrt(std::max(a[2]-L[2][0]*L[2][0]-L[2][1]*L[2][1], 0.0));
+}
+
+// Float BGR (0 to 1) of a Y, Cb, Cr colour (less 128), clipped as
+// a decoded pixel would be.
+inline void JpegYccToBgr(const double ycc[3], float *bgr)
+{
+    double y=ycc[0]+128;
+    double r=y+1.402*ycc[2];
+    double g=y-0.344136*ycc[1]-0.714136*ycc[2];
+    double b=y+1.772*ycc[1];
+    bgr[0]=(float)(std::min(std::max(b, 0.0), 255.0)/255);
+    bgr[1]=(float)(std::min(std::max(g, 0.0), 255.0)/255);
+    bgr[2]=(float)(std::min(std::max(r, 0.0), 255.0)/255);
+}
+
+// Moments of 'count' pixels with mean 'mean' and covariance 'cov'
+// (of channels 0 to 2 in order, then 1 and 2).
+inline BlockMoments GaussianMoments(double count, const double mean[3],
+                                    const double cov[4])
+{
+    BlockMoments b;
+    b.count=count;
+    for(int c=0;c<3;c++) {b.mean[c]=mean[c]; b.m2[c]=count*cov[c];}
+    b.c12=count*cov[3];
+    return b;
+}
+
+// Estimates the statistics of JPEG file 'filename' in the colour
+// space of 'space' from its DCT coefficients, as described above,
+// returning the estimated error in 'error' (the largest difference
+// in a mean or standard deviation as a fraction of the standard
+// deviation, or in the correlation).  Returns false if the file
+// is not a JPEG image of a type handled.
+template<class Space>
+bool JpegStatistics(const Space &space, const std::string &filename,
+                    ColourStatistics &stats, float &error)
+{
+    std::vector<McuMoments> mcus;
+    int mcuPixels;
+    if(!ReadMcuMoments(filename, mcus, mcuPixels)) return false;
+
+    // The sigma points of each MCU: the mean and the mean plus and
+    // minus sqrt(3) times each column of the Cholesky factor.
+    int n=(int)mcus.size();
+    cv::Mat points(n, 7, CV_32FC3), converted(n, 7, CV_32FC3);
+    const int chunk=1024;
+    int chunks=(n+chunk-1)/chunk;
+    std::vector<BlockMoments> unscented(chunks), linear(chunks);
+
+    cv::parallel_for_(cv::Range(0, chunks), [&](const cv::Range &range)
+    {
+        for(int k=range.start;k<range.end;k++)
+        {
+            int row0=k*chunk, row1=std::min(row0+chunk, n);
+            for(int i=row0;i<row1;i++)
+            {
+                double L[3][3], p[3];
+                McuCholesky(mcus[i], L);
+                float *bgr=points.ptr<float>(i);
+                JpegYccToBgr(mcus[i].mean, bgr);
+                for(int j=0;j<3;j++)
+                    for(int sign=-1;sign<=1;sign+=2)
+                    {
+                        for(int c=0;c<3;c++)
+                            p[c]=mcus[i].mean[c]+sign*std::sqrt(3.0)*L[c][j];
+                        JpegYccToBgr(p, bgr+3*(1+2*j+(sign>0)));
+                    }
+            }
+            space.ForwardRow(points.ptr<float>(row0),
+                             converted.ptr<float>(row0), 7*(row1-row0));
+
+            for(int i=row0;i<row1;i++)
+            {
+                const float *f=converted.ptr<float>(i);
+                const int ch[4][2]={{0,0}, {1,1}, {2,2}, {1,2}};
+                double mean[3]={0, 0, 0}, cov[4]={0, 0, 0, 0};
+                double centre[3], lcov[4]={0, 0, 0, 0};
+
+                // Unscented transform.
+                for(int s=1;s<7;s++)
+                    for(int c=0;c<3;c++) mean[c]+=f[3*s+c]/6;
+                for(int s=1;s<7;s++)
+                    for(int q=0;q<4;q++)
+                        cov[q]+=(f[3*s+ch[q][0]]-mean[ch[q][0]])*
+                                (f[3*s+ch[q][1]]-mean[ch[q][1]])/6;
+
+                // Linearisation, by central differences.
+                for(int c=0;c<3;c++) centre[c]=f[c];
+                for(int j=0;j<3;j++)
+                {
+                    double d[3];
+                    for(int c=0;c<3;c++)
+                        d[c]=(f[3*(2+2*j)+c]-f[3*(1+2*j)+c])/(2*std::sqrt(3.0));
+                    for(int q=0;q<4;q++) lcov[q]+=d[ch[q][0]]*d[ch[q][1]];
+                }
+
+                MergeMoments(unscented[k],
+                             GaussianMoments(mcuPixels, mean, cov), 3);
+                MergeMoments(linear[k],
+                             GaussianMoments(mcuPixels, centre, lcov), 3);
+            }
+        }
+    });
+
+    BlockMoments ut, lin;
+    for(int k=0;k<chunks;k++)
+    {
+        MergeMoments(ut, unscented[k], 3);
+        MergeMoments(lin, linear[k], 3);
+    }
+    stats=StatisticsFromMoments(ut);
+    ColourStatistics l=StatisticsFromMoments(lin);
+    double e=std::fabs(stats.corr-l.corr);
+    for(int c=0;c<3;c++)
+    {
+        double dev=std::max(stats.dev[c], 1e-6);
+        e=std::max(e, std::fabs(stats.mean[c]-l.mean[c])/dev);
+        e=std::max(e, std::fabs(stats.dev[c]-l.dev[c])/dev);
+    }
+    error=(float)e;
+    return true;
+}
+
+#endif
@@ -0,0 +1,145 @@
+//*** MASKED REGIONS OF AN IMAGE
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// A region of an image, selected by a mask and/or a rectangle, held
+// as the runs ('spans') of selected pixels in each row.  The pixels
+// of the region may be gathered into a packed image, of one column
+// and a row for each selected pixel, processed there and scattered
+// back.  Since the colour transfer is a per-pixel operation apart
+// from its global statistics, processing the packed image is the
+// same as processing the selected pixels in place, with statistics
+// taken from the selected pixels only, and both the work and the
+// memory needed are in proportion to the selected area rather than
+// to the image.  (Only the mask is scanned, within the rectangle.)
+
+#ifndef MASKREGION_HPP
+#define MASKREGION_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// A run of selected pixels x0 to x1-1 of row y, held in row 'offset'
+// of the packed image.
+struct PixelSpan
+{
+    int    y, x0, x1;
+    size_t offset;
+};
+
+struct MaskRegion
+{
+    cv::Size               size;    // Size of the image.
+    cv::Rect               bounds;  // Bounding box of the selection.
+    std::vector<PixelSpan> spans;   // Runs of selected pixels in order.
+    size_t                 pixels;  // Number of selected pixels.
+    MaskRegion() : pixels(0) {}
+};
+
+// Finds the pixels of an image of size 'size' which are within the
+// rectangle 'roi' (the whole image if empty) and for which 'mask'
+// (CV_8UC1 of the same size, or empty for all pixels) is non-zero.
+inline MaskRegion FindMaskRegion(const cv::Mat &mask, cv::Rect roi,
+                                 cv::Size size)
+{
+    MaskRegion region;
+    region.size=size;
+    cv::Rect whole(0, 0, size.width, size.height);
+    roi= roi.area()>0 ? roi&whole : whole;
+    CV_Assert(mask.empty() ||
+              (mask.size()==size && mask.type()==CV_8UC1));
+
+    // The rows are scanned in parallel and their spans joined.
+    std::vector<std::vector<PixelSpan> > rows(roi.height);
+    cv::parallel_for_(cv::Range(0, roi.height), [&](const cv::Range &r)
+    {
+        for(int i=r.start;i<r.end;i++)
+        {
+            PixelSpan span;
+            span.y=roi.y+i;
+            span.offset=0;
+            if(mask.empty())
+            {
+                span.x0=roi.x;
+                span.x1=roi.x+roi.width;
+                rows[i].push_back(span);
+                continue;
+            }
+            const uchar *k=mask.ptr<uchar>(span.y);
+            int x=roi.x, end=roi.x+roi.width;
+            while(x<end)
+            {
+                while(x<end && k[x]==0) x++;
+                if(x==end) break;
+                span.x0=x;
+                while(x<end && k[x]!=0) x++;
+                span.x1=x;
+                rows[i].push_back(span);
+            }
+        }
+    });
+
+    int left=size.width, right=0, top=size.height, bottom=0;
+    for(int i=0;i<roi.height;i++)
+        for(size_t j=0;j<rows[i].size();j++)
+        {
+            PixelSpan span=rows[i][j];
+            span.offset=region.pixels;
+            region.pixels+=span.x1-span.x0;
+            region.spans.push_back(span);
+            left=std::min(left, span.x0);
+            right=std::max(right, span.x1);
+            top=std::min(top, span.y);
+            bottom=std::max(bottom, span.y+1);
+        }
+    if(region.pixels>0)
+        region.bounds=cv::Rect(left, top, right-left, bottom-top);
+    return region;
+}
+
+// Returns the pixels of 'region' of 'image' as a packed image of one
+// column.
+inline cv::Mat GatherRegion(const cv::Mat &image, const MaskRegion &region)
+{
+    CV_Assert(image.size()==region.size);
+    cv::Mat packed((int)region.pixels, 1, image.type());
+    size_t bytes=image.elemSize();
+    cv::parallel_for_(cv::Range(0, (int)region.spans.size()),
+                      [&](const cv::Range &r)
+    {
+        for(int i=r.start;i<r.end;i++)
+        {
+            const PixelSpan &span=region.spans[i];
+            std::memcpy(packed.ptr((int)span.offset),
+                        image.ptr(span.y)+span.x0*bytes,
+                        (span.x1-span.x0)*bytes);
+        }
+    });
+    return packed;
+}
+
+// Puts the pixels of the packed image 'packed' back into 'region' of
+// 'image'.
+inline void ScatterRegion(const cv::Mat &packed, const MaskRegion &region,
+                          cv::Mat &image)
+{
+    CV_Assert(image.size()==region.size && packed.type()==image.type() &&
+              packed.rows==(int)region.pixels);
+    size_t bytes=image.elemSize();
+    cv::parallel_for_(cv::Range(0, (int)region.spans.size()),
+                      [&](const cv::Range &r)
+    {
+        for(int i=r.start;i<r.end;i++)
+        {
+            const PixelSpan &span=region.spans[i];
+            std::memcpy(image.ptr(span.y)+span.x0*bytes,
+                        packed.ptr((int)span.offset),
+                        (span.x1-span.x0)*bytes);
+        }
+    });
+}
+
+#endif
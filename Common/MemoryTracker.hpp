@@ -0,0 +1,210 @@
+//*** ALLOCATION TRACKING FOR OPENCV IMAGE MEMORY
+//*** WITH A PER-STAGE MEMORY REPORT
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// An optional cv::MatAllocator which passes every allocation on to
+// the standard OpenCV allocator but first records it against the
+// processing stage, and the image, that is active on the calling
+// thread.  For each image and stage the number of allocations and
+// releases, the bytes allocated, the bytes still live and the peak
+// live bytes are kept, so that the stages which use the most
+// memory can be identified and the memory needed per image can be
+// used to size containers.
+//
+// Stages are marked by 'MemoryScope' objects:
+//     MemoryScope scope("Decode", index);
+// which set the stage (and optionally the image) for the current
+// thread until they go out of scope.  Memory is charged to the
+// stage that allocated it, wherever it is later released.
+// Allocations made on threads with no active scope (for example
+// OpenCV's own parallel worker threads) are charged to stage
+// "(other)" of image -1.
+//
+// Tracking is enabled by 'EnableMemoryTracking' and costs a lock
+// and a map update per allocation, which is small compared with
+// the processing of the allocated image.
+
+#ifndef MEMORYTRACKER_HPP
+#define MEMORYTRACKER_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+// The stage and image currently active on this thread.
+struct MemoryContext
+{
+    const char *stage;
+    int image;
+};
+
+inline MemoryContext &CurrentMemoryContext()
+{
+    static thread_local MemoryContext context={"(other)", -1};
+    return context;
+}
+
+// Sets the stage (and, if 'image' is not negative, the image)
+// for the current thread for the lifetime of the object.
+class MemoryScope
+{
+public:
+    explicit MemoryScope(const char *stage, int image=-1)
+        : saved(CurrentMemoryContext())
+    {
+        CurrentMemoryContext().stage=stage;
+        if(image>=0) CurrentMemoryContext().image=image;
+    }
+    ~MemoryScope() {CurrentMemoryContext()=saved;}
+private:
+    MemoryContext saved;
+    MemoryScope(const MemoryScope &);
+    MemoryScope &operator=(const MemoryScope &);
+};
+
+struct MemoryCounters
+{
+    long   allocations, releases;
+    double allocated, live, peak;
+    MemoryCounters() : allocations(0), releases(0),
+                       allocated(0), live(0), peak(0) {}
+};
+
+// The type of the access flags of 'cv::MatAllocator' (an enum from
+// OpenCV 4).
+#if CV_VERSION_MAJOR>=4
+typedef cv::AccessFlag MatAccessFlags;
+#else
+typedef int MatAccessFlags;
+#endif
+
+class TrackingAllocator : public cv::MatAllocator
+{
+public:
+    typedef std::pair<int, std::string> Key;
+
+    cv::UMatData *allocate(int dims, const int *sizes, int type,
+                           void *data, size_t *step, MatAccessFlags flags,
+                           cv::UMatUsageFlags usageFlags) const
+    {
+        cv::UMatData *u=Standard()->allocate(dims, sizes, type, data,
+                                             step, flags, usageFlags);
+        if(!u) return u;
+
+        // Release must come back here to be recorded.
+        u->currAllocator=this;
+        if(data) return u;  // (User memory is not counted.)
+
+        MemoryContext &context=CurrentMemoryContext();
+        Key key(context.image, context.stage);
+        std::lock_guard<std::mutex> guard(lock);
+        owners[u]=key;
+        Charge(counters[key], (double)u->size);
+        Charge(counters[Key(context.image, "")], (double)u->size);
+        return u;
+    }
+
+    bool allocate(cv::UMatData *u, MatAccessFlags accessFlags,
+                  cv::UMatUsageFlags usageFlags) const
+    {
+        return Standard()->allocate(u, accessFlags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData *u) const
+    {
+        if(!u) return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::map<cv::UMatData*, Key>::iterator owner=owners.find(u);
+            if(owner!=owners.end())
+            {
+                Key key=owner->second;
+                owners.erase(owner);
+                Release(key, (double)u->size);
+                Release(Key(key.first, ""), (double)u->size);
+            }
+        }
+        u->currAllocator=Standard();
+        Standard()->deallocate(u);
+    }
+
+    // Prints the counters for one image (-1 for memory not tied to
+    // an image) and then discards them.  Memory still live is then
+    // no longer counted when released.
+    void PrintReport(int image, const std::string &name) const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const double MB=1048576.0;
+        printf("Memory used by %s:\n", name.c_str());
+        printf("   %-22s %8s %8s %11s %9s %9s\n", "stage", "allocs",
+               "releases", "allocated", "peak", "live");
+        std::map<Key, MemoryCounters>::iterator i=counters.begin();
+        while(i!=counters.end())
+        {
+            if(i->first.first!=image) {++i; continue;}
+            const MemoryCounters &c=i->second;
+            printf("   %-22s %8ld %8ld %8.1f MB %6.1f MB %6.1f MB\n",
+                   i->first.second.empty() ? "(all stages)"
+                                           : i->first.second.c_str(),
+                   c.allocations, c.releases, c.allocated/MB,
+                   c.peak/MB, c.live/MB);
+            counters.erase(i++);
+        }
+    }
+
+private:
+    mutable std::mutex lock;
+    mutable std::map<Key, MemoryCounters> counters;
+    mutable std::map<cv::UMatData*, Key> owners;
+
+    static cv::MatAllocator *Standard()
+    {
+        return cv::Mat::getStdAllocator();
+    }
+
+    static void Charge(MemoryCounters &c, double bytes)
+    {
+        c.allocations++;
+        c.allocated+=bytes;
+        c.live+=bytes;
+        c.peak=std::max(c.peak, c.live);
+    }
+
+    void Release(const Key &key, double bytes) const
+    {
+        std::map<Key, MemoryCounters>::iterator i=counters.find(key);
+        if(i==counters.end()) return;
+        i->second.releases++;
+        i->second.live-=bytes;
+    }
+};
+
+inline TrackingAllocator &MemoryTracker()
+{
+    static TrackingAllocator tracker;
+    return tracker;
+}
+
+// Routes all subsequent cv::Mat allocations through the tracker.
+inline void EnableMemoryTracking()
+{
+    cv::Mat::setDefaultAllocator(&MemoryTracker());
+}
+
+inline bool MemoryTrackingEnabled()
+{
+    return cv::Mat::getDefaultAllocator()==&MemoryTracker();
+}
+
+inline void PrintMemoryReport(int image, const std::string &name)
+{
+    if(MemoryTrackingEnabled()) MemoryTracker().PrintReport(image, name);
+}
+
+#endif
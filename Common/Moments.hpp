@@ -0,0 +1,579 @@
+//*** MERGEABLE MOMENT ACCUMULATORS
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// Image statistics held as moments which can be computed for any
+// band of rows of an image, saved to a file and merged later, so
+// that the statistics of a very large image can be gathered by
+// several processes (or machines) each reading only its own rows.
+//
+// An accumulator holds the pixel count, the channel means and the
+// co-moments (sums of products of deviations from the means) of up
+// to three channels, which are all that the global transfer needs.
+// Means rather than sums are kept and merged, using the pairwise
+// update of Chan et al., so the merged result agrees with a single
+// pass over the whole image to rounding, however the image is
+// divided.
+//
+// The reshaping of the enhanced program ('ChannelCondition') uses
+// the masked, weighted fourth moments of the channels standardised
+// by the statistics of the whole image, which a single set of
+// moments cannot give.  They are held as tail moments, gathered in
+// further passes over the same bands once the moments have been
+// merged (see 'TailMoments' below).
+//
+// Accumulators are saved as text with the values in hexadecimal
+// floating point, so that a reloaded accumulator is exactly the
+// one saved.  Each file is written under a temporary name and then
+// renamed, so that a coordinator never reads a partial file.
+
+#ifndef MOMENTS_HPP
+#define MOMENTS_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "Cancellation.hpp"
+#include "Statistics.hpp"
+
+struct MomentAccumulator
+{
+    int    channels;
+    double count;
+    double mean[3];
+    double comoment[3][3];
+    explicit MomentAccumulator(int cn=3) : channels(cn), count(0)
+    {
+        for(int i=0;i<3;i++)
+        {
+            mean[i]=0;
+            for(int j=0;j<3;j++) comoment[i][j]=0;
+        }
+    }
+};
+
+// Merges the moments 'b' into 'a'.  Returns false if the
+// accumulators are for different numbers of channels.
+inline bool MergeAccumulators(MomentAccumulator &a,
+                              const MomentAccumulator &b)
+{
+    if(a.channels!=b.channels) return false;
+    int cn=a.channels;
+    if(b.count==0) return true;
+
+    double n=a.count+b.count;
+    double delta[3];
+    for(int c=0;c<cn;c++) delta[c]=b.mean[c]-a.mean[c];
+    for(int i=0;i<cn;i++)
+        for(int j=0;j<cn;j++)
+            a.comoment[i][j]+=b.comoment[i][j]
+                             +delta[i]*delta[j]*a.count*b.count/n;
+    for(int c=0;c<cn;c++)
+        a.mean[c] = a.count==0 ? b.mean[c] : a.mean[c]+delta[c]*b.count/n;
+    a.count=n;
+    return true;
+}
+
+inline double MomentDev(const MomentAccumulator &m, int c)
+{
+    return m.count>0 ? sqrt(m.comoment[c][c]/m.count) : 0;
+}
+
+inline double MomentCorr(const MomentAccumulator &m, int i, int j)
+{
+    double d=sqrt(m.comoment[i][i]*m.comoment[j][j]);
+    return d>0 ? m.comoment[i][j]/d : 0;
+}
+
+
+// Block accumulation.  The rows are processed in blocks (of the
+// size used by 'Statistics.hpp') in parallel and the blocks are
+// merged in order.  Each block is first converted into the colour
+// space, if one is given, while it is in cache.  The loop stops
+// early if the current job is cancelled (see 'Cancellation.hpp')
+// and then throws.
+struct NoConversion {};
+
+inline cv::Mat MomentBlockRows(const NoConversion &, cv::Mat rows,
+                               cv::Mat &)
+{
+    return rows;
+}
+
+template<class Space>
+cv::Mat MomentBlockRows(const Space &space, cv::Mat rows, cv::Mat &scratch)
+{
+    scratch.create(rows.size(), CV_32FC3);
+    for(int y=0;y<rows.rows;y++)
+        space.ForwardRow(rows.ptr<float>(y), scratch.ptr<float>(y),
+                         rows.cols);
+    return scratch;
+}
+
+template<class Space, class Moments, class Block>
+void ForEachMomentBlock(const Space &space, const cv::Mat &image,
+                        const cv::Mat &mask, int row0, int row1,
+                        std::vector<Moments> &partial,
+                        const Moments &initial, Block block)
+{
+    int rowsPerBlock=std::max(1, StatBlockPixels/std::max(image.cols,1));
+    int blocks=(row1-row0+rowsPerBlock-1)/rowsPerBlock;
+    partial.assign(std::max(blocks,0), initial);
+
+    const CancelToken *token=CurrentCancelToken();
+    cv::parallel_for_(cv::Range(0, std::max(blocks,0)),
+                      [&](const cv::Range &range)
+    {
+        cv::Mat scratch;
+        for(int b=range.start;b<range.end && !Cancelled(token);b++)
+        {
+            int r0=row0+b*rowsPerBlock;
+            int r1=std::min(r0+rowsPerBlock, row1);
+            cv::Mat rows=MomentBlockRows(space, image.rowRange(r0, r1),
+                                         scratch);
+            block(rows, mask.empty() ? mask : mask.rowRange(r0, r1),
+                  partial[b]);
+        }
+    });
+    ThrowIfCancelled();
+}
+
+// One block: count, means and co-moments.
+inline void AccumulateBlock(const cv::Mat &rows, const cv::Mat &mask,
+                            MomentAccumulator &m)
+{
+    int cn=m.channels;
+    double sum[3]={0,0,0};
+
+    for(int y=0;y<rows.rows;y++)
+    {
+        const float *p=rows.ptr<float>(y);
+        const uchar *k=mask.empty() ? NULL : mask.ptr<uchar>(y);
+        for(int x=0;x<rows.cols;x++)
+        {
+            if(k && !k[x]) continue;
+            for(int c=0;c<cn;c++) sum[c]+=p[x*cn+c];
+            m.count++;
+        }
+    }
+    if(m.count==0) return;
+    for(int c=0;c<cn;c++) m.mean[c]=sum[c]/m.count;
+
+    // Second pass (data now in cache): co-moments.
+    for(int y=0;y<rows.rows;y++)
+    {
+        const float *p=rows.ptr<float>(y);
+        const uchar *k=mask.empty() ? NULL : mask.ptr<uchar>(y);
+        for(int x=0;x<rows.cols;x++)
+        {
+            if(k && !k[x]) continue;
+            double d[3];
+            for(int c=0;c<cn;c++) d[c]=p[x*cn+c]-m.mean[c];
+            for(int i=0;i<cn;i++)
+                for(int j=i;j<cn;j++) m.comoment[i][j]+=d[i]*d[j];
+        }
+    }
+    for(int i=0;i<cn;i++)
+        for(int j=0;j<i;j++) m.comoment[i][j]=m.comoment[j][i];
+}
+
+template<class Space>
+MomentAccumulator AccumulateMomentsIn(const Space &space,
+                                      const cv::Mat &image,
+                                      const cv::Mat &mask,
+                                      int cn, int row0, int row1)
+{
+    std::vector<MomentAccumulator> partial;
+    MomentAccumulator total(cn);
+    ForEachMomentBlock(space, image, mask, row0, row1, partial, total,
+                       AccumulateBlock);
+    for(size_t b=0;b<partial.size();b++)
+        MergeAccumulators(total, partial[b]);
+    return total;
+}
+
+
+// Accumulates the moments of rows 'row0' to 'row1' (all rows if
+// 'row1' is negative) of a CV_32F image with one or three
+// channels, optionally within a CV_8U mask.
+inline MomentAccumulator AccumulateMoments(const cv::Mat &image,
+                                           const cv::Mat &mask=cv::Mat(),
+                                           int row0=0, int row1=-1)
+{
+    if(row1<0) row1=image.rows;
+    return AccumulateMomentsIn(NoConversion(), image, mask,
+                               image.channels(), row0, row1);
+}
+
+// As 'AccumulateMoments' for a float BGR image, with the moments
+// taken in the colour space 'space' (see 'ColourSpace.hpp').
+template<class Space>
+MomentAccumulator AccumulateColourMoments(const Space &space,
+                                          const cv::Mat &bgr,
+                                          int row0=0, int row1=-1)
+{
+    if(row1<0) row1=bgr.rows;
+    return AccumulateMomentsIn(space, bgr, cv::Mat(), 3, row0, row1);
+}
+
+
+// Tail moments.  The reshaping matches, separately for the values
+// above and below the mean, the weighted mean fourth power of each
+// channel standardised by the statistics of the whole image.  The
+// weight of a standardised value 's' is (1-exp(-s*w/m))^2, where
+// 'w' is 'TailWeightScale' and 'm' is the mean of the standardised
+// values on the same side of the mean, so that it is zero at the
+// mean and unity far from it.  The weights depend upon 'm', which
+// depends upon the mean and deviation, so the tails are gathered
+// in two passes over the bands after the moments have been merged:
+// the first sums the standardised values on each side, giving 'm',
+// and the second, started by 'NextTailPass' once the first has
+// been merged over all the bands, sums the weights and the weighted
+// fourth powers.  Every quantity is a plain sum, so the tails of
+// the bands merge by addition, in order.
+const double TailWeightScale = 0.25;
+
+struct TailMoments
+{
+    int    channels;
+    int    pass;                // 1 (sums) or 2 (weighted powers).
+    double mean[3], dev[3];     // Standardisation of each channel.
+    double count[3][2];         // Values above [c][0] and below
+    double sum[3][2];           // [c][1] the mean.
+    double weight[3][2];
+    double fourth[3][2];
+    explicit TailMoments(int cn=3) : channels(cn), pass(1)
+    {
+        for(int c=0;c<3;c++)
+        {
+            mean[c]=0;
+            dev[c]=1;
+            for(int h=0;h<2;h++)
+                count[c][h]=sum[c][h]=weight[c][h]=fourth[c][h]=0;
+        }
+    }
+};
+
+// The first pass of the tails of channels standardised by the
+// merged moments 'm'.  (A default 'TailMoments' is for channels
+// which are standardised already.)
+inline TailMoments StartTailMoments(const MomentAccumulator &m)
+{
+    TailMoments t(m.channels);
+    for(int c=0;c<m.channels;c++)
+    {
+        t.mean[c]=m.mean[c];
+        t.dev[c]=MomentDev(m, c)>0 ? MomentDev(m, c) : 1;
+    }
+    return t;
+}
+
+// Clears the sums of the current pass.
+inline void ClearTailPass(TailMoments &t)
+{
+    for(int c=0;c<3;c++)
+        for(int h=0;h<2;h++)
+        {
+            if(t.pass==1) t.count[c][h]=t.sum[c][h]=0;
+            else          t.weight[c][h]=t.fourth[c][h]=0;
+        }
+}
+
+// Starts the second pass once the first has been merged over all
+// the bands.
+inline void NextTailPass(TailMoments &t)
+{
+    t.pass=2;
+    ClearTailPass(t);
+}
+
+// Merges the tails 'b' into 'a'.  Returns false if they are not
+// for the same channels, standardisation and pass (and, in the
+// second pass, the same sums of the first).
+inline bool MergeTails(TailMoments &a, const TailMoments &b)
+{
+    if(a.channels!=b.channels || a.pass!=b.pass) return false;
+    for(int c=0;c<a.channels;c++)
+    {
+        if(a.mean[c]!=b.mean[c] || a.dev[c]!=b.dev[c]) return false;
+        for(int h=0;h<2;h++)
+            if(a.pass==2 &&
+               (a.count[c][h]!=b.count[c][h] || a.sum[c][h]!=b.sum[c][h]))
+                return false;
+    }
+    for(int c=0;c<a.channels;c++)
+        for(int h=0;h<2;h++)
+        {
+            if(a.pass==1)
+            {
+                a.count[c][h]+=b.count[c][h];
+                a.sum[c][h]+=b.sum[c][h];
+            }
+            else
+            {
+                a.weight[c][h]+=b.weight[c][h];
+                a.fourth[c][h]+=b.fourth[c][h];
+            }
+        }
+    return true;
+}
+
+// The mean standardised value of channel 'c' above (side 0) or
+// below (side 1) the mean.
+inline double TailMean(const TailMoments &t, int c, int side)
+{
+    return t.count[c][side]>0 ? t.sum[c][side]/t.count[c][side] : 0;
+}
+
+// The weighted mean fourth power of the standardised values of
+// channel 'c' above (side 0) or below (side 1) the mean.
+inline double TailFourthMoment(const TailMoments &t, int c, int side)
+{
+    return t.weight[c][side]>0 ? t.fourth[c][side]/t.weight[c][side] : 0;
+}
+
+// Standardises channel 'c' of 'n' pixels of 'cn' channels at 'p'
+// into 's' and, if 'w' is not NULL, computes their weights (which
+// needs the first pass of 't').
+inline void TailRow(const TailMoments &t, int c, const float *p, int cn,
+                    int n, float *s, float *w)
+{
+    float mean=(float)t.mean[c], scale=(float)(1/t.dev[c]);
+    for(int x=0;x<n;x++) s[x]=(p[x*cn+c]-mean)*scale;
+    if(!w || n==0) return;
+
+    // (A side with no values has no weight.)
+    float m[2]={(float)TailMean(t, c, 0), (float)TailMean(t, c, 1)};
+    for(int x=0;x<n;x++)
+    {
+        float side=m[s[x]>0 ? 0 : 1];
+        w[x]= side!=0 ? (float)(-s[x]*TailWeightScale)/side : 0;
+    }
+    cv::Mat weights(1, n, CV_32F, w);
+    cv::exp(weights, weights);
+    for(int x=0;x<n;x++) w[x]=(1-w[x])*(1-w[x]);
+}
+
+// One block: the sums of the current pass.
+inline void AccumulateTailBlock(const cv::Mat &rows, const cv::Mat &mask,
+                                TailMoments &t)
+{
+    int cn=t.channels, n=rows.cols;
+    std::vector<float> s(n+1), w(n+1);
+    for(int y=0;y<rows.rows;y++)
+    {
+        const float *p=rows.ptr<float>(y);
+        const uchar *k=mask.empty() ? NULL : mask.ptr<uchar>(y);
+        for(int c=0;c<cn;c++)
+        {
+            TailRow(t, c, p, cn, n, &s[0], t.pass==2 ? &w[0] : NULL);
+            for(int x=0;x<n;x++)
+            {
+                if(k && !k[x]) continue;
+                int h= s[x]>0 ? 0 : 1;
+                if(t.pass==1)
+                {
+                    t.count[c][h]++;
+                    t.sum[c][h]+=s[x];
+                }
+                else
+                {
+                    double s2=(double)s[x]*s[x];
+                    t.weight[c][h]+=w[x];
+                    t.fourth[c][h]+=w[x]*s2*s2;
+                }
+            }
+        }
+    }
+}
+
+template<class Space>
+TailMoments AccumulateTailsIn(const Space &space, const TailMoments &t,
+                              const cv::Mat &image, const cv::Mat &mask,
+                              int row0, int row1)
+{
+    std::vector<TailMoments> partial;
+    TailMoments total=t;
+    ClearTailPass(total);
+    ForEachMomentBlock(space, image, mask, row0, row1, partial, total,
+                       AccumulateTailBlock);
+    for(size_t b=0;b<partial.size();b++)
+        MergeTails(total, partial[b]);
+    return total;
+}
+
+// Accumulates the current pass of the tails 't' over rows 'row0' to
+// 'row1' (all rows if 'row1' is negative) of a CV_32F image with
+// the channels of 't', optionally within a CV_8U mask.  The result
+// holds the sums of these rows only.
+inline TailMoments AccumulateTails(const TailMoments &t,
+                                   const cv::Mat &image,
+                                   const cv::Mat &mask=cv::Mat(),
+                                   int row0=0, int row1=-1)
+{
+    if(row1<0) row1=image.rows;
+    return AccumulateTailsIn(NoConversion(), t, image, mask, row0, row1);
+}
+
+// As 'AccumulateTails' for a float BGR image, with the tails taken
+// in the colour space 'space'.
+template<class Space>
+TailMoments AccumulateColourTails(const Space &space, const TailMoments &t,
+                                  const cv::Mat &bgr, int row0=0,
+                                  int row1=-1)
+{
+    if(row1<0) row1=bgr.rows;
+    return AccumulateTailsIn(space, t, bgr, cv::Mat(), row0, row1);
+}
+
+// Both passes of the tails of the whole of an image held in one
+// process, whose channels are standardised already.
+inline TailMoments StandardisedTails(const cv::Mat &image,
+                                     const cv::Mat &mask=cv::Mat())
+{
+    TailMoments t=AccumulateTails(TailMoments(image.channels()), image,
+                                  mask);
+    NextTailPass(t);
+    return AccumulateTails(t, image, mask);
+}
+
+
+// Files.  Each is written under a temporary name by
+// 'OpenMomentsFile' and renamed into place by 'CloseMomentsFile'.
+inline FILE *OpenMomentsFile(const std::string &filename)
+{
+    return fopen((filename+".tmp").c_str(), "w");
+}
+
+inline void PrintMomentsRecord(FILE *f, const char *name, const double *v,
+                               int n)
+{
+    fprintf(f, "%s", name);
+    for(int i=0;i<n;i++) fprintf(f, " %a", v[i]);
+    fprintf(f, "\n");
+}
+
+inline bool CloseMomentsFile(FILE *f, const std::string &filename)
+{
+    std::string temporary=filename+".tmp";
+    bool ok=!ferror(f);
+    ok=fclose(f)==0 && ok;
+
+#ifdef _WIN32
+    if(ok) remove(filename.c_str());
+#endif
+    if(!ok || rename(temporary.c_str(), filename.c_str())!=0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Reads the records of a moments file.
+struct MomentsFileReader
+{
+    FILE *f;
+    char word[64];
+    explicit MomentsFileReader(const std::string &filename)
+        : f(fopen(filename.c_str(), "r")) {}
+    ~MomentsFileReader() {if(f) fclose(f);}
+
+    bool Number(double &v)
+    {
+        char *end;
+        if(!f || fscanf(f, "%63s", word)!=1) return false;
+        v=strtod(word, &end);
+        return end!=word && *end==0;
+    }
+    // Reads the record 'name' of 'n' numbers.
+    bool Record(const char *name, double *v, int n)
+    {
+        if(!f || fscanf(f, "%63s", word)!=1 || std::string(word)!=name)
+            return false;
+        for(int i=0;i<n;i++)
+            if(!Number(v[i])) return false;
+        return true;
+    }
+private:
+    MomentsFileReader(const MomentsFileReader &);
+    MomentsFileReader &operator=(const MomentsFileReader &);
+};
+
+// Saves an accumulator.  Returns false on failure.
+inline bool SaveMoments(const MomentAccumulator &m,
+                        const std::string &filename)
+{
+    FILE *f=OpenMomentsFile(filename);
+    if(!f) return false;
+
+    fprintf(f, "ColourTransferMoments 2\n");
+    fprintf(f, "channels %d\n", m.channels);
+    PrintMomentsRecord(f, "count", &m.count, 1);
+    PrintMomentsRecord(f, "mean", m.mean, 3);
+    PrintMomentsRecord(f, "comoment", &m.comoment[0][0], 9);
+    return CloseMomentsFile(f, filename);
+}
+
+// Loads an accumulator saved by 'SaveMoments'.  Returns false if
+// the file cannot be read or is not a moments file.
+inline bool LoadMoments(MomentAccumulator &m, const std::string &filename)
+{
+    MomentsFileReader file(filename);
+    double version, channels;
+    bool ok=file.Record("ColourTransferMoments", &version, 1) &&
+            version==2 && file.Record("channels", &channels, 1) &&
+            (channels==1 || channels==3);
+    if(ok) m=MomentAccumulator((int)channels);
+    return ok && file.Record("count", &m.count, 1) &&
+           file.Record("mean", m.mean, 3) &&
+           file.Record("comoment", &m.comoment[0][0], 9);
+}
+
+// Saves tail moments.  Returns false on failure.
+inline bool SaveTails(const TailMoments &t, const std::string &filename)
+{
+    FILE *f=OpenMomentsFile(filename);
+    if(!f) return false;
+
+    fprintf(f, "ColourTransferTails 1\n");
+    fprintf(f, "channels %d\n", t.channels);
+    fprintf(f, "pass %d\n", t.pass);
+    PrintMomentsRecord(f, "mean", t.mean, 3);
+    PrintMomentsRecord(f, "dev", t.dev, 3);
+    PrintMomentsRecord(f, "count", &t.count[0][0], 6);
+    PrintMomentsRecord(f, "sum", &t.sum[0][0], 6);
+    PrintMomentsRecord(f, "weight", &t.weight[0][0], 6);
+    PrintMomentsRecord(f, "fourth", &t.fourth[0][0], 6);
+    return CloseMomentsFile(f, filename);
+}
+
+// Loads tail moments saved by 'SaveTails'.  Returns false if the
+// file cannot be read or is not a tails file.
+inline bool LoadTails(TailMoments &t, const std::string &filename)
+{
+    MomentsFileReader file(filename);
+    double version, channels, pass;
+    bool ok=file.Record("ColourTransferTails", &version, 1) &&
+            version==1 && file.Record("channels", &channels, 1) &&
+            (channels==1 || channels==3) && file.Record("pass", &pass, 1) &&
+            (pass==1 || pass==2);
+    if(ok)
+    {
+        t=TailMoments((int)channels);
+        t.pass=(int)pass;
+    }
+    return ok && file.Record("mean", t.mean, 3) &&
+           file.Record("dev", t.dev, 3) &&
+           file.Record("count", &t.count[0][0], 6) &&
+           file.Record("sum", &t.sum[0][0], 6) &&
+           file.Record("weight", &t.weight[0][0], 6) &&
+           file.Record("fourth", &t.fourth[0][0], 6);
+}
+
+#endif
@@ -0,0 +1,314 @@
+//*** HARDWARE PERFORMANCE COUNTERS WITH A PER-STAGE REPORT
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// Timings alone do not show whether a processing stage is limited
+// by its arithmetic, by memory bandwidth or by stalls on cache and
+// branch misses.  Here the processor's own counters of cycles,
+// instructions, last level cache misses and branch misses are read
+// (through the Linux 'perf_event_open' interface) as each stage
+// starts and ends, and the differences are charged to the stage.
+//
+// Stages are marked by 'PerfScope' objects:
+//     PerfScope perf("ChannelCondition", Chan.total());
+// giving the stage and the number of pixels it processes.  A stage
+// within another is charged with its own counts only, which are
+// taken from those of the enclosing stage.
+//
+// The counters are opened by 'EnableHardwareCounters' for the whole
+// process and are inherited by threads created afterwards, so it
+// must be called before OpenCV starts its worker threads.  Since
+// the counts are of the whole process, a stage is charged with all
+// the work done while it is active, which includes any other stage
+// running at the same time on another thread.  The report is
+// therefore exact for a single image but only indicative for the
+// concurrent stages of batch processing.
+//
+// Counters are often unavailable in containers and virtual machines
+// or where 'perf_event_paranoid' forbids them.  A counter which
+// cannot be opened is reported as such and left out of the report,
+// and if the cycles or instructions cannot be counted the scopes do
+// nothing at all.  Only user space is counted.
+//
+// 'PrintHardwareCounterReport' prints, for each stage, the cycles
+// per pixel, the instructions per cycle (IPC), the memory traffic
+// per pixel (the last level cache misses times the line size), the
+// instructions per byte of memory traffic and the branch misses per
+// thousand pixels.  Each stage is then placed against a roofline:
+// the IPC is at most 'PeakInstructionsPerCycle' and at most the
+// instructions per byte times the memory traffic per cycle which a
+// streaming copy achieves on this machine (measured when the
+// counters are enabled).  A stage to the left of the ridge point is
+// memory bound, and one well below its roof is stalling.
+
+#ifndef PERFCOUNTERS_HPP
+#define PERFCOUNTERS_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const int PerfEvents = 4;
+enum {PerfCycles, PerfInstructions, PerfCacheMisses, PerfBranchMisses};
+
+// Assumed issue width of the processor.
+const double PeakInstructionsPerCycle = 4.0;
+
+struct PerfCounts
+{
+    double value[PerfEvents];
+    PerfCounts() {for(int e=0;e<PerfEvents;e++) value[e]=0;}
+    PerfCounts &operator+=(const PerfCounts &other)
+    {
+        for(int e=0;e<PerfEvents;e++) value[e]+=other.value[e];
+        return *this;
+    }
+    PerfCounts &operator-=(const PerfCounts &other)
+    {
+        for(int e=0;e<PerfEvents;e++) value[e]-=other.value[e];
+        return *this;
+    }
+};
+
+struct PerfStage
+{
+    long       calls;
+    double     pixels;
+    PerfCounts counts;
+    PerfStage() : calls(0), pixels(0) {}
+};
+
+class HardwareCounters
+{
+public:
+    HardwareCounters() : enabled(false), bytesPerCycle(0)
+    {
+        for(int e=0;e<PerfEvents;e++) fd[e]=-1;
+    }
+
+    // Opens the counters for this process, reporting any which are
+    // unavailable, and measures the streaming memory traffic.
+    void Enable()
+    {
+        static const char *const names[PerfEvents]=
+            {"cycles", "instructions", "cache misses", "branch misses"};
+        for(int e=0;e<PerfEvents;e++)
+        {
+            if(fd[e]<0) fd[e]=Open(e);
+            if(fd[e]<0)
+                printf("Hardware counter of %s unavailable (%s)\n",
+                       names[e], strerror(errno));
+        }
+        enabled=fd[PerfCycles]>=0 && fd[PerfInstructions]>=0;
+        if(enabled) MeasureStreaming();
+        else printf("Hardware counter report not available\n");
+    }
+
+    bool Enabled() const {return enabled;}
+    bool Available(int e) const {return fd[e]>=0;}
+
+    // The counts of the process so far (scaled up for any time the
+    // counters were not running, when shared with other users).
+    PerfCounts Read() const
+    {
+        PerfCounts c;
+#if defined(__linux__)
+        for(int e=0;e<PerfEvents;e++)
+        {
+            unsigned long long v[3];    // Value, time enabled, running.
+            if(fd[e]<0 || read(fd[e], v, sizeof(v))!=(ssize_t)sizeof(v))
+                continue;
+            c.value[e]=v[2]>0 ? (double)v[0]*v[1]/v[2] : 0;
+        }
+#endif
+        return c;
+    }
+
+    void Charge(const char *stage, double pixels, const PerfCounts &c)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        PerfStage &s=stages[stage];
+        s.calls++;
+        s.pixels+=pixels;
+        s.counts+=c;
+    }
+
+    void PrintReport()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!enabled || stages.empty()) return;
+        double ridge=bytesPerCycle>0 ? PeakInstructionsPerCycle/bytesPerCycle
+                                     : 0;
+        printf("Hardware counters per stage (streaming %.2f bytes/cycle, "
+               "ridge at %.2f instructions/byte):\n", bytesPerCycle, ridge);
+        printf("   %-22s %6s %8s %9s %5s %9s %10s %9s  %s\n", "stage",
+               "calls", "Mpixels", "cycles/px", "IPC", "bytes/px",
+               "instr/byte", "br.miss/k", "bound");
+        std::map<std::string, PerfStage>::iterator i;
+        for(i=stages.begin();i!=stages.end();++i)
+        {
+            const PerfStage &s=i->second;
+            const double *v=s.counts.value;
+            double pixels=std::max(s.pixels, 1.0);
+            double ipc=v[PerfCycles]>0 ? v[PerfInstructions]/v[PerfCycles]
+                                       : 0;
+            printf("   %-22s %6ld %8.2f %9.2f %5.2f ", i->first.c_str(),
+                   s.calls, s.pixels/1e6, v[PerfCycles]/pixels, ipc);
+
+            if(!Available(PerfCacheMisses)) printf("%9s %10s ", "-", "-");
+            else
+            {
+                double bytes=v[PerfCacheMisses]*LineBytes();
+                printf("%9.2f ", bytes/pixels);
+                if(bytes>0)
+                    printf("%10.2f ", v[PerfInstructions]/bytes);
+                else
+                    printf("%10s ", "-");
+            }
+            if(Available(PerfBranchMisses))
+                printf("%9.2f  ", 1000*v[PerfBranchMisses]/pixels);
+            else
+                printf("%9s  ", "-");
+            printf("%s\n", Bound(s.counts, ipc).c_str());
+        }
+        stages.clear();
+    }
+
+private:
+    int    fd[PerfEvents];
+    bool   enabled;
+    double bytesPerCycle;
+    std::mutex lock;
+    std::map<std::string, PerfStage> stages;
+
+    static int Open(int e)
+    {
+#if defined(__linux__)
+        static const unsigned long long config[PerfEvents]=
+            {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+             PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size=sizeof(attr);
+        attr.type=PERF_TYPE_HARDWARE;
+        attr.config=config[e];
+        attr.read_format=PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit=1;
+        attr.exclude_kernel=1;
+        attr.exclude_hv=1;
+        return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+        (void)e;
+        errno=ENOSYS;
+        return -1;
+#endif
+    }
+
+    static double LineBytes()
+    {
+        long line=0;
+#if defined(_SC_LEVEL3_CACHE_LINESIZE)
+        line=sysconf(_SC_LEVEL3_CACHE_LINESIZE);
+#endif
+        return line>0 ? (double)line : 64.0;
+    }
+
+    // Bytes read and written per cycle by one thread copying a
+    // buffer far larger than the caches.
+    void MeasureStreaming()
+    {
+        std::vector<char> from(64<<20, 1), to(from.size());
+        memcpy(&to[0], &from[0], to.size());
+        PerfCounts start=Read();
+        for(int k=0;k<4;k++) memcpy(&to[0], &from[0], to.size());
+        PerfCounts c=Read();
+        c-=start;
+        volatile char last=to.back();
+        (void)last;
+        if(c.value[PerfCycles]>0)
+            bytesPerCycle=4*2.0*to.size()/c.value[PerfCycles];
+    }
+
+    std::string Bound(const PerfCounts &c, double ipc) const
+    {
+        double bytes=c.value[PerfCacheMisses]*LineBytes();
+        if(!Available(PerfCacheMisses) || bytesPerCycle<=0) return "-";
+        double intensity=bytes>0 ? c.value[PerfInstructions]/bytes
+                                 : PeakInstructionsPerCycle/bytesPerCycle;
+        double roof=std::min(PeakInstructionsPerCycle,
+                             intensity*bytesPerCycle);
+        std::string bound=roof<PeakInstructionsPerCycle ? "memory"
+                                                         : "compute";
+        if(ipc<0.5*roof) bound+=" (stalls)";
+        return bound;
+    }
+};
+
+inline HardwareCounters &HardwareCounterSet()
+{
+    static HardwareCounters counters;
+    return counters;
+}
+
+// Opens the counters.  (Call before any threads are started.)
+inline void EnableHardwareCounters()
+{
+    HardwareCounterSet().Enable();
+}
+
+// Counts a stage for the lifetime of the object.
+class PerfScope
+{
+public:
+    explicit PerfScope(const char *stage_, double pixels_=0)
+        : stage(stage_), pixels(pixels_), parent(Current())
+    {
+        if(!HardwareCounterSet().Enabled()) return;
+        Current()=this;
+        start=HardwareCounterSet().Read();
+    }
+    ~PerfScope()
+    {
+        if(!HardwareCounterSet().Enabled()) return;
+        PerfCounts total=HardwareCounterSet().Read();
+        total-=start;
+        PerfCounts self=total;
+        self-=nested;
+        HardwareCounterSet().Charge(stage, pixels, self);
+        if(parent) parent->nested+=total;
+        Current()=parent;
+    }
+private:
+    const char *stage;
+    double      pixels;
+    PerfScope  *parent;
+    PerfCounts  start, nested;
+
+    static PerfScope *&Current()
+    {
+        static thread_local PerfScope *current=NULL;
+        return current;
+    }
+    PerfScope(const PerfScope &);
+    PerfScope &operator=(const PerfScope &);
+};
+
+inline void PrintHardwareCounterReport()
+{
+    HardwareCounterSet().PrintReport();
+}
+
+#endif
@@ -0,0 +1,452 @@
+//*** THREE STAGE DECODE / TRANSFER / ENCODE PIPELINE
+//*** FOR BATCH COLOUR TRANSFER
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// In batch use the decoding of the input images and the encoding
+// of the output image take a similar time to the colour transfer
+// itself.  This pipeline runs the three activities concurrently in
+// separate pools of worker threads, connected by bounded lock-free
+// queues, so that the processor cores are kept busy with colour
+// transfer while image files are being read and written.  A thread
+// only blocks (on a condition variable) when its queue is full or
+// empty.
+//
+// The caller supplies three functions:
+//   decode(index)  returns an item for work item 'index',
+//   process(item)  performs the colour transfer on the item,
+//   encode(item)   writes the item out.
+// Items are passed between the stages by move, so an item will
+// normally hold cv::Mat headers and file names.
+//
+// An item holds its memory from the start of its decoding until its
+// encoding ends, whether it is queued or being worked on, so the
+// number of items in flight is limited to the memory budget divided
+// by an estimate of the memory used by each item.  Per-stage
+// utilisation and queue-stall counts are reported so that the pool
+// sizes can be balanced.
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bounded multi-producer multi-consumer lock-free queue.
+// (After the design by D Vyukov.)  Each cell carries a sequence
+// number which tells producers and consumers whether the cell is
+// free for writing or ready for reading.  'WaitPush' and 'WaitPop'
+// block on a condition variable while the queue is full or empty,
+// and 'TryPush' and 'TryPop' only touch the lock when a thread is
+// waiting.
+template<class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : pushWaiters(0), popWaiters(0)
+    {
+        // Round the capacity up to a power of two.
+        size_t size=2;
+        while(size<capacity) size*=2;
+        cells.reset(new Cell[size]);
+        for(size_t i=0;i<size;i++) cells[i].sequence.store(i);
+        mask=size-1;
+        head.store(0);
+        tail.store(0);
+    }
+
+    bool TryPush(T &item)
+    {
+        if(!Push(item)) return false;
+        Wake(popWaiters, notEmpty);
+        return true;
+    }
+
+    bool TryPop(T &item)
+    {
+        if(!Pop(item)) return false;
+        Wake(pushWaiters, notFull);
+        return true;
+    }
+
+    void WaitPush(T &item)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            pushWaiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while(!Push(item)) notFull.wait(guard);
+            pushWaiters.fetch_sub(1);
+        }
+        Wake(popWaiters, notEmpty);
+    }
+
+    void WaitPop(T &item)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            popWaiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while(!Pop(item)) notEmpty.wait(guard);
+            popWaiters.fetch_sub(1);
+        }
+        Wake(pushWaiters, notFull);
+    }
+
+private:
+    bool Push(T &item)
+    {
+        size_t pos=tail.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            Cell &cell=cells[pos & mask];
+            size_t seq=cell.sequence.load(std::memory_order_acquire);
+            long diff=(long)seq-(long)pos;
+            if(diff==0)
+            {
+                if(tail.compare_exchange_weak(pos, pos+1,
+                                              std::memory_order_relaxed))
+                {
+                    cell.data=std::move(item);
+                    cell.sequence.store(pos+1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff<0) return false;   // Queue full.
+            else pos=tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool Pop(T &item)
+    {
+        size_t pos=head.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            Cell &cell=cells[pos & mask];
+            size_t seq=cell.sequence.load(std::memory_order_acquire);
+            long diff=(long)seq-(long)(pos+1);
+            if(diff==0)
+            {
+                if(head.compare_exchange_weak(pos, pos+1,
+                                              std::memory_order_relaxed))
+                {
+                    item=std::move(cell.data);
+                    cell.sequence.store(pos+mask+1,
+                                        std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff<0) return false;   // Queue empty.
+            else pos=head.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Wakes a thread waiting for the change just made.  (The fence
+    // pairs with that in 'WaitPush' and 'WaitPop': either the waiter
+    // sees the change or this sees the waiter.)
+    void Wake(std::atomic<int> &waiters, std::condition_variable &cv)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiters.load(std::memory_order_relaxed)==0) return;
+        std::lock_guard<std::mutex> guard(lock);
+        cv.notify_one();
+    }
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    std::mutex lock;
+    std::condition_variable notFull, notEmpty;
+    std::atomic<int> pushWaiters, popWaiters;
+};
+
+
+// A count of the items which the memory budget allows in flight.
+class PipelineTokens
+{
+public:
+    explicit PipelineTokens(size_t count) : available(count) {}
+
+    // Takes a token, returning false if it had to wait for one.
+    bool Acquire()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        bool waited=available==0;
+        while(available==0) freed.wait(guard);
+        available--;
+        return !waited;
+    }
+
+    void Release()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            available++;
+        }
+        freed.notify_one();
+    }
+
+private:
+    size_t available;
+    std::mutex lock;
+    std::condition_variable freed;
+};
+
+
+// Pool sizes and memory budget for the pipeline.
+struct PipelineSettings
+{
+    int    decodeThreads;    // Threads reading and decoding images.
+    int    transferThreads;  // Threads performing colour transfer.
+    int    encodeThreads;    // Threads encoding and writing images.
+    size_t memoryBudget;     // Bytes allowed for items in flight.
+    size_t itemBytes;        // Estimated bytes held by one item.
+
+    PipelineSettings() : decodeThreads(2), transferThreads(2),
+                         encodeThreads(2), memoryBudget((size_t)1<<30),
+                         itemBytes((size_t)24000000*3*4*2) {}
+};
+
+// Activity counters for one pipeline stage.
+struct StageReport
+{
+    int    threads;
+    double busySeconds;      // Time spent inside the stage function.
+    long   pushStalls;       // Times the output queue, or for decoding
+                             // the memory budget, was full.
+    long   popStalls;        // Times the input queue was empty.
+    double stallSeconds;     // Time spent waiting on either.
+    StageReport() : threads(0), busySeconds(0), pushStalls(0),
+                    popStalls(0), stallSeconds(0) {}
+};
+
+struct PipelineReport
+{
+    StageReport decode, transfer, encode;
+    size_t queueCapacity;
+    size_t itemLimit;        // Items allowed in flight.
+    size_t items;
+    double wallSeconds;
+};
+
+
+// Accumulates the counters for one worker thread into the shared
+// stage report.  Counters are kept per thread while running and
+// are merged once, at the end, under a simple spin lock.
+struct StageCounters
+{
+    double busy, stall;
+    long pushStalls, popStalls;
+    StageCounters() : busy(0), stall(0), pushStalls(0), popStalls(0) {}
+};
+
+inline void MergeStageCounters(StageReport &report, StageCounters &counts,
+                               std::atomic_flag &lock)
+{
+    while(lock.test_and_set(std::memory_order_acquire))
+        std::this_thread::yield();
+    report.busySeconds  += counts.busy;
+    report.stallSeconds += counts.stall;
+    report.pushStalls   += counts.pushStalls;
+    report.popStalls    += counts.popStalls;
+    lock.clear(std::memory_order_release);
+}
+
+inline double PipelineSeconds(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(
+               std::chrono::steady_clock::now()-t0).count();
+}
+
+// Push and pop which wait while the queue is full or empty,
+// recording the stall.
+template<class T>
+void PipelinePush(BoundedQueue<T> &queue, T &item, StageCounters &counts)
+{
+    if(queue.TryPush(item)) return;
+    std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+    counts.pushStalls++;
+    queue.WaitPush(item);
+    counts.stall+=PipelineSeconds(t0);
+}
+
+template<class T>
+void PipelinePop(BoundedQueue<T> &queue, T &item, StageCounters &counts)
+{
+    if(queue.TryPop(item)) return;
+    std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+    counts.popStalls++;
+    queue.WaitPop(item);
+    counts.stall+=PipelineSeconds(t0);
+}
+
+// Takes a token for a new item, waiting while the memory budget is
+// full and recording the stall.
+inline void PipelineAcquire(PipelineTokens &tokens, StageCounters &counts)
+{
+    std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+    if(tokens.Acquire()) return;
+    counts.pushStalls++;
+    counts.stall+=PipelineSeconds(t0);
+}
+
+
+// Runs 'count' work items through the three stages and returns the
+// activity report.  Each stage claims items from a shared counter,
+// so every item passes through every stage exactly once.  (Stage
+// functions should record failures in the item rather than throw.)
+template<class Item, class Decode, class Process, class Encode>
+PipelineReport RunPipeline(size_t count, Decode decode, Process process,
+                           Encode encode, PipelineSettings settings)
+{
+    PipelineReport report;
+    std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+
+    // Limit the items in flight (queued, or in any stage) to the
+    // memory budget.  Two queues hold items between the stages and
+    // need hold no more than that.
+    size_t limit=settings.memoryBudget/std::max<size_t>(settings.itemBytes,1);
+    limit=std::max<size_t>(1, limit);
+    size_t capacity=std::min<size_t>(limit, 64);
+    BoundedQueue<Item> decoded(capacity), processed(capacity);
+    PipelineTokens tokens(limit);
+
+    std::atomic<size_t> nextDecode(0), nextTransfer(0), nextEncode(0);
+    std::atomic_flag lock=ATOMIC_FLAG_INIT;
+    std::vector<std::thread> workers;
+
+    for(int t=0;t<settings.decodeThreads;t++)
+        workers.push_back(std::thread([&]()
+        {
+            StageCounters counts;
+            size_t i;
+            while((i=nextDecode.fetch_add(1))<count)
+            {
+                PipelineAcquire(tokens, counts);
+                std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+                Item item=decode(i);
+                counts.busy+=PipelineSeconds(t0);
+                PipelinePush(decoded, item, counts);
+            }
+            MergeStageCounters(report.decode, counts, lock);
+        }));
+
+    for(int t=0;t<settings.transferThreads;t++)
+        workers.push_back(std::thread([&]()
+        {
+            StageCounters counts;
+            while(nextTransfer.fetch_add(1)<count)
+            {
+                Item item;
+                PipelinePop(decoded, item, counts);
+                std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+                process(item);
+                counts.busy+=PipelineSeconds(t0);
+                PipelinePush(processed, item, counts);
+            }
+            MergeStageCounters(report.transfer, counts, lock);
+        }));
+
+    for(int t=0;t<settings.encodeThreads;t++)
+        workers.push_back(std::thread([&]()
+        {
+            StageCounters counts;
+            while(nextEncode.fetch_add(1)<count)
+            {
+                Item item;
+                PipelinePop(processed, item, counts);
+                std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+                encode(item);
+                item=Item();
+                tokens.Release();
+                counts.busy+=PipelineSeconds(t0);
+            }
+            MergeStageCounters(report.encode, counts, lock);
+        }));
+
+    for(size_t t=0;t<workers.size();t++) workers[t].join();
+
+    report.decode.threads  =settings.decodeThreads;
+    report.transfer.threads=settings.transferThreads;
+    report.encode.threads  =settings.encodeThreads;
+    report.queueCapacity=capacity;
+    report.itemLimit=limit;
+    report.items=count;
+    report.wallSeconds=PipelineSeconds(start);
+    return report;
+}
+
+// Prints the utilisation of each stage (the fraction of the wall
+// clock time for which its threads were busy) and its stalls.
+// A stage with high utilisation and no push stalls is the
+// bottleneck and should be given more threads.
+inline void PrintPipelineReport(const PipelineReport &report)
+{
+    const char *names[3]={"decode  ", "transfer", "encode  "};
+    const StageReport *stages[3]={&report.decode, &report.transfer,
+                                  &report.encode};
+
+    printf("%zu images in %.2f s (%.2f images/s), queue capacity %zu, "
+           "at most %zu images in memory\n",
+           report.items, report.wallSeconds,
+           report.items/std::max(report.wallSeconds,1e-9),
+           report.queueCapacity, report.itemLimit);
+    for(int s=0;s<3;s++)
+    {
+        const StageReport &r=*stages[s];
+        double util=r.busySeconds/
+                    std::max(r.threads*report.wallSeconds,1e-9);
+        printf("   %s  threads %2d  utilisation %5.1f%%"
+               "  push stalls %5ld  pop stalls %5ld  stalled %.2f s\n",
+               names[s], r.threads, 100.0*util,
+               r.pushStalls, r.popStalls, r.stallSeconds);
+    }
+}
+
+
+// Reads a batch list file in which each line gives a target, a
+// source and an output file name, separated by white space.
+// Blank lines and lines beginning with '#' are ignored.
+inline bool ReadBatchList(std::string filename,
+                          std::vector<std::string> &targets,
+                          std::vector<std::string> &sources,
+                          std::vector<std::string> &outputs)
+{
+    std::ifstream file(filename.c_str());
+    std::string line, target, source, output;
+
+    while(std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        if(!(fields>>target) || target[0]=='#') continue;
+        if(!(fields>>source>>output))
+        {
+            printf("Incomplete batch entry: %s\n", line.c_str());
+            continue;
+        }
+        targets.push_back(target);
+        sources.push_back(source);
+        outputs.push_back(output);
+    }
+    if(targets.empty()) printf("No images listed in %s\n", filename.c_str());
+    return !targets.empty();
+}
+
+#endif
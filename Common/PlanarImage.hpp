@@ -0,0 +1,60 @@
+//*** PLANAR THREE CHANNEL IMAGES
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// An image held as three separate single channel planes rather than
+// as interleaved pixels.  The processing which works on the colour
+// channels one at a time (standardising, reshaping, cross covariance
+// adjustment and rescaling) can then use each plane directly, where
+// an interleaved image would have to be split into channels and the
+// channels merged back, a copy of the whole image each time.
+//
+// The planes are held in one allocation, with every row starting on
+// a 64 byte boundary so that the rows suit the widest vector loads.
+// An operation may also replace a plane with any single channel
+// image of the same size (as 'ChannelCondition' returns a new one).
+// Images are only interleaved where they are converted from and to
+// BGR (see 'ConvertForwardPlanar' and 'ConvertInversePlanar' in
+// 'TransferKernel.hpp').
+
+#ifndef PLANARIMAGE_HPP
+#define PLANARIMAGE_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cstdint>
+
+const int PlaneAlignBytes = 64;
+
+struct PlanarImage
+{
+    cv::Mat plane[3];       // CV_32FC1 planes of the same size.
+
+    PlanarImage() {}
+    explicit PlanarImage(cv::Size size) {Create(size);}
+
+    // Allocates the three planes (unless already of this size).
+    void Create(cv::Size size)
+    {
+        if(!empty() && this->size()==size) return;
+        const int align=PlaneAlignBytes/sizeof(float);
+        int stride=(int)cv::alignSize(std::max(size.width, 1), align);
+        cv::Mat buffer(3*size.height, stride+align, CV_32FC1);
+        uintptr_t base=(uintptr_t)buffer.data;
+        int offset=(int)((cv::alignSize((size_t)base, PlaneAlignBytes)-
+                          base)/sizeof(float));
+        for(int c=0;c<3;c++)
+            plane[c]=buffer(cv::Rect(offset, c*size.height, size.width,
+                                     size.height));
+    }
+
+    cv::Size size() const {return plane[0].size();}
+    bool empty() const {return plane[0].empty();}
+    void release() {for(int c=0;c<3;c++) plane[c].release();}
+
+    cv::Mat       &operator[](int c)       {return plane[c];}
+    const cv::Mat &operator[](int c) const {return plane[c];}
+};
+
+#endif
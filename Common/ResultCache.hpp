@@ -0,0 +1,316 @@
+//*** CONTENT ADDRESSED RESULT CACHE
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// A cache of processed (encoded) output files on local disk, so
+// that processing which has been done before is not repeated.  An
+// entry is keyed by a hash of the decoded target and source pixels
+// together with a description of every option which affects the
+// result and of the program version.  A hit copies the stored
+// output file into place and no processing is done at all.
+//
+// Each entry is a file named by its key in the cache directory.
+// Entries are written under a temporary name and then renamed, so
+// that a partly written entry is never used, even when several
+// processes share the cache.  The modification time of an entry is
+// updated whenever it is used and, when the total size of the
+// entries exceeds the limit, the least recently used entries are
+// deleted until it is within 'CacheEvictTo' of the limit.  The
+// directory is only scanned for this on the first store and then
+// once the sizes of the entries stored since, added to the total
+// found then, exceed the limit.  Entries stored meanwhile by other
+// processes sharing the cache are only counted at the next scan.
+//
+// The hash is a fast non-cryptographic hash (four interleaved
+// lanes of 64 bit multiply and rotate rounds) computed over blocks
+// of rows in parallel and combined in block order.  Two hashes with
+// different seeds form a 128 bit key.
+
+#ifndef RESULTCACHE_HPP
+#define RESULTCACHE_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+// Fraction of the limit to which the entries are reduced when it is
+// exceeded, so that the directory is not scanned on every store.
+const double CacheEvictTo = 0.9;
+
+struct ResultCache
+{
+    std::string directory;      // Empty for no cache.
+    double      maxBytes;       // Limit on the total size of entries.
+    double      knownBytes;     // Total at the last scan and stored
+                                // since (negative before any scan).
+    std::mutex  mutex;          // Guards 'knownBytes'.
+    ResultCache() : maxBytes(1024.0*1048576), knownBytes(-1) {}
+};
+
+const uint64_t HashPrime1 = 0x9e3779b185ebca87ULL;
+const uint64_t HashPrime2 = 0xc2b2ae3d27d4eb4fULL;
+
+inline uint64_t HashRotate(uint64_t x, int r)
+{
+    return (x<<r)|(x>>(64-r));
+}
+
+inline uint64_t HashRound(uint64_t acc, uint64_t word)
+{
+    return HashRotate(acc+word*HashPrime2, 31)*HashPrime1;
+}
+
+inline uint64_t HashFinal(uint64_t h)
+{
+    h^=h>>33; h*=HashPrime2;
+    h^=h>>29; h*=HashPrime1;
+    return h^(h>>32);
+}
+
+// Hashes 'n' bytes.
+inline uint64_t HashBytes(const void *data, size_t n, uint64_t seed)
+{
+    const unsigned char *p=(const unsigned char *)data;
+    uint64_t lane[4]={seed+HashPrime1, seed+HashPrime2, seed, seed-HashPrime1};
+    size_t i=0;
+    for(;i+32<=n;i+=32)
+    {
+        uint64_t w[4];
+        memcpy(w, p+i, 32);
+        for(int k=0;k<4;k++) lane[k]=HashRound(lane[k], w[k]);
+    }
+    uint64_t h=HashRotate(lane[0],1)+HashRotate(lane[1],7)+
+               HashRotate(lane[2],12)+HashRotate(lane[3],18)+n;
+    for(;i+8<=n;i+=8)
+    {
+        uint64_t w;
+        memcpy(&w, p+i, 8);
+        h=HashRotate(h^HashRound(0, w), 27)*HashPrime1;
+    }
+    for(;i<n;i++) h=HashRotate(h^(p[i]*HashPrime2), 11)*HashPrime1;
+    return HashFinal(h);
+}
+
+// Hashes the size, type and pixels of an image.
+inline uint64_t HashImage(const cv::Mat &image, uint64_t seed)
+{
+    int header[3]={image.rows, image.cols, image.type()};
+    uint64_t h=HashBytes(header, sizeof(header), seed);
+    if(image.empty()) return h;
+
+    size_t rowBytes=image.cols*image.elemSize();
+    int rowsPerBlock=std::max(1, (int)(1048576/std::max(rowBytes,(size_t)1)));
+    int blocks=(image.rows+rowsPerBlock-1)/rowsPerBlock;
+    std::vector<uint64_t> partial(blocks);
+
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range)
+    {
+        for(int b=range.start;b<range.end;b++)
+        {
+            int row0=b*rowsPerBlock;
+            int row1=std::min(row0+rowsPerBlock, image.rows);
+            uint64_t hb=seed+b;
+            for(int y=row0;y<row1;y++)
+                hb=HashBytes(image.ptr(y), rowBytes, hb);
+            partial[b]=hb;
+        }
+    });
+
+    for(int b=0;b<blocks;b++) h=HashRound(h, partial[b]);
+    return HashFinal(h);
+}
+
+// Returns the cache key for processing 'target' with 'source'.
+// 'settings' must describe every option which affects the output
+// (including its format) and the program version.
+inline std::string ResultCacheKey(const cv::Mat &target,
+                                  const cv::Mat &source,
+                                  const std::string &settings)
+{
+    std::string key;
+    for(uint64_t seed=1;seed<=2;seed++)
+    {
+        uint64_t parts[3]={HashImage(target, seed), HashImage(source, seed),
+                           HashBytes(settings.data(), settings.size(),
+                                     seed)};
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx",
+                 (unsigned long long)HashBytes(parts, sizeof(parts), seed));
+        key+=hex;
+    }
+    return key;
+}
+
+
+// File operations.
+
+// An entry of the cache directory.
+struct CacheEntry
+{
+    std::string path;
+    double      bytes;
+    time_t      used;
+    bool operator<(const CacheEntry &e) const {return used<e.used;}
+};
+
+inline std::string CacheEntryPath(const ResultCache &cache,
+                                  const std::string &key,
+                                  const std::string &outputname)
+{
+    size_t dot=outputname.rfind('.');
+    std::string extension= dot==std::string::npos ? "" : outputname.substr(dot);
+    return cache.directory+"/"+key+extension;
+}
+
+// A temporary file name unique to this process and thread.
+inline std::string CacheTemporaryName(const std::string &path)
+{
+    std::ostringstream name;
+#ifdef _WIN32
+    name<<path<<".tmp"<<_getpid();
+#else
+    name<<path<<".tmp"<<getpid();
+#endif
+    name<<"."<<std::this_thread::get_id();
+    return name.str();
+}
+
+// Copies a file by way of a temporary file and a rename.
+inline bool CopyFileAtomically(const std::string &from, const std::string &to)
+{
+    std::string temporary=CacheTemporaryName(to);
+    {
+        std::ifstream in(from.c_str(), std::ios::binary);
+        std::ofstream out(temporary.c_str(), std::ios::binary);
+        if(!in || !out) {out.close(); remove(temporary.c_str()); return false;}
+        out<<in.rdbuf();
+        out.close();
+        if(!out) {remove(temporary.c_str()); return false;}
+    }
+#ifdef _WIN32
+    // (Windows will not rename over an existing file.)
+    if(!MoveFileExA(temporary.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+    if(rename(temporary.c_str(), to.c_str())!=0)
+#endif
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline std::vector<CacheEntry> ListCacheEntries(const ResultCache &cache)
+{
+    std::vector<CacheEntry> entries;
+    std::vector<std::string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find=FindFirstFileA((cache.directory+"/*").c_str(), &data);
+    if(find!=INVALID_HANDLE_VALUE)
+    {
+        do names.push_back(data.cFileName);
+        while(FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    DIR *dir=opendir(cache.directory.c_str());
+    if(dir)
+    {
+        while(struct dirent *e=readdir(dir)) names.push_back(e->d_name);
+        closedir(dir);
+    }
+#endif
+    for(size_t i=0;i<names.size();i++)
+    {
+        // Temporary files of other writers are left alone.
+        if(names[i][0]=='.' || names[i].find(".tmp")!=std::string::npos)
+            continue;
+        CacheEntry entry;
+        struct stat info;
+        entry.path=cache.directory+"/"+names[i];
+        if(stat(entry.path.c_str(), &info)!=0) continue;
+        entry.bytes=(double)info.st_size;
+        entry.used=info.st_mtime;
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+// Finds the total size of the entries and, if it exceeds the limit,
+// deletes the least recently used entries until it is within
+// 'CacheEvictTo' of the limit.  Returns the total left.
+inline double EvictCacheEntries(const ResultCache &cache)
+{
+    std::vector<CacheEntry> entries=ListCacheEntries(cache);
+    double total=0;
+    for(size_t i=0;i<entries.size();i++) total+=entries[i].bytes;
+    if(total<=cache.maxBytes) return total;
+    std::sort(entries.begin(), entries.end());
+    for(size_t i=0;i<entries.size() && total>CacheEvictTo*cache.maxBytes;
+        i++)
+        if(remove(entries[i].path.c_str())==0) total-=entries[i].bytes;
+    return total;
+}
+
+
+// Copies the cached output for 'key', if any, to 'outputname' and
+// marks the entry as used.  Returns true on a hit.
+inline bool ResultCacheFetch(const ResultCache &cache,
+                             const std::string &key,
+                             const std::string &outputname)
+{
+    if(cache.directory.empty()) return false;
+    std::string path=CacheEntryPath(cache, key, outputname);
+    if(!CopyFileAtomically(path, outputname)) return false;
+    utime(path.c_str(), NULL);
+    return true;
+}
+
+// Stores the output file 'outputname' as the entry for 'key' and
+// then evicts entries if the limit may have been exceeded.  (May
+// be called from several threads.)
+inline bool ResultCacheStore(ResultCache &cache, const std::string &key,
+                             const std::string &outputname)
+{
+    if(cache.directory.empty()) return false;
+#ifdef _WIN32
+    _mkdir(cache.directory.c_str());
+#else
+    mkdir(cache.directory.c_str(), 0777);
+#endif
+    std::string path=CacheEntryPath(cache, key, outputname);
+    bool stored=CopyFileAtomically(outputname, path);
+    struct stat info;
+    double bytes= stored && stat(path.c_str(), &info)==0
+                  ? (double)info.st_size : 0;
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if(cache.knownBytes>=0) cache.knownBytes+=bytes;
+    if(cache.knownBytes<0 || cache.knownBytes>cache.maxBytes)
+        cache.knownBytes=EvictCacheEntries(cache);
+    return stored;
+}
+
+#endif
@@ -0,0 +1,304 @@
+//*** DETERMINISTIC IMAGE STATISTICS
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// Means, standard deviations and mean cross products computed so
+// that the result is bit-identical whatever the number of threads.
+//
+// When statistics are computed in parallel, the order in which the
+// floating point partial sums are added depends upon how the image
+// is divided between the threads.  The tiny differences which result
+// propagate through the cross correlation weights, the rescaling and
+// the iterations, so that the output image differs slightly from one
+// machine to another.
+//
+// Here the image is divided into blocks of a fixed number of rows,
+// independent of the thread count.  Each block is accumulated in
+// double precision (the block mean, then the sum of squared
+// deviations from it) and the block results are merged in block
+// order using the pairwise update of Chan et al.  Threads only
+// decide which blocks they compute, never the order of addition.
+//
+// Deterministic statistics are selected by calling
+// 'SetDeterministicStatistics(true)'.  Otherwise the functions
+// below use the standard OpenCV routines.  Only CV_32F images with
+// one or three channels (and CV_8U masks) are computed
+// deterministically.  Other types always use OpenCV.
+
+#ifndef STATISTICS_HPP
+#define STATISTICS_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Target number of pixels in each block.
+const int StatBlockPixels = 16384;
+
+inline bool &DeterministicStatisticsFlag()
+{
+    static bool flag=false;
+    return flag;
+}
+
+inline void SetDeterministicStatistics(bool deterministic)
+{
+    DeterministicStatisticsFlag()=deterministic;
+}
+
+
+// Count, mean and sum of squared deviations for up to three
+// channels, and the sum of cross products of the deviations for
+// channels 1 and 2 (three channel images only).
+struct BlockMoments
+{
+    double count;
+    double mean[3];
+    double m2[3];
+    double c12;
+    BlockMoments() : count(0), c12(0)
+    {
+        for(int c=0;c<3;c++) {mean[c]=0; m2[c]=0;}
+    }
+};
+
+// Merges the moments 'b' into 'a'.
+inline void MergeMoments(BlockMoments &a, const BlockMoments &b, int cn)
+{
+    if(b.count==0) return;
+    if(a.count==0) {a=b; return;}
+    double n=a.count+b.count;
+    if(cn==3)
+    {
+        a.c12+=b.c12+(b.mean[1]-a.mean[1])*(b.mean[2]-a.mean[2])
+                    *a.count*b.count/n;
+    }
+    for(int c=0;c<cn;c++)
+    {
+        double delta=b.mean[c]-a.mean[c];
+        a.mean[c]+=delta*b.count/n;
+        a.m2[c]  +=b.m2[c]+delta*delta*a.count*b.count/n;
+    }
+    a.count=n;
+}
+
+// Removes the moments 'b', previously merged, from 'a'.  (The
+// inverse of 'MergeMoments', so that the moments of part of an
+// image can be replaced without visiting the rest.)
+inline void RemoveMoments(BlockMoments &a, const BlockMoments &b, int cn)
+{
+    if(b.count==0) return;
+    double n=a.count-b.count;
+    if(n<=0) {a=BlockMoments(); return;}
+    double delta[3];
+    for(int c=0;c<cn;c++)
+    {
+        double mean=(a.mean[c]*a.count-b.mean[c]*b.count)/n;
+        delta[c]=b.mean[c]-mean;
+        a.mean[c]=mean;
+        a.m2[c]=std::max(0.0, a.m2[c]-b.m2[c]-
+                              delta[c]*delta[c]*n*b.count/a.count);
+    }
+    if(cn==3) a.c12-=b.c12+delta[1]*delta[2]*n*b.count/a.count;
+    a.count=n;
+}
+
+// Computes the moments of rows 'row0' to 'row1' of a CV_32F image
+// (of 'cn' channels) or, when 'second' is given, of the product
+// of corresponding elements of two single channel images.
+// The squared deviations are only computed if 'deviations' is set.
+template<int cn>
+BlockMoments ComputeBlockMoments(const cv::Mat &image,
+                                 const cv::Mat &second,
+                                 const cv::Mat &mask, bool deviations,
+                                 int row0, int row1)
+{
+    BlockMoments m;
+    double sum[3]={0,0,0};
+    int cols=image.cols;
+
+    // First pass: sums.
+    for(int y=row0;y<row1;y++)
+    {
+        const float *p=image.ptr<float>(y);
+        const float *q=second.empty() ? NULL : second.ptr<float>(y);
+        const uchar *k=mask.empty() ? NULL : mask.ptr<uchar>(y);
+        for(int x=0;x<cols;x++)
+        {
+            if(k && !k[x]) continue;
+            if(q) sum[0]+=(double)p[x]*q[x];
+            else for(int c=0;c<cn;c++) sum[c]+=p[x*cn+c];
+            m.count++;
+        }
+    }
+    if(m.count==0) return m;
+    for(int c=0;c<cn;c++) m.mean[c]=sum[c]/m.count;
+    if(!deviations) return m;
+
+    // Second pass (data now in cache): squared deviations.
+    for(int y=row0;y<row1;y++)
+    {
+        const float *p=image.ptr<float>(y);
+        const float *q=second.empty() ? NULL : second.ptr<float>(y);
+        const uchar *k=mask.empty() ? NULL : mask.ptr<uchar>(y);
+        for(int x=0;x<cols;x++)
+        {
+            if(k && !k[x]) continue;
+            if(q)
+            {
+                double d=(double)p[x]*q[x]-m.mean[0];
+                m.m2[0]+=d*d;
+            }
+            else
+            {
+                double d[3];
+                for(int c=0;c<cn;c++)
+                {
+                    d[c]=p[x*cn+c]-m.mean[c];
+                    m.m2[c]+=d[c]*d[c];
+                }
+                if(cn==3) m.c12+=d[1]*d[2];
+            }
+        }
+    }
+    return m;
+}
+
+// Computes the moments of a whole image block by block, in
+// parallel, and merges the blocks in a fixed order.
+inline BlockMoments ComputeMoments(const cv::Mat &image,
+                                  const cv::Mat &second,
+                                  const cv::Mat &mask, int cn,
+                                  bool deviations)
+{
+    int rowsPerBlock=std::max(1, StatBlockPixels/std::max(image.cols,1));
+    int blocks=(image.rows+rowsPerBlock-1)/rowsPerBlock;
+    std::vector<BlockMoments> partial(blocks);
+
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range)
+    {
+        for(int b=range.start;b<range.end;b++)
+        {
+            int row0=b*rowsPerBlock;
+            int row1=std::min(row0+rowsPerBlock, image.rows);
+            partial[b]= cn==3 ?
+                ComputeBlockMoments<3>(image, second, mask, deviations,
+                                       row0, row1) :
+                ComputeBlockMoments<1>(image, second, mask, deviations,
+                                       row0, row1);
+        }
+    });
+
+    BlockMoments total;
+    for(int b=0;b<blocks;b++) MergeMoments(total, partial[b], cn);
+    return total;
+}
+
+inline bool DeterministicType(const cv::Mat &image, const cv::Mat &mask)
+{
+    return DeterministicStatisticsFlag() && image.depth()==CV_32F &&
+           (image.channels()==1 || image.channels()==3) &&
+           (mask.empty() || mask.type()==CV_8UC1);
+}
+
+
+// Replacement for cv::meanStdDev.
+inline void StatMeanStdDev(cv::Mat image, cv::Scalar &mean,
+                           cv::Scalar &dev, cv::Mat mask=cv::Mat())
+{
+    if(!DeterministicType(image, mask))
+    {
+        cv::meanStdDev(image, mean, dev, mask);
+        return;
+    }
+    int cn=image.channels();
+    BlockMoments m=ComputeMoments(image, cv::Mat(), mask, cn, true);
+    mean=cv::Scalar::all(0);
+    dev =cv::Scalar::all(0);
+    for(int c=0;c<cn && m.count>0;c++)
+    {
+        mean[c]=m.mean[c];
+        dev[c] =sqrt(m.m2[c]/m.count);
+    }
+}
+
+// Replacement for cv::mean.
+inline cv::Scalar StatMean(cv::Mat image, cv::Mat mask=cv::Mat())
+{
+    if(!DeterministicType(image, mask)) return cv::mean(image, mask);
+    int cn=image.channels();
+    BlockMoments m=ComputeMoments(image, cv::Mat(), mask, cn, false);
+    cv::Scalar mean=cv::Scalar::all(0);
+    for(int c=0;c<cn;c++) mean[c]=m.mean[c];
+    return mean;
+}
+
+// Mean of the product of two single channel images (the value
+// of cv::mean(a.mul(b), mask)) without forming the product image.
+inline cv::Scalar StatMeanProduct(cv::Mat a, cv::Mat b,
+                                  cv::Mat mask=cv::Mat())
+{
+    if(!DeterministicType(a, mask) || a.channels()!=1 ||
+       b.type()!=a.type())
+    {
+        cv::Mat product;
+        cv::multiply(a, b, product);
+        return cv::mean(product, mask);
+    }
+    BlockMoments m=ComputeMoments(a, b, mask, 1, false);
+    return cv::Scalar(m.mean[0]);
+}
+
+// Means and standard deviations of a three channel image together
+// with the correlation between channels 1 and 2, in a single
+// statistics pass.  (The block computation is always used here.)
+inline void StatMeanStdDevCorr(cv::Mat image, cv::Scalar &mean,
+                               cv::Scalar &dev, double &corr)
+{
+    if(image.type()!=CV_32FC3)
+    {
+        cv::Mat chans[3], product;
+        cv::meanStdDev(image, mean, dev);
+        cv::split(image, chans);
+        cv::multiply(chans[1]-mean[1], chans[2]-mean[2], product);
+        corr=cv::mean(product)[0]/(dev[1]*dev[2]);
+        return;
+    }
+    BlockMoments m=ComputeMoments(image, cv::Mat(), cv::Mat(), 3, true);
+    mean=cv::Scalar::all(0);
+    dev =cv::Scalar::all(0);
+    corr=0;
+    if(m.count==0) return;
+    for(int c=0;c<3;c++)
+    {
+        mean[c]=m.mean[c];
+        dev[c] =sqrt(m.m2[c]/m.count);
+    }
+    corr=m.c12/sqrt(m.m2[1]*m.m2[2]);
+}
+
+// Measures how far the statistics of a processed image still are
+// from those of the source image.  Differences in the means and
+// standard deviations are expressed relative to the source
+// standard deviation.  The lightness channel (0) and the cross
+// correlation of the colour channels are included if requested.
+// The largest difference is returned.
+inline double TransferResidual(cv::Scalar tmean, cv::Scalar tdev,
+                               double tcorr,
+                               cv::Scalar smean, cv::Scalar sdev,
+                               double scorr,
+                               bool lightness, bool correlation)
+{
+    double residual=0;
+    for(int c=(lightness ? 0 : 1);c<3;c++)
+    {
+        residual=std::max(residual, std::abs(tmean[c]-smean[c])/sdev[c]);
+        residual=std::max(residual, std::abs(tdev[c] -sdev[c]) /sdev[c]);
+    }
+    if(correlation) residual=std::max(residual, std::abs(tcorr-scorr));
+    return residual;
+}
+
+#endif
@@ -0,0 +1,147 @@
+//*** CACHE BLOCKED STRIP SCHEDULING
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// A chain of per-pixel stages run one at a time over whole images
+// writes each intermediate image out to memory and reads it back
+// for the next stage.  For a large image none of it is still in
+// cache, so every stage streams the whole image through memory.
+//
+// Here the stages are scheduled in two parts instead:
+//   1. The global reductions (means, deviations, maxima) that the
+//      stages need, as passes which only read their inputs.  A pass
+//      whose statistics depend on those of an earlier pass follows
+//      it (a barrier), but passes are otherwise combined.
+//   2. All the per-pixel stages back to back on each strip of rows,
+//      the strips being shared between the threads.  A strip holds
+//      few enough rows for its working buffers to fit in the level 2
+//      cache, so the intermediate results never leave the cache and
+//      only the inputs are read from, and the output written to,
+//      memory.
+//
+// The reduction passes are made over the blocks of the transfer
+// kernel (see 'KernelRowsPerBlock') rather than the strips, and the
+// blocks merged in order, as by 'Statistics.hpp', so that
+// deterministic statistics remain deterministic.  A 'MemoryTraffic'
+// counter records a model of the memory traffic: the bytes of whole
+// images which each pass reads and writes, together with those of
+// the same stages run one at a time over whole images.  It is not a
+// measurement.  The measured traffic, from the last level cache
+// misses, is given by the hardware counters (see 'PerfCounters.hpp').
+
+#ifndef STRIPSCHEDULER_HPP
+#define STRIPSCHEDULER_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include "Cancellation.hpp"
+#include "TransferKernel.hpp"
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+inline bool &StripSchedulingFlag()
+{
+    static bool flag=false;
+    return flag;
+}
+
+inline void SetStripScheduling(bool strips)
+{
+    StripSchedulingFlag()=strips;
+}
+
+// Size of the level 2 cache of each core (256 KB if unknown).
+inline size_t CacheBytesPerCore()
+{
+    static const size_t bytes=[]()
+    {
+        long size=0;
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+        size=sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        return size>0 ? (size_t)size : (size_t)262144;
+    }();
+    return bytes;
+}
+
+// Rows in each strip of an image of 'cols' columns, for which each
+// pixel uses 'bytesPerPixel' of buffers, so that the strip fills
+// half the cache.
+inline int StripRows(int cols, size_t bytesPerPixel)
+{
+    size_t rowBytes=(size_t)std::max(cols, 1)*bytesPerPixel;
+    return (int)std::max<size_t>(1, CacheBytesPerCore()/2/rowBytes);
+}
+
+// Calls 'body(row0, row1)' for each strip (or block) of 'stripRows'
+// rows of an image of 'rows' rows, in parallel.  The loop stops early if the
+// current job is cancelled and then throws.
+template<class Body>
+void ForEachStrip(int rows, int stripRows, Body body)
+{
+    int strips=(rows+stripRows-1)/stripRows;
+    const CancelToken *token=CurrentCancelToken();
+    cv::parallel_for_(cv::Range(0, strips), [&](const cv::Range &range)
+    {
+        for(int s=range.start;s<range.end && !Cancelled(token);s++)
+            body(s*stripRows, std::min((s+1)*stripRows, rows));
+    });
+    ThrowIfCancelled();
+}
+
+// Bytes of whole images read and written, as modelled by the
+// stages.
+struct MemoryTraffic
+{
+    double scheduled;   // By the passes made.
+    double staged;      // By the stages run one at a time.
+    MemoryTraffic() : scheduled(0), staged(0) {}
+    MemoryTraffic &operator+=(const MemoryTraffic &other)
+    {
+        scheduled+=other.scheduled;
+        staged+=other.staged;
+        return *this;
+    }
+};
+
+// The traffic of all the images processed.
+struct SharedMemoryTraffic
+{
+    std::mutex    mutex;
+    MemoryTraffic traffic;
+};
+
+inline SharedMemoryTraffic &TotalMemoryTraffic()
+{
+    static SharedMemoryTraffic total;
+    return total;
+}
+
+inline void AddMemoryTraffic(const MemoryTraffic &traffic)
+{
+    SharedMemoryTraffic &total=TotalMemoryTraffic();
+    std::lock_guard<std::mutex> lock(total.mutex);
+    total.traffic+=traffic;
+}
+
+inline void PrintMemoryTraffic(const char *stages)
+{
+    MemoryTraffic total;
+    {
+        SharedMemoryTraffic &shared=TotalMemoryTraffic();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        total=shared.traffic;
+    }
+    if(total.staged==0) return;
+    std::printf("Modelled memory traffic of the %s (whole images read "
+                "and written, not measured): %.1f MB in strips, "
+                "%.1f MB as whole image stages (%.0f%% less)\n", stages,
+                total.scheduled/1048576, total.staged/1048576,
+                100*(1-total.scheduled/total.staged));
+}
+
+#endif
@@ -0,0 +1,161 @@
+//*** PER-TILE MOMENTS FOR INCREMENTAL STATISTICS
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// When a small part of a target image is edited (a brush stroke in a
+// retouching tool) and the transfer is run again, recomputing the
+// target statistics over the whole image costs a full pass over it
+// for the sake of a few changed pixels.
+//
+// Here the target is kept converted to the working colour space,
+// together with the moments of each tile of 'TileMomentSize' square
+// pixels and the moments of the whole image.  When a rectangle of the
+// target changes, only that rectangle is converted again and only the
+// tiles which it touches are recomputed.  The old moments of each of
+// those tiles are removed from the totals and the new ones merged in
+// (see 'RemoveMoments' in 'Statistics.hpp'), so the cost is in
+// proportion to the edited area rather than to the image.
+//
+// Removal is not exact in floating point, so the totals are merged
+// afresh from the tiles, in tile order, after every
+// 'TileRemergeInterval' updates.  When deterministic statistics are
+// selected they are merged afresh after every update, so that the
+// statistics depend only upon the image and not upon its history.
+
+#ifndef TILEMOMENTS_HPP
+#define TILEMOMENTS_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "Cancellation.hpp"
+#include "Statistics.hpp"
+#include "TransferKernel.hpp"
+
+const int TileMomentSize      = 128;
+const int TileRemergeInterval = 64;
+
+struct TileMoments
+{
+    cv::Mat converted;                // Target in the working space.
+    int     tilesX, tilesY;
+    std::vector<BlockMoments> tiles;  // Row by row.
+    BlockMoments total;
+    int     updates;                  // Since 'total' was merged afresh.
+    TileMoments() : tilesX(0), tilesY(0), updates(0) {}
+
+    cv::Rect Tile(int i) const
+    {
+        cv::Rect tile((i%tilesX)*TileMomentSize, (i/tilesX)*TileMomentSize,
+                      TileMomentSize, TileMomentSize);
+        return tile&cv::Rect(0, 0, converted.cols, converted.rows);
+    }
+};
+
+inline void MergeTileMoments(TileMoments &tm)
+{
+    tm.total=BlockMoments();
+    for(size_t i=0;i<tm.tiles.size();i++)
+        MergeMoments(tm.total, tm.tiles[i], 3);
+    tm.updates=0;
+}
+
+inline BlockMoments ComputeTileMoments(const TileMoments &tm, int i)
+{
+    cv::Rect tile=tm.Tile(i);
+    return ComputeBlockMoments<3>(tm.converted(tile), cv::Mat(), cv::Mat(),
+                                  true, 0, tile.height);
+}
+
+// Converts a float BGR target to the colour space of 'space' and
+// computes the moments of its tiles.  Each band of tiles is
+// converted and its moments computed while still in cache.
+template<class Space>
+ColourStatistics BuildTileMoments(const Space &space, const cv::Mat &bgr,
+                                  TileMoments &tm)
+{
+    tm.converted.create(bgr.size(), CV_32FC3);
+    tm.tilesX=(bgr.cols+TileMomentSize-1)/TileMomentSize;
+    tm.tilesY=(bgr.rows+TileMomentSize-1)/TileMomentSize;
+    tm.tiles.assign(tm.tilesX*tm.tilesY, BlockMoments());
+    const CancelToken *token=CurrentCancelToken();
+
+    cv::parallel_for_(cv::Range(0, tm.tilesY), [&](const cv::Range &range)
+    {
+        for(int band=range.start;band<range.end && !Cancelled(token);band++)
+        {
+            int row0=band*TileMomentSize;
+            int row1=std::min(row0+TileMomentSize, bgr.rows);
+            for(int y=row0;y<row1;y++)
+                space.ForwardRow(bgr.ptr<float>(y),
+                                 tm.converted.ptr<float>(y), bgr.cols);
+            for(int i=band*tm.tilesX;i<(band+1)*tm.tilesX;i++)
+                tm.tiles[i]=ComputeTileMoments(tm, i);
+        }
+    });
+    ThrowIfCancelled();
+
+    MergeTileMoments(tm);
+    return StatisticsFromMoments(tm.total);
+}
+
+// Replaces rectangle 'rect' of the converted target with the float
+// BGR pixels 'bgr' (of the size of 'rect') and updates the moments of
+// the tiles which it touches.  Returns the number of tiles updated.
+template<class Space>
+int UpdateTileMoments(const Space &space, const cv::Mat &bgr,
+                      cv::Rect rect, TileMoments &tm)
+{
+    CV_Assert(bgr.size()==rect.size() &&
+              (rect&cv::Rect(0, 0, tm.converted.cols,
+                             tm.converted.rows))==rect);
+    if(rect.area()==0) return 0;
+    for(int y=0;y<rect.height;y++)
+        space.ForwardRow(bgr.ptr<float>(y),
+                         tm.converted.ptr<float>(rect.y+y)+3*rect.x,
+                         rect.width);
+
+    int tx0=rect.x/TileMomentSize, tx1=(rect.br().x-1)/TileMomentSize;
+    int ty0=rect.y/TileMomentSize, ty1=(rect.br().y-1)/TileMomentSize;
+    std::vector<int> dirty;
+    for(int ty=ty0;ty<=ty1;ty++)
+        for(int tx=tx0;tx<=tx1;tx++) dirty.push_back(ty*tm.tilesX+tx);
+
+    std::vector<BlockMoments> fresh(dirty.size());
+    cv::parallel_for_(cv::Range(0, (int)dirty.size()),
+                      [&](const cv::Range &range)
+    {
+        for(int k=range.start;k<range.end;k++)
+            fresh[k]=ComputeTileMoments(tm, dirty[k]);
+    });
+
+    for(size_t k=0;k<dirty.size();k++)
+    {
+        RemoveMoments(tm.total, tm.tiles[dirty[k]], 3);
+        MergeMoments(tm.total, fresh[k], 3);
+        tm.tiles[dirty[k]]=fresh[k];
+    }
+    if(DeterministicStatisticsFlag() || ++tm.updates>=TileRemergeInterval)
+        MergeTileMoments(tm);
+    return (int)dirty.size();
+}
+
+// The largest difference between statistics 'a' and 'b': of the
+// means and standard deviations in units of the standard deviations
+// of 'a', and of the colour channel correlations.
+inline double StatisticsShift(const ColourStatistics &a,
+                              const ColourStatistics &b)
+{
+    double shift=std::abs(b.corr-a.corr);
+    for(int c=0;c<3;c++)
+    {
+        double dev=std::max(a.dev[c], 1e-12);
+        shift=std::max(shift, std::abs(b.mean[c]-a.mean[c])/dev);
+        shift=std::max(shift, std::abs(b.dev[c]-a.dev[c])/dev);
+    }
+    return shift;
+}
+
+#endif
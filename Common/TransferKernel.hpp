@@ -0,0 +1,923 @@
+//*** TEMPLATED COLOUR TRANSFER KERNEL
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// The Reinhard style transfer with cross covariance adjustment,
+// written once as a template on a colour space policy (see
+// 'ColourSpace.hpp') and shared by the processing variants.
+//
+// Each iteration makes two passes over the image (three if
+// rescaling is selected):
+//   1. Conversion from BGR with the image statistics accumulated
+//      block by block while the converted block is still in cache.
+//   2. (Rescaling only.) The channel ranges after transfer, without
+//      writing the transferred image.
+//   3. The transfer, which reduces to a per-pixel affine map of the
+//      channels (including any rescaling), followed immediately by
+//      the conversion back to BGR.
+//
+// The block loops stop early if the current job is cancelled (see
+// 'Cancellation.hpp'), and throw once the loop is left.
+
+#ifndef TRANSFERKERNEL_HPP
+#define TRANSFERKERNEL_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ColourSpace.hpp"
+#include "Statistics.hpp"
+#include "Moments.hpp"
+#include "Cancellation.hpp"
+#include "PlanarImage.hpp"
+
+// Means, standard deviations and colour channel (1 and 2)
+// correlation of an image in a given colour space.
+struct ColourStatistics
+{
+    cv::Scalar mean, dev;
+    double corr;
+    ColourStatistics() : corr(0) {}
+};
+
+inline ColourStatistics StatisticsFromMoments(const BlockMoments &m)
+{
+    ColourStatistics s;
+    if(m.count==0) return s;
+    for(int c=0;c<3;c++)
+    {
+        s.mean[c]=m.mean[c];
+        s.dev[c] =sqrt(m.m2[c]/m.count);
+    }
+    s.corr=m.c12/sqrt(m.m2[1]*m.m2[2]);
+    return s;
+}
+
+inline ColourStatistics StatisticsFromMoments(const MomentAccumulator &m)
+{
+    ColourStatistics s;
+    if(m.count==0 || m.channels!=3) return s;
+    for(int c=0;c<3;c++)
+    {
+        s.mean[c]=m.mean[c];
+        s.dev[c] =MomentDev(m, c);
+    }
+    s.corr=MomentCorr(m, 1, 2);
+    return s;
+}
+
+// Options for 'IterativeTransfer'.
+//   shaderVal    0 keeps the target lightness, 1 matches the
+//                lightness statistics to those of the source and
+//                intermediate values blend the two.
+//   rescale      scale channels back into range rather than clip
+//                (colour spaces with fixed ranges only).
+//   clipOutput   limit the BGR output to the range 0 to 1.
+//   rgbTarget    the target image is in RGB order (a mapped PFM
+//                image) and is read as such; the output is BGR.
+struct TransferOptions
+{
+    float crossCovarianceLimit;
+    float shaderVal;
+    bool  rescale;
+    bool  clipOutput;
+    int   iterations;
+    float convergenceTolerance;
+    bool  rgbTarget;
+    TransferOptions() : crossCovarianceLimit(0.5f), shaderVal(1.0f),
+                        rescale(false), clipOutput(false),
+                        iterations(1), convergenceTolerance(0.0f),
+                        rgbTarget(false) {}
+};
+
+inline void CovarianceWeights(double tcorr, double scorr, float covLim,
+                              float &W1, float &W2)
+{
+        // Computes the weights used to adjust colour channels
+        // 1 and 2 of the standardised image.
+        //
+        // The channels each have zero mean and unit
+        // standard deviation but their cross correlation
+        // value will not normally be zero.
+        //
+        // The processing reduces the cross correlation between
+        // the channels to zero but then reintroduces
+        // correlation such that the new cross correlation
+        // value matches that for the source image.
+        //
+        // Throughout these manipulations the mean channel values
+        // are maintained at zero and the standard deviations are
+        // maintained as unity.
+        //
+        // The manipulations are based upon the following relationship.
+        //
+        // Let z1 and z2 be two independent (zero correlation) variables
+        // with zero means and unit standard deviations. It can be shown
+        // that variables a1 and a2 have zero means, unit standard
+        // deviations, and mutual cross correlation 'R' when:
+        //
+        // a1=sqrt((1+R)/2)*z1 + sqrt((1-R)/2)*z2
+        // a2=sqrt((1+R)/2)*z1 - sqrt((1-R)/2)*z2
+        //
+        // The above relationships are applied inversely to derive
+        // uncorrelated standardised colour channels variables from
+        // the standardised but correlated input channels.
+        //
+        // The above relationships are then applied directly to obtain
+        // standardised correlated colour channels with correlation
+        // matched to that of the source image colour channels.
+        //
+        // The adjusted channels are then
+        //     W1*Chan1+W2*Chan2 and W1*Chan2+W2*Chan1
+        // where the size of W2 relative to W1 is limited by 'covLim'
+        // (no adjustment for covLim=0).
+        //
+        // Original processing method attributable to Dr T E Johnson Sept 2019.
+
+        float norm;
+
+        W1= 0.5*sqrt((1+scorr)/(1+tcorr))
+           +0.5*sqrt((1-scorr)/(1-tcorr));
+        W2= 0.5*sqrt((1+scorr)/(1+tcorr))
+           -0.5*sqrt((1-scorr)/(1-tcorr));
+
+        if(std::abs(W2)>covLim*std::abs(W1))
+        {
+            W2=copysign(covLim*W1,W2);
+            norm=1.0/sqrt(W1*W1+W2*W2+2*W1*W2*tcorr);
+            W1=W1*norm;
+            W2=W2*norm;
+        }
+}
+
+// The transfer as an affine map of the three channels:
+//     L' = l[0]*L + l[1]
+//     1' = c1[0]*1 + c1[1]*2 + c1[2]
+//     2' = c2[0]*2 + c2[1]*1 + c2[2]
+struct TransferMap
+{
+    float l[2], c1[3], c2[3];
+
+    void Apply(const float *in, float *out) const
+    {
+        out[0]=l[0]*in[0]+l[1];
+        out[1]=c1[0]*in[1]+c1[1]*in[2]+c1[2];
+        out[2]=c2[0]*in[2]+c2[1]*in[1]+c2[2];
+    }
+};
+
+// Standardise the target channels, adjust the colour channel
+// correlation with weights W1 and W2 and rescale to the source
+// statistics.  The lightness is blended between the target and
+// source statistics by 'shaderVal'.
+inline TransferMap MakeTransferMap(const ColourStatistics &t,
+                                   const ColourStatistics &s,
+                                   float W1, float W2, float shaderVal)
+{
+    TransferMap m;
+    if(shaderVal==0) {m.l[0]=1; m.l[1]=0;}
+    else
+    {
+        double dev =shaderVal*s.dev[0] +(1-shaderVal)*t.dev[0];
+        double mean=shaderVal*s.mean[0]+(1-shaderVal)*t.mean[0];
+        m.l[0]=dev/t.dev[0];
+        m.l[1]=mean-m.l[0]*t.mean[0];
+    }
+    m.c1[0]=s.dev[1]*W1/t.dev[1];
+    m.c1[1]=s.dev[1]*W2/t.dev[2];
+    m.c1[2]=s.mean[1]-m.c1[0]*t.mean[1]-m.c1[1]*t.mean[2];
+    m.c2[0]=s.dev[2]*W1/t.dev[2];
+    m.c2[1]=s.dev[2]*W2/t.dev[1];
+    m.c2[2]=s.mean[2]-m.c2[0]*t.mean[2]-m.c2[1]*t.mean[1];
+    return m;
+}
+
+// Target number of pixels in each block of the kernel.  This may
+// be changed by the per-machine tuning (see 'Tuning.hpp'), for the
+// whole process or, if 'ThreadKernelBlockPixels' is set, for the
+// kernels called from one thread, but the standard block size is
+// always used for deterministic statistics so that the results do
+// not depend upon the machine.
+inline int &KernelBlockPixels()
+{
+    static int pixels=StatBlockPixels;
+    return pixels;
+}
+
+// The block size for the kernels called from this thread, or 0 for
+// that of the process.
+inline int &ThreadKernelBlockPixels()
+{
+    static thread_local int pixels=0;
+    return pixels;
+}
+
+inline int KernelRowsPerBlock(int cols)
+{
+    int pixels=ThreadKernelBlockPixels()>0 ? ThreadKernelBlockPixels()
+                                           : KernelBlockPixels();
+    if(DeterministicStatisticsFlag()) pixels=StatBlockPixels;
+    return std::max(1, pixels/std::max(cols,1));
+}
+
+// Converts a float BGR image to the colour space of 'space' and
+// returns its statistics.  The converted image is returned in
+// 'out' unless 'out' is NULL, in which case each block is
+// converted into scratch memory and only the statistics are kept.
+template<class Space>
+ColourStatistics ConvertForward(const Space &space, const cv::Mat &bgr,
+                                cv::Mat *out)
+{
+    int rowsPerBlock=KernelRowsPerBlock(bgr.cols);
+    int blocks=(bgr.rows+rowsPerBlock-1)/rowsPerBlock;
+    std::vector<BlockMoments> partial(blocks);
+    if(out) out->create(bgr.size(), CV_32FC3);
+    const CancelToken *token=CurrentCancelToken();
+
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range)
+    {
+        cv::Mat scratch;
+        for(int b=range.start;b<range.end && !Cancelled(token);b++)
+        {
+            int row0=b*rowsPerBlock;
+            int row1=std::min(row0+rowsPerBlock, bgr.rows);
+            cv::Mat dst;
+            if(out) dst=*out;
+            else
+            {
+                scratch.create(rowsPerBlock, bgr.cols, CV_32FC3);
+                dst=scratch;
+            }
+            int offset=out ? 0 : row0;
+            for(int y=row0;y<row1;y++)
+                space.ForwardRow(bgr.ptr<float>(y),
+                                 dst.ptr<float>(y-offset), bgr.cols);
+            partial[b]=ComputeBlockMoments<3>(dst, cv::Mat(), cv::Mat(),
+                                              true, row0-offset,
+                                              row1-offset);
+        }
+    });
+    ThrowIfCancelled();
+
+    BlockMoments total;
+    for(int b=0;b<blocks;b++) MergeMoments(total, partial[b], 3);
+    return StatisticsFromMoments(total);
+}
+
+// As 'ConvertForward', reading 'image' in RGB order if 'rgb' is set.
+template<class Space>
+ColourStatistics ConvertTarget(const Space &space, const cv::Mat &image,
+                               bool rgb, cv::Mat *out)
+{
+    if(rgb) return ConvertForward(RgbOrder<Space>(space), image, out);
+    return ConvertForward(space, image, out);
+}
+
+// The BGR form of an image in RGB order if 'rgb' is set (for a
+// transfer of no iterations), or the image itself.
+inline cv::Mat TargetAsBgr(const cv::Mat &image, bool rgb)
+{
+    if(!rgb) return image;
+    cv::Mat bgr;
+    cv::cvtColor(image, bgr, cv::COLOR_RGB2BGR);
+    return bgr;
+}
+
+// An image converted to a colour space, with its statistics.
+struct ConvertedImage
+{
+    cv::Mat          image;
+    ColourStatistics stats;
+};
+
+// Converts a float BGR image to the colour spaces of both 'spaceA'
+// and 'spaceB' in a single pass, so that each block of the image is
+// read from memory once for both.  The converted images are kept in
+// 'a' and 'b' only if 'keep' is set; the statistics always are.
+template<class SpaceA, class SpaceB>
+void ConvertForwardPair(const SpaceA &spaceA, const SpaceB &spaceB,
+                        const cv::Mat &bgr, bool keep,
+                        ConvertedImage &a, ConvertedImage &b)
+{
+    int rowsPerBlock=KernelRowsPerBlock(bgr.cols);
+    int blocks=(bgr.rows+rowsPerBlock-1)/rowsPerBlock;
+    std::vector<BlockMoments> partialA(blocks), partialB(blocks);
+    a.image.release();
+    b.image.release();
+    if(keep)
+    {
+        a.image.create(bgr.size(), CV_32FC3);
+        b.image.create(bgr.size(), CV_32FC3);
+    }
+    const CancelToken *token=CurrentCancelToken();
+
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range)
+    {
+        cv::Mat scratchA, scratchB;
+        for(int k=range.start;k<range.end && !Cancelled(token);k++)
+        {
+            int row0=k*rowsPerBlock;
+            int row1=std::min(row0+rowsPerBlock, bgr.rows);
+            cv::Mat dstA=a.image, dstB=b.image;
+            if(!keep)
+            {
+                scratchA.create(rowsPerBlock, bgr.cols, CV_32FC3);
+                scratchB.create(rowsPerBlock, bgr.cols, CV_32FC3);
+                dstA=scratchA;
+                dstB=scratchB;
+            }
+            int offset=keep ? 0 : row0;
+            for(int y=row0;y<row1;y++)
+            {
+                const float *p=bgr.ptr<float>(y);
+                spaceA.ForwardRow(p, dstA.ptr<float>(y-offset), bgr.cols);
+                spaceB.ForwardRow(p, dstB.ptr<float>(y-offset), bgr.cols);
+            }
+            partialA[k]=ComputeBlockMoments<3>(dstA, cv::Mat(), cv::Mat(),
+                                               true, row0-offset,
+                                               row1-offset);
+            partialB[k]=ComputeBlockMoments<3>(dstB, cv::Mat(), cv::Mat(),
+                                               true, row0-offset,
+                                               row1-offset);
+        }
+    });
+    ThrowIfCancelled();
+
+    BlockMoments totalA, totalB;
+    for(int k=0;k<blocks;k++)
+    {
+        MergeMoments(totalA, partialA[k], 3);
+        MergeMoments(totalB, partialB[k], 3);
+    }
+    a.stats=StatisticsFromMoments(totalA);
+    b.stats=StatisticsFromMoments(totalB);
+}
+
+// Converts an image from the colour space of 'space' to float
+// BGR, after first applying 'map' if given.
+template<class Space>
+cv::Mat ConvertInverse(const Space &space, const cv::Mat &image,
+                       const TransferMap *map, bool clipOutput)
+{
+    cv::Mat bgr(image.size(), CV_32FC3);
+    int rowsPerBlock=KernelRowsPerBlock(image.cols);
+    int blocks=(image.rows+rowsPerBlock-1)/rowsPerBlock;
+    const CancelToken *token=CurrentCancelToken();
+
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range)
+    {
+        std::vector<float> row(map ? 3*image.cols : 0);
+        for(int b=range.start;b<range.end && !Cancelled(token);b++)
+        {
+            int row0=b*rowsPerBlock;
+            int row1=std::min(row0+rowsPerBlock, image.rows);
+            for(int y=row0;y<row1;y++)
+            {
+                const float *p=image.ptr<float>(y);
+                float *q=bgr.ptr<float>(y);
+                if(map)
+                {
+                    for(int x=0;x<image.cols;x++)
+                        map->Apply(p+3*x, &row[3*x]);
+                    p=&row[0];
+                }
+                space.InverseRow(p, q, image.cols);
+                if(clipOutput)
+                    for(int x=0;x<3*image.cols;x++) q[x]=ClipUnit(q[x]);
+            }
+        }
+    });
+    ThrowIfCancelled();
+    return bgr;
+}
+
+// As 'ConvertForward', but returning the converted image as planes
+// in 'out'.  Each block is converted into scratch memory, for its
+// statistics, and distributed to the planes while still in cache.
+template<class Space>
+ColourStatistics ConvertForwardPlanar(const Space &space, const cv::Mat &bgr,
+                                     PlanarImage &out)
+{
+    int rowsPerBlock=KernelRowsPerBlock(bgr.cols);
+    int blocks=(bgr.rows+rowsPerBlock-1)/rowsPerBlock;
+    std::vector<BlockMoments> partial(blocks);
+    out.Create(bgr.size());
+    const CancelToken *token=CurrentCancelToken();
+
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range)
+    {
+        cv::Mat scratch(rowsPerBlock, bgr.cols, CV_32FC3);
+        for(int b=range.start;b<range.end && !Cancelled(token);b++)
+        {
+            int row0=b*rowsPerBlock;
+            int row1=std::min(row0+rowsPerBlock, bgr.rows);
+            for(int y=row0;y<row1;y++)
+            {
+                float *q=scratch.ptr<float>(y-row0);
+                space.ForwardRow(bgr.ptr<float>(y), q, bgr.cols);
+                float *p0=out[0].ptr<float>(y);
+                float *p1=out[1].ptr<float>(y);
+                float *p2=out[2].ptr<float>(y);
+                for(int x=0;x<bgr.cols;x++)
+                {
+                    p0[x]=q[3*x];
+                    p1[x]=q[3*x+1];
+                    p2[x]=q[3*x+2];
+                }
+            }
+            partial[b]=ComputeBlockMoments<3>(scratch, cv::Mat(), cv::Mat(),
+                                              true, 0, row1-row0);
+        }
+    });
+    ThrowIfCancelled();
+
+    BlockMoments total;
+    for(int b=0;b<blocks;b++) MergeMoments(total, partial[b], 3);
+    return StatisticsFromMoments(total);
+}
+
+// As 'ConvertInverse', for an image held as planes.
+template<class Space>
+cv::Mat ConvertInversePlanar(const Space &space, const PlanarImage &image,
+                             const TransferMap *map, bool clipOutput)
+{
+    cv::Size size=image.size();
+    cv::Mat bgr(size, CV_32FC3);
+    int rowsPerBlock=KernelRowsPerBlock(size.width);
+    int blocks=(size.height+rowsPerBlock-1)/rowsPerBlock;
+    const CancelToken *token=CurrentCancelToken();
+
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range)
+    {
+        std::vector<float> row(3*size.width);
+        for(int b=range.start;b<range.end && !Cancelled(token);b++)
+        {
+            int row0=b*rowsPerBlock;
+            int row1=std::min(row0+rowsPerBlock, size.height);
+            for(int y=row0;y<row1;y++)
+            {
+                const float *p0=image[0].ptr<float>(y);
+                const float *p1=image[1].ptr<float>(y);
+                const float *p2=image[2].ptr<float>(y);
+                float *q=bgr.ptr<float>(y);
+                for(int x=0;x<size.width;x++)
+                {
+                    float v[3]={p0[x], p1[x], p2[x]};
+                    if(map) map->Apply(v, &row[3*x]);
+                    else for(int c=0;c<3;c++) row[3*x+c]=v[c];
+                }
+                space.InverseRow(&row[0], q, size.width);
+                if(clipOutput)
+                    for(int x=0;x<3*size.width;x++) q[x]=ClipUnit(q[x]);
+            }
+        }
+    });
+    ThrowIfCancelled();
+    return bgr;
+}
+
+// The range of each channel of an image after applying 'map'.
+inline void MappedRange(const cv::Mat &image, const TransferMap &map,
+                        float minVal[3], float maxVal[3])
+{
+    int rowsPerBlock=KernelRowsPerBlock(image.cols);
+    int blocks=(image.rows+rowsPerBlock-1)/rowsPerBlock;
+    std::vector<float> lo(3*blocks, FLT_MAX), hi(3*blocks, -FLT_MAX);
+    const CancelToken *token=CurrentCancelToken();
+
+    cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range)
+    {
+        for(int b=range.start;b<range.end && !Cancelled(token);b++)
+        {
+            int row0=b*rowsPerBlock;
+            int row1=std::min(row0+rowsPerBlock, image.rows);
+            for(int y=row0;y<row1;y++)
+            {
+                const float *p=image.ptr<float>(y);
+                for(int x=0;x<image.cols;x++)
+                {
+                    float v[3];
+                    map.Apply(p+3*x, v);
+                    for(int c=0;c<3;c++)
+                    {
+                        lo[3*b+c]=std::min(lo[3*b+c], v[c]);
+                        hi[3*b+c]=std::max(hi[3*b+c], v[c]);
+                    }
+                }
+            }
+        }
+    });
+    ThrowIfCancelled();
+
+    for(int c=0;c<3;c++) {minVal[c]=FLT_MAX; maxVal[c]=-FLT_MAX;}
+    for(int b=0;b<blocks;b++)
+        for(int c=0;c<3;c++)
+        {
+            minVal[c]=std::min(minVal[c], lo[3*b+c]);
+            maxVal[c]=std::max(maxVal[c], hi[3*b+c]);
+        }
+}
+
+// Folds into 'map' a rescaling of the channels towards the centre
+// of their permitted ranges, where the transferred data would
+// otherwise fall outside them and be clipped.  The colour channels
+// are scaled jointly to ensure consistency.
+template<class Space>
+void RescaleMap(const Space &space, const cv::Mat &image, TransferMap &map)
+{
+    float mid, half, colourMax, minVal[3], maxVal[3];
+    if(!space.RescaleLimits(mid, half, colourMax)) return;
+    MappedRange(image, map, minVal, maxVal);
+
+    float scale=0.0f;
+    for(int c=1;c<3;c++)
+    {
+        scale=std::max(scale, maxVal[c]/colourMax);
+        scale=std::max(scale,-minVal[c]/colourMax);
+    }
+    if(scale>1.0f)
+        for(int k=0;k<3;k++) {map.c1[k]/=scale; map.c2[k]/=scale;}
+
+    scale=std::max((maxVal[0]-mid)/half, -(minVal[0]-mid)/half);
+    if(scale>1.0f)
+    {
+        map.l[0]/=scale;
+        map.l[1]=(map.l[1]-mid)/scale+mid;
+    }
+}
+
+// Selects the fast approximations of 'space', if it has any, for a
+// transfer by 'map' between the forward and inverse conversions, or
+// by a local transfer of unknown gain if 'map' is NULL.  Returns true
+// if they changed, in which case the image must be converted again.
+template<class Space>
+bool FitFastMathToMap(Space &, const TransferMap *) {return false;}
+
+inline bool FitFastMathToMap(LalphabetaSpace &space, const TransferMap *map)
+{
+    if(space.maxError<=0) return false;
+    int degree=space.fastDegree;
+    float gain=FLT_MAX;
+    if(map)
+    {
+        // The gain is the largest absolute row sum of the linear part
+        // of the map carried over to the logarithms of LMS.
+        float M[9]={map->l[0], 0,          0,
+                    0,         map->c1[0], map->c1[1],
+                    0,         map->c2[1], map->c2[0]};
+        float T[9], C[9];
+        for(int r=0;r<3;r++)
+            for(int c=0;c<3;c++)
+            {
+                T[3*r+c]=0;
+                for(int k=0;k<3;k++)
+                    T[3*r+c]+=space.lab_to_LMS[3*r+k]*M[3*k+c];
+            }
+        for(int r=0;r<3;r++)
+            for(int c=0;c<3;c++)
+            {
+                C[3*r+c]=0;
+                for(int k=0;k<3;k++)
+                    C[3*r+c]+=T[3*r+k]*space.LMS_to_lab[3*k+c];
+            }
+        gain=0;
+        for(int r=0;r<3;r++)
+            gain=std::max(gain, std::abs(C[3*r])+std::abs(C[3*r+1])
+                               +std::abs(C[3*r+2]));
+    }
+    space.SelectDegree(gain);
+    return space.fastDegree!=degree;
+}
+
+// Transfers the colour statistics of 'sourcef' to 'targetf' (both
+// float BGR) in the colour space of 'space'.
+//
+// If the convergence tolerance is greater than zero, the number of
+// iterations is the maximum number and the processing stops as soon
+// as the image statistics match those of the source image to
+// within the tolerance, or stop improving.  In this case the cross
+// covariance limit is relaxed over the first two iterations (and is
+// applied in full if there is only one), and the processing only
+// stops once an iteration has applied the full limit, so that the
+// result never carries the partial weights of an early iteration.
+// Otherwise the limit is relaxed evenly over all the iterations.
+//
+// The source statistics 's' may be given in place of the source
+// image, for instance when merged from moments computed separately
+// (see 'Moments.hpp'), and the target image may be given already
+// converted, in 'first', for the first iteration.  With
+// 'opt.rgbTarget' the target is read in RGB order by the first
+// iteration, and each later one reads the BGR result of the last.
+//
+// If the fast approximations of 'space' do not meet its error budget
+// with the gain of an iteration's map, the target is converted again
+// with those that do (see 'FitFastMathToMap').
+template<class Space>
+cv::Mat IterativeTransfer(const Space &space, cv::Mat targetf,
+                          const ColourStatistics &s,
+                          const TransferOptions &opt,
+                          int *iterationsUsed=NULL,
+                          const ConvertedImage *first=NULL)
+{
+    ColourStatistics t;
+    double residual, lastResidual=0;
+    bool adaptive=opt.convergenceTolerance>0;
+    float W1, W2;
+    bool fullLimit=false;   // The last iteration applied the full limit.
+    bool rgb=opt.rgbTarget; // 'targetf' is in RGB order.
+    int i;
+
+    for(i=1;i<=opt.iterations;i++)
+    {
+        cv::Mat converted;
+        if(i==1 && first)
+        {
+            converted=first->image;
+            t=first->stats;
+        }
+        else t=ConvertTarget(space, targetf, rgb, &converted);
+
+        if(adaptive)
+        {
+            residual=TransferResidual(t.mean, t.dev, t.corr,
+                                      s.mean, s.dev, s.corr,
+                                      opt.shaderVal>0,
+                                      opt.crossCovarianceLimit>=1.0);
+            if(i>1 && fullLimit &&
+               (residual<opt.convergenceTolerance ||
+                residual>0.95*lastResidual)) break;
+            lastResidual=residual;
+        }
+
+        float covLim=opt.crossCovarianceLimit*i/opt.iterations;
+        fullLimit=i==opt.iterations || (adaptive && i>=2) ||
+                  opt.crossCovarianceLimit==0;
+        if(adaptive)
+            covLim=fullLimit ? opt.crossCovarianceLimit
+                             : opt.crossCovarianceLimit/2;
+        CovarianceWeights(t.corr, s.corr, covLim, W1, W2);
+
+        TransferMap map=MakeTransferMap(t, s, W1, W2, opt.shaderVal);
+        if(opt.rescale) RescaleMap(space, converted, map);
+        Space fitted=space;
+        if(FitFastMathToMap(fitted, &map))
+        {
+            converted=cv::Mat();
+            ConvertTarget(fitted, targetf, rgb, &converted);
+        }
+        targetf=ConvertInverse(fitted, converted, &map, opt.clipOutput);
+        rgb=false;
+        CancelPoint((float)i/opt.iterations);
+    }
+
+    if(iterationsUsed) *iterationsUsed=i-1;
+    return TargetAsBgr(targetf, rgb);
+}
+
+template<class Space>
+cv::Mat IterativeTransfer(const Space &space, cv::Mat targetf,
+                          cv::Mat sourcef, const TransferOptions &opt,
+                          int *iterationsUsed=NULL)
+{
+    return IterativeTransfer(space, targetf,
+                             ConvertForward(space, sourcef, NULL), opt,
+                             iterationsUsed);
+}
+
+// Number of intervals of the table of covariance weights against
+// the local correlation in 'LocalTransfer'.  (Linear interpolation
+// in the table is within about 0.002 of the weights themselves,
+// which are of order one.)
+const int LocalWeightSteps = 4096;
+
+// Transfers the colour statistics of 'sourcef' to 'targetf' as
+// 'IterativeTransfer' does, except that the target means, standard
+// deviations and colour channel correlation are those of the
+// 'window' x 'window' neighbourhood of each pixel rather than of the
+// whole image.  This follows regional colour variation in the
+// target image which global statistics would average away.  The
+// source statistics remain global.
+//
+// The local moments are computed by normalised box filters, which
+// use running sums, so the cost per pixel does not depend on the
+// window size.  The moments are taken about the global mean to
+// limit rounding error in the variances.  Local standard deviations
+// are not allowed to fall below a tenth of the global value, so that
+// noise in flat regions is not amplified.  The local correlation is
+// limited to +/-0.99, and the covariance weights for it are
+// interpolated from a table made once per iteration, since they
+// depend on the pixel only through the correlation.
+//
+// With 'opt.rescale' the transferred channels are held until the
+// range of each is known and are then scaled as a whole towards the
+// centre of their permitted ranges, as 'RescaleMap' does for a
+// global map, at the cost of a further pass over the image.
+// Adaptive iteration is not available in this mode.  The local
+// gains are not known before the conversion, so the exact
+// conversions are used in place of any fast approximations which
+// need a bounded gain.
+template<class Space>
+cv::Mat LocalTransfer(const Space &fastSpace, cv::Mat targetf,
+                      const ColourStatistics &s, int window,
+                      const TransferOptions &opt)
+{
+    cv::Size ksize(window, window);
+    Space space=fastSpace;
+    FitFastMathToMap(space, (const TransferMap *)NULL);
+    float mid, half, colourMax;
+    bool rescale=opt.rescale && space.RescaleLimits(mid, half, colourMax);
+    bool rgb=opt.rgbTarget;
+
+    for(int i=1;i<=opt.iterations;i++)
+    {
+        cv::Mat converted, centred, squares, product;
+        cv::Mat mean, meanSq, meanProd;
+        ColourStatistics g=ConvertTarget(space, targetf, rgb, &converted);
+        rgb=false;
+        float covLim=opt.crossCovarianceLimit*i/opt.iterations;
+
+        // Covariance weights at correlations from -0.99 to 0.99.
+        const float corrMax=0.99f, step=2*corrMax/LocalWeightSteps;
+        std::vector<float> W(2*(LocalWeightSteps+1));
+        for(int k=0;k<=LocalWeightSteps;k++)
+            CovarianceWeights(-corrMax+k*step, s.corr, covLim,
+                              W[2*k], W[2*k+1]);
+
+        // Local first and second moments.
+        cv::subtract(converted, g.mean, centred);
+        cv::multiply(centred, centred, squares);
+        product.create(centred.size(), CV_32FC1);
+        cv::parallel_for_(cv::Range(0, centred.rows),
+                          [&](const cv::Range &rows)
+        {
+            for(int y=rows.start;y<rows.end;y++)
+            {
+                const float *p=centred.ptr<float>(y);
+                float *q=product.ptr<float>(y);
+                for(int x=0;x<centred.cols;x++) q[x]=p[3*x+1]*p[3*x+2];
+            }
+        });
+        cv::boxFilter(centred, mean,     CV_32F, ksize, cv::Point(-1,-1),
+                      true, cv::BORDER_REFLECT);
+        cv::boxFilter(squares, meanSq,   CV_32F, ksize, cv::Point(-1,-1),
+                      true, cv::BORDER_REFLECT);
+        cv::boxFilter(product, meanProd, CV_32F, ksize, cv::Point(-1,-1),
+                      true, cv::BORDER_REFLECT);
+        squares.release();
+        product.release();
+
+        // Apply the locally standardised transfer and convert back,
+        // or keep the result in 'converted' if it is to be rescaled.
+        cv::Mat bgr;
+        if(!rescale) bgr.create(converted.size(), CV_32FC3);
+        float sv=opt.shaderVal;
+        const CancelToken *token=CurrentCancelToken();
+        cv::parallel_for_(cv::Range(0, converted.rows),
+                          [&](const cv::Range &rows)
+        {
+            std::vector<float> row(3*converted.cols);
+            for(int y=rows.start;y<rows.end && !Cancelled(token);y++)
+            {
+                float *p       =converted.ptr<float>(y);
+                const float *m =mean.ptr<float>(y);
+                const float *m2=meanSq.ptr<float>(y);
+                const float *mp=meanProd.ptr<float>(y);
+                for(int x=0;x<converted.cols;x++)
+                {
+                    float lm[3], ld[3];
+                    for(int c=0;c<3;c++)
+                    {
+                        float v=m2[3*x+c]-m[3*x+c]*m[3*x+c];
+                        lm[c]=m[3*x+c]+(float)g.mean[c];
+                        ld[c]=std::max(std::sqrt(std::max(v, 0.0f)),
+                                       0.1f*(float)g.dev[c]);
+                    }
+                    float corr=(mp[x]-m[3*x+1]*m[3*x+2])/(ld[1]*ld[2]);
+                    corr=std::min(std::max(corr, -corrMax), corrMax);
+                    float f=(corr+corrMax)/step;
+                    int k=std::min((int)f, LocalWeightSteps-1);
+                    f-=k;
+                    const float *w=&W[2*k];
+                    float w1=w[0]+f*(w[2]-w[0]), w2=w[1]+f*(w[3]-w[1]);
+
+                    const float *in=p+3*x;
+                    float *out=&row[3*x];
+                    float z1=(in[1]-lm[1])/ld[1], z2=(in[2]-lm[2])/ld[2];
+                    out[1]=(w1*z1+w2*z2)*s.dev[1]+s.mean[1];
+                    out[2]=(w1*z2+w2*z1)*s.dev[2]+s.mean[2];
+                    if(sv==0) out[0]=in[0];
+                    else out[0]=(in[0]-lm[0])/ld[0]*(sv*s.dev[0]+(1-sv)*ld[0])
+                                +sv*s.mean[0]+(1-sv)*lm[0];
+                }
+                if(rescale)
+                {
+                    std::copy(row.begin(), row.end(), p);
+                    continue;
+                }
+                float *q=bgr.ptr<float>(y);
+                space.InverseRow(&row[0], q, converted.cols);
+                if(opt.clipOutput)
+                    for(int x=0;x<3*converted.cols;x++) q[x]=ClipUnit(q[x]);
+            }
+        });
+        ThrowIfCancelled();
+        if(rescale)
+        {
+            TransferMap scale={{1, 0}, {1, 0, 0}, {1, 0, 0}};
+            mean.release();
+            meanSq.release();
+            meanProd.release();
+            RescaleMap(space, converted, scale);
+            bgr=ConvertInverse(space, converted, &scale, opt.clipOutput);
+        }
+        targetf=bgr;
+        CancelPoint((float)i/opt.iterations);
+    }
+    return TargetAsBgr(targetf, rgb);
+}
+
+template<class Space>
+cv::Mat LocalTransfer(const Space &space, cv::Mat targetf,
+                      cv::Mat sourcef, int window,
+                      const TransferOptions &opt)
+{
+    return LocalTransfer(space, targetf, ConvertForward(space, sourcef, NULL),
+                         window, opt);
+}
+
+// Reports the difference between a result computed with the exact
+// L-alpha-beta transforms and one computed with the fast
+// approximations of 'space', in 8 bit output levels, together with
+// the bound predicted for a round trip and the permitted error.  (A
+// transfer selects a higher degree, or the exact functions, if its
+// gain requires.)
+inline void PrintFastMathError(const std::string &name,
+                               const cv::Mat &exact, const cv::Mat &fast,
+                               const LalphabetaSpace &space, float budget)
+{
+    cv::Mat diff;
+    double maxDiff;
+    cv::absdiff(exact, fast, diff);
+    diff=diff.reshape(1);
+    cv::minMaxLoc(diff, NULL, &maxDiff);
+    double meanDiff=cv::mean(diff)[0];
+
+    std::ostringstream line;
+    line<<"Fast math error "<<name<<": ";
+    if(space.fastDegree==0) line<<"(exact functions kept)";
+    else
+        line<<"max "<<maxDiff*255<<"/255, mean "<<meanDiff*255
+            <<"/255, round trip bound "<<space.predictedError*255<<"/255"
+            <<" (degree "<<space.fastDegree<<")";
+    line<<", budget "<<budget*255<<"/255"
+        <<(maxDiff<=budget ? "\n" : "  EXCEEDED\n");
+    std::cout<<line.str();
+}
+
+// Reports the colour difference (delta E) between the conversions
+// of 'imagef' (in RGB order if 'rgb' is set) to CIELAB by OpenCV and
+// by the fast CIELAB conversions, together with the largest
+// differences measured over the colour cube (see
+// 'MeasureCielabFastError').
+inline void PrintFastLabError(const std::string &name,
+                              const cv::Mat &imagef, bool rgb)
+{
+    cv::Mat reference, fast(imagef.size(), CV_32FC3);
+    cv::cvtColor(imagef, reference, rgb ? cv::COLOR_RGB2Lab
+                                        : cv::COLOR_BGR2Lab);
+    CielabSpace lab(CielabFastError);
+    RgbOrder<CielabSpace> rgblab(lab);
+    double maxDeltaE=0, sumDeltaE=0;
+    for(int y=0;y<imagef.rows;y++)
+    {
+        const float *r=reference.ptr<float>(y);
+        float *f=fast.ptr<float>(y);
+        if(rgb) rgblab.ForwardRow(imagef.ptr<float>(y), f, imagef.cols);
+        else    lab.ForwardRow(imagef.ptr<float>(y), f, imagef.cols);
+        for(int x=0;x<3*imagef.cols;x+=3)
+        {
+            double d0=f[x]-r[x], d1=f[x+1]-r[x+1], d2=f[x+2]-r[x+2];
+            double deltaE=std::sqrt(d0*d0+d1*d1+d2*d2);
+            maxDeltaE=std::max(maxDeltaE, deltaE);
+            sumDeltaE+=deltaE;
+        }
+    }
+
+    float cubeDeltaE, cubeError;
+    MeasureCielabFastError(cubeDeltaE, cubeError);
+    std::ostringstream line;
+    line<<"Fast CIELAB error "<<name<<": max delta E "<<maxDeltaE
+        <<", mean "<<sumDeltaE/std::max((double)imagef.total(), 1.0)
+        <<" against OpenCV; colour cube max delta E "<<cubeDeltaE
+        <<", round trip "<<cubeError*255<<"/255\n";
+    std::cout<<line.str();
+}
+
+#endif
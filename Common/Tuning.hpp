@@ -0,0 +1,364 @@
+//*** PER-MACHINE TUNING
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// The fastest kernel block size, number of processing threads and
+// choice between the exact and the fast approximate colour space
+// functions differ between processors and with the image size.
+// Here they are found by timing the colour transfer of synthetic
+// images ('RunTuner', selected by running a program with the
+// argument '--tune') and the best settings are saved in a local
+// file, keyed by the processor model, the program variant and the
+// image size.  At startup 'LoadTuning' finds the settings for the
+// machine and image size and 'ApplyTuning' selects them.
+//
+// In batch processing the images may differ in size and several are
+// transferred at once, so the settings of every size bucket are
+// loaded ('BatchTuning') and those for each image's own size are
+// selected while it is transferred.  Only the block size, which is
+// set for the transferring thread alone ('TuningScope'), and the
+// choice of functions are selected per image.  The number of
+// threads is left to the batch settings, since 'cv::setNumThreads'
+// applies to the whole process and the tuned number was timed with
+// one image at a time.
+//
+// Each line of the tuning file reads
+//     <processor>|<variant>|<size bucket> <block pixels> <threads>
+//     <fast math> <seconds>
+// (on one line), where the size buckets are images of less than 1,
+// 4 and 16 megapixels and larger images.  Lines for other machines
+// are kept, so one file may be shared between machines.
+
+#ifndef TUNING_HPP
+#define TUNING_HPP
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "TransferKernel.hpp"
+
+const char *const TuningFileName = "ColourTransferTuning.txt";
+
+// Error budget of the fast approximate functions while tuning.
+// (Whether they are then used depends upon the error allowed by
+// the processing options.)
+const float TuningFastMathError = 2.0f/255;
+
+// Number of size buckets and the image size used for each.
+const int TuningBuckets = 4;
+const int TuningWidth[TuningBuckets]  = {1024, 2048, 4096, 6000};
+const int TuningHeight[TuningBuckets] = { 683, 1365, 2731, 4000};
+
+struct TuningConfig
+{
+    int    blockPixels;     // See 'KernelBlockPixels'.
+    int    threads;         // For cv::setNumThreads.
+    bool   fastMath;        // Fast functions are the faster.
+    double seconds;         // Time for the synthetic image.
+    TuningConfig() : blockPixels(StatBlockPixels),
+                     threads(cv::getNumberOfCPUs()), fastMath(true),
+                     seconds(0) {}
+};
+
+inline std::string TrimSpace(const std::string &text)
+{
+    size_t first=text.find_first_not_of(" \t\r");
+    if(first==std::string::npos) return "";
+    return text.substr(first, text.find_last_not_of(" \t\r")-first+1);
+}
+
+// Returns a description of the processor model and its number of
+// processors.
+inline std::string CpuModel()
+{
+    std::string model;
+#ifdef _WIN32
+    const char *id=getenv("PROCESSOR_IDENTIFIER");
+    if(id) model=id;
+#else
+    // x86 processors give a 'model name' and ARM processors an
+    // implementer and part number.
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line, implementer, part;
+    while(std::getline(cpuinfo, line))
+    {
+        size_t colon=line.find(':');
+        if(colon==std::string::npos) continue;
+        std::string key=TrimSpace(line.substr(0, colon));
+        std::string value=TrimSpace(line.substr(colon+1));
+        if(key=="model name" && model.empty()) model=value;
+        if(key=="CPU implementer" && implementer.empty()) implementer=value;
+        if(key=="CPU part" && part.empty()) part=value;
+    }
+    if(model.empty() && !implementer.empty())
+        model="ARM "+implementer+" "+part;
+#endif
+    if(model.empty()) model="unknown";
+    // The '|' separates the key fields.
+    std::replace(model.begin(), model.end(), '|', '/');
+    std::ostringstream key;
+    key<<model<<" x"<<cv::getNumberOfCPUs();
+    return key.str();
+}
+
+inline int TuningBucket(double pixels)
+{
+    int bucket=0;
+    while(bucket<TuningBuckets-1 && pixels>=1048576.0*(1<<(2*bucket)))
+        bucket++;
+    return bucket;
+}
+
+inline std::string TuningKey(const std::string &variant, int bucket)
+{
+    std::ostringstream key;
+    key<<CpuModel()<<"|"<<variant<<"|"<<bucket;
+    return key.str();
+}
+
+// Splits a tuning file line into its key and settings.
+inline bool ParseTuningLine(const std::string &line, std::string &key,
+                            TuningConfig &config)
+{
+    size_t last=line.rfind('|');
+    if(last==std::string::npos) return false;
+    size_t space=line.find(' ', last);
+    if(space==std::string::npos) return false;
+    key=line.substr(0, space);
+    std::istringstream in(line.substr(space));
+    int fast;
+    if(!(in>>config.blockPixels>>config.threads>>fast>>config.seconds))
+        return false;
+    config.fastMath=fast!=0;
+    return config.blockPixels>0 && config.threads>0;
+}
+
+// Finds the settings for this machine, the variant and size bucket
+// 'bucket'.  Returns false if the machine is not tuned.
+inline bool LoadTuningBucket(const std::string &variant, int bucket,
+                             TuningConfig &config,
+                             const std::string &filename=TuningFileName)
+{
+    std::ifstream file(filename.c_str());
+    std::string line, key, wanted=TuningKey(variant, bucket);
+    TuningConfig c;
+    while(std::getline(file, line))
+        if(ParseTuningLine(line, key, c) && key==wanted)
+        {
+            config=c;
+            return true;
+        }
+    return false;
+}
+
+// Finds the settings for this machine, the variant and an image of
+// 'pixels' pixels.  Returns false if the machine is not tuned.
+inline bool LoadTuning(const std::string &variant, double pixels,
+                       TuningConfig &config,
+                       const std::string &filename=TuningFileName)
+{
+    return LoadTuningBucket(variant, TuningBucket(pixels), config,
+                            filename);
+}
+
+// Saves the settings, replacing any for the same key.  The file is
+// written under a temporary name and then renamed.
+inline bool SaveTuning(const std::string &variant, int bucket,
+                       const TuningConfig &config,
+                       const std::string &filename=TuningFileName)
+{
+    std::vector<std::string> lines;
+    std::string line, key, wanted=TuningKey(variant, bucket);
+    TuningConfig c;
+    std::ifstream in(filename.c_str());
+    while(std::getline(in, line))
+        if(!ParseTuningLine(line, key, c) || key!=wanted)
+            lines.push_back(line);
+    in.close();
+
+    std::ostringstream entry;
+    entry<<wanted<<" "<<config.blockPixels<<" "<<config.threads<<" "
+         <<(config.fastMath ? 1 : 0)<<" "<<config.seconds;
+    lines.push_back(entry.str());
+
+    std::string temporary=filename+".tmp";
+    std::ofstream out(temporary.c_str());
+    for(size_t i=0;i<lines.size();i++) out<<lines[i]<<"\n";
+    out.close();
+    if(!out) return false;
+#ifdef _WIN32
+    remove(filename.c_str());
+#endif
+    return rename(temporary.c_str(), filename.c_str())==0;
+}
+
+inline void ApplyTuning(const TuningConfig &config)
+{
+    KernelBlockPixels()=config.blockPixels;
+    cv::setNumThreads(config.threads);
+}
+
+// Loads and applies the settings for this machine, the variant and
+// an image of 'pixels' pixels, if the machine has been tuned.
+inline bool SelectTuning(const std::string &variant, double pixels,
+                         TuningConfig &config)
+{
+    if(!LoadTuning(variant, pixels, config)) return false;
+    ApplyTuning(config);
+    std::cout<<"Tuned settings: "<<config.threads<<" threads, blocks of "
+             <<config.blockPixels<<" pixels"
+             <<(config.fastMath ? "" : ", exact functions")<<"\n";
+    return true;
+}
+
+// The settings of every size bucket for batch processing.
+struct BatchTuning
+{
+    bool         tuned[TuningBuckets];
+    TuningConfig config[TuningBuckets];
+    BatchTuning() {for(int b=0;b<TuningBuckets;b++) tuned[b]=false;}
+
+    // Loads the settings for this machine and the variant.  Returns
+    // false if no size bucket is tuned.
+    bool Load(const std::string &variant)
+    {
+        bool any=false;
+        for(int b=0;b<TuningBuckets;b++)
+        {
+            tuned[b]=LoadTuningBucket(variant, b, config[b]);
+            if(!tuned[b]) continue;
+            any=true;
+            std::cout<<"Tuned settings for images of "<<TuningWidth[b]
+                     <<" x "<<TuningHeight[b]<<": blocks of "
+                     <<config[b].blockPixels<<" pixels"
+                     <<(config[b].fastMath ? "" : ", exact functions")
+                     <<"\n";
+        }
+        return any;
+    }
+
+    // The settings for an image of 'pixels' pixels, or NULL if its
+    // size bucket is not tuned.
+    const TuningConfig *For(double pixels) const
+    {
+        int b=TuningBucket(pixels);
+        return tuned[b] ? &config[b] : NULL;
+    }
+};
+
+// The permitted error of the fast functions for an image with
+// settings 'config' (which may be NULL), given that permitted by
+// the options.
+inline float TunedFastMathError(const TuningConfig *config, float error)
+{
+    return config && !config->fastMath ? 0.0f : error;
+}
+
+// Selects the block size of 'config' (if not NULL) for the kernels
+// called from this thread for the lifetime of the scope.
+class TuningScope
+{
+public:
+    explicit TuningScope(const TuningConfig *config)
+        : previous(ThreadKernelBlockPixels())
+    {
+        if(config) ThreadKernelBlockPixels()=config->blockPixels;
+    }
+    ~TuningScope() {ThreadKernelBlockPixels()=previous;}
+private:
+    int previous;
+    TuningScope(const TuningScope &);
+    TuningScope &operator=(const TuningScope &);
+};
+
+// Times 'stage(target, source, fastMath)' with the given settings,
+// taking the best of three runs after a first run to warm up.
+template<class Stage>
+double TimeTuning(Stage &stage, const cv::Mat &target,
+                  const cv::Mat &source, const TuningConfig &config)
+{
+    double best=0;
+    ApplyTuning(config);
+    stage(target, source, config.fastMath);
+    for(int run=0;run<3;run++)
+    {
+        std::chrono::steady_clock::time_point t0=
+            std::chrono::steady_clock::now();
+        stage(target, source, config.fastMath);
+        double seconds=std::chrono::duration<double>(
+                       std::chrono::steady_clock::now()-t0).count();
+        if(run==0 || seconds<best) best=seconds;
+    }
+    return best;
+}
+
+// Tunes 'variant' for each image size bucket and saves the results.
+// 'stage' performs the colour transfer of a float BGR target image
+// (the fast functions being used if 'fastMath' is set) and the
+// choice of functions is only tuned if 'hasFastMath' is set.  The
+// thread count, then the block size and then the functions are
+// tuned in turn, each with the best of the settings before it.
+template<class Stage>
+void RunTuner(const std::string &variant, Stage stage, bool hasFastMath,
+              const std::string &filename=TuningFileName)
+{
+    int cpus=cv::getNumberOfCPUs();
+    std::vector<int> threads;
+    for(int n=1;n<cpus;n*=2) threads.push_back(n);
+    threads.push_back(cpus);
+    const int blocks[]={4096, 8192, 16384, 32768, 65536, 131072, 262144};
+
+    std::cout<<"Tuning "<<variant<<" for "<<CpuModel()<<"\n";
+    for(int bucket=0;bucket<TuningBuckets;bucket++)
+    {
+        // Synthetic images of random colours.
+        cv::Mat target(TuningHeight[bucket], TuningWidth[bucket], CV_32FC3);
+        cv::Mat source(TuningHeight[bucket]/2, TuningWidth[bucket]/2,
+                       CV_32FC3);
+        cv::randu(target, cv::Scalar::all(0.02), cv::Scalar(0.9, 0.8, 1.0));
+        cv::randu(source, cv::Scalar::all(0.02), cv::Scalar(1.0, 0.6, 0.7));
+
+        TuningConfig best, trial;
+        best.fastMath=false;
+        best.seconds=TimeTuning(stage, target, source, best);
+        for(size_t i=0;i<threads.size();i++)
+        {
+            trial=best;
+            trial.threads=threads[i];
+            trial.seconds=TimeTuning(stage, target, source, trial);
+            if(trial.seconds<best.seconds) best=trial;
+        }
+        for(size_t i=0;i<sizeof(blocks)/sizeof(blocks[0]);i++)
+        {
+            trial=best;
+            trial.blockPixels=blocks[i];
+            trial.seconds=TimeTuning(stage, target, source, trial);
+            if(trial.seconds<best.seconds) best=trial;
+        }
+        if(hasFastMath)
+        {
+            trial=best;
+            trial.fastMath=true;
+            trial.seconds=TimeTuning(stage, target, source, trial);
+            if(trial.seconds<best.seconds) best=trial;
+        }
+
+        std::cout<<"  "<<target.cols<<" x "<<target.rows<<": "
+                 <<best.threads<<" threads, blocks of "<<best.blockPixels
+                 <<" pixels, "<<(best.fastMath ? "fast" : "exact")
+                 <<" functions, "<<best.seconds<<" s\n";
+        if(!SaveTuning(variant, bucket, best, filename))
+            std::cout<<"Cannot write tuning file "<<filename<<"\n";
+    }
+    ApplyTuning(TuningConfig());
+}
+
+#endif
@@ -0,0 +1,495 @@
+//*** SHARED WORK MANIFEST FOR MULTI-PROCESS BATCH PROCESSING
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// A batch list (see 'ReadBatchList' in 'Pipeline.hpp') may be
+// shared by any number of processes, on one machine or on several
+// machines sharing a file system, each of which runs the usual
+// three stage pipeline over the items that it claims.  The items
+// are claimed in chunks through files in the folder
+// '<batch list>.work':
+//
+//   <chunk>.lease   held by the process working on the chunk.  Its
+//                   first line names the process and a line is
+//                   added as each item is finished ('D <index>', or
+//                   'F <index>' if it failed).
+//   <chunk>.done    the lease, renamed once the chunk is finished.
+//   <host>.<pid>.log   each process's log of its chunks, their
+//                   throughput and its failed items.
+//
+// A lease is written under a temporary name and then moved into
+// place by an operation which fails if the lease already exists
+// (a hard link, or a move without replacement on Windows), so only
+// one process can claim a chunk.  The holder renews the lease (its
+// modification time) regularly while working.  A lease which has
+// not been renewed for 'leaseSeconds' is taken to belong to a
+// process which has stopped: another process renames it away
+// (which only one can do), replaces it with its own lease carrying
+// over the items already finished, and works on the rest.  So a
+// rerun, or the surviving processes, resume after a crash without
+// redoing finished items; a process which finds only chunks leased
+// by others waits for them to be finished or abandoned.  The lease
+// time must be well above any difference between the clocks of the
+// machines.  Failed items are logged and are not retried.
+//
+// A process which stalls for longer than the lease time may find
+// that its chunk has been taken over, so it never trusts the lease
+// file by name alone.  Each item record is appended only after
+// checking, through the same open file, that the first line still
+// names the process and (except on Windows) that the file is still
+// the lease.  A chunk is finished by first renaming the lease to a
+// name of the process's own and then checking its first line, and
+// the lease is put back if another process holds it.  The lease is
+// renewed only while it names the process.  So a stalled process
+// drops its records, and its later items are redone by the new
+// holder, rather than writing to the new holder's lease or marking
+// the chunk finished under it.
+
+#ifndef WORKMANIFEST_HPP
+#define WORKMANIFEST_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "Pipeline.hpp"
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+struct ShardSettings
+{
+    int    chunkItems;      // Items claimed together.
+    double leaseSeconds;    // Time after which a lease is abandoned.
+    ShardSettings() : chunkItems(64), leaseSeconds(600) {}
+};
+
+// Result of a claim.
+enum ShardClaim {ShardClaimed, ShardBusy, ShardFinished};
+
+// Name of this process, unique among those sharing the manifest.
+inline std::string ShardOwner()
+{
+    std::ostringstream name;
+#ifdef _WIN32
+    const char *host=getenv("COMPUTERNAME");
+    name<<(host ? host : "host")<<"."<<_getpid();
+#else
+    char host[256]="host";
+    gethostname(host, sizeof(host)-1);
+    host[sizeof(host)-1]=0;
+    name<<host<<"."<<getpid();
+#endif
+    return name.str();
+}
+
+// Moves 'from' to 'to' unless 'to' exists.  Returns false if it
+// exists (or the move fails).
+inline bool MoveExclusive(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), 0)!=0;
+#else
+    if(link(from.c_str(), to.c_str())!=0) return false;
+    unlink(from.c_str());
+    return true;
+#endif
+}
+
+// Appends a line to file 'path' if its first line is 'header'.
+// Returns false if the file no longer exists, has another first line
+// or (except on Windows) has been renamed since it was opened.
+inline bool AppendIfHeader(const std::string &path,
+                           const std::string &header,
+                           const std::string &line)
+{
+    std::string expected=header+"\n", first(expected.size(), 0);
+    std::string text=line+"\n";
+#ifdef _WIN32
+    int fd=_open(path.c_str(), _O_RDWR|_O_APPEND|_O_BINARY);
+    if(fd<0) return false;
+    bool ok=_read(fd, &first[0], (unsigned)first.size())==
+                (int)first.size() && first==expected &&
+            _write(fd, text.data(), (unsigned)text.size())==
+                (int)text.size();
+    _close(fd);
+#else
+    int fd=open(path.c_str(), O_RDWR|O_APPEND);
+    if(fd<0) return false;
+    struct stat opened, named;
+    bool ok=pread(fd, &first[0], first.size(), 0)==(ssize_t)first.size() &&
+            first==expected && fstat(fd, &opened)==0 &&
+            stat(path.c_str(), &named)==0 &&
+            opened.st_dev==named.st_dev && opened.st_ino==named.st_ino &&
+            write(fd, text.data(), text.size())==(ssize_t)text.size();
+    close(fd);
+#endif
+    return ok;
+}
+
+// Whether the first line of file 'path' is 'header'.
+inline bool HasHeader(const std::string &path, const std::string &header)
+{
+    std::ifstream in(path.c_str());
+    std::string first;
+    return std::getline(in, first) && first==header;
+}
+
+inline bool FileExists(const std::string &path)
+{
+    struct stat info;
+    return stat(path.c_str(), &info)==0;
+}
+
+class WorkManifest
+{
+public:
+    WorkManifest(const std::string &manifest, size_t count,
+                 const ShardSettings &shard)
+        : directory(manifest+".work"), owner(ShardOwner()), items(count),
+          settings(shard), chunk(-1), lost(false), carried(0),
+          finished(0), failed(0), processed(0), seconds(0)
+    {
+        settings.chunkItems=std::max(1, settings.chunkItems);
+        chunks=(items+settings.chunkItems-1)/settings.chunkItems;
+        // (Processes start their search at different chunks.)
+        size_t h=0;
+        for(size_t i=0;i<owner.size();i++) h=h*131+(unsigned char)owner[i];
+        cursor=chunks ? h%chunks : 0;
+    }
+
+    // Creates the folder and checks that the manifest has the same
+    // items and chunks as when it was first used.
+    bool Open()
+    {
+#ifdef _WIN32
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0777);
+#endif
+        std::ostringstream layout;
+        layout<<items<<" items in chunks of "<<settings.chunkItems;
+        std::string path=directory+"/layout", temporary=path+"."+owner;
+        {
+            std::ofstream out(temporary.c_str());
+            out<<layout.str()<<"\n";
+        }
+        if(!MoveExclusive(temporary, path)) remove(temporary.c_str());
+        std::ifstream in(path.c_str());
+        std::string line;
+        std::getline(in, line);
+        if(line!=layout.str())
+        {
+            printf("%s was made for %s, not %s\n", directory.c_str(),
+                   line.c_str(), layout.str().c_str());
+            return false;
+        }
+        log.open((directory+"/"+owner+".log").c_str(), std::ios::app);
+        return true;
+    }
+
+    // Claims an unfinished chunk and returns its unfinished items in
+    // 'pending'.  (The lease state is shared with 'Renew', which is
+    // called from the heartbeat thread, so it is updated with 'mutex'
+    // held.)
+    ShardClaim Claim(std::vector<size_t> &pending)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool busy=false;
+        for(size_t n=0;n<chunks;n++)
+        {
+            size_t k=(cursor+n)%chunks;
+            if(FileExists(ChunkPath(k, ".done"))) continue;
+            std::set<size_t> done;
+            if(!TryLease(k, done)) {busy=true; continue;}
+
+            cursor=(k+1)%chunks;
+            chunk=(long)k;
+            lost=false;
+            carried=done.size();
+            start=std::chrono::steady_clock::now();
+            pending.clear();
+            size_t end=std::min(items, (k+1)*settings.chunkItems);
+            for(size_t i=k*settings.chunkItems;i<end;i++)
+                if(!done.count(i)) pending.push_back(i);
+            return ShardClaimed;
+        }
+        return busy ? ShardBusy : ShardFinished;
+    }
+
+    // Records that item 'index' of the current chunk is finished.
+    // (May be called from several threads.)
+    void Finished(size_t index, bool ok, const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream line;
+        line<<(ok ? "D " : "F ")<<index;
+        if(!lost && !AppendIfHeader(ChunkPath(chunk, ".lease"), Header(),
+                                    line.str()))
+            Lost();
+        processed++;
+        if(!ok)
+        {
+            failed++;
+            log<<"failed item "<<index<<": "<<name<<"\n";
+        }
+        log.flush();
+    }
+
+    // Marks the current chunk as finished.
+    void Complete()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(chunk<0) return;
+        double s=std::chrono::duration<double>(
+                 std::chrono::steady_clock::now()-start).count();
+        size_t first=(size_t)chunk*settings.chunkItems;
+        size_t done=std::min(items, first+settings.chunkItems)-first;
+        if(!lost && !ReleaseLease()) Lost();
+        seconds+=s;
+        finished++;
+        char text[160];
+        snprintf(text, sizeof(text), "chunk %ld: %zu items (%zu already "
+                 "done) in %.1f s, %.2f images/s\n", chunk, done, carried,
+                 s, (done-carried)/std::max(s, 1e-9));
+        log<<text;
+        log.flush();
+        chunk=-1;
+    }
+
+    // Renews the lease of the current chunk.
+    void Renew()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(chunk<0 || lost) return;
+        std::string lease=ChunkPath(chunk, ".lease");
+        if(HasHeader(lease, Header())) utime(lease.c_str(), NULL);
+        else Lost();
+    }
+
+    // Writes the totals for this process to its log and the console.
+    void Summarise()
+    {
+        char text[200];
+        snprintf(text, sizeof(text), "%s: %zu chunks, %zu images (%zu "
+                 "failed) in %.1f s, %.2f images/s\n", owner.c_str(),
+                 finished, processed, failed, seconds,
+                 processed/std::max(seconds, 1e-9));
+        log<<text;
+        log.flush();
+        printf("%s", text);
+    }
+
+    double LeaseSeconds() const {return settings.leaseSeconds;}
+
+private:
+    std::string ChunkPath(size_t k, const char *suffix) const
+    {
+        std::ostringstream path;
+        path<<directory<<"/"<<k<<suffix;
+        return path.str();
+    }
+
+    // The first line of this process's leases.
+    std::string Header() const {return "owner "+owner;}
+
+    // Records that the lease of the current chunk has been taken
+    // over.  (Called with 'mutex' held.)
+    void Lost()
+    {
+        lost=true;
+        log<<"lost the lease of chunk "<<chunk<<"\n";
+    }
+
+    // Renames the lease of the current chunk to mark it finished,
+    // unless it has been taken over.  (Called with 'mutex' held.)
+    bool ReleaseLease()
+    {
+        std::string lease=ChunkPath(chunk, ".lease");
+        std::string temporary=lease+"."+owner;
+        if(rename(lease.c_str(), temporary.c_str())!=0) return false;
+        if(!HasHeader(temporary, Header()))
+        {
+            if(!MoveExclusive(temporary, lease)) remove(temporary.c_str());
+            return false;
+        }
+        return rename(temporary.c_str(),
+                      ChunkPath(chunk, ".done").c_str())==0;
+    }
+
+    // Takes the lease of chunk 'k', reading the items already
+    // finished into 'done' if it was abandoned.  (Called with 'mutex'
+    // held.)
+    bool TryLease(size_t k, std::set<size_t> &done)
+    {
+        std::string lease=ChunkPath(k, ".lease");
+        std::string temporary=lease+"."+owner;
+        std::vector<std::string> records;
+        struct stat info;
+        if(stat(lease.c_str(), &info)==0)
+        {
+            if(difftime(time(NULL), info.st_mtime)<settings.leaseSeconds)
+                return false;
+            // (Only one process can rename the abandoned lease.  It is
+            // put back if it was renewed meanwhile.)
+            if(rename(lease.c_str(), temporary.c_str())!=0) return false;
+            if(stat(temporary.c_str(), &info)==0 &&
+               difftime(time(NULL), info.st_mtime)<settings.leaseSeconds)
+            {
+                if(!MoveExclusive(temporary, lease)) remove(temporary.c_str());
+                return false;
+            }
+            std::ifstream in(temporary.c_str());
+            std::string holder, line, state;
+            std::getline(in, holder);
+            while(std::getline(in, line))
+            {
+                std::istringstream fields(line);
+                size_t index;
+                if(!(fields>>state>>index)) continue;
+                done.insert(index);
+                records.push_back(line);
+            }
+            in.close();
+            log<<"took over chunk "<<k<<" from "<<holder<<"\n";
+        }
+
+        // Write the new lease, keeping the finished items, and move
+        // it into place.
+        {
+            std::ofstream out(temporary.c_str());
+            out<<Header()<<"\n";
+            for(size_t i=0;i<records.size();i++) out<<records[i]<<"\n";
+            if(!out) return false;
+        }
+        if(!MoveExclusive(temporary, lease))
+        {
+            remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    std::string   directory, owner;
+    size_t        items, chunks, cursor;
+    ShardSettings settings;
+    std::mutex    mutex;
+    std::ofstream log;
+    long          chunk;        // Current chunk (-1 if none).
+    bool          lost;         // The current lease was taken over.
+    size_t        carried;      // Items finished by an earlier holder.
+    std::chrono::steady_clock::time_point start;
+    size_t        finished, failed, processed;
+    double        seconds;
+};
+
+inline void AddStageReport(StageReport &total, const StageReport &r)
+{
+    total.threads       =r.threads;
+    total.busySeconds  +=r.busySeconds;
+    total.pushStalls   +=r.pushStalls;
+    total.popStalls    +=r.popStalls;
+    total.stallSeconds +=r.stallSeconds;
+}
+
+// Runs the items of the batch list 'manifest' (of which 'outputs'
+// are the output names) that this process claims, chunk by chunk,
+// through 'RunPipeline' with the stage functions given, and returns
+// the combined activity report.  'succeeded(item)' tells, after
+// 'encode(item)' has returned, whether the item was processed and
+// its output written, and the item's 'index' is its position in the
+// list.  Only such items are recorded as finished ('D'), so an item
+// whose output could not be written is recorded as failed.
+template<class Item, class Decode, class Process, class Encode,
+         class Succeeded>
+PipelineReport RunShardedPipeline(const std::string &manifest,
+                                  const std::vector<std::string> &outputs,
+                                  Decode decode, Process process,
+                                  Encode encode, Succeeded succeeded,
+                                  PipelineSettings settings,
+                                  ShardSettings shard)
+{
+    PipelineReport total;
+    total.queueCapacity=0;
+    total.itemLimit=0;
+    total.items=0;
+    total.wallSeconds=0;
+    WorkManifest work(manifest, outputs.size(), shard);
+    if(!work.Open()) return total;
+
+    // Renew the lease four times in each lease period.
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stop=false;
+    std::chrono::duration<double> interval(shard.leaseSeconds/4);
+    std::thread heartbeat([&]()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(!wake.wait_for(lock, interval, [&]() {return stop;}))
+            work.Renew();
+    });
+
+    std::vector<size_t> pending;
+    ShardClaim claim;
+    while((claim=work.Claim(pending))!=ShardFinished)
+    {
+        if(claim==ShardBusy)
+        {
+            // Wait for other processes to finish, or abandon, their
+            // chunks.
+            std::this_thread::sleep_for(std::chrono::duration<double>(
+                std::min(std::max(shard.leaseSeconds/4, 1.0), 60.0)));
+            continue;
+        }
+        PipelineReport report=RunPipeline<Item>(pending.size(),
+            [&](size_t i) {return decode(pending[i]);},
+            process,
+            [&](Item &item)
+            {
+                size_t index=(size_t)item.index;
+                encode(item);
+                work.Finished(index, succeeded(item), outputs[index]);
+            },
+            settings);
+        work.Complete();
+
+        AddStageReport(total.decode,   report.decode);
+        AddStageReport(total.transfer, report.transfer);
+        AddStageReport(total.encode,   report.encode);
+        total.queueCapacity=report.queueCapacity;
+        total.itemLimit=report.itemLimit;
+        total.items+=report.items;
+        total.wallSeconds+=report.wallSeconds;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop=true;
+    }
+    wake.notify_all();
+    heartbeat.join();
+    work.Summarise();
+    return total;
+}
+
+#endif
@@ -8,26 +8,118 @@
 
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/photo/photo.hpp>
+#include "../Common/Batch.hpp"
+#include "../Common/ImageIO.hpp"
+#include "../Common/Statistics.hpp"
+#include "../Common/TransferKernel.hpp"
+#include "../Common/MemoryTracker.hpp"
+#include "../Common/PerfCounters.hpp"
+#include "../Common/StripScheduler.hpp"
+#include "../Common/Tuning.hpp"
+#include "../Common/Deadline.hpp"
+#include "../Common/ResultCache.hpp"
+#include "../Common/MaskRegion.hpp"
+#include "../Common/Moments.hpp"
+#include "../Common/Cancellation.hpp"
+#include <iostream>
+#include <fstream>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <cfloat>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <sstream>
 
 // Declare functions
+cv::Mat ColourTransfer(cv::Mat targetf, cv::Mat sourcef,
+                       float CrossCovarianceLimit,
+                       int   ReshapingIterations,
+                       float ReshapingTolerance,
+                       bool  HistogramReshaping,
+                       float PercentSaturationShift,
+                       float PercentShadingShift,
+                       bool  ExtraShading,
+                       float PercentTint,
+                       float PercentModified,
+                       float FastMathError,
+                       int  *ReshapingIterationsUsed=NULL);
 cv::Mat CoreProcessing(cv::Mat targetf, cv::Mat sourcef,
                        float CrossCovarianceLimit,
                        int   ReshapingIterations,
-                       float ShaderVal);
-cv::Mat adjust_covariance(cv::Mat Lab[3], cv::Mat sLab[3],
-                          float covLim);
-cv::Mat ChannelCondition(cv::Mat tChan, cv::Mat sChan);
+                       float ReshapingTolerance,
+                       bool  HistogramReshaping,
+                       float ShaderVal,
+                       float FastMathError,
+                       int  *ReshapingIterationsUsed=NULL);
+void adjust_covariance(cv::Mat Lab[3], cv::Mat sLab[3],
+                       float covLim);
+cv::Mat ChannelCondition(cv::Mat tChan, const TailMoments &sTails,
+                         float &shift);
+cv::Mat HistogramMatch(cv::Mat tChan, cv::Mat sChan);
+std::vector<double> ChannelCdf(cv::Mat Chan, int bins, float range);
 cv::Mat SaturationProcessing(cv::Mat targetf, cv::Mat savedtf,
                              float SatVal);
 cv::Mat FullShading(cv::Mat targetf, cv::Mat savedtf, cv::Mat sourcef,
                     bool ExtraShading, float ShadeVal);
 cv::Mat FinalAdjustment(cv::Mat targetf, cv::Mat savedtf,
                         float TintVal, float ModifiedVal);
-cv::Mat convertTolab  (cv::Mat input);
-cv::Mat convertFromlab(cv::Mat input);
-
-
-
+cv::Mat StripRefinements(cv::Mat targetf, cv::Mat savedtf, cv::Mat greys,
+                         float SatVal, bool ExtraShading, float ShaderVal,
+                         float TintVal, float ModifiedVal);
+bool SelectRegions(cv::Mat &targetf, cv::Mat &sourcef, cv::Mat &fulltargetf,
+                   MaskRegion &tregion, std::string targetname,
+                   std::string sourcename,
+                   std::string TargetMaskName, cv::Rect TargetRegion,
+                   std::string SourceMaskName, cv::Rect SourceRegion,
+                   bool bottomUp);
+bool FindImageRegion(cv::Mat image, std::string imagename,
+                     std::string maskname, cv::Rect roi, bool bottomUp,
+                     MaskRegion &region);
+
+// Version of the processing, for the result cache key.  Increase it
+// whenever a change to the program changes its output, so that
+// results cached by earlier versions are no longer used.
+const int EnhancedOutputVersion = 1;
+
+// A work item for batch processing.
+struct EnhancedBatchItem : BatchItem
+{
+    std::string cachekey;   // Empty if the result is not to be cached.
+    bool        cached;     // Output taken from the result cache.
+    cv::Mat     fulltargetf;    // Whole target if a region is selected.
+    MaskRegion  region;         // The selected target region.
+    EnhancedBatchItem() : cached(false) {}
+};
+
+
+cv::Mat DeadlineTransfer(cv::Mat targetf, cv::Mat sourcef,
+                         float CrossCovarianceLimit,
+                         int   ReshapingIterations,
+                         float ReshapingTolerance,
+                         bool  HistogramReshaping,
+                         float PercentSaturationShift,
+                         float PercentShadingShift,
+                         bool  ExtraShading,
+                         float PercentTint,
+                         float PercentModified,
+                         float FastMathError,
+                         double DeadlineSeconds,
+                         DeadlinePlan &plan);
+DeadlineCosts &CalibrateDeadlineCosts(bool  HistogramReshaping,
+                                      float PercentSaturationShift,
+                                      float PercentShadingShift,
+                                      bool  ExtraShading,
+                                      float PercentTint,
+                                      float PercentModified,
+                                      float FastMathError);
+
+
+
+// (When built into the shared library, see 'Library/ColourTransfer.h',
+// only the processing routines are needed.)
+#ifndef COLOURTRANSFER_LIBRARY
 int main(int argc, char *argv[])
 {
 //  Transfers the colour distribution from the source image to the
@@ -56,7 +148,12 @@ int main(int argc, char *argv[])
 //  The number of iterative adjustments can be specified for this
 //  'reshaping' option. A zero value specifies no reshaping processing
 //  and a non-zero value specifies the total number of reshaping
-//  iterations to be implemented.
+//  iterations to be implemented.  Alternatively, a tolerance may be
+//  specified so that the number of iterations becomes a maximum and
+//  reshaping stops once the distributions match.  As a faster
+//  alternative, the distributions may instead be matched exactly
+//  in a single step by histogram matching.
+//  (See the note at the end of the code).
 
 //  OPTION 3
 //  There is an option to pare back excess colour saturation
@@ -81,6 +178,85 @@ int main(int argc, char *argv[])
 //  There is an option to mix the final image with the initial image,
 //  so that only part modification occurs.
 
+//  OPTION 8
+//  There is an option to decode the source image at reduced
+//  resolution.  The source image contributes only its global
+//  statistics, so a large source image may be decoded at 1/2,
+//  1/4 or 1/8 scale.  The decoder averages the pixels, which
+//  lowers the standard deviations by an amount that depends on the
+//  image, so the change in the statistics may be reported.  The
+//  source image is decoded in full by default.
+//  (See the notes in 'Common/ImageIO.hpp').
+
+//  OPTION 9
+//  There is an option to select the bit depth of the output
+//  image (8 bit, 16 bit or 32 bit float) or to match the bit
+//  depth of the target image.  16 bit and float target images
+//  are processed at full precision.
+//  (See the notes in 'Common/ImageIO.hpp').
+
+//  OPTION 10
+//  There is an option to compute the image statistics
+//  deterministically, so that the output image is bit-identical
+//  whatever the number of processor threads.
+//  (See the note at the end of the code).
+
+//  OPTION 11
+//  There is an option to compute the logarithms and powers of ten
+//  in the L-alpha-beta transforms with fast approximations, within
+//  a specified maximum error in the output, and to report the
+//  error actually obtained.  The exact functions are the default.
+//  (See the note at the end of the code).
+
+//  OPTION 12
+//  There is an option to track the memory allocated for images
+//  and to report, for each image, the allocation counts and the
+//  allocated, peak and live memory of each processing stage.
+//  (See the note at the end of the code).
+
+//  OPTION 13
+//  There is an option to use the processing thread count, block
+//  size and choice of exact or fast functions found to be fastest
+//  for this machine and the image size, when the program has been
+//  run with the argument '--tune'.
+//  (See the note at the end of the code).
+
+//  OPTION 14
+//  There is an option to set a deadline for the processing of each
+//  image.  The processing is then reduced as necessary, according
+//  to the processing times measured on this machine, so that the
+//  deadline is met, and the reductions made are reported.
+//  (See the note at the end of the code).
+
+//  OPTION 15
+//  There is an option to keep the output images in a cache on local
+//  disk, so that when the same target and source images are processed
+//  again with the same options, the output is taken from the cache
+//  without any processing.
+//  (See the note at the end of the code).
+
+//  OPTION 16
+//  There is an option to restrict the colour transfer to a region of
+//  the target image and to take the source statistics from a region
+//  of the source image, each selected by a mask image (non-zero
+//  pixels are selected) and/or a rectangle.  Only the selected pixels
+//  are processed.
+//  (See the note at the end of the code).
+
+//  OPTION 17
+//  There is an option to apply the image refinements (Options 3 and
+//  5 to 7) to cache sized strips of the image in turn, rather than
+//  as a succession of whole image stages, and to report a model of
+//  the memory traffic saved.
+//  (See the note at the end of the code).
+
+//  OPTION 18
+//  There is an option to read the processor's hardware performance
+//  counters (Linux only) and to report, for each processing stage,
+//  the cycles and memory traffic per pixel, the instructions per
+//  cycle and whether the stage is limited by compute or by memory.
+//  (See the note at the end of the code).
+
 // ##########################################################################
 // #######################  PROCESSING SELECTIONS  ##########################
 // ##########################################################################
@@ -89,19 +265,50 @@ int main(int argc, char *argv[])
 
     float CrossCovarianceLimit     = 0.5;    // Option 1 (Default is '0.5')
     int   ReshapingIterations      = 1;      // Option 2 (Default is '1')
+    float ReshapingTolerance       = 0.0;    // Option 2 (Default is 0.0)
+    bool  HistogramReshaping       = false;  // Option 2 (Default is 'false')
     float PercentSaturationShift   = -1.0;   // Option 3 (Default is -1.0)
     float PercentShadingShift      = 50.0;   // Option 4 (Default is 50.0)
     bool  ExtraShading             = true;   // Option 5 (Default is 'true')
     float PercentTint              = 100.0;  // Option 6 (Default is 100.0)
     float PercentModified          = 100.0;  // Option 7 (Default is 100.0)
+    float SourceAccuracy           = 0.0;    // Option 8 (Default is 0.0)
+    bool  ReportDecodeDrift        = false;  // Option 8 (Default is 'false')
+    int   OutputDepth              = 0;      // Option 9 (Default is 0)
+    bool  DeterministicStatistics  = false;  // Option 10 (Default is 'false')
+    float FastMathError            = 0.0;    // Option 11 (Default is 0.0)
+    bool  ReportFastMathError      = false;  // Option 11 (Default is 'false')
+    bool  TrackMemory              = false;  // Option 12 (Default is 'false')
+    bool  UseMachineTuning         = true;   // Option 13 (Default is 'true')
+    double DeadlineSeconds         = 0.0;    // Option 14 (Default is 0.0)
+    std::string ResultCacheDir     = "";     // Option 15 (Default is "")
+    double ResultCacheMB           = 1024;   // Option 15 (Default is 1024)
+    std::string TargetMaskName     = "";     // Option 16 (Default is "")
+    cv::Rect TargetRegion          = cv::Rect(); // Option 16 (Default is empty)
+    std::string SourceMaskName     = "";     // Option 16 (Default is "")
+    cv::Rect SourceRegion          = cv::Rect(); // Option 16 (Default is empty)
+    bool  StripScheduling          = false;  // Option 17 (Default is 'false')
+    bool  HardwareCounters         = false;  // Option 18 (Default is 'false')
 
    //  Setting CrossCovarianceLimit to 0.0 inhibits cross covariance processing.
    //  Setting ReshapingIterations to 0, inhibits reshaping processing.
+   //  Setting ReshapingTolerance above 0, stops reshaping once converged.
+   //  Setting HistogramReshaping to 'true', reshapes by histogram matching.
    //  Setting PercentShadingShift to 0, retains the target image saturation.
    //  Setting PercentShadingShift to 0, retains the target image shading.
    //  Setting ExtraShading to 'false' reverts to simple shading.
    //  Setting PercentTint to '0', gives a monochrome image.
    //  Setting PercentModified to '0', retains the target image in full.
+   //  Setting SourceAccuracy to 0.0, decodes the source image in full.
+   //  Setting OutputDepth to 0, matches the bit depth of the target image.
+   //  Setting FastMathError to 0, uses the exact L-alpha-beta transforms.
+   //  (Otherwise it is the permitted output error, for example 0.5/255.)
+   //  Setting DeadlineSeconds to 0, sets no deadline.
+   //  Setting ResultCacheDir to "", uses no result cache.
+   //  Setting a mask name to "" and its region empty, selects the whole image.
+   //  (A region is given as cv::Rect(x, y, width, height) in pixels.)
+   //  Setting StripScheduling to 'true', refines the image in strips.
+   //  Setting HardwareCounters to 'true', reports counters for each stage.
 
    //  For each of the percentage parameters, defined above, a setting of '100'
    //  allows the full processing effect.  A setting of '0' suppresses the
@@ -120,177 +327,828 @@ int main(int argc, char *argv[])
 
     std::string targetname = "images/Flowers_target.jpg";
     std::string sourcename = "images/Flowers_source.jpg";
+    std::string outputname = "images/processed.jpg";
+
+   // For batch processing, specify a list file in which each
+   // line gives a target, a source and an output file name.
+   // The files are then processed in a pipeline in which
+   // decoding, colour transfer and encoding run concurrently.
+   // (Leave 'batchname' empty to process the single image above.)
+   // (See the notes in 'Common/Batch.hpp'.)
+
+    std::string batchname = "";
+    int    DecodeThreads      = 2;     // Threads reading images.
+    int    TransferThreads    = 2;     // Threads transferring colour.
+    int    EncodeThreads      = 2;     // Threads writing images.
+    double MemoryBudgetMB     = 1024;  // Memory for images in flight.
+    bool   ShardedBatch       = false; // Share the list between processes.
+    double LeaseSeconds       = 600;   // Time before a stopped process's
+                                       // items are taken over.
+    int    ShardChunkItems    = 64;    // Items claimed at a time.
 
 // ###########################################################################
 // ###########################################################################
 // ###########################################################################
 
-    // Read in the images and convert to floating point,
-    // saving a copy of the target image for later.
-    cv::Mat target = cv::imread(targetname, 1);
-    cv::Mat source = cv::imread(sourcename, 1);
+    if(HardwareCounters) EnableHardwareCounters();
+    SetDeterministicStatistics(DeterministicStatistics);
+    SetStripScheduling(StripScheduling);
+    if(TrackMemory) EnableMemoryTracking();
+
+    // Tune the processing for this machine if requested.
+    if(argc>1 && std::string(argv[1])=="--tune")
+    {
+        RunTuner("Enhanced",
+                 [&](const cv::Mat &t, const cv::Mat &s, bool fastMath)
+        {
+            ColourTransfer(t, s, CrossCovarianceLimit, ReshapingIterations,
+                           ReshapingTolerance, HistogramReshaping,
+                           PercentSaturationShift, PercentShadingShift,
+                           ExtraShading, PercentTint, PercentModified,
+                           fastMath ? TuningFastMathError : 0.0f);
+        }, true);
+        return 0;
+    }
+
+    // The fast functions are only used (within the permitted error)
+    // if they are the faster on this machine.
+    TuningConfig tuning;
+
+    // The result cache.  Its key includes a description of every
+    // option affecting the output and the version of the output.
+    ResultCache cache;
+    cache.directory=ResultCacheDir;
+    cache.maxBytes=ResultCacheMB*1048576;
+    auto cachesettings=[&](int depth, const MaskRegion &region,
+                           float fastMathError)
+    {
+        uint64_t spans=region.pixels;
+        for(size_t i=0;i<region.spans.size();i++)
+        {
+            int span[3]={region.spans[i].y, region.spans[i].x0,
+                         region.spans[i].x1};
+            spans=HashBytes(span, sizeof(span), spans);
+        }
+        std::ostringstream settings;
+        settings.precision(9);
+        settings<<"Enhanced "<<EnhancedOutputVersion<<" "
+                <<CrossCovarianceLimit<<" "<<ReshapingIterations<<" "
+                <<ReshapingTolerance<<" "<<HistogramReshaping<<" "
+                <<PercentSaturationShift<<" "<<PercentShadingShift<<" "
+                <<ExtraShading<<" "<<PercentTint<<" "<<PercentModified<<" "
+                <<DeterministicStatistics<<" "<<fastMathError<<" "<<depth
+                <<" "<<spans<<" "<<StripScheduling;
+        return settings.str();
+    };
+
+    if(!batchname.empty())
+    {
+        std::vector<std::string> targets, sources, outputs;
+        if(!ReadBatchList(batchname, targets, sources, outputs)) return 1;
+
+        // The tuned settings are chosen for each image's own size.
+        BatchTuning batchtuning;
+        bool tuned=UseMachineTuning && batchtuning.Load("Enhanced");
+
+        // Measure the processing costs before any image is started,
+        // so that no image pays for the measurement within its own
+        // deadline.
+        if(DeadlineSeconds>0)
+            CalibrateDeadlineCosts(HistogramReshaping, PercentSaturationShift,
+                                   PercentShadingShift, ExtraShading,
+                                   PercentTint, PercentModified,
+                                   FastMathError);
+
+        BatchSettings batch;
+        batch.listname       =batchname;
+        batch.decodeThreads  =DecodeThreads;
+        batch.transferThreads=TransferThreads;
+        batch.encodeThreads  =EncodeThreads;
+        batch.memoryBudgetMB =MemoryBudgetMB;
+        batch.sharded        =ShardedBatch;
+        batch.leaseSeconds   =LeaseSeconds;
+        batch.chunkItems     =ShardChunkItems;
+        batch.tuning         =tuned ? &batchtuning : NULL;
+
+        auto decode=[&](EnhancedBatchItem &item, size_t i)
+        {
+            // (The processing needs a PFM target in BGR order.)
+            item.targetf=CopyMappedImage(item.targetf, item.mapped);
+            float error=TunedFastMathError(item.tuning, FastMathError);
+            item.sourcef=ConvertToFloat(
+                         ReadSourceImage(LalphabetaSpace(1.0/255, error),
+                                         sources[i], SourceAccuracy,
+                                         ReportDecodeDrift));
+            return !item.sourcef.empty() &&
+                   SelectRegions(item.targetf, item.sourcef,
+                                 item.fulltargetf, item.region,
+                                 targets[i], sources[i],
+                                 TargetMaskName, TargetRegion,
+                                 SourceMaskName, SourceRegion,
+                                 !item.mapped.image.empty());
+        };
+        auto transfer=[&](EnhancedBatchItem &item)
+        {
+            float error=TunedFastMathError(item.tuning, FastMathError);
+            if(!cache.directory.empty())
+            {
+                item.cachekey=ResultCacheKey(item.fulltargetf.empty()
+                                             ? item.targetf
+                                             : item.fulltargetf,
+                                             item.sourcef,
+                                  cachesettings(OutputDepth==0
+                                                ? item.targetdepth
+                                                : OutputDepth,
+                                                item.region, error));
+                item.cached=ResultCacheFetch(cache, item.cachekey,
+                                             item.outputname);
+                if(item.cached) return;
+            }
+            cv::Mat exact;
+            if(ReportFastMathError && error>0)
+                exact=ColourTransfer(item.targetf, item.sourcef,
+                                     CrossCovarianceLimit,
+                                     ReshapingIterations,
+                                     ReshapingTolerance,
+                                     HistogramReshaping,
+                                     PercentSaturationShift,
+                                     PercentShadingShift,
+                                     ExtraShading,
+                                     PercentTint,
+                                     PercentModified, 0.0);
+            DeadlinePlan plan;
+            item.targetf=DeadlineTransfer(item.targetf, item.sourcef,
+                                          CrossCovarianceLimit,
+                                          ReshapingIterations,
+                                          ReshapingTolerance,
+                                          HistogramReshaping,
+                                          PercentSaturationShift,
+                                          PercentShadingShift,
+                                          ExtraShading,
+                                          PercentTint,
+                                          PercentModified, error,
+                                          DeadlineSeconds, plan);
+            // (Reduced results are not cached.)
+            if(DescribeDeadlinePlan(plan, ReshapingIterations)!="none")
+                item.cachekey.clear();
+            if(DeadlineSeconds>0)
+                std::cout<<item.outputname<<": reductions: "
+                         <<DescribeDeadlinePlan(plan,
+                                                ReshapingIterations)
+                         <<" ("<<plan.actualSeconds<<" s"
+                         <<(plan.missed ? ", deadline missed" : "")
+                         <<")\n";
+            if(ReshapingTolerance>0)
+                std::cout<<item.outputname
+                         <<": reshaping iterations used: "
+                         <<plan.reshapingIterationsUsed<<"\n";
+            if(!exact.empty())
+                PrintFastMathError(item.outputname, exact,
+                                   item.targetf,
+                                   LalphabetaSpace(1.0/255, error),
+                                   error);
+        };
+        auto encode=[&](EnhancedBatchItem &item)
+        {
+            if(item.cached)
+                std::cout<<item.outputname<<": taken from the cache\n";
+            else
+            {
+                // Put the processed region back in the target.
+                if(!item.fulltargetf.empty())
+                {
+                    ScatterRegion(item.targetf, item.region,
+                                  item.fulltargetf);
+                    item.targetf=item.fulltargetf;
+                }
+                WriteBatchItem(item, OutputDepth);
+                if(!item.cachekey.empty())
+                    ResultCacheStore(cache, item.cachekey,
+                                     item.outputname);
+            }
+            item.fulltargetf.release();
+        };
+
+        RunBatch<EnhancedBatchItem>(batch, targets, outputs,
+                                    decode, transfer, encode);
+        if(DeadlineSeconds>0) CheckDeadlineRecord();
+        PrintMemoryTraffic("refinements");
+        PrintHardwareCounterReport();
+        return 0;
+    }
+
+    // Read in the images and convert to floating point.
+    // (A PFM target image is mapped and then copied, in one pass, in
+    // BGR order, which the processing needs.)
+    MappedImage mapped;
+    int targetdepth;
+    cv::Mat targetf = ReadImageFloat(targetname, mapped, targetdepth);
+    targetf = CopyMappedImage(targetf, mapped);
+    if(UseMachineTuning &&
+       SelectTuning("Enhanced", (double)targetf.total(), tuning) &&
+       !tuning.fastMath) FastMathError=0;
+    cv::Mat source  = ReadSourceImage(LalphabetaSpace(1.0/255,
+                                                      FastMathError),
+                                      sourcename, SourceAccuracy,
+                                      ReportDecodeDrift);
+    cv::Mat sourcef = ConvertToFloat(source);
+    if(OutputDepth==0) OutputDepth=targetdepth;
+    if(DeadlineSeconds>0)
+        CalibrateDeadlineCosts(HistogramReshaping, PercentSaturationShift,
+                               PercentShadingShift, ExtraShading,
+                               PercentTint, PercentModified, FastMathError);
+
+    // Restrict the transfer to the selected regions, if any.
+    cv::Mat fulltargetf;
+    MaskRegion tregion;
+    if(!SelectRegions(targetf, sourcef, fulltargetf, tregion,
+                      targetname, sourcename, TargetMaskName, TargetRegion,
+                      SourceMaskName, SourceRegion, !mapped.image.empty()))
+        return 1;
+
+    // Take the output from the cache if the same images have been
+    // processed before with the same options.
+    std::string cachekey;
+    if(!cache.directory.empty())
+    {
+        cachekey=ResultCacheKey(fulltargetf.empty() ? targetf : fulltargetf,
+                                sourcef, cachesettings(OutputDepth, tregion,
+                                                       FastMathError));
+        if(ResultCacheFetch(cache, cachekey, outputname))
+        {
+            std::cout<<"Output taken from the cache\n";
+            targetf.release();
+            fulltargetf.release();
+            UnmapImage(mapped);
+            cv::imshow("processed image",
+                       cv::imread(outputname, cv::IMREAD_UNCHANGED));
+            cv::waitKey(0);
+            return 0;
+        }
+    }
+
+    // Implement the colour transfer.
+    // (For the error report the exact result is computed first.)
+    cv::Mat exact;
+    if(ReportFastMathError && FastMathError>0)
+        exact = ColourTransfer(targetf, sourcef, CrossCovarianceLimit,
+                               ReshapingIterations, ReshapingTolerance,
+                               HistogramReshaping,
+                               PercentSaturationShift, PercentShadingShift,
+                               ExtraShading, PercentTint, PercentModified,
+                               0.0);
+    DeadlinePlan plan;
+    cv::Mat processed = DeadlineTransfer(targetf, sourcef,
+                                         CrossCovarianceLimit,
+                                         ReshapingIterations,
+                                         ReshapingTolerance,
+                                         HistogramReshaping,
+                                         PercentSaturationShift,
+                                         PercentShadingShift,
+                                         ExtraShading,
+                                         PercentTint,
+                                         PercentModified,
+                                         FastMathError,
+                                         DeadlineSeconds, plan);
+    if(DeadlineSeconds>0)
+        std::cout<<"Reductions: "
+                 <<DescribeDeadlinePlan(plan, ReshapingIterations)<<"\n"
+                 <<"Predicted "<<plan.predictedSeconds<<" s, took "
+                 <<plan.actualSeconds<<" s"
+                 <<(plan.missed ? " (deadline missed)" : "")<<"\n";
+    if(ReshapingTolerance>0)
+        std::cout<<"Reshaping iterations used: "
+                 <<plan.reshapingIterationsUsed<<"\n";
+    if(!exact.empty())
+        PrintFastMathError(targetname, exact, processed,
+                           LalphabetaSpace(1.0/255, FastMathError),
+                           FastMathError);
+
+    // Put the processed region back in the target.
+    if(!fulltargetf.empty())
+    {
+        ScatterRegion(processed, tregion, fulltargetf);
+        processed=fulltargetf;
+    }
+
+    // Save the final image in the selected bit depth and add it to
+    // the cache (unless reduced to meet a deadline).
+    cv::Mat result;
+    bool written = WriteImageFloat(outputname, processed, OutputDepth,
+                                   !mapped.image.empty(), &result);
+    if(!written) std::cout<<"Cannot write "<<outputname<<"\n";
+    else if(!cachekey.empty() &&
+            DescribeDeadlinePlan(plan, ReshapingIterations)=="none")
+        ResultCacheStore(cache, cachekey, outputname);
+    targetf.release();
+    fulltargetf.release();
+    processed.release();
+    UnmapImage(mapped);
+
+    // Report the modelled memory traffic (if refined in strips), the
+    // memory used (if tracked) and the hardware counters (if read).
+    PrintMemoryTraffic("refinements");
+    PrintMemoryReport(-1, targetname);
+    PrintHardwareCounterReport();
+
+    // Display the final image.
+    cv::imshow("processed image",result);
+
+    // Display image until a key is pressed.
+    cv::waitKey(0);
+    return written ? 0 : 1;
+   }
+#endif
 
-    cv::Mat targetf(target.size(),CV_32FC3);
-    cv::Mat sourcef(source.size(),CV_32FC3);
-    target.convertTo(targetf, CV_32FC3, 1.0/255.f);
-    source.convertTo(sourcef, CV_32FC3, 1.0/255.f);
-    cv::Mat savedtf=targetf.clone();
+
+
+cv::Mat ColourTransfer(cv::Mat targetf, cv::Mat sourcef,
+                       float CrossCovarianceLimit,
+                       int   ReshapingIterations,
+                       float ReshapingTolerance,
+                       bool  HistogramReshaping,
+                       float PercentSaturationShift,
+                       float PercentShadingShift,
+                       bool  ExtraShading,
+                       float PercentTint,
+                       float PercentModified,
+                       float FastMathError,
+                       int  *ReshapingIterationsUsed)
+{
+// Implements the colour transfer and the image refinements for
+// float BGR target and source images in accordance with the
+// processing options described in the 'main' routine.  The number
+// of reshaping iterations made is returned in
+// 'ReshapingIterationsUsed' if not NULL.
+// When run as a background job (see 'Cancellation.hpp') the
+// progress is reported, and cancellation checked, between stages.
+
+    // Keep the target image for later.  No copy is needed since
+    // the processing below never modifies its input in place.
+    cv::Mat savedtf = targetf;
 
     // Implement augmented "Reinhard Processing" in
     // L-alpha-beta colour space.
-    targetf=CoreProcessing(targetf, sourcef, CrossCovarianceLimit,
-                           ReshapingIterations,
-                           PercentShadingShift/100.0);
-    cv::cvtColor(sourcef,sourcef,CV_BGR2GRAY); // Only need mono hereafter.
+    {
+        ProgressStage stage(0.0f, 0.7f);
+        targetf=CoreProcessing(targetf, sourcef, CrossCovarianceLimit,
+                               ReshapingIterations, ReshapingTolerance,
+                               HistogramReshaping,
+                               PercentShadingShift/100.0, FastMathError,
+                               ReshapingIterationsUsed);
+    }
+    CancelPoint(0.7f);
+    cv::cvtColor(sourcef,sourcef,cv::COLOR_BGR2GRAY); // Only mono hereafter.
 
     // Implement image refinements where a change is specified.
+    if(StripSchedulingFlag())
+    {
+        targetf=StripRefinements(targetf, savedtf, sourcef,
+                                 PercentSaturationShift/100.0,
+                                 ExtraShading, PercentShadingShift/100.0,
+                                 PercentTint/100.0, PercentModified/100.0);
+        CancelPoint(1.0f);
+        return targetf;
+    }
     SaturationProcessing(targetf, savedtf,
                          PercentSaturationShift/100.0);
+    CancelPoint(0.8f);
     targetf=FullShading(targetf, savedtf, sourcef, ExtraShading,
                         PercentShadingShift/100.0);
+    CancelPoint(0.95f);
     targetf=FinalAdjustment(targetf,savedtf,
                             PercentTint/100.0,
                             PercentModified/100.0);
+    CancelPoint(1.0f);
+    return targetf;
+}
 
-    //  Convert the processed image to integer format.
-    cv::Mat result;
 
-    targetf.convertTo(result, CV_8UC3, 255.f);
-    // Display and save the final image.
-    cv::imshow("processed image",result);
-    cv::imwrite("images/processed.jpg", result);
 
-    // Display image until a key is pressed.
-    cv::waitKey(0);
-    return 0;
-   }
+cv::Mat DeadlineTransfer(cv::Mat targetf, cv::Mat sourcef,
+                         float CrossCovarianceLimit,
+                         int   ReshapingIterations,
+                         float ReshapingTolerance,
+                         bool  HistogramReshaping,
+                         float PercentSaturationShift,
+                         float PercentShadingShift,
+                         bool  ExtraShading,
+                         float PercentTint,
+                         float PercentModified,
+                         float FastMathError,
+                         double DeadlineSeconds,
+                         DeadlinePlan &plan)
+{
+// Implements 'ColourTransfer' within 'DeadlineSeconds' (no limit
+// if zero), reducing the processing as necessary according to
+// 'PlanDeadline'.  The reductions applied, and the predicted and
+// actual times, are returned in 'plan'.
+
+    std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+    DeadlineCosts *model=NULL, costs;
+    double remaining=0;
+    plan=DeadlinePlan();
+    plan.reshapingIterations=ReshapingIterations;
+    if(DeadlineSeconds>0)
+    {
+        // (The calibration counts for no progress.  It is normally
+        // made at startup, but if it is made here its time is taken
+        // from the deadline and left out of the time of the
+        // processing, by which the costs are corrected.)
+        ProgressStage stage(0.0f, 0.0f);
+        model=&CalibrateDeadlineCosts(HistogramReshaping,
+                                      PercentSaturationShift,
+                                      PercentShadingShift, ExtraShading,
+                                      PercentTint, PercentModified,
+                                      FastMathError);
+        std::chrono::steady_clock::time_point t1=
+            std::chrono::steady_clock::now();
+        remaining=DeadlineSeconds-
+                  std::chrono::duration<double>(t1-t0).count();
+        t0=t1;
+        {
+            std::lock_guard<std::mutex> lock(DeadlineCostsMutex());
+            costs=*model;
+        }
+        plan=PlanDeadline(costs, targetf.size(), sourcef.size(),
+                          ReshapingIterations, PercentSaturationShift,
+                          std::max(remaining, 0.001));
+    }
+
+    // Sample the source image for its statistics.
+    if(plan.sourceStep>1)
+        cv::resize(sourcef, sourcef,
+                   cv::Size((sourcef.cols+plan.sourceStep-1)/plan.sourceStep,
+                            (sourcef.rows+plan.sourceStep-1)/plan.sourceStep),
+                   0, 0, cv::INTER_NEAREST);
+
+    // Process a reduced copy of the target image if required.
+    cv::Mat small=targetf;
+    if(plan.pyramidLevel>0)
+        cv::resize(targetf, small,
+                   cv::Size(std::max(1, targetf.cols>>plan.pyramidLevel),
+                            std::max(1, targetf.rows>>plan.pyramidLevel)),
+                   0, 0, cv::INTER_AREA);
+
+    cv::Mat result=ColourTransfer(small, sourcef, CrossCovarianceLimit,
+                                  plan.reshapingIterations,
+                                  ReshapingTolerance, HistogramReshaping,
+                                  plan.skipSaturation ? 100.0f
+                                                      : PercentSaturationShift,
+                                  PercentShadingShift, ExtraShading,
+                                  PercentTint, PercentModified,
+                                  FastMathError,
+                                  &plan.reshapingIterationsUsed);
+
+    // Apply the change made to the reduced copy, enlarged, to the
+    // full target image.
+    if(plan.pyramidLevel>0)
+    {
+        cv::Mat change=result-small;
+        cv::resize(change, change, targetf.size(), 0, 0, cv::INTER_LINEAR);
+        result=targetf+change;
+    }
+
+    // Correct the cost model for the time actually taken and count
+    // the deadline as met or missed.
+    plan.actualSeconds=std::chrono::duration<double>(
+                       std::chrono::steady_clock::now()-t0).count();
+    if(model)
+    {
+        plan.missed=plan.actualSeconds>remaining;
+        RecordDeadline(plan);
+    }
+    // (The correction moves part way towards the latest ratio of the
+    // actual to the predicted time.)
+    if(model && plan.predictedSeconds>0)
+    {
+        std::lock_guard<std::mutex> lock(DeadlineCostsMutex());
+        double ratio=plan.actualSeconds/plan.predictedSeconds;
+        ratio=std::min(std::max(ratio, 0.5), 2.0);
+        model->correction*=std::sqrt(ratio);
+        model->correction=std::min(std::max(model->correction, 0.25), 4.0);
+    }
+    return result;
+}
+
+DeadlineCosts &CalibrateDeadlineCosts(bool  HistogramReshaping,
+                                      float PercentSaturationShift,
+                                      float PercentShadingShift,
+                                      bool  ExtraShading,
+                                      float PercentTint,
+                                      float PercentModified,
+                                      float FastMathError)
+{
+// Measures, once for each combination of the options which change
+// the cost per pixel, the time taken by each processing stage for
+// synthetic images, with the refinements made as 'ColourTransfer'
+// makes them for these options.  The images are larger than the
+// last level cache (see 'DeadlineCalibrationSize').  The costs are
+// kept for later calls.  Only one thread measures at a time, so
+// that no measurement is made while another competes for the
+// processors, and other threads wanting the same costs wait for
+// them to be measured.
+
+    static std::map<std::string, DeadlineCosts> measured;
+    static std::mutex calibrating;
+    std::lock_guard<std::mutex> serial(calibrating);
+    std::ostringstream key;
+    key<<HistogramReshaping<<" "<<PercentSaturationShift<<" "
+       <<PercentShadingShift<<" "<<ExtraShading<<" "<<PercentTint<<" "
+       <<PercentModified<<" "<<(FastMathError>0)<<" "
+       <<StripSchedulingFlag();
+    {
+        std::lock_guard<std::mutex> lock(DeadlineCostsMutex());
+        std::map<std::string, DeadlineCosts>::iterator found=
+            measured.find(key.str());
+        if(found!=measured.end()) return found->second;
+    }
+
+    // Synthetic target and source images of random colours.
+    cv::Size size=DeadlineCalibrationSize();
+    cv::Mat target(size, CV_32FC3), source(size, CV_32FC3);
+    cv::randu(target, cv::Scalar::all(0.02), cv::Scalar(0.9, 0.8, 1.0));
+    cv::randu(source, cv::Scalar::all(0.02), cv::Scalar(1.0, 0.6, 0.7));
+    double pixels=(double)target.total();
+    cv::Mat grey, processed, change;
+    cv::cvtColor(source, grey, cv::COLOR_BGR2GRAY);
+
+    std::chrono::steady_clock::time_point t0;
+    auto seconds=[&]()
+    {
+        double s=std::chrono::duration<double>(
+                 std::chrono::steady_clock::now()-t0).count();
+        t0=std::chrono::steady_clock::now();
+        return s;
+    };
+
+    // The refinements of 'processed' as made by 'ColourTransfer',
+    // with the saturation processing if 'saturation' is set.
+    // Returns their time.
+    float SatVal=PercentSaturationShift/100.0;
+    float ShaderVal=PercentShadingShift/100.0;
+    float TintVal=PercentTint/100.0, ModifiedVal=PercentModified/100.0;
+    auto refine=[&](cv::Mat image, cv::Mat original, cv::Mat greys,
+                    bool saturation)
+    {
+        cv::Mat result=image.clone();
+        float sat=saturation ? SatVal : 1.0f;
+        t0=std::chrono::steady_clock::now();
+        if(StripSchedulingFlag())
+            StripRefinements(result, original, greys, sat, ExtraShading,
+                             ShaderVal, TintVal, ModifiedVal);
+        else
+        {
+            SaturationProcessing(result, original, sat);
+            result=FullShading(result, original, greys, ExtraShading,
+                               ShaderVal);
+            FinalAdjustment(result, original, TintVal, ModifiedVal);
+        }
+        return seconds();
+    };
+
+    // (Each stage is first run on a few rows so that its first use
+    // costs, such as the thread pool start up, are not counted.)
+    int few=std::min(size.height, 16);
+    cv::Mat ftarget=target.rowRange(0, few), fsource=source.rowRange(0, few);
+    cv::Mat fprocessed=CoreProcessing(ftarget, fsource, 0.5, 2, 0,
+                                      HistogramReshaping, 0.5,
+                                      FastMathError);
+    refine(fprocessed, ftarget, grey.rowRange(0, few), true);
+
+    DeadlineCosts c;
+    t0=std::chrono::steady_clock::now();
+    processed=CoreProcessing(target, source, 0.5, 0, 0,
+                             HistogramReshaping, 0.5, FastMathError);
+    c.core=seconds()/(2*pixels);
+    CoreProcessing(target, source, 0.5, 2, 0, HistogramReshaping, 0.5,
+                   FastMathError);
+    c.reshaping=std::max(0.0, seconds()/(2*pixels)-c.core)/2;
+    c.refinement=refine(processed, target, grey, false)/pixels;
+    if(SatVal!=1)
+        c.saturation=std::max(0.0, refine(processed, target, grey, true)/
+                                   pixels-c.refinement);
+    t0=std::chrono::steady_clock::now();
+    cv::resize(target, change, cv::Size(size.width/2, size.height/2), 0, 0,
+               cv::INTER_AREA);
+    cv::resize(change, change, target.size(), 0, 0, cv::INTER_LINEAR);
+    processed=target+change;
+    c.resampling=seconds()/pixels;
+
+    std::lock_guard<std::mutex> lock(DeadlineCostsMutex());
+    return measured.insert(std::make_pair(key.str(), c)).first->second;
+}
+
 
 
 
 cv::Mat CoreProcessing(cv::Mat targetf, cv::Mat sourcef,
                        float CrossCovarianceLimit,
                        int   ReshapingIterations,
-                       float ShaderVal)
+                       float ReshapingTolerance,
+                       bool  HistogramReshaping,
+                       float ShaderVal,
+                       float FastMathError,
+                       int  *ReshapingIterationsUsed)
 {
 // Implements augmented "Reinhard Processing" in
 // L-alpha-beta colour space.
+//
+// If 'ReshapingTolerance' is greater than zero, each phase of
+// reshaping stops as soon as the reshaping correction falls
+// below the tolerance or stops falling.  The number of reshaping
+// iterations made is returned in 'ReshapingIterationsUsed' if not
+// NULL.
+//
+// If 'HistogramReshaping' is set, each phase of reshaping is
+// instead a single exact histogram match.
+//
+// If 'FastMathError' is greater than zero, fast approximations
+// are used for the logarithms and powers of ten.
+
+    MemoryScope scope("CoreProcessing");
+    PerfScope perf("CoreProcessing", targetf.total());
 
     // First convert the images from the BGR colour
     // space to the L-alpha-beta colour space.
     // Estimate the mean and standard deviation of
-    // colour channels. Split the target and source
-    // images into colour channels and standardise
-    // the distribution within each channel.
+    // colour channels (this is done by the shared
+    // transfer kernel as part of the conversion).
+    cv::Mat tconv;
+    cv::Scalar tmean, tdev, smean, sdev;
+    LalphabetaSpace space(1.0/255, FastMathError);
+
+    // Without reshaping the whole process reduces to a
+    // per-pixel affine map of the channels, which the
+    // kernel applies as part of the conversion back to
+    // BGR.  The split channels are not then needed.
+    if(ReshapingIterationsUsed) *ReshapingIterationsUsed=0;
+    if(ReshapingIterations==0)
+    {
+        ColourStatistics t=ConvertForward(space, targetf, &tconv);
+        ColourStatistics s=ConvertForward(space, sourcef, NULL);
+        float W1=1.0, W2=0.0;
+        if(CrossCovarianceLimit!=0.0)
+            CovarianceWeights(t.corr, s.corr, CrossCovarianceLimit, W1, W2);
+        TransferMap map=MakeTransferMap(t, s, W1, W2, ShaderVal);
+        if(FitFastMathToMap(space, &map))
+            ConvertForward(space, targetf, &tconv);
+        return ConvertInverse(space, tconv, &map, false);
+    }
+
+    // Otherwise convert the target and source images into
+    // separate colour channels (see 'Common/PlanarImage.hpp')
+    // and standardise the distribution within each channel
+    // in place.
     //
     // The standardised data has zero mean and
     // unit standard deviation.
-    cv::Mat Lab[3], sLab[3];
-    cv::Scalar tmean, tdev, smean, sdev;
-
-    targetf = convertTolab(targetf);
-    sourcef = convertTolab(sourcef);
-
-    cv::meanStdDev(targetf, tmean, tdev);
-    cv::meanStdDev(sourcef, smean, sdev);
-    cv::split(targetf,Lab);
-    cv::split(sourcef,sLab);
-
-    Lab[0]=(Lab[0]-tmean[0])/tdev[0];
-    Lab[1]=(Lab[1]-tmean[1])/tdev[1];
-    Lab[2]=(Lab[2]-tmean[2])/tdev[2];
+    PlanarImage tplanes, splanes;
+    cv::Mat *Lab=tplanes.plane, *sLab=splanes.plane;
+    ColourStatistics t, s;
+    {
+        PerfScope perf("ConvertForward", targetf.total()+sourcef.total());
+        t=ConvertForwardPlanar(space, targetf, tplanes);
+        s=ConvertForwardPlanar(space, sourcef, splanes);
+
+        // Any fast approximations are selected for the gain of the
+        // equivalent affine transfer.  Reshaping may stretch parts of
+        // the colour channels further ('ReportFastMathError' measures
+        // the actual error).
+        float W1=1.0, W2=0.0;
+        if(CrossCovarianceLimit!=0.0)
+            CovarianceWeights(t.corr, s.corr, CrossCovarianceLimit, W1, W2);
+        TransferMap map=MakeTransferMap(t, s, W1, W2, ShaderVal);
+        if(FitFastMathToMap(space, &map))
+            t=ConvertForwardPlanar(space, targetf, tplanes);
+    }
+    tmean=t.mean; tdev=t.dev;
+    smean=s.mean; sdev=s.dev;
+    CancelPoint(0.2f);
 
-    sLab[0]=(sLab[0]-smean[0])/sdev[0];
-    sLab[1]=(sLab[1]-smean[1])/sdev[1];
-    sLab[2]=(sLab[2]-smean[2])/sdev[2];
+    for(int c=0;c<3;c++)
+    {
+        Lab[c].convertTo(Lab[c], CV_32F, 1.0/tdev[c], -tmean[c]/tdev[c]);
+        sLab[c].convertTo(sLab[c], CV_32F, 1.0/sdev[c], -smean[c]/sdev[c]);
+    }
 
 
     // Implement first phase of reshaping for the colour channels
     // when one or more iteration is specified.
-    int jcount=ReshapingIterations;
-    while (jcount>ceil((ReshapingIterations+1)/2))
+    // 'shift' measures the reshaping correction that was applied.
+    int jcount=ReshapingIterations, jsplit=ceil((ReshapingIterations+1)/2);
+    int jused=0;
+    float shift1, shift2, shift, lastShift=FLT_MAX;
+    // (Reshaping takes the progress from 0.2 to 0.8.)
+    float perPhase=0.6f/std::max(ReshapingIterations, 1);
+
+    // The weighted tail moments of the source colour channels (see
+    // 'Common/Moments.hpp') do not change, so they are gathered once.
+    TailMoments sTails1(1), sTails2(1);
+    if(!HistogramReshaping)
+    {
+        sTails1=StandardisedTails(sLab[1]);
+        sTails2=StandardisedTails(sLab[2]);
+    }
+    while (jcount>jsplit)
     {
-         Lab[1]=ChannelCondition(Lab[1],sLab[1]);
-         Lab[2]=ChannelCondition(Lab[2],sLab[2]);
+         // (Histogram matching completes the phase in one step.)
+         if(HistogramReshaping)
+         {
+             Lab[1]=HistogramMatch(Lab[1],sLab[1]);
+             Lab[2]=HistogramMatch(Lab[2],sLab[2]);
+             jcount=jsplit;
+             jused++;
+             CancelPoint(0.2f+perPhase*(ReshapingIterations-jcount));
+             continue;
+         }
+         Lab[1]=ChannelCondition(Lab[1],sTails1,shift1);
+         ThrowIfCancelled();
+         Lab[2]=ChannelCondition(Lab[2],sTails2,shift2);
          jcount--;
+         jused++;
+         CancelPoint(0.2f+perPhase*(ReshapingIterations-jcount));
+
+         // Skip the rest of the phase once converged.
+         shift=std::max(shift1,shift2);
+         if(ReshapingTolerance>0 &&
+            (shift<ReshapingTolerance || shift>0.95*lastShift)) jcount=jsplit;
+         lastShift=shift;
      }
     // Implement cross covariance processing.
     // (null if CrossCovarianceLimit=0.0)
-        targetf=adjust_covariance(Lab, sLab,
+        adjust_covariance(Lab, sLab,
                        CrossCovarianceLimit );
-        cv::split(targetf,Lab);
 
     // Implement second phase of reshaping
+    lastShift=FLT_MAX;
     while (jcount>0)
     {
-         Lab[1]=ChannelCondition(Lab[1],sLab[1]);
-         Lab[2]=ChannelCondition(Lab[2],sLab[2]);
+         if(HistogramReshaping)
+         {
+             Lab[1]=HistogramMatch(Lab[1],sLab[1]);
+             Lab[2]=HistogramMatch(Lab[2],sLab[2]);
+             jcount=0;
+             jused++;
+             CancelPoint(0.2f+perPhase*(ReshapingIterations-jcount));
+             continue;
+         }
+         Lab[1]=ChannelCondition(Lab[1],sTails1,shift1);
+         ThrowIfCancelled();
+         Lab[2]=ChannelCondition(Lab[2],sTails2,shift2);
          jcount--;
+         jused++;
+         CancelPoint(0.2f+perPhase*(ReshapingIterations-jcount));
+
+         shift=std::max(shift1,shift2);
+         if(ReshapingTolerance>0 &&
+            (shift<ReshapingTolerance || shift>0.95*lastShift)) jcount=0;
+         lastShift=shift;
      }
+    if(ReshapingIterationsUsed) *ReshapingIterationsUsed=jused;
 
     // Rescale the previously standardised colour channels
     // so that the means and standard deviations now match
     // those of the source image.
-    Lab[1]=Lab[1]*sdev[1]+smean[1];
-    Lab[2]=Lab[2]*sdev[2]+smean[2];
+    Lab[1].convertTo(Lab[1], CV_32F, sdev[1], smean[1]);
+    Lab[2].convertTo(Lab[2], CV_32F, sdev[2], smean[2]);
 
     // Rescale the lightness channel (channel 0)
     // in accordance with the specified percentage
     // shading shift.
-    Lab[0]=Lab[0]*(ShaderVal*sdev[0]+(1.0-ShaderVal)*tdev[0])
-           +ShaderVal*smean[0]+(1.0-ShaderVal)*tmean[0];
-
-    // Merge channels and convert back to BGR colour space.
-    cv::Mat resultant;
-    cv::merge(Lab,3,resultant);
-    resultant = convertFromlab(resultant);
-    return resultant;
+    Lab[0].convertTo(Lab[0], CV_32F,
+                     ShaderVal*sdev[0]+(1.0-ShaderVal)*tdev[0],
+                     ShaderVal*smean[0]+(1.0-ShaderVal)*tmean[0]);
+
+    // Convert the channels back to the BGR colour space.
+    CancelPoint(0.8f);
+    PerfScope inverse("ConvertInverse", targetf.total());
+    return ConvertInversePlanar(space, tplanes, NULL, false);
 }
 
 
 
-cv::Mat adjust_covariance(cv::Mat Lab[3], cv::Mat sLab[3], float covLim)
+void adjust_covariance(cv::Mat Lab[3], cv::Mat sLab[3], float covLim)
 {
 // This routine adjusts colour channels 2 and 3 of
-// the image within the L-alpha-beta colour space.
-
-// The channels each have zero mean and unit
-// standard deviation but their cross correlation
-// value will not normally be zero.
-//
-// The processing reduces the cross correlation between
-// the channels to zero but then reintroduces
-// correlation such that the new cross correlation
-// value matches that for the source image.
-//
-// Throughout these manipulations the mean channel values
-// are maintained at zero and the standard deviations are
-// maintained as unity.
-//
-// The manipulations are based upon the following relationship.
-//
-// Let z1 and z2 be two independent (zero correlation) variables
-// with zero means and unit standard deviations. It can be shown
-// that variables a1 and a2 have zero means, unit standard
-// deviations, and mutual cross correlation 'R' when:
-//
-// a1=sqrt((1+R)/2)*z1 + sqrt((1-R)/2)*z2
-// a2=sqrt((1+R)/2)*z1 - sqrt((1-R)/2)*z2
+// the image within the L-alpha-beta colour space,
+// in place.
 //
-// The above relationships are applied inversely to derive
-// uncorrelated standardised colour channels variables from
-// the standardised but correlated input channels.
-//
-// The above relationships are then applied directly to obtain
-// standardised correlated colour channels with correlation
-// matched to that of the source image colour channels.
-//
-// Original processing method attributable to Dr T E Johnson Sept 2019.
+// The channels each have zero mean and unit standard
+// deviation.  Their cross correlation is adjusted to match
+// that of the source image colour channels using the weights
+// computed by 'CovarianceWeights' (see
+// 'Common/TransferKernel.hpp', which describes the method).
+// Unlike the other processing variants, the channels may have
+// been reshaped beforehand, so the correlations are measured
+// here from the standardised channels.
+
+    PerfScope perf("adjust_covariance", Lab[1].total());
 
     // Declare variables
     float tcrosscorr, scrosscorr;
-    float W1, W2, norm;
-    cv::Mat temp1;
-    cv::Scalar smean, sdev, temp2;
+    float W1, W2;
+    cv::Scalar temp2;
 
     // No processing required if 'covLim' set to zero.
     if(covLim!=0.0)
@@ -299,159 +1157,225 @@ cv::Mat adjust_covariance(cv::Mat Lab[3], cv::Mat sLab[3], float covLim)
         // The correlation between the standardised variables (zero mean,
         // unit standard deviation) can be computed as the mean cross
         // product for the two channels.
-        cv::multiply(Lab[1],Lab[2],temp1);
-        temp2=cv::mean(temp1);
+        temp2=StatMeanProduct(Lab[1],Lab[2]);
         tcrosscorr =temp2[0];
 
         // Compute the correlation for the source
         // image colour channels.
-        cv::multiply(sLab[1],sLab[2],temp1);
-        temp2=cv::mean(temp1);
+        temp2=StatMeanProduct(sLab[1],sLab[2]);
         scrosscorr =temp2[0];
 
         // Adjust the correlation between the
         // standardised input channel values.
-        W1= 0.5*sqrt((1+scrosscorr)/(1+tcrosscorr))
-           +0.5*sqrt((1-scrosscorr)/(1-tcrosscorr));
-        W2= 0.5*sqrt((1+scrosscorr)/(1+tcrosscorr))
-           -0.5*sqrt((1-scrosscorr)/(1-tcrosscorr));
-
-        // Limit the size of W2 if required.
+        // The size of W2 is limited by 'covLim'.
         // This limits the proportional amount by which
         // a given colour channel can be augmented by
         // the energy from the other colour channel.
-        if(std::abs(W2)>covLim*std::abs(W1))
+        CovarianceWeights(tcrosscorr, scrosscorr, covLim, W1, W2);
+        cv::Mat z1=Lab[1], z2=Lab[2];
+        ForEachStrip(z1.rows, KernelRowsPerBlock(z1.cols),
+                     [&](int row0, int row1)
         {
-            W2=copysign(covLim*W1,W2);
-            norm=1.0/sqrt(W1*W1+W2*W2+2*W1*W2*tcrosscorr);
-            W1=W1*norm;
-            W2=W2*norm;
-        }
-        cv::Mat z1=Lab[1].clone();
-
-        Lab[1]=W1*z1+W2*Lab[2];
-        Lab[2]=W1*Lab[2]+W2*z1;
+            for(int y=row0;y<row1;y++)
+            {
+                float *p1=z1.ptr<float>(y), *p2=z2.ptr<float>(y);
+                for(int x=0;x<z1.cols;x++)
+                {
+                    float a=p1[x], b=p2[x];
+                    p1[x]=W1*a+W2*b;
+                    p2[x]=W1*b+W2*a;
+                }
+            }
+        });
     }
-    cv:merge(Lab,3,temp1);
-    return temp1;
 }
 
 
 
-cv::Mat ChannelCondition(cv::Mat Chan,cv::Mat sChan)
+cv::Mat ChannelCondition(cv::Mat Chan, const TailMoments &sTails,
+                         float &shift)
     {
 // Modifies the distribution of values in 'Chan' to more
-// closely match the distribution of those in 'sChan'.
+// closely match the distribution of those in the source
+// channel whose weighted tail moments are 'sTails' (see
+// 'Common/Moments.hpp').
 // Separate matching operations are performed for values
 // above and below the mean.  The input channels have
 // been standardised so the mean is equal to zero.
+// 'shift' returns the size of the correction applied
+// (zero when the distributions already match).
 // Original processing method attributable to
 // Dr T E Johnson Oct 2020.
 
-    // Declare variables
-    // Computations use weighted data values.
-    // 'wval' is the tuning constant for the
-    // weighting function.
-    cv::Mat mask, ChanU, ChanL;
-    cv::Mat WU, WL;
-    cv::Scalar smeanU, smeanL, wmean;
-    cv::Scalar tmeanU, tmeanL, tmean, tdev;
-    float k, wval=0.25;
-
-    // sChan is processed before Chan because
-    // Chan data is used in later processing.
-
-    // Processing for upper 'sChan'.
-
-    // Determine the mask for selecting data values
-    // above zero.
-    cv::threshold(sChan,mask,0,1,CV_THRESH_BINARY);
-    mask.convertTo(mask,CV_8U);
-
-    // Compute the weighting function for values
-    // above zero.
-    // (Zero is the mean value of the input channel).
-    // The weighting function is zero for sChan values
-    // equal to zero and unity for large values of
-    // sChan.
-    smeanU=mean(sChan,mask);
-    cv::exp(-sChan*wval/smeanU[0],WU);
-    WU=(1-WU).mul(1-WU);
-    wmean=mean(WU,mask);
-    // Compute deviation from the mean
-    // and raise to the power 4 so as to
-    // address kurtosis.
-    cv::pow(sChan,4,ChanU);
-    // Find the weighted average of the
-    // fourth power of the deviations.
-    smeanU=mean(WU.mul(ChanU),mask)/wmean[0];
-
-    // Processing for lower 'sChan'.
-
-    // As for upper processing but values are
-    // selected by applying the complementary
-    // masking function (1-mask).
-    smeanL=mean(sChan,(1-mask));
-    cv::exp(-sChan*wval/smeanL[0],WL);
-    WL=(1-WL).mul(1-WL);
-    wmean=mean(WL,1-mask);
-    cv::pow(sChan,4,ChanL);
-    smeanL=mean(WL.mul(ChanL),1-mask)/wmean[0];
-
-    // Processing for upper 'Chan'
-
-    cv::threshold(Chan,mask,0,1,CV_THRESH_BINARY);
-    mask.convertTo(mask,CV_8U);
-    tmeanU=mean(Chan,mask);
-    cv::exp(-Chan*wval/tmeanU[0],WU);
-    WU=(1-WU).mul(1-WU);
-    wmean=mean(WU,mask);
-    cv::pow(Chan,4,ChanU);
-    tmeanU=mean(WU.mul(ChanU),mask)/wmean[0];
-
-    // Processing for lower 'Chan'
-
-    tmeanL=mean(Chan,(1-mask));
-    cv::exp(-Chan*wval/tmeanL[0],WL);
-    WL=(1-WL).mul(1-WL);
-    wmean=mean(WL,1-mask);
-    cv::pow(Chan,4,ChanL);
-    tmeanL=mean(WL.mul(ChanL),1-mask)/wmean[0];
-
-    // Modify the upper 'Chan' values
+    MemoryScope scope("ChannelCondition");
+    PerfScope perf("ChannelCondition", Chan.total());
+
+    // Computations use weighted data values.  For
+    // values above zero the weighting function is zero
+    // for values equal to zero and unity for large
+    // values, and similarly below zero.  Find the
+    // weighted average of the fourth power of the
+    // values above and below zero, so as to address
+    // kurtosis, as for the source channel.  (Zero is
+    // the mean value of the input channel.)
+    TailMoments tTails=StandardisedTails(Chan);
 
     // Compute the ratio of the weighted fourth
-    // power for 'sChan' relative to that for
-    // 'Chan' and then take the fourth root.
+    // power for the source relative to that for
+    // 'Chan' and then take the fourth root, for the
+    // upper (kU) and lower (kL) values.
     // The resultant is used to apply a shift to
     // the 'Chan' data where the shift is a
     // function of the data deviation.
     // No shift is applied to small values and full
     // shift to large values.
-    k=sqrt(sqrt(smeanU[0]/tmeanU[0]));
-    ChanU=(1+WU*(k-1)).mul(Chan);
-
-    // Similarly modify the lower 'Chan' values.
-    k=sqrt(sqrt(smeanL[0]/tmeanL[0]));
-    ChanL=(1+WL*(k-1)).mul(Chan);
-
-    // Combine the upper and lower 'Chan'values to form
-    // a whole
-    Chan=cv::Mat::zeros(Chan.rows, Chan.cols, CV_32FC1);
-    cv::add(Chan,ChanU,Chan,mask);
-    cv::add(Chan,ChanL,Chan,1-mask);
+    auto ratio=[&](int side)
+    {
+        double s=TailFourthMoment(sTails, 0, side);
+        double t=TailFourthMoment(tTails, 0, side);
+        return s>0 && t>0 ? (float)sqrt(sqrt(s/t)) : 1.0f;
+    };
+    float kU=ratio(0), kL=ratio(1);
+    shift=std::max(std::abs(kU-1), std::abs(kL-1));
+
+    // Modify the upper and lower 'Chan' values
+    // together, a block of rows at a time.
+    int cols=Chan.cols;
+    cv::Mat result(Chan.size(), CV_32FC1);
+    ForEachStrip(Chan.rows, KernelRowsPerBlock(cols), [&](int row0, int row1)
+    {
+        std::vector<float> s(cols+1), w(cols+1);
+        for(int y=row0;y<row1;y++)
+        {
+            float *q=result.ptr<float>(y);
+            TailRow(tTails, 0, Chan.ptr<float>(y), 1, cols, &s[0], &w[0]);
+            for(int x=0;x<cols;x++)
+                q[x]=(1+w[x]*((s[x]>0 ? kU : kL)-1))*s[x];
+        }
+    });
+    Chan=result;
 
     // Re-standardise the modified 'Chan' data
     // before it is fed back.
-    cv::meanStdDev(Chan, tmean, tdev);
+    cv::Scalar tmean, tdev;
+    StatMeanStdDev(Chan, tmean, tdev);
     Chan=(Chan-tmean[0])/tdev[0];
-    cv::meanStdDev(Chan, tmean, tdev);
 
     return Chan;
     }
 
 
 
+cv::Mat HistogramMatch(cv::Mat Chan, cv::Mat sChan)
+{
+// Reshapes the distribution of values in 'Chan' to match that
+// of the values in 'sChan' by mapping each value through the
+// cumulative distribution function (CDF) of 'Chan' and then
+// through the inverse CDF of 'sChan'.
+//
+// The channels have been standardised (zero mean and unit
+// standard deviation), so fixed histograms of 4096 bins spanning
+// +/-8 standard deviations are used, with values beyond that
+// range counted in the end bins.  Within each bin the values
+// are taken as evenly spread, so the mapping is piecewise linear
+// between the bin edges and is applied by interpolation in a
+// lookup table.  One pass over each channel builds the histograms
+// and one further pass maps the values, however closely the
+// distributions are matched.
+
+    MemoryScope scope("HistogramMatch");
+    PerfScope perf("HistogramMatch", Chan.total());
+
+    const int   bins=4096;
+    const float range=8.0;
+    const float width=2*range/bins;
+
+    std::vector<double> tcdf=ChannelCdf(Chan, bins, range);
+    std::vector<double> scdf=ChannelCdf(sChan, bins, range);
+
+    // For each bin edge of 'Chan' find the value in 'sChan' with
+    // the same CDF.  The CDF values increase with the edge, so the
+    // search through 'sChan' only moves forwards.
+    std::vector<float> lut(bins+1);
+    int j=0;
+    for(int k=0;k<=bins;k++)
+    {
+        double q=std::max(tcdf[k], 1e-12);
+        while(j<bins-1 && scdf[j+1]<q) j++;
+        double d=scdf[j+1]-scdf[j];
+        double t=d>0 ? std::min((q-scdf[j])/d, 1.0) : 0.0;
+        lut[k]=-range+(j+t)*width;
+    }
+
+    // Map the channel values through the table.
+    cv::Mat result(Chan.size(), CV_32FC1);
+    const CancelToken *token=CurrentCancelToken();
+    cv::parallel_for_(cv::Range(0, Chan.rows), [&](const cv::Range &rows)
+    {
+        for(int y=rows.start;y<rows.end && !Cancelled(token);y++)
+        {
+            const float *p=Chan.ptr<float>(y);
+            float *q=result.ptr<float>(y);
+            for(int x=0;x<Chan.cols;x++)
+            {
+                float pos=(p[x]+range)/width;
+                pos=std::min(std::max(pos, 0.0f), (float)bins);
+                int k=std::min((int)pos, bins-1);
+                float t=pos-k;
+                q[x]=lut[k]+t*(lut[k+1]-lut[k]);
+            }
+        }
+    });
+    ThrowIfCancelled();
+    return result;
+}
+
+
+
+std::vector<double> ChannelCdf(cv::Mat Chan, int bins, float range)
+{
+// Returns the fraction of the values in the single channel float
+// image 'Chan' that lie below each of the 'bins'+1 edges of a
+// histogram spanning -'range' to +'range'.  Values beyond the
+// range are counted in the end bins.  The histogram is computed
+// in parallel over strips of rows and the integer counts are
+// then summed, so the result does not depend on the thread count.
+
+    const int strips=std::max(1, std::min(Chan.rows, 64));
+    std::vector<int> counts((size_t)strips*bins, 0);
+    float scale=bins/(2*range);
+
+    cv::parallel_for_(cv::Range(0, strips), [&](const cv::Range &r)
+    {
+        for(int s=r.start;s<r.end;s++)
+        {
+            int *h=&counts[(size_t)s*bins];
+            int row0=(int)((long)Chan.rows*s/strips);
+            int row1=(int)((long)Chan.rows*(s+1)/strips);
+            for(int y=row0;y<row1;y++)
+            {
+                const float *p=Chan.ptr<float>(y);
+                for(int x=0;x<Chan.cols;x++)
+                {
+                    int k=(int)((p[x]+range)*scale);
+                    h[std::min(std::max(k, 0), bins-1)]++;
+                }
+            }
+        }
+    });
+
+    std::vector<double> cdf(bins+1, 0.0);
+    double total=std::max((double)Chan.rows*Chan.cols, 1.0), sum=0;
+    for(int k=0;k<bins;k++)
+    {
+        for(int s=0;s<strips;s++) sum+=counts[(size_t)s*bins+k];
+        cdf[k+1]=sum/total;
+    }
+    return cdf;
+}
+
+
+
 cv::Mat SaturationProcessing(cv::Mat targetf, cv::Mat savedtf,
                              float SatVal)
 {
@@ -461,6 +1385,9 @@ cv::Mat SaturationProcessing(cv::Mat targetf, cv::Mat savedtf,
 // often exhibit excessive colour saturation. This function
 // allows a scaling back of saturation.
 
+    MemoryScope scope("SaturationProcessing");
+    PerfScope perf("SaturationProcessing", targetf.total());
+
 // The idea of saturation processing is to adjust the saturation
 // characteristics of the processed image to match the saturation
 // characteristics of an artificially constructed image whose
@@ -475,10 +1402,12 @@ cv::Mat SaturationProcessing(cv::Mat targetf, cv::Mat savedtf,
 
         // Colour saturation will be computed in accordance
         // with the definition used for the HSV colour space.
-        cv::cvtColor(targetf,targetf,CV_BGR2HSV);
-        cv::cvtColor(savedtf,temp,CV_BGR2HSV);
-        cv::split(targetf,Hsv);
-        cv::split(temp,tmpHsv);
+        // (Only the saturation channels are taken out.)
+        cv::cvtColor(targetf,targetf,cv::COLOR_BGR2HSV);
+        cv::cvtColor(savedtf,temp,cv::COLOR_BGR2HSV);
+        cv::extractChannel(targetf,Hsv[1],1);
+        cv::extractChannel(temp,tmpHsv[1],1);
+        ThrowIfCancelled();
 
         if(SatVal<0)
         {
@@ -504,7 +1433,7 @@ cv::Mat SaturationProcessing(cv::Mat targetf, cv::Mat savedtf,
         // will apply only to those pixels where the
         // saturation in the processed image exceeds that
         // in the original target image.
-        cv::threshold((Hsv[1]-tmpHsv[1]),mask,0,1,CV_THRESH_BINARY);
+        cv::threshold((Hsv[1]-tmpHsv[1]),mask,0,1,cv::THRESH_BINARY);
         mask.convertTo(mask,CV_8U);
 
         // Create a new reference saturation channel which is taken
@@ -515,6 +1444,7 @@ cv::Mat SaturationProcessing(cv::Mat targetf, cv::Mat savedtf,
         temp=cv::Mat::zeros(targetf.rows, targetf.cols, CV_32FC1);
         cv::add(temp,tmpHsv[1],temp,mask);
         cv::add(temp,Hsv[1],tmpHsv[1],(1-mask));
+        ThrowIfCancelled();
 
         // Now match the mean and standard deviation of the
         // saturation channel for the processed image channel
@@ -522,12 +1452,13 @@ cv::Mat SaturationProcessing(cv::Mat targetf, cv::Mat savedtf,
         // reference saturation channel. This give the final
         // saturation channel which is the output from
         // the saturation processing
-        cv::meanStdDev(Hsv[1], tmean, tdev);
-        cv::meanStdDev(tmpHsv[1], tmpmean, tmpdev);
+        StatMeanStdDev(Hsv[1], tmean, tdev);
+        StatMeanStdDev(tmpHsv[1], tmpmean, tmpdev);
         Hsv[1]=(Hsv[1]-tmean[0])/tdev[0];
         Hsv[1]=Hsv[1]*tmpdev[0]+tmpmean[0];
-        cv::merge(Hsv,3,targetf);
-        cv::cvtColor(targetf,targetf,CV_HSV2BGR);
+        cv::insertChannel(Hsv[1],targetf,1);
+        ThrowIfCancelled();
+        cv::cvtColor(targetf,targetf,cv::COLOR_HSV2BGR);
     }
     return targetf;
 }
@@ -543,21 +1474,24 @@ cv::Mat FullShading(cv::Mat targetf, cv::Mat savedtf, cv::Mat sourcef,
      // of the original target and source image as
      // determined by the value of 'ShaderVal'.
 
+     MemoryScope scope("FullShading");
+     PerfScope perf("FullShading", targetf.total());
+
      if(ExtraShading)
      {
-         cv::Mat greyt, greys, greyp, chans[3];
+         cv::Mat greyt, greys, greyp;
          cv::Scalar smean, tmean, sdev, tdev;
 
          // Compute the grey shade images for the target,
          // processed and source images.
-         cv::cvtColor(savedtf,greyt,CV_BGR2GRAY);
-         cv::cvtColor(targetf,greyp,CV_BGR2GRAY);
+         cv::cvtColor(savedtf,greyt,cv::COLOR_BGR2GRAY);
+         cv::cvtColor(targetf,greyp,cv::COLOR_BGR2GRAY);
          sourcef.copyTo(greys);// Already converted.
 
          // Standardise the greyshade images
          // for the source and target.
-         cv::meanStdDev(greys, smean, sdev);
-         cv::meanStdDev(greyt, tmean, tdev);
+         StatMeanStdDev(greys, smean, sdev);
+         StatMeanStdDev(greyt, tmean, tdev);
          greyt=(greyt-tmean[0])/tdev[0];
 
          // Rescale the previously standardised grey shade
@@ -578,14 +1512,20 @@ cv::Mat FullShading(cv::Mat targetf, cv::Mat savedtf, cv::Mat sourcef,
 
 
 
-         cv::split(targetf,chans);
-         cv::divide(chans[0],greyp,chans[0]);
-         chans[0]=chans[0].mul(greyt);
-         cv::divide(chans[1],greyp,chans[1]);
-         chans[1]=chans[1].mul(greyt);
-         cv::divide(chans[2],greyp,chans[2]);
-         chans[2]=chans[2].mul(greyt);
-         cv::merge(chans,3,targetf);
+         // (The channels are rescaled in place.)
+         ThrowIfCancelled();
+         ForEachStrip(targetf.rows, KernelRowsPerBlock(targetf.cols),
+                      [&](int row0, int row1)
+         {
+             for(int y=row0;y<row1;y++)
+             {
+                 float *q=targetf.ptr<float>(y);
+                 const float *p=greyp.ptr<float>(y);
+                 const float *t=greyt.ptr<float>(y);
+                 for(int x=0;x<targetf.cols;x++)
+                     for(int c=0;c<3;c++) q[3*x+c]=q[3*x+c]/p[x]*t[x];
+             }
+         });
      }
 
      return targetf;
@@ -599,18 +1539,28 @@ cv::Mat FinalAdjustment(cv::Mat targetf,cv::Mat savedtf,
 // Implements a change to the tint of the final image and
 // to its degree of modification if a change is specified.
 
+    MemoryScope scope("FinalAdjustment");
+    PerfScope perf("FinalAdjustment", targetf.total());
+
     // If 100% tint not specified then compute a weighted average
     // of the processed image and its grey scale representation.
     if(TintVal!=1.0)
      {
          cv::Mat grey;
-         cv::Mat BGR[3];
-         cv::cvtColor(targetf,grey,CV_BGR2GRAY);
-         cv::split(targetf,BGR);
-         BGR[0]=TintVal*BGR[0]+(1.0-TintVal)*grey;
-         BGR[1]=TintVal*BGR[1]+(1.0-TintVal)*grey;
-         BGR[2]=TintVal*BGR[2]+(1.0-TintVal)*grey;
-         cv::merge(BGR,3,targetf);
+         cv::cvtColor(targetf,grey,cv::COLOR_BGR2GRAY);
+         ForEachStrip(targetf.rows, KernelRowsPerBlock(targetf.cols),
+                      [&](int row0, int row1)
+         {
+             for(int y=row0;y<row1;y++)
+             {
+                 float *q=targetf.ptr<float>(y);
+                 const float *g=grey.ptr<float>(y);
+                 for(int x=0;x<targetf.cols;x++)
+                     for(int c=0;c<3;c++)
+                         q[3*x+c]=(float)(TintVal*q[3*x+c]+
+                                          (1.0-TintVal)*g[x]);
+             }
+         });
      }
 
     // If 100% image modification not specified then
@@ -626,93 +1576,315 @@ cv::Mat FinalAdjustment(cv::Mat targetf,cv::Mat savedtf,
 
 
 
-// ##########################################################################
-// ##### IMPLEMENTATION OF L-ALPHA-BETA FORWARD AND INVERSE TRANSFORMS ######
-// ##########################################################################
-// Coding taken from https://github.com/ZZPot/Color-transfer
-// Credit to 'ZZPot'.
-// I take responsibility for any issues arising my adaptation.
-
-
-// Define the transformation matrices for L-alpha-beta transformation.
-cv::Mat RGB_to_LMS = (cv::Mat_<float>(3,3) <<	0.3811f, 0.5783f, 0.0402f,
-										        0.1967f, 0.7244f, 0.0782f,
-                                                0.0241f, 0.1288f, 0.8444f);
-float i3 = 1/sqrt(3), i6 = 1/sqrt(6), i2 = 1/sqrt(2);
-cv::Mat LMS_to_lab = (cv::Mat_<float>(3,3) <<	i3, i3, i3,
-										        i6, i6, -2*i6,
-                                                i2, -i2, 0);
-
-
-
-cv::Mat convertTolab(cv::Mat input)
+cv::Mat StripRefinements(cv::Mat targetf, cv::Mat savedtf, cv::Mat greys,
+                         float SatVal, bool ExtraShading, float ShaderVal,
+                         float TintVal, float ModifiedVal)
 {
-	cv::Mat img_RGBf(input.size(),CV_32FC3);
-    cv::Mat img_lms (input.size(),CV_32FC3);
-    cv::Mat img_lab (input.size(),CV_32FC3);
-
-	// Swap channel order (so that transformation
-	// matrices can be used in their familiar form).
+// Implements 'SaturationProcessing', 'FullShading' and
+// 'FinalAdjustment' together, with the same outcome, as a strip
+// schedule (see 'StripScheduler.hpp').  The statistics that they
+// need are gathered first, in at most two passes over the target
+// and saved images, and the three refinements are then applied to
+// each strip of rows in turn while it is in cache.  'greys' is the
+// grey shade source image.
+
+    MemoryScope scope("StripRefinements");
+    PerfScope perf("StripRefinements", targetf.total());
+
+    bool saturation=(SatVal!=1), shading=ExtraShading;
+    bool tint=(TintVal!=1.0), modified=(ModifiedVal!=1.0);
+    if(!saturation && !shading && !tint && !modified) return targetf;
+
+    int rows=targetf.rows, cols=targetf.cols;
+    double image=(double)targetf.total()*targetf.elemSize();
+    MemoryTraffic traffic;
+
+    // A strip holds its rows of the target, saved and output images
+    // and their HSV and grey shade forms.  The statistics are
+    // accumulated over the blocks of the transfer kernel instead.
+    int stripRows=StripRows(cols, 5*3*sizeof(float)+3*sizeof(float));
+    int blockRows=KernelRowsPerBlock(cols);
+    int blocks=(rows+blockRows-1)/blockRows;
+    auto deviation=[](const BlockMoments &m)
+    {
+        return m.count>0 ? std::sqrt(m.m2[0]/m.count) : 0.0;
+    };
 
-	// Then convert to float.
-	//cv::cvtColor(input, img_RGB, CV_BGR2RGB);
-	//img_RGB.convertTo(img_RGBf, CV_32FC3, 1.0/255.f);
+    // If 'SatVal' is less than 0, it is the ratio of the largest
+    // saturation in the original image to the largest in the
+    // processed image.
+    if(saturation && SatVal<0)
+    {
+        std::vector<float> pmax(blocks, -FLT_MAX), omax(blocks, -FLT_MAX);
+        ForEachStrip(rows, blockRows, [&](int row0, int row1)
+        {
+            cv::Mat phsv, ohsv;
+            int b=row0/blockRows;
+            cv::cvtColor(targetf.rowRange(row0, row1), phsv, cv::COLOR_BGR2HSV);
+            cv::cvtColor(savedtf.rowRange(row0, row1), ohsv, cv::COLOR_BGR2HSV);
+            for(int y=0;y<row1-row0;y++)
+            {
+                const float *p=phsv.ptr<float>(y);
+                const float *o=ohsv.ptr<float>(y);
+                for(int x=0;x<cols;x++)
+                {
+                    pmax[b]=std::max(pmax[b], p[3*x+1]);
+                    omax[b]=std::max(omax[b], o[3*x+1]);
+                }
+            }
+        });
+        float amax1=-FLT_MAX, amax2=-FLT_MAX;
+        for(int b=0;b<blocks;b++)
+        {
+            amax1=std::max(amax1, pmax[b]);
+            amax2=std::max(amax2, omax[b]);
+        }
+        SatVal=amax2/amax1;
+        traffic.scheduled+=2*image;
+        traffic.staged+=2*image;
+    }
 
-    cv::cvtColor(input, img_RGBf, CV_BGR2RGB);
+    // The statistics of the processed saturation channel and of the
+    // reference saturation channel (which depends upon 'SatVal'),
+    // and of the grey shade original image.
+    BlockMoments pmoments, rmoments, tmoments;
+    if(saturation || shading)
+    {
+        std::vector<BlockMoments> pblock(blocks), rblock(blocks),
+                                  tblock(blocks);
+        ForEachStrip(rows, blockRows, [&](int row0, int row1)
+        {
+            cv::Mat phsv, ohsv, psat, rsat, greyt;
+            int b=row0/blockRows, n=row1-row0;
+            if(saturation)
+            {
+                cv::cvtColor(targetf.rowRange(row0, row1), phsv,
+                             cv::COLOR_BGR2HSV);
+                cv::cvtColor(savedtf.rowRange(row0, row1), ohsv,
+                             cv::COLOR_BGR2HSV);
+                psat.create(n, cols, CV_32FC1);
+                rsat.create(n, cols, CV_32FC1);
+                for(int y=0;y<n;y++)
+                {
+                    const float *p=phsv.ptr<float>(y);
+                    const float *o=ohsv.ptr<float>(y);
+                    float *ps=psat.ptr<float>(y), *rs=rsat.ptr<float>(y);
+                    for(int x=0;x<cols;x++)
+                    {
+                        // The weighted mix applies only where the
+                        // processed saturation exceeds the mix.
+                        float mix=SatVal*p[3*x+1]+(1-SatVal)*o[3*x+1];
+                        ps[x]=p[3*x+1];
+                        rs[x]= ps[x]-mix>0 ? mix : ps[x];
+                    }
+                }
+            }
+            if(shading)
+                cv::cvtColor(savedtf.rowRange(row0, row1), greyt,
+                             cv::COLOR_BGR2GRAY);
+            if(saturation)
+            {
+                pblock[b]=ComputeBlockMoments<1>(psat, cv::Mat(), cv::Mat(),
+                                                 true, 0, n);
+                rblock[b]=ComputeBlockMoments<1>(rsat, cv::Mat(), cv::Mat(),
+                                                 true, 0, n);
+            }
+            if(shading)
+                tblock[b]=ComputeBlockMoments<1>(greyt, cv::Mat(), cv::Mat(),
+                                                 true, 0, n);
+        });
+        for(int b=0;b<blocks;b++)
+        {
+            MergeMoments(pmoments, pblock[b], 1);
+            MergeMoments(rmoments, rblock[b], 1);
+            MergeMoments(tmoments, tblock[b], 1);
+        }
+        traffic.scheduled+=(saturation ? 2 : 1)*image;
+    }
+    double pmean=pmoments.mean[0], pdev=deviation(pmoments);
+    double rmean=rmoments.mean[0], rdev=deviation(rmoments);
+    double tmean=tmoments.mean[0], tdev=deviation(tmoments);
+    cv::Scalar smean, sdev;
+    if(shading) StatMeanStdDev(greys, smean, sdev);
+    double shadeScale=ShaderVal*sdev[0]+(1.0-ShaderVal)*tdev;
+    double shadeShift=ShaderVal*smean[0]+(1.0-ShaderVal)*tmean;
+
+    // Each refinement in turn on each strip, as in the whole image
+    // routines.
+    cv::Mat result(targetf.size(), CV_32FC3);
+    ForEachStrip(rows, stripRows, [&](int row0, int row1)
+    {
+        cv::Mat out=result.rowRange(row0, row1);
+        cv::Mat saved=savedtf.rowRange(row0, row1);
+        cv::Mat hsv, greyp, greyt;
+        if(saturation)
+        {
+            cv::cvtColor(targetf.rowRange(row0, row1), hsv, cv::COLOR_BGR2HSV);
+            for(int y=0;y<row1-row0;y++)
+            {
+                float *p=hsv.ptr<float>(y);
+                for(int x=0;x<cols;x++)
+                {
+                    float s=(float)((p[3*x+1]-pmean)/pdev);
+                    p[3*x+1]=(float)(s*rdev+rmean);
+                }
+            }
+            cv::cvtColor(hsv, out, cv::COLOR_HSV2BGR);
+        }
+        else targetf.rowRange(row0, row1).copyTo(out);
 
+        if(shading)
+        {
+            cv::cvtColor(out, greyp, cv::COLOR_BGR2GRAY);
+            cv::cvtColor(saved, greyt, cv::COLOR_BGR2GRAY);
+            for(int y=0;y<row1-row0;y++)
+            {
+                float *q=out.ptr<float>(y);
+                const float *p=greyp.ptr<float>(y);
+                const float *t=greyt.ptr<float>(y);
+                for(int x=0;x<cols;x++)
+                {
+                    // (Guard against zero divide and negative values.)
+                    float gp=std::max(p[x], (float)(1/255.0));
+                    float gt=(float)((t[x]-tmean)/tdev);
+                    gt=std::max((float)(gt*shadeScale+shadeShift), 0.0f);
+                    for(int c=0;c<3;c++) q[3*x+c]=q[3*x+c]/gp*gt;
+                }
+            }
+        }
 
-	// Apply stage 1 transform.
-	cv::transform(img_RGBf, img_lms, RGB_to_LMS);
+        if(tint)
+        {
+            cv::cvtColor(out, greyp, cv::COLOR_BGR2GRAY);
+            for(int y=0;y<row1-row0;y++)
+            {
+                float *q=out.ptr<float>(y);
+                const float *g=greyp.ptr<float>(y);
+                for(int x=0;x<cols;x++)
+                    for(int c=0;c<3;c++)
+                        q[3*x+c]=(float)(TintVal*q[3*x+c]+
+                                         (1.0-TintVal)*g[x]);
+            }
+        }
 
-	// Define smallest permitted value and implement it.
-    float epsilon =1.0/255;
-	cv::Scalar min_scalar(epsilon, epsilon, epsilon);
-	cv::Mat min_mat = cv::Mat(input.size(), CV_32FC3, min_scalar);
-	cv::max(img_lms, min_mat, img_lms); // just before log operation.
+        if(modified)
+            for(int y=0;y<row1-row0;y++)
+            {
+                float *q=out.ptr<float>(y);
+                const float *o=saved.ptr<float>(y);
+                for(int x=0;x<3*cols;x++)
+                    q[x]=(float)(ModifiedVal*q[x]+(1.0-ModifiedVal)*o[x]);
+            }
+    });
+
+    // The target image is read and the output written once, and the
+    // saved image read if needed.  Run one at a time, each stage
+    // (after its statistics) reads its inputs and writes its output.
+    traffic.scheduled+=(shading || modified ? 3 : 2)*image;
+    traffic.staged+=((saturation ? 4 : 0)+(shading ? 4 : 0)+
+                     (tint ? 2 : 0)+(modified ? 3 : 0))*image;
+    AddMemoryTraffic(traffic);
+    return result;
+}
 
-	// Compute log10(x)  as ln(x)/ln(10)
-	cv::log(img_lms,img_lms);
-	img_lms=img_lms/log(10);
 
-    // Apply stage 2 transform.
-	cv::transform(img_lms, img_lab, LMS_to_lab);
 
-	return img_lab;
-}
 
 
 
-cv::Mat convertFromlab(cv::Mat input)
+bool SelectRegions(cv::Mat &targetf, cv::Mat &sourcef, cv::Mat &fulltargetf,
+                   MaskRegion &tregion, std::string targetname,
+                   std::string sourcename,
+                   std::string TargetMaskName, cv::Rect TargetRegion,
+                   std::string SourceMaskName, cv::Rect SourceRegion,
+                   bool bottomUp)
 {
-	cv::Mat img_lms (input.size(),  CV_32FC3);
-	cv::Mat img_RGBf(input.size(),  CV_32FC3);
-	cv::Mat img_BGRf(input.size(),  CV_32FC3);
-    cv::Mat temp    (LMS_to_lab.size(),CV_32FC1);
-
-    // Apply inverse of stage 2 transformation.
-	cv::invert(LMS_to_lab,temp);
-	cv::transform(input, img_lms, temp);
-
-	// Compute 10^x as (e^x)^(ln10)
-    cv::exp(img_lms,img_lms);
-    cv::pow(img_lms,(double)log(10.0),img_lms);
+// Restricts the colour transfer to the regions of the target and
+// source images selected by the mask images and rectangles of
+// Option 16.  'sourcef' is replaced by its selected pixels and
+// 'targetf' by its selected pixels, each packed into an image of
+// one column (see 'Common/MaskRegion.hpp').  The whole target image
+// is then returned in 'fulltargetf', and the target region in
+// 'tregion', so that the processed pixels can be put back by
+// 'ScatterRegion'.  'fulltargetf' is left empty if the whole target
+// image is selected.  'bottomUp' indicates that the rows of the
+// target image are stored bottom to top (as for a mapped PFM image).
+// Returns false if a mask cannot be used or nothing is selected.
+
+    MaskRegion sregion;
+    if(!SourceMaskName.empty() || SourceRegion.area()>0)
+    {
+        if(!FindImageRegion(sourcef, sourcename, SourceMaskName,
+                            SourceRegion, false, sregion)) return false;
+        sourcef=GatherRegion(sourcef, sregion);
+    }
+    if(!TargetMaskName.empty() || TargetRegion.area()>0)
+    {
+        if(!FindImageRegion(targetf, targetname, TargetMaskName,
+                            TargetRegion, bottomUp, tregion)) return false;
+        fulltargetf=targetf;
+        targetf=GatherRegion(targetf, tregion);
+    }
+    return true;
+}
 
-    // Apply inverse of stage 1 transformation.
-	cv::invert(RGB_to_LMS,temp);
-	cv::transform(img_lms, img_RGBf, temp);
+bool FindImageRegion(cv::Mat image, std::string imagename,
+                     std::string maskname, cv::Rect roi, bool bottomUp,
+                     MaskRegion &region)
+{
+// Finds the region of 'image' selected by the mask image 'maskname'
+// (if given) and the rectangle 'roi' (if not empty), both given for
+// the image file 'imagename'.  A source image may have been decoded
+// at reduced scale, in which case the mask and the rectangle are
+// scaled to match it.
+
+    // The size of the image file.
+    cv::Size full=image.size();
+    int width, height;
+    if(ReadJpegSize(imagename, width, height)) full=cv::Size(width, height);
+
+    cv::Mat mask;
+    if(!maskname.empty())
+    {
+        mask=cv::imread(maskname, cv::IMREAD_GRAYSCALE);
+        if(mask.size()!=full)
+        {
+            std::cout<<"Mask "<<maskname<<" does not match "<<imagename<<"\n";
+            return false;
+        }
+    }
 
-	//  Revert channel ordering to BGR.
-	cv::cvtColor(img_RGBf, img_BGRf, CV_RGB2BGR);
+    if(full!=image.size())
+    {
+        double sx=(double)image.cols/full.width;
+        double sy=(double)image.rows/full.height;
+        if(!mask.empty())
+            cv::resize(mask, mask, image.size(), 0, 0, cv::INTER_NEAREST);
+        if(roi.area()>0)
+        {
+            int x0=(int)std::floor(roi.x*sx), y0=(int)std::floor(roi.y*sy);
+            int x1=(int)std::ceil((roi.x+roi.width)*sx);
+            int y1=(int)std::ceil((roi.y+roi.height)*sy);
+            roi=cv::Rect(x0, y0, std::max(x1-x0, 1), std::max(y1-y0, 1));
+        }
+    }
+    if(bottomUp)
+    {
+        if(!mask.empty()) cv::flip(mask, mask, 0);
+        if(roi.area()>0) roi.y=image.rows-roi.y-roi.height;
+    }
 
-	return img_BGRf;
+    region=FindMaskRegion(mask, roi, image.size());
+    if(region.pixels==0)
+    {
+        std::cout<<"No pixels selected in "<<imagename<<"\n";
+        return false;
+    }
+    return true;
 }
 
 
 
-// ##########################################################################
-// ##########################################################################
-// ##########################################################################
-
 
 // Notes on Cross Correlation Matching.
 // ====================================
@@ -734,8 +1906,273 @@ cv::Mat convertFromlab(cv::Mat input)
 //(for a maximum modification corresponding to 50%).
 
 
-
-
-
-
-
+// Notes on Deterministic Statistics.
+// ==================================
+// The means, standard deviations and mean cross products are
+// computed in parallel and the order in which partial sums are
+// added then depends upon the number of threads.  The resulting
+// tiny differences are amplified by the later processing, so that
+// output images can differ slightly between machines.  When
+// 'DeterministicStatistics' is 'true' the statistics are computed
+// over blocks of a fixed size, in double precision, and the block
+// results are combined in a fixed order.  (See 'Common/Statistics.hpp'.)
+// The output is then bit-identical regardless of the thread count,
+// at a small extra cost.
+
+
+// Notes on Adaptive Reshaping.
+// ============================
+// Each reshaping iteration matches the weighted fourth powers of
+// the values above and below the mean to those of the source
+// image by scaling the tails of the distribution by a factor 'k'.
+// The amount by which 'k' differs from one is a direct measure of
+// how far the distributions still are from matching and it comes
+// from the statistics which the iteration computes anyway.  When
+// 'ReshapingTolerance' is greater than zero, 'ReshapingIterations'
+// is the maximum number of iterations and each phase of reshaping
+// stops as soon as the largest correction is below the tolerance
+// (0.01 is a reasonable value) or is no longer falling.  The number
+// of reshaping iterations used is reported.
+//
+// The weighted fourth powers are held as tail moments (see
+// 'Common/Moments.hpp'), which are sums over blocks of rows.  Those
+// of the source are gathered once rather than in every iteration,
+// and like the other moments they can be gathered for bands of a
+// very large image in separate processes, saved and merged.
+
+
+// Notes on Histogram Reshaping.
+// =============================
+// Iterative reshaping matches only the weighted fourth powers of
+// the colour channel values, costs several full image passes with
+// transcendental functions per iteration and approaches a match
+// only gradually.  When 'HistogramReshaping' is 'true' each phase
+// of reshaping (before and after the cross covariance processing)
+// is replaced by a single histogram match, in which the values of
+// each colour channel are mapped through its cumulative
+// distribution and then through the inverse cumulative
+// distribution of the source channel.  This matches the whole
+// distribution, to within the histogram resolution of 1/256 of a
+// standard deviation, in two passes over the image.  The number
+// of phases still follows 'ReshapingIterations' (one phase for
+// one iteration, two phases for more) and 'ReshapingTolerance'
+// is not needed.
+
+
+// Notes on Fast Approximate Transforms.
+// =====================================
+// The conversions to and from the L-alpha-beta colour space are
+// dominated by a logarithm and a power of ten per channel per
+// pixel.  When 'FastMathError' is set these are computed from
+// branch free polynomial approximations of log2 and 2^x which the
+// compiler vectorises (see 'Common/ColourSpace.hpp').  The
+// polynomial degree is the lowest for which a worst case bound on
+// the output error stays within 'FastMathError', allowing for the
+// gain of the equivalent affine transfer, which scales the error of
+// the forward conversion.  Note that the error in the final image
+// can still be larger, since reshaping and the saturation and
+// shading stages amplify small differences in places.  'ReportFastMathError'
+// processes each image with the exact functions as well and
+// reports the measured difference in 8 bit levels, so a batch
+// list of reference images can be used to confirm the budget.
+
+
+// Notes on Memory Tracking.
+// =========================
+// When 'TrackMemory' is 'true' every cv::Mat allocation is passed
+// through a tracking allocator (see 'Common/MemoryTracker.hpp')
+// which charges it to the processing stage active on the calling
+// thread: Decode, CoreProcessing, ChannelCondition,
+// SaturationProcessing, FullShading, FinalAdjustment or Encode.
+// After each image is written a table is printed giving, for each
+// stage, the numbers of allocations and releases, the total bytes
+// allocated, the peak bytes live at any one time and the bytes
+// still live.  The '(all stages)' line gives the peak memory for
+// the image as a whole, which is the figure needed to size a
+// container for a given number of concurrent images.  Memory
+// allocated by OpenCV's own worker threads is reported separately
+// ('other threads') in batch processing.  Tracking adds a lock per
+// allocation and is off by default.
+
+
+// Notes on Machine Tuning.
+// ========================
+// The fastest number of processing threads, size of the blocks in
+// which the transfer kernel works through the image and choice
+// between the exact and the fast approximate functions depend upon
+// the processor and upon the image size.  Running the program as
+//     Main --tune
+// times the whole processing, with the selected options, of
+// synthetic images of about 0.7, 2.8, 11 and 24 megapixels and
+// saves the fastest settings for each size in
+// 'ColourTransferTuning.txt' in the working directory (see
+// 'Common/Tuning.hpp'), keyed by the processor model.  When
+// 'UseMachineTuning' is set the settings for this machine and the
+// target image size are then used automatically.  In batch
+// processing the block size and the choice of functions are those
+// for the size of each image, while the number of threads is left
+// to the batch settings.  The thread count applies to all of the
+// OpenCV processing but the block size only to the transfer
+// kernel (the fused path taken when 'ReshapingIterations' is
+// zero, and the colour space conversions otherwise).  The fast
+// functions are never used unless 'FastMathError' permits them;
+// the tuning only withdraws them on machines where they are not
+// the faster.
+
+
+// Notes on Deadlines.
+// ===================
+// The processing time varies greatly with the image size and with
+// 'ReshapingIterations' and 'ExtraShading'.  When 'DeadlineSeconds'
+// is set, the time taken per pixel by each processing stage is
+// first measured on this machine, once at startup, for synthetic
+// images (see 'CalibrateDeadlineCosts') and the time for each image
+// is then predicted from its size.  If the prediction exceeds 80% of the
+// deadline, the following reductions are made in turn, each only as
+// far as needed (see 'PlanDeadline').
+//   1. The source statistics are computed from a regular sample of
+//      the source pixels (1 in 4, 16 or 64).
+//   2. Fewer reshaping iterations are made.
+//   3. The processing is applied to a reduced copy of the target
+//      image (1/2, 1/4 or 1/8 scale) and the change made to it is
+//      enlarged and applied to the full image.  Broad colour changes
+//      are kept but fine detail in the change is lost.
+//   4. The saturation processing is left out.
+// The reductions made are reported, with the predicted and actual
+// times.  After each image the measured costs are corrected towards
+// the time actually taken, so that predictions follow the machine's
+// load.
+//
+// The costs are measured with the refinements which the options
+// select (tint and mix included) and, so that memory bandwidth is
+// counted as it is for real images, on images twice the size of the
+// last level cache.  Each image is counted as meeting or missing
+// its deadline.  Once the corrections have settled (after the first
+// five images) misses should be rare, and at the end of a batch the
+// misses are reported and checked: if more than one in twenty of at
+// least twenty images missed, the cost model is reported as not
+// fitting the machine.  A deadline which even the fully reduced
+// processing cannot meet is always missed.
+// (The library, which has no startup, measures the costs with the
+// first deadline transfer and takes that time from its deadline.)
+
+
+
+// Notes on the Result Cache.
+// ==========================
+// When 'ResultCacheDir' is set, each output image is also stored in
+// that directory, under a key formed from a hash of the decoded
+// target and source pixels, the processing options, the output bit
+// depth and 'EnhancedOutputVersion'.  When the same images are
+// processed again with the same options (for example when a job is
+// retried or an unchanged item is rendered again) the stored output
+// file is copied to the output name and none of the processing is
+// done.
+//
+// Entries are written under a temporary name and renamed, so that
+// several processes may share a cache directory, and when the total
+// size exceeds 'ResultCacheMB' megabytes the least recently used
+// entries are deleted (see 'Common/ResultCache.hpp').  The key
+// holds a version number rather than the time of the build, so that
+// a rebuild, or the same build on another machine, still finds the
+// results.  'EnhancedOutputVersion' must therefore be increased
+// whenever a change to the program changes its output, so that
+// stale results are never returned.  Results reduced to meet a
+// deadline are not stored.  Unless the statistics are computed
+// deterministically (Option 10) the stored output may
+// differ in the last bit from one computed afresh with a different
+// number of threads.
+
+
+
+// Notes on Masked Regions.
+// ========================
+// A retoucher will often want the colour transfer applied only to
+// part of the target image (a garment, say), with the source
+// statistics taken only from the matching part of the source image.
+// Each region is selected by a mask image, of the same size as the
+// image file, in which the non-zero pixels are selected, and/or by
+// a rectangle (in the coordinates of the image file).  Both are
+// scaled to match a source image decoded at reduced resolution.
+//
+// The processing is per-pixel apart from its global statistics (and
+// the largest saturation), so the selected pixels are gathered, one
+// run of pixels at a time, into a packed image of one column, which
+// is processed as a whole image would be, and the processed pixels
+// are then put back into the target image.  The statistics are thus
+// those of the selected pixels only, and the work and the memory
+// needed are in proportion to the selected area.  Pixels which are
+// not selected are left unchanged.  With a deadline (Option 14) the
+// packed image is never processed at reduced scale, since it has no
+// spatial layout, but the other reductions apply.  In batch
+// processing the same masks and rectangles apply to every image.
+
+
+
+// Notes on Strip Scheduling.
+// ==========================
+// The image refinements (saturation, shading, tint and the mix with
+// the original image) are each written as a succession of whole
+// image operations: colour conversions, channel splits and merges
+// and arithmetic.  For a large image every one of these reads and
+// writes images far larger than the processor caches, so the
+// refinements are limited by memory bandwidth rather than by the
+// arithmetic.
+//
+// When 'StripScheduling' is 'true' the statistics which the
+// refinements need (the largest saturations, the mean and standard
+// deviation of the saturation and of the grey shade original) are
+// gathered first, in at most two passes which read the processed
+// and original images, the second pass waiting for the first where
+// the automatic saturation shift needs the largest saturations.
+// All the refinements are then applied to one strip of rows after
+// another, each strip small enough for its intermediate results to
+// stay in the level 2 cache, with the strips shared between the
+// threads.  The processed and original images are read, and the
+// output written, once.  The outcome is that of the whole image
+// refinements, to within rounding.
+//
+// At the end of the run a model of the memory traffic is reported:
+// the whole images read and written by the passes made, together
+// with those of the same refinements run one at a time, each
+// reading its inputs and writing its output once.  This is an
+// estimate, not a measurement.  (The whole image routines make many
+// more passes than that, and a strip is assumed never to leave the
+// cache.)  With 'HardwareCounters' the measured traffic of the
+// 'StripRefinements' stage, from the last level cache misses, is
+// reported as well, and can be compared with that of the
+// 'SaturationProcessing', 'FullShading' and 'FinalAdjustment'
+// stages in a run without strip scheduling.
+
+
+
+// Notes on Hardware Counters.
+// ===========================
+// Timings show where the time goes but not why.  When
+// 'HardwareCounters' is 'true' the processor's counters of cycles,
+// instructions, last level cache misses and branch misses are read
+// through 'perf_event_open' (see 'Common/PerfCounters.hpp') as each
+// stage starts and ends: ConvertForward, ChannelCondition,
+// HistogramMatch, adjust_covariance, ConvertInverse, the rest of
+// CoreProcessing, SaturationProcessing, FullShading,
+// FinalAdjustment, StripRefinements and Encode.  A stage is charged
+// with its own counts, those of the stages within it being taken
+// away.
+//
+// At the end of the run a table gives, for each stage, the calls,
+// the pixels processed, the cycles per pixel, the instructions per
+// cycle, the memory traffic per pixel (estimated from the cache
+// misses), the instructions per byte of that traffic and the branch
+// misses per thousand pixels.  The last column places the stage on
+// a roofline, against the traffic per cycle of a streaming copy
+// measured at startup: 'memory' for a stage whose instructions per
+// byte are too few to keep the processor busy, 'compute' otherwise,
+// and '(stalls)' where the instructions per cycle fall well short of
+// the roof, as with cache or branch misses.
+//
+// The counts are of the whole process, so they are exact for a
+// single image but only indicative in batch processing, where
+// stages of different images overlap.  Where the counters cannot be
+// opened (often the case in containers, or with a restrictive
+// '/proc/sys/kernel/perf_event_paranoid') this is reported once and
+// the processing runs as usual without the table.
@@ -0,0 +1,739 @@
+//*** C INTERFACE TO THE COLOUR TRANSFER PROCESSING
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// Implementation of the interface declared in 'ColourTransfer.h'.
+// The caller's buffers are wrapped as cv::Mat headers (no copy) and
+// converted to the float BGR working format, after which the
+// processing is exactly that of the corresponding program.  The
+// CIELAB and L-alpha-beta methods use the shared transfer kernel
+// directly and the enhanced method uses the processing routines of
+// 'Further Enhanced Processing/Main.cpp', which is built into the
+// library with COLOURTRANSFER_LIBRARY defined so that its 'main'
+// routine is left out.
+//
+// Background jobs ('CTSubmit') are run by a small pool of worker
+// threads of the library's own, each job carrying a 'CancelToken'
+// (see 'Common/Cancellation.hpp') which the processing checks.
+//
+// A session ('CTSessionCreate') holds the input of each iteration of
+// the transfer, converted, with the moments of its tiles (see
+// 'Common/TileMoments.hpp') and the map of each iteration at the last
+// full redraw, so that an edited rectangle of the target costs, for
+// each iteration, a conversion of the rectangle and the moments of
+// the tiles it touches and, unless the statistics have moved, a
+// redraw of the rectangle alone.
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "../Common/TransferKernel.hpp"
+#include "../Common/Deadline.hpp"
+#include "../Common/Cancellation.hpp"
+#include "../Common/TileMoments.hpp"
+#include "ColourTransfer.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+// Processing routine of 'Further Enhanced Processing/Main.cpp'.
+cv::Mat DeadlineTransfer(cv::Mat targetf, cv::Mat sourcef,
+                         float CrossCovarianceLimit,
+                         int   ReshapingIterations,
+                         float ReshapingTolerance,
+                         bool  HistogramReshaping,
+                         float PercentSaturationShift,
+                         float PercentShadingShift,
+                         bool  ExtraShading,
+                         float PercentTint,
+                         float PercentModified,
+                         float FastMathError,
+                         double DeadlineSeconds,
+                         DeadlinePlan &plan);
+
+// A background job.  It is held by the caller until 'CTRelease' and
+// by the executor until it has completed, and is deleted when both
+// have let it go.
+struct CTJob
+{
+    CTImage      target, source, output;
+    CTOptions    options;
+    CTCompletion completion;
+    void        *userData;
+    CancelToken  token;
+    std::mutex   mutex;
+    std::condition_variable finished;
+    bool         done;
+    int          code;
+    CTResult     result;
+    int          holds;
+};
+
+namespace
+{
+
+// Number of jobs run at once.  Each transfer is itself spread over
+// OpenCV's thread pool, so more jobs at once would only compete for
+// the same processors.
+const int JobThreads = 2;
+
+// Layout of a pixel format.
+struct FormatInfo
+{
+    int    depth;
+    int    channels;
+    bool   rgb;     // Channel order RGB rather than BGR.
+    double scale;   // Multiplier to the range 0 to 1.
+};
+
+bool DescribeFormat(int format, FormatInfo &f)
+{
+    f.rgb=(format==CT_FORMAT_RGB8  || format==CT_FORMAT_RGBA8 ||
+           format==CT_FORMAT_RGB16 || format==CT_FORMAT_RGB32F);
+    f.channels=(format==CT_FORMAT_BGRA8 || format==CT_FORMAT_RGBA8) ? 4 : 3;
+    switch(format)
+    {
+    case CT_FORMAT_BGR8:   case CT_FORMAT_RGB8:
+    case CT_FORMAT_BGRA8:  case CT_FORMAT_RGBA8:
+        f.depth=CV_8U;  f.scale=1.0/255;   return true;
+    case CT_FORMAT_BGR16:  case CT_FORMAT_RGB16:
+        f.depth=CV_16U; f.scale=1.0/65535; return true;
+    case CT_FORMAT_BGR32F: case CT_FORMAT_RGB32F:
+        f.depth=CV_32F; f.scale=1.0;       return true;
+    }
+    return false;
+}
+
+// Checks an image description and wraps it as a cv::Mat header.
+int WrapImage(const CTImage *image, FormatInfo &f, cv::Mat &wrapped)
+{
+    if(!image || !image->data || image->width<=0 || image->height<=0)
+        return CT_BAD_ARGUMENT;
+    if(!DescribeFormat(image->format, f)) return CT_BAD_FORMAT;
+    size_t rowBytes=(size_t)image->width*f.channels*CV_ELEM_SIZE1(f.depth);
+    if(image->stride<(ptrdiff_t)rowBytes) return CT_BAD_ARGUMENT;
+    wrapped=cv::Mat(image->height, image->width,
+                    CV_MAKETYPE(f.depth, f.channels), image->data,
+                    (size_t)image->stride);
+    return CT_OK;
+}
+
+// Float BGR working copy of a wrapped image.  (The caller's memory
+// is only read, so the output may share the target buffer.)
+cv::Mat ToFloatBGR(const cv::Mat &wrapped, const FormatInfo &f)
+{
+    cv::Mat bgr=wrapped, bgrf;
+    if(f.channels==4) cv::cvtColor(wrapped, bgr, f.rgb ? cv::COLOR_RGBA2BGR
+                                                       : cv::COLOR_BGRA2BGR);
+    else if(f.rgb)    cv::cvtColor(wrapped, bgr, cv::COLOR_RGB2BGR);
+    bgr.convertTo(bgrf, CV_32F, f.scale);
+    return bgrf;
+}
+
+// Writes a float BGR result into the caller's output buffer.
+void FromFloatBGR(const cv::Mat &bgrf, const cv::Mat &alpha,
+                  cv::Mat &wrapped, const FormatInfo &f)
+{
+    if(f.channels==3 && !f.rgb)
+    {
+        bgrf.convertTo(wrapped, wrapped.type(), 1.0/f.scale);
+        return;
+    }
+    cv::Mat bgr;
+    bgrf.convertTo(bgr, CV_MAKETYPE(f.depth, 3), 1.0/f.scale);
+    if(f.channels==3) {cv::cvtColor(bgr, wrapped, cv::COLOR_BGR2RGB); return;}
+
+    // Interleave the colour channels with the alpha channel.
+    cv::Mat a=alpha;
+    if(a.empty()) a=cv::Mat(bgr.size(), CV_MAKETYPE(f.depth, 1),
+                            cv::Scalar(1.0/f.scale));
+    const cv::Mat in[2]={bgr, a};
+    int fromTo[8]={0, f.rgb ? 2 : 0,  1, 1,  2, f.rgb ? 0 : 2,  3, 3};
+    cv::mixChannels(in, 2, &wrapped, 1, fromTo, 4);
+}
+
+double Seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(
+           std::chrono::steady_clock::now()-start).count();
+}
+
+void CopyStatistics(const ColourStatistics &s, double mean[3],
+                    double dev[3], double &corr)
+{
+    for(int c=0;c<3;c++) {mean[c]=s.mean[c]; dev[c]=s.dev[c];}
+    corr=s.corr;
+}
+
+void ReleaseJob(CTJob *job)
+{
+    bool last;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        last=--job->holds==0;
+    }
+    if(last) delete job;
+}
+
+// Runs a job, calls its completion function and then wakes any
+// caller waiting for it.  (So the completion function has returned
+// before 'CTWait' does.)  A job cancelled while still queued is
+// not started.
+void RunJob(CTJob *job)
+{
+    int code=CT_CANCELLED;
+    CTResult r;
+    memset(&r, 0, sizeof(r));
+    if(!Cancelled(&job->token))
+    {
+        CancelScope scope(&job->token);
+        code=CTTransfer(&job->target, &job->source, &job->output,
+                        &job->options, &r);
+    }
+    if(code==CT_OK) job->token.progress.store(1.0f);
+    if(job->completion)
+        job->completion(job, code, code==CT_OK ? &r : NULL, job->userData);
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->done=true;
+        job->code=code;
+        job->result=r;
+    }
+    job->finished.notify_all();
+    ReleaseJob(job);
+}
+
+// Worker threads running the queued jobs in order.
+class JobExecutor
+{
+public:
+    JobExecutor()
+    {
+        int threads=std::max(1, std::min(JobThreads, cv::getNumberOfCPUs()));
+        for(int i=0;i<threads;i++)
+            std::thread(&JobExecutor::Work, this).detach();
+    }
+    void Submit(CTJob *job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(job);
+        }
+        available.notify_one();
+    }
+private:
+    void Work()
+    {
+        for(;;)
+        {
+            CTJob *job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                available.wait(lock, [this]() {return !queue.empty();});
+                job=queue.front();
+                queue.pop_front();
+            }
+            RunJob(job);
+        }
+    }
+    std::mutex              mutex;
+    std::condition_variable available;
+    std::deque<CTJob *>     queue;
+};
+
+// (The executor is never destroyed, so that no worker thread has
+// to be stopped while the process exits.)
+JobExecutor &Executor()
+{
+    static JobExecutor *executor=new JobExecutor;
+    return *executor;
+}
+
+}
+
+
+
+CT_API void CTDefaultOptions(CTOptions *options, int method)
+{
+    if(!options) return;
+    options->method                 = method;
+    options->crossCovarianceLimit   = 0.5f;
+    options->fastMathError          = 0.0f;
+    options->keepOriginalShading    = 1;
+    options->scaleRatherThanClip    = 1;
+    options->iterations             = 2;
+    options->convergenceTolerance   = 0.0f;
+    options->localWindow            = 0;
+    options->reshapingIterations    = 1;
+    options->reshapingTolerance     = 0.0f;
+    options->histogramReshaping     = 0;
+    options->percentSaturationShift = -1.0f;
+    options->percentShadingShift    = 50.0f;
+    options->extraShading           = 1;
+    options->percentTint            = 100.0f;
+    options->percentModified        = 100.0f;
+    options->deadlineSeconds        = 0.0;
+}
+
+
+
+CT_API int CTTransfer(const CTImage *target, const CTImage *source,
+                      const CTImage *output, const CTOptions *options,
+                      CTResult *result)
+{
+    std::chrono::steady_clock::time_point start, t0;
+    start=std::chrono::steady_clock::now();
+    CTResult r;
+    memset(&r, 0, sizeof(r));
+
+    if(!options) return CT_BAD_ARGUMENT;
+    FormatInfo tf, sf, of;
+    cv::Mat twrap, swrap, owrap;
+    int code;
+    if((code=WrapImage(target, tf, twrap))!=CT_OK) return code;
+    if((code=WrapImage(source, sf, swrap))!=CT_OK) return code;
+    if((code=WrapImage(output, of, owrap))!=CT_OK) return code;
+    if(owrap.size()!=twrap.size()) return CT_SIZE_MISMATCH;
+    if(options->method<CT_METHOD_LAB || options->method>CT_METHOD_ENHANCED)
+        return CT_BAD_ARGUMENT;
+
+    try
+    {
+        // Convert the inputs, keeping any target alpha channel (an
+        // independent copy, since the output may be the target).
+        t0=std::chrono::steady_clock::now();
+        cv::Mat targetf=ToFloatBGR(twrap, tf);
+        cv::Mat sourcef=ToFloatBGR(swrap, sf);
+        cv::Mat alpha;
+        if(tf.channels==4 && of.channels==4 && tf.depth==of.depth)
+            cv::extractChannel(twrap, alpha, 3);
+        r.inputSeconds=Seconds(t0);
+        CancelPoint(0.05f);
+
+        // Statistics in the working colour space of the method.
+        const CTOptions &o=*options;
+        LalphabetaSpace lalphabeta(o.method==CT_METHOD_LALPHABETA ? 0.07f
+                                                                  : 1.0f/255,
+                                   o.fastMathError);
+        CielabSpace cielab(o.fastMathError);
+        if(result)
+        {
+            t0=std::chrono::steady_clock::now();
+            ColourStatistics ts, ss;
+            if(o.method==CT_METHOD_LAB)
+            {
+                ts=ConvertForward(cielab, targetf, NULL);
+                ss=ConvertForward(cielab, sourcef, NULL);
+            }
+            else
+            {
+                ts=ConvertForward(lalphabeta, targetf, NULL);
+                ss=ConvertForward(lalphabeta, sourcef, NULL);
+            }
+            CopyStatistics(ts, r.targetMean, r.targetDev, r.targetCorr);
+            CopyStatistics(ss, r.sourceMean, r.sourceDev, r.sourceCorr);
+            r.statisticsSeconds=Seconds(t0);
+        }
+
+        // The colour transfer.  (The output buffer is not touched
+        // if the job is cancelled.)
+        t0=std::chrono::steady_clock::now();
+        ProgressStage stage(0.1f, 0.95f);
+        if(o.method==CT_METHOD_ENHANCED)
+        {
+            DeadlinePlan plan;
+            targetf=DeadlineTransfer(targetf, sourcef,
+                                     o.crossCovarianceLimit,
+                                     o.reshapingIterations,
+                                     o.reshapingTolerance,
+                                     o.histogramReshaping!=0,
+                                     o.percentSaturationShift,
+                                     o.percentShadingShift,
+                                     o.extraShading!=0,
+                                     o.percentTint,
+                                     o.percentModified,
+                                     o.fastMathError,
+                                     o.deadlineSeconds, plan);
+            r.sourceStep=plan.sourceStep;
+            r.reshapingIterationsUsed=plan.reshapingIterationsUsed;
+            r.pyramidScale=1<<plan.pyramidLevel;
+            r.saturationSkipped=plan.skipSaturation ? 1 : 0;
+            r.predictedSeconds=plan.predictedSeconds;
+        }
+        else
+        {
+            TransferOptions opt;
+            opt.crossCovarianceLimit=o.crossCovarianceLimit;
+            opt.shaderVal=o.keepOriginalShading ? 0.0f : 1.0f;
+            opt.iterations=o.iterations;
+            opt.convergenceTolerance=o.convergenceTolerance;
+            if(o.method==CT_METHOD_LAB)
+            {
+                opt.rescale=o.scaleRatherThanClip!=0;
+                if(o.localWindow>0)
+                    targetf=LocalTransfer(cielab, targetf, sourcef,
+                                          o.localWindow, opt);
+                else
+                    targetf=IterativeTransfer(cielab, targetf,
+                                              sourcef, opt,
+                                              &r.iterationsUsed);
+            }
+            else
+            {
+                opt.clipOutput=true;
+                if(o.localWindow>0)
+                    targetf=LocalTransfer(lalphabeta, targetf, sourcef,
+                                          o.localWindow, opt);
+                else
+                    targetf=IterativeTransfer(lalphabeta, targetf, sourcef,
+                                              opt, &r.iterationsUsed);
+            }
+        }
+        r.transferSeconds=Seconds(t0);
+
+        // Write the result into the caller's buffer.
+        t0=std::chrono::steady_clock::now();
+        FromFloatBGR(targetf, alpha, owrap, of);
+        r.outputSeconds=Seconds(t0);
+    }
+    catch(const TransferCancelled &)
+    {
+        return CT_CANCELLED;
+    }
+    catch(...)
+    {
+        return CT_PROCESSING;
+    }
+
+    r.totalSeconds=Seconds(start);
+    if(result) *result=r;
+    return CT_OK;
+}
+
+
+
+CT_API CTJob *CTSubmit(const CTImage *target, const CTImage *source,
+                       const CTImage *output, const CTOptions *options,
+                       CTCompletion completion, void *userData)
+{
+    if(!options) return NULL;
+    CTJob *job=new (std::nothrow) CTJob;
+    if(!job) return NULL;
+    // (Missing images are left empty for 'CTTransfer' to reject.)
+    memset(&job->target, 0, sizeof(CTImage));
+    memset(&job->source, 0, sizeof(CTImage));
+    memset(&job->output, 0, sizeof(CTImage));
+    if(target) job->target=*target;
+    if(source) job->source=*source;
+    if(output) job->output=*output;
+    job->options=*options;
+    job->completion=completion;
+    job->userData=userData;
+    job->done=false;
+    job->code=CT_PENDING;
+    memset(&job->result, 0, sizeof(CTResult));
+    job->holds=2;
+    try
+    {
+        Executor().Submit(job);
+    }
+    catch(...)
+    {
+        delete job;
+        return NULL;
+    }
+    return job;
+}
+
+
+
+CT_API void CTCancel(CTJob *job)
+{
+    if(job) job->token.cancelled.store(true);
+}
+
+
+
+CT_API double CTProgress(CTJob *job)
+{
+    return job ? job->token.progress.load() : 0.0;
+}
+
+
+
+CT_API int CTWait(CTJob *job, double timeoutSeconds, CTResult *result)
+{
+    if(!job) return CT_BAD_ARGUMENT;
+    std::unique_lock<std::mutex> lock(job->mutex);
+    if(timeoutSeconds<0)
+        job->finished.wait(lock, [job]() {return job->done;});
+    else
+        job->finished.wait_for(lock,
+                               std::chrono::duration<double>(timeoutSeconds),
+                               [job]() {return job->done;});
+    if(!job->done) return CT_PENDING;
+    if(result) *result=job->result;
+    return job->code;
+}
+
+
+
+CT_API void CTRelease(CTJob *job)
+{
+    if(!job) return;
+    CTCancel(job);
+    ReleaseJob(job);
+}
+
+
+
+// An incremental session.  The colour spaces are those which
+// 'CTTransfer' uses for the method.
+struct CTSession
+{
+    CTImage          target, source, output;
+    CTOptions        options;
+    double           tolerance;
+    bool             incremental;
+    FormatInfo       tf, of;
+    cv::Mat          twrap, owrap;
+    LalphabetaSpace  lalphabeta;
+    CielabSpace      cielab;
+    ColourStatistics s;         // Source.
+
+    // For each iteration, its input with the moments of its tiles,
+    // and its statistics and map at the last full redraw.
+    std::vector<TileMoments>      stages;
+    std::vector<ColourStatistics> drawn;
+    std::vector<TransferMap>      maps;
+
+    explicit CTSession(const CTOptions &o)
+        : options(o),
+          lalphabeta(o.method==CT_METHOD_LALPHABETA ? 0.07f : 1.0f/255,
+                     o.fastMathError),
+          cielab(o.fastMathError),
+          stages(std::max(o.iterations, 1)), drawn(stages.size()),
+          maps(stages.size()) {}
+};
+
+namespace
+{
+
+// Redraws rectangle 'rect' of the output of a session, after first
+// making the map of each iteration afresh, and the input of each
+// iteration after the first, if 'full'.  The maps are those of
+// 'IterativeTransfer' without a convergence tolerance.
+template<class Space>
+void DrawSession(CTSession &session, const Space &space, cv::Rect rect,
+                 bool full)
+{
+    const CTOptions &o=session.options;
+    bool clip=o.method==CT_METHOD_LALPHABETA;
+    size_t n=session.stages.size();
+    for(size_t k=0;full && k<n;k++)
+    {
+        float W1, W2;
+        TileMoments &stage=session.stages[k];
+        session.drawn[k]=StatisticsFromMoments(stage.total);
+        CovarianceWeights(session.drawn[k].corr, session.s.corr,
+                          o.crossCovarianceLimit*(k+1)/n, W1, W2);
+        session.maps[k]=MakeTransferMap(session.drawn[k], session.s, W1, W2,
+                                        o.keepOriginalShading ? 0.0f : 1.0f);
+        if(o.method==CT_METHOD_LAB && o.scaleRatherThanClip)
+            RescaleMap(space, stage.converted, session.maps[k]);
+        if(k+1<n)
+            BuildTileMoments(space, ConvertInverse(space, stage.converted,
+                                                   &session.maps[k], clip),
+                             session.stages[k+1]);
+    }
+    cv::Mat bgrf=ConvertInverse(space, session.stages[n-1].converted(rect),
+                                &session.maps[n-1], clip);
+    cv::Mat alpha, out=session.owrap(rect);
+    if(session.tf.channels==4 && session.of.channels==4 &&
+       session.tf.depth==session.of.depth)
+        cv::extractChannel(session.twrap(rect), alpha, 3);
+    FromFloatBGR(bgrf, alpha, out, session.of);
+}
+
+template<class Space>
+void StartSession(CTSession &session, const Space &space,
+                  const cv::Mat &sourcef)
+{
+    session.s=ConvertForward(space, sourcef, NULL);
+    BuildTileMoments(space, ToFloatBGR(session.twrap, session.tf),
+                     session.stages[0]);
+    DrawSession(session, space,
+                cv::Rect(0, 0, session.twrap.cols, session.twrap.rows),
+                true);
+}
+
+// Carries the change to rectangle 'rect' of the target through the
+// input of each iteration in turn, with the maps of the last full
+// redraw, stopping if the statistics of an input move by more than
+// the tolerance, in which case the whole output is redrawn.
+template<class Space>
+void UpdateSession(CTSession &session, const Space &space, cv::Rect rect,
+                   CTUpdate &u)
+{
+    bool clip=session.options.method==CT_METHOD_LALPHABETA;
+    cv::Mat bgrf=ToFloatBGR(session.twrap(rect), session.tf);
+    for(size_t k=0;k<session.stages.size();k++)
+    {
+        TileMoments &stage=session.stages[k];
+        if(k>0)
+            bgrf=ConvertInverse(space, session.stages[k-1].converted(rect),
+                                &session.maps[k-1], clip);
+        int tiles=UpdateTileMoments(space, bgrf, rect, stage);
+        if(k==0) u.tilesUpdated=tiles;
+        u.statisticsShift=std::max(u.statisticsShift,
+                              StatisticsShift(session.drawn[k],
+                                  StatisticsFromMoments(stage.total)));
+        if(u.statisticsShift>session.tolerance) break;
+    }
+    u.fullRender=u.statisticsShift>session.tolerance ? 1 : 0;
+    if(u.fullRender)
+        rect=cv::Rect(0, 0, session.twrap.cols, session.twrap.rows);
+    DrawSession(session, space, rect, u.fullRender!=0);
+}
+
+}
+
+
+
+CT_API CTSession *CTSessionCreate(const CTImage *target,
+                                  const CTImage *source,
+                                  const CTImage *output,
+                                  const CTOptions *options,
+                                  double tolerance, int *code)
+{
+    int unused;
+    if(!code) code=&unused;
+    *code=CT_BAD_ARGUMENT;
+    if(!options || tolerance<0) return NULL;
+    FormatInfo tf, sf, of;
+    cv::Mat twrap, swrap, owrap;
+    if((*code=WrapImage(target, tf, twrap))!=CT_OK) return NULL;
+    if((*code=WrapImage(source, sf, swrap))!=CT_OK) return NULL;
+    if((*code=WrapImage(output, of, owrap))!=CT_OK) return NULL;
+    *code=CT_SIZE_MISMATCH;
+    if(owrap.size()!=twrap.size()) return NULL;
+    *code=CT_BAD_ARGUMENT;
+    if(options->method<CT_METHOD_LAB || options->method>CT_METHOD_ENHANCED ||
+       output->data==target->data) return NULL;
+
+    CTSession *session=NULL;
+    *code=CT_PROCESSING;
+    try {session=new CTSession(*options);}
+    catch(...) {}
+    if(!session) return NULL;
+    session->target=*target;
+    session->source=*source;
+    session->output=*output;
+    session->tolerance=tolerance;
+    session->incremental=options->method!=CT_METHOD_ENHANCED &&
+                         options->localWindow<=0 && options->iterations>=1 &&
+                         options->convergenceTolerance<=0;
+    // (The maps of a session change without the target being
+    // converted again, so their gains are not known in advance.)
+    if(session->incremental)
+        FitFastMathToMap(session->lalphabeta, (const TransferMap *)NULL);
+    session->tf=tf;
+    session->of=of;
+    session->twrap=twrap;
+    session->owrap=owrap;
+
+    try
+    {
+        if(!session->incremental)
+            *code=CTTransfer(target, source, output, options, NULL);
+        else
+        {
+            cv::Mat sourcef=ToFloatBGR(swrap, sf);
+            if(options->method==CT_METHOD_LAB)
+                StartSession(*session, session->cielab, sourcef);
+            else
+                StartSession(*session, session->lalphabeta, sourcef);
+            *code=CT_OK;
+        }
+    }
+    catch(...)
+    {
+        *code=CT_PROCESSING;
+    }
+    if(*code!=CT_OK)
+    {
+        delete session;
+        return NULL;
+    }
+    return session;
+}
+
+
+
+CT_API int CTSessionUpdate(CTSession *session, int x, int y,
+                           int width, int height, CTUpdate *update)
+{
+    std::chrono::steady_clock::time_point start;
+    start=std::chrono::steady_clock::now();
+    CTUpdate u;
+    memset(&u, 0, sizeof(u));
+
+    if(!session || width<0 || height<0) return CT_BAD_ARGUMENT;
+    cv::Rect rect=cv::Rect(x, y, width, height)&
+                  cv::Rect(0, 0, session->twrap.cols, session->twrap.rows);
+    try
+    {
+        if(!session->incremental)
+        {
+            int code=CTTransfer(&session->target, &session->source,
+                                &session->output, &session->options, NULL);
+            if(code!=CT_OK) return code;
+            u.fullRender=1;
+        }
+        else if(rect.area()>0)
+        {
+            if(session->options.method==CT_METHOD_LAB)
+                UpdateSession(*session, session->cielab, rect, u);
+            else
+                UpdateSession(*session, session->lalphabeta, rect, u);
+        }
+    }
+    catch(...)
+    {
+        return CT_PROCESSING;
+    }
+
+    u.seconds=Seconds(start);
+    if(update) *update=u;
+    return CT_OK;
+}
+
+
+
+CT_API void CTSessionRelease(CTSession *session)
+{
+    delete session;
+}
+
+
+
+CT_API const char *CTErrorString(int code)
+{
+    switch(code)
+    {
+    case CT_OK:            return "success";
+    case CT_BAD_ARGUMENT:  return "invalid argument";
+    case CT_BAD_FORMAT:    return "unsupported pixel format";
+    case CT_SIZE_MISMATCH: return "output size differs from target size";
+    case CT_PROCESSING:    return "processing failed";
+    case CT_CANCELLED:     return "cancelled";
+    case CT_PENDING:       return "not yet complete";
+    }
+    return "unknown error";
+}
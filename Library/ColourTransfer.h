@@ -0,0 +1,260 @@
+/*** C INTERFACE TO THE COLOUR TRANSFER PROCESSING
+ *
+ * Copyright  Terry Johnson, October 2026
+ * https://github.com/TJCoding
+ *
+ * A plain C interface, built as the shared library
+ * 'libcolourtransfer.so', through which any of the three colour
+ * transfer methods can be applied to images held in the caller's
+ * own memory (decoded video frames, shared memory segments and so
+ * on).  The caller describes each image by a pointer, its width
+ * and height, the number of bytes between the starts of successive
+ * rows (the stride) and its pixel format.  The buffers are used in
+ * place and are never retained after the call returns; the result
+ * is written directly into the caller's output buffer, which may
+ * be the target buffer itself.
+ *
+ * Only fixed size C types are used, so the interface can be called
+ * through the foreign function interfaces of other languages
+ * without any extra copying of image data.
+ *
+ * 'CTSubmit' runs a transfer as a background job, for callers such
+ * as event loops which cannot wait for it.  The job may be waited
+ * for, polled for its progress and cancelled; a cancelled job stops
+ * at the next check between processing stages, iterations or
+ * blocks of rows.  ('ColourTransfer.hpp' wraps a job as a C++
+ * future or coroutine awaitable.)
+ *
+ * A session ('CTSessionCreate') keeps the target, converted, with
+ * the statistics of each of its tiles, for callers such as
+ * retouching tools which edit part of the target and transfer
+ * again.  Each update then only revisits the edited rectangle.
+ *
+ * Build (Linux, from the repository folder):
+ *   g++ -O3 -std=c++11 -pthread -fPIC -shared -fvisibility=hidden
+ *       -DCOLOURTRANSFER_LIBRARY Library/ColourTransfer.cpp
+ *       "Further Enhanced Processing/Main.cpp"
+ *       -o libcolourtransfer.so `pkg-config --cflags --libs opencv4`
+ * OpenCV 3.2 or later, including 4.x, is supported (for 3.x the
+ * pkg-config package is 'opencv' rather than 'opencv4').
+ */
+
+#ifndef COLOURTRANSFER_H
+#define COLOURTRANSFER_H
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#define CT_API __declspec(dllexport)
+#else
+#define CT_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pixel formats.  The 4 channel formats carry an alpha channel
+ * which is not processed; the output alpha is copied from the
+ * target image if it has one and is otherwise opaque.  16 bit and
+ * float formats are processed at full precision (float values are
+ * nominally in the range 0 to 1). */
+enum
+{
+    CT_FORMAT_BGR8    = 0,
+    CT_FORMAT_RGB8    = 1,
+    CT_FORMAT_BGRA8   = 2,
+    CT_FORMAT_RGBA8   = 3,
+    CT_FORMAT_BGR16   = 4,
+    CT_FORMAT_RGB16   = 5,
+    CT_FORMAT_BGR32F  = 6,
+    CT_FORMAT_RGB32F  = 7
+};
+
+/* Processing methods. */
+enum
+{
+    CT_METHOD_LAB        = 0, /* 'Main.cpp', CIELAB.                   */
+    CT_METHOD_LALPHABETA = 1, /* L-alpha-beta alternative.             */
+    CT_METHOD_ENHANCED   = 2  /* 'Further Enhanced Processing'.        */
+};
+
+/* Return codes. */
+enum
+{
+    CT_OK             =  0,
+    CT_BAD_ARGUMENT   = -1,
+    CT_BAD_FORMAT     = -2,
+    CT_SIZE_MISMATCH  = -3,
+    CT_PROCESSING     = -4,
+    CT_CANCELLED      = -5,
+    CT_PENDING        =  1  /* 'CTWait' timed out.               */
+};
+
+/* An image in caller owned memory. */
+typedef struct
+{
+    void     *data;
+    int       width;
+    int       height;
+    ptrdiff_t stride;   /* Bytes from one row to the next. */
+    int       format;   /* CT_FORMAT_...                   */
+} CTImage;
+
+/* Processing options.  Call 'CTDefaultOptions' first and then
+ * change the fields required.  The fields correspond to the
+ * options of the same names described in each program. */
+typedef struct
+{
+    int   method;                  /* CT_METHOD_...                   */
+    float crossCovarianceLimit;    /* All methods.                    */
+    float fastMathError;           /* All methods.                    */
+
+    /* CT_METHOD_LAB and CT_METHOD_LALPHABETA. */
+    int   keepOriginalShading;
+    int   scaleRatherThanClip;     /* CT_METHOD_LAB only.             */
+    int   iterations;
+    float convergenceTolerance;
+    int   localWindow;             /* 0 for global statistics.        */
+
+    /* CT_METHOD_ENHANCED. */
+    int   reshapingIterations;
+    float reshapingTolerance;
+    int   histogramReshaping;
+    float percentSaturationShift;
+    float percentShadingShift;
+    int   extraShading;
+    float percentTint;
+    float percentModified;
+    double deadlineSeconds;        /* 0 for no deadline.              */
+} CTOptions;
+
+/* Statistics and timings returned by 'CTTransfer'.  The means,
+ * standard deviations and colour channel (1 and 2) correlations
+ * are of the target and source images in the working colour space
+ * of the method (CIELAB or L-alpha-beta). */
+typedef struct
+{
+    double targetMean[3], targetDev[3], targetCorr;
+    double sourceMean[3], sourceDev[3], sourceCorr;
+    int    iterationsUsed;         /* CT_METHOD_LAB and LALPHABETA.   */
+    double inputSeconds;           /* Conversion of the input images. */
+    double statisticsSeconds;      /* Statistics reported above.      */
+    double transferSeconds;        /* The colour transfer.            */
+    double outputSeconds;          /* Conversion into the output.     */
+    double totalSeconds;
+
+    /* CT_METHOD_ENHANCED with a deadline: the processing reductions
+     * made to meet it (none if 'sourceStep' and 'pyramidScale' are
+     * 1 and 'saturationSkipped' is 0) and the predicted transfer
+     * time.  'reshapingIterationsUsed' is the number of reshaping
+     * iterations made, with or without a deadline, which may be
+     * fewer than the option if the reshaping converged early. */
+    int    sourceStep;             /* Statistics of 1 in n*n pixels.  */
+    int    reshapingIterationsUsed;
+    int    pyramidScale;           /* Processed at 1/n scale.         */
+    int    saturationSkipped;
+    double predictedSeconds;
+} CTResult;
+
+/* Fills 'options' with the default settings for 'method'. */
+CT_API void CTDefaultOptions(CTOptions *options, int method);
+
+/* Transfers the colours of 'source' to 'target', writing the
+ * result to 'output', which must have the size of 'target' (and
+ * may share its memory).  'result' may be NULL.  Returns CT_OK or
+ * a negative error code; no exception ever leaves the library. */
+CT_API int CTTransfer(const CTImage *target, const CTImage *source,
+                      const CTImage *output, const CTOptions *options,
+                      CTResult *result);
+
+/* A background transfer job. */
+typedef struct CTJob CTJob;
+
+/* Called, on the thread that ran the job, when a job completes or
+ * is cancelled.  'result' is NULL unless 'code' is CT_OK. */
+typedef void (*CTCompletion)(CTJob *job, int code, const CTResult *result,
+                             void *userData);
+
+/* Queues the transfer of 'CTTransfer' to be run by the library's
+ * own worker threads and returns at once.  The image descriptors
+ * and options are copied, but the image buffers must remain valid
+ * until the job completes.  'completion' may be NULL.  Returns NULL
+ * if 'options' is NULL or the job cannot be created.  The job must
+ * be released with 'CTRelease'. */
+CT_API CTJob *CTSubmit(const CTImage *target, const CTImage *source,
+                       const CTImage *output, const CTOptions *options,
+                       CTCompletion completion, void *userData);
+
+/* Asks the job to stop.  It completes with CT_CANCELLED unless it
+ * has already finished. */
+CT_API void CTCancel(CTJob *job);
+
+/* The fraction of the job done, from 0 to 1. */
+CT_API double CTProgress(CTJob *job);
+
+/* Waits up to 'timeoutSeconds' (without limit if negative) for the
+ * job to complete.  Returns its return code, filling 'result' if
+ * not NULL, or CT_PENDING if it has not completed. */
+CT_API int CTWait(CTJob *job, double timeoutSeconds, CTResult *result);
+
+/* Releases the caller's hold on the job, cancelling it if it has
+ * not completed.  The completion function is still called. */
+CT_API void CTRelease(CTJob *job);
+
+/* An incremental transfer session. */
+typedef struct CTSession CTSession;
+
+/* Outcome of 'CTSessionUpdate'. */
+typedef struct
+{
+    int    fullRender;             /* The whole output was redrawn.   */
+    int    tilesUpdated;           /* Tiles of target statistics.     */
+    double statisticsShift;        /* Since the last full redraw.     */
+    double seconds;
+} CTUpdate;
+
+/* Transfers the colours of 'source' to 'target' as 'CTTransfer'
+ * does and keeps the target statistics for later updates.  Unlike
+ * 'CTTransfer', the target and output buffers must remain valid
+ * until the session is released and must not share memory.  The
+ * source is only read here.  Statistics are updated incrementally
+ * for CT_METHOD_LAB and CT_METHOD_LALPHABETA with no local window
+ * and no convergence tolerance, for any number of iterations (the
+ * default options qualify), at the cost of a converted copy of the
+ * target for each iteration.  With other options every update is a
+ * full 'CTTransfer' and the source buffer must remain valid too.
+ * Returns NULL, with the error in 'code' (which may be NULL), if
+ * the session cannot be created. */
+CT_API CTSession *CTSessionCreate(const CTImage *target,
+                                  const CTImage *source,
+                                  const CTImage *output,
+                                  const CTOptions *options,
+                                  double tolerance, int *code);
+
+/* Transfers again after the caller has changed the rectangle at
+ * 'x', 'y' of 'width' by 'height' pixels of the target.  The
+ * statistics of the tiles touched by the rectangle are replaced, in
+ * the target and in the input of each later iteration.  If any of
+ * these statistics have then moved by more than the session's
+ * 'tolerance' (in standard deviations for the means and deviations,
+ * and directly for the correlation) since the output was last drawn
+ * in full, the whole output is redrawn with the new statistics.
+ * Otherwise only the rectangle is redrawn, with the statistics of
+ * the last full redraw, so that it matches the rest of the output.
+ * 'update' may be NULL.  A session must not be updated from two
+ * threads at once. */
+CT_API int CTSessionUpdate(CTSession *session, int x, int y,
+                           int width, int height, CTUpdate *update);
+
+/* Releases a session. */
+CT_API void CTSessionRelease(CTSession *session);
+
+/* A short description of a return code. */
+CT_API const char *CTErrorString(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
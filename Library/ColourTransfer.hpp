@@ -0,0 +1,150 @@
+//*** C++ FUTURES AND AWAITABLES FOR BACKGROUND COLOUR TRANSFER
+//
+// Copyright  Terry Johnson, October 2026
+// https://github.com/TJCoding
+//
+// A background job of 'ColourTransfer.h' wrapped for C++ callers:
+//
+//     CTAsyncTransfer job(&target, &source, &output, &options);
+//     ...
+//     int code=job.Future().get();        // or poll job.Progress()
+//
+// or, in a C++20 coroutine,
+//
+//     int code=co_await job;
+//
+// in which case the coroutine is resumed on the library's worker
+// thread when the job completes.  Destroying the object cancels the
+// job if it has not completed and waits for it to stop, which is a
+// matter of milliseconds.  The image buffers must remain valid
+// until then.
+
+#ifndef COLOURTRANSFER_HPP
+#define COLOURTRANSFER_HPP
+
+#include "ColourTransfer.h"
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define CT_COROUTINES 1
+#endif
+
+class CTAsyncTransfer
+{
+public:
+    // Submits the job.  The future is ready with CT_BAD_ARGUMENT at
+    // once if the job cannot be submitted.
+    CTAsyncTransfer(const CTImage *target, const CTImage *source,
+                    const CTImage *output, const CTOptions *options)
+        : state(std::make_shared<State>()),
+          future(state->promise.get_future())
+    {
+        std::shared_ptr<State> *hold=new std::shared_ptr<State>(state);
+        job=CTSubmit(target, source, output, options, Completed, hold);
+        if(!job) Complete(hold, CT_BAD_ARGUMENT, NULL);
+    }
+    // (A coroutine may destroy the object from within the completion
+    // function, when the job is already complete and is not waited
+    // for.)
+    ~CTAsyncTransfer()
+    {
+        if(!job) return;
+        bool done;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            done=state->done;
+        }
+        if(!done)
+        {
+            CTCancel(job);
+            CTWait(job, -1, NULL);
+        }
+        CTRelease(job);
+    }
+
+    // The return code of the transfer, when complete.
+    std::future<int> &Future() {return future;}
+
+    // The statistics and timings, once complete with CT_OK.
+    const CTResult &Result() const {return state->result;}
+
+    void   Cancel() {if(job) CTCancel(job);}
+    double Progress() const {return job ? CTProgress(job) : 1.0;}
+
+#ifdef CT_COROUTINES
+    bool await_ready() const
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->done;
+    }
+    // (The coroutine is resumed at once if the job completed after
+    // 'await_ready'.)
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if(state->done) return false;
+        state->waiter=handle;
+        return true;
+    }
+    int await_resume() {return state->code;}
+#endif
+
+private:
+    struct State
+    {
+        std::promise<int> promise;
+        std::mutex        mutex;
+        bool              done;
+        int               code;
+        CTResult          result;
+#ifdef CT_COROUTINES
+        std::coroutine_handle<> waiter;
+#endif
+        State() : done(false), code(CT_PENDING)
+        {
+            memset(&result, 0, sizeof(result));
+        }
+    };
+
+    static void Completed(CTJob *, int code, const CTResult *result,
+                          void *userData)
+    {
+        Complete((std::shared_ptr<State> *)userData, code, result);
+    }
+    // The completion function holds its own reference to the state,
+    // which may outlive the object.
+    static void Complete(std::shared_ptr<State> *hold, int code,
+                         const CTResult *result)
+    {
+        std::shared_ptr<State> s(*hold);
+        delete hold;
+#ifdef CT_COROUTINES
+        std::coroutine_handle<> waiter;
+#endif
+        {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            if(result) s->result=*result;
+            s->code=code;
+            s->done=true;
+#ifdef CT_COROUTINES
+            waiter=s->waiter;
+#endif
+        }
+        s->promise.set_value(code);
+#ifdef CT_COROUTINES
+        if(waiter) waiter.resume();
+#endif
+    }
+
+    std::shared_ptr<State> state;
+    std::future<int>       future;
+    CTJob                 *job;
+
+    CTAsyncTransfer(const CTAsyncTransfer &);
+    CTAsyncTransfer &operator=(const CTAsyncTransfer &);
+};
+
+#endif
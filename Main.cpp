@@ -8,11 +8,55 @@
 
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/photo/photo.hpp>
+#include "Common/Batch.hpp"
+#include "Common/ImageIO.hpp"
+#include "Common/Statistics.hpp"
+#include "Common/TransferKernel.hpp"
+#include "Common/Moments.hpp"
+#include "Common/Tuning.hpp"
+#include "Common/MemoryTracker.hpp"
+#ifdef USE_LIBJPEG
+#include "Common/JpegStatistics.hpp"
+#endif
+#ifdef COMPARE_ENHANCED
+#include "Library/ColourTransfer.h"
+#endif
+#include <chrono>
 #include <iostream>
+#include <fstream>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 int main(int argc, char *argv[]);
-cv::Mat adjust_covariance(cv::Mat Lab[3], cv::Mat sLab[3], float covLim);
-cv::Mat Rescale(cv::Mat lab_image);
+cv::Mat ColourTransfer(cv::Mat targetf, cv::Mat sourcef,
+                       float CrossCovarianceLimit,
+                       bool  KeepOriginalShading,
+                       bool  ScaleRatherThanClip,
+                       int   iterations,
+                       float ConvergenceTolerance,
+                       int   LocalWindow,
+                       float FastMathError,
+                       const ColourStatistics *SourceStatistics,
+                       bool  RgbTarget);
+int MomentsCommand(int argc, char *argv[]);
+bool ReadSourceStatistics(std::string filename, float maxError,
+                          float FastMathError, ColourStatistics &stats);
+
+// A work item for batch processing.
+struct CielabBatchItem : BatchItem
+{
+    ColourStatistics sourcestats;   // In place of 'sourcef' if
+    bool        hasstats;           // 'hasstats' is set.
+    CielabBatchItem() : hasstats(false) {}
+};
+
+int CompareColourSpaces(std::string targetname, std::string sourcename,
+                        std::string outputname, std::string comparisonname,
+                        const TransferOptions &opt, int LocalWindow,
+                        float SourceAccuracy, float FastMathError,
+                        int OutputDepth, bool UseMachineTuning);
 
 int main(int argc, char *argv[])
 {
@@ -42,6 +86,84 @@ int main(int argc, char *argv[])
 
 //  Option 4
 //  There is an option to iterate the processing more than once
+//  either a fixed number of times or, adaptively, until the
+//  image statistics match those of the source image.
+//  (See the note at the end of the code).
+
+//  Option 5
+//  There is an option to decode the source image at reduced
+//  resolution.  The source image contributes only its global
+//  statistics, so a large source image may be decoded at 1/2,
+//  1/4 or 1/8 scale.  The decoder averages the pixels, which
+//  lowers the standard deviations by an amount that depends on the
+//  image, so the change in the statistics may be reported.  The
+//  source image is decoded in full by default.
+//  (See the notes in 'Common/ImageIO.hpp').
+
+//  Option 6
+//  There is an option to select the bit depth of the output
+//  image (8 bit, 16 bit or 32 bit float) or to match the bit
+//  depth of the target image.  16 bit and float target images
+//  are processed at full precision.
+//  (See the notes in 'Common/ImageIO.hpp').
+
+//  Option 7
+//  There is an option to compute the image statistics
+//  deterministically, so that the output image is bit-identical
+//  whatever the number of processor threads.
+//  (See the note at the end of the code).
+
+//  Option 8
+//  There is an option to track the memory allocated for images
+//  and to report, for each image, the allocation counts and the
+//  allocated, peak and live memory of each processing stage.
+//  (See the note at the end of the code).
+
+//  Option 9
+//  There is an option to transfer colour locally, using the target
+//  statistics of a square window around each pixel rather than
+//  those of the whole image, for images with strong regional
+//  colour variation.
+//  (See the note at the end of the code).
+
+//  Option 10
+//  There is an option to take the source image statistics from a
+//  moments file rather than from the source image.  The file is
+//  merged from partial statistics computed separately, by several
+//  processes or machines, for bands of rows of a very large source
+//  image.  (The program is run with command line arguments to
+//  compute and to merge the partial statistics.)
+//  (See the note at the end of the code).
+
+//  Option 11
+//  There is an option to use the processing thread count,
+//  block size and choice of exact or fast functions found to be
+//  fastest for this machine and the image size, when the program
+//  has been run with the argument '--tune'.
+//  (See the note at the end of the code).
+
+//  Option 12
+//  There is an option to convert to and from L*a*b* with fast
+//  approximations of the sRGB gamma and cube root functions,
+//  within a specified maximum error in the output, and to report
+//  the colour difference from OpenCV's conversion.  The exact
+//  functions are the default.
+//  (See the note at the end of the code).
+
+//  Option 13
+//  There is an option to estimate the statistics of a JPEG source
+//  image from its DCT coefficients, without decoding it, when the
+//  estimated error is within a specified limit.  The source image
+//  is otherwise decoded.  (This needs the program to be built with
+//  'USE_LIBJPEG' defined and linked with libjpeg.)
+//  (See the note at the end of the code).
+
+//  Option 14
+//  There is an option to compare the result with that of the
+//  L-alpha-beta alternative implementation (and, when built with
+//  the colour transfer library, with that of the further enhanced
+//  processing), decoding and analysing the images only once for
+//  all of them, and to write the results side by side.
 //  (See the note at the end of the code).
 
 
@@ -56,6 +178,29 @@ int main(int argc, char *argv[])
     bool  KeepOriginalShading     = true;   // Option 2 (Default is 'true'.)
     bool  ScaleRatherThanClip     = true;   // Option 3 (Default is 'true'.)
     int   iterations              = 2;      // Option 4 (Default is '2'.)
+    float ConvergenceTolerance    = 0.0;    // Option 4 (Default is '0.0'.)
+    float SourceAccuracy          = 0.0;    // Option 5 (Default is '0.0'.)
+    bool  ReportDecodeDrift       = false;  // Option 5 (Default is 'false'.)
+    // (SourceAccuracy, for example 0.001, keeps at least 1/SourceAccuracy^2
+    // pixels at reduced resolution, or 0 decodes the source image in full.)
+    int   OutputDepth             = 0;      // Option 6 (Default is '0'.)
+    // (OutputDepth may be 8, 16 or 32, or 0 to match the target image.)
+    bool  DeterministicStatistics = false;  // Option 7 (Default is 'false'.)
+    bool  TrackMemory             = false;  // Option 8 (Default is 'false'.)
+    int   LocalWindow             = 0;      // Option 9 (Default is '0'.)
+    // (LocalWindow is the window width in pixels, or 0 for global statistics.)
+    std::string SourceMomentsName = "";     // Option 10 (Default is "".)
+    bool  UseMachineTuning        = true;   // Option 11 (Default is 'true'.)
+    float FastMathError           = 0.0;    // Option 12 (Default is '0.0'.)
+    bool  ReportFastMathError     = false;  // Option 12 (Default is 'false'.)
+    // (FastMathError is the permitted output error, for example 0.5/255,
+    // or 0 for the exact functions.)
+    float JpegStatisticsError     = 0.0;    // Option 13 (Default is '0.0'.)
+    // (JpegStatisticsError is the permitted estimated error, for example
+    // 0.05, or 0 always to decode the source image.)
+    std::string ComparisonName    = "";     // Option 14 (Default is "".)
+    // (ComparisonName is the side by side image file, or "" for no
+    // comparison.)
 
 
     // Specify the image files that are to be processed,
@@ -64,241 +209,543 @@ int main(int argc, char *argv[])
 
     std::string targetname = "images/Flowers_target.jpg";
     std::string sourcename = "images/Flowers_source.jpg";
+    std::string outputname = "images/processed.jpg";
+
+
+    // For batch processing, specify a list file in which each
+    // line gives a target, a source and an output file name.
+    // The files are then processed in a pipeline in which
+    // decoding, colour transfer and encoding run concurrently.
+    // (Leave 'batchname' empty to process the single image above.)
+    // (See the notes in 'Common/Batch.hpp'.)
+
+    std::string batchname = "";
+    int    DecodeThreads      = 2;     // Threads reading images.
+    int    TransferThreads    = 2;     // Threads transferring colour.
+    int    EncodeThreads      = 2;     // Threads writing images.
+    double MemoryBudgetMB     = 1024;  // Memory for images in flight.
+    bool   ShardedBatch       = false; // Share the list between processes.
+    double LeaseSeconds       = 600;   // Time before a stopped process's
+                                       // items are taken over.
+    int    ShardChunkItems    = 64;    // Items claimed at a time.
 
 // ###########################################################################
 // ###########################################################################
 // ###########################################################################
 
+    SetDeterministicStatistics(DeterministicStatistics);
+    if(TrackMemory) EnableMemoryTracking();
+
+    // Tune the processing for this machine if requested.
+    if(argc>1 && std::string(argv[1])=="--tune")
+    {
+        RunTuner("CIELAB",
+                 [&](const cv::Mat &t, const cv::Mat &s, bool fastMath)
+        {
+            ColourTransfer(t, s, CrossCovarianceLimit, KeepOriginalShading,
+                           ScaleRatherThanClip, iterations,
+                           ConvergenceTolerance, LocalWindow,
+                           fastMath ? TuningFastMathError : 0.0f, NULL,
+                           false);
+        }, true);
+        return 0;
+    }
+
+    // Compute or merge partial source statistics if requested.
+    if(argc>1) return MomentsCommand(argc, argv);
+
+    // The fast functions are only used (within the permitted error)
+    // if they are the faster on this machine.
+    TuningConfig tuning;
+
+    if(!batchname.empty())
+    {
+        std::vector<std::string> targets, sources, outputs;
+        if(!ReadBatchList(batchname, targets, sources, outputs)) return 1;
+
+        // The tuned settings are chosen for each image's own size.
+        BatchTuning batchtuning;
+        bool tuned=UseMachineTuning && batchtuning.Load("CIELAB");
+
+        BatchSettings batch;
+        batch.listname       =batchname;
+        batch.decodeThreads  =DecodeThreads;
+        batch.transferThreads=TransferThreads;
+        batch.encodeThreads  =EncodeThreads;
+        batch.memoryBudgetMB =MemoryBudgetMB;
+        batch.sharded        =ShardedBatch;
+        batch.leaseSeconds   =LeaseSeconds;
+        batch.chunkItems     =ShardChunkItems;
+        batch.tuning         =tuned ? &batchtuning : NULL;
+
+        auto decode=[&](CielabBatchItem &item, size_t i)
+        {
+            float error=TunedFastMathError(item.tuning, FastMathError);
+            item.hasstats=ReadSourceStatistics(sources[i],
+                                               JpegStatisticsError,
+                                               error, item.sourcestats);
+            if(!item.hasstats)
+                item.sourcef=ConvertToFloat(
+                             ReadSourceImage(CielabSpace(error),
+                                             sources[i], SourceAccuracy,
+                                             ReportDecodeDrift));
+            return item.hasstats || !item.sourcef.empty();
+        };
+        auto transfer=[&](CielabBatchItem &item)
+        {
+            float error=TunedFastMathError(item.tuning, FastMathError);
+            if(ReportFastMathError && error>=CielabFastError)
+                PrintFastLabError(item.outputname, item.targetf,
+                                  item.mapped.rgb);
+            item.targetf=ColourTransfer(item.targetf, item.sourcef,
+                                        CrossCovarianceLimit,
+                                        KeepOriginalShading,
+                                        ScaleRatherThanClip,
+                                        iterations,
+                                        ConvergenceTolerance,
+                                        LocalWindow, error,
+                                        item.hasstats
+                                            ? &item.sourcestats
+                                            : NULL,
+                                        item.mapped.rgb);
+        };
+        auto encode=[&](CielabBatchItem &item)
+        {
+            WriteBatchItem(item, OutputDepth);
+        };
+
+        RunBatch<CielabBatchItem>(batch, targets, outputs,
+                                  decode, transfer, encode);
+        return 0;
+    }
+
+    // Compare the colour spaces if requested.
+    if(!ComparisonName.empty())
+    {
+        TransferOptions opt;
+        opt.crossCovarianceLimit=CrossCovarianceLimit;
+        opt.shaderVal=KeepOriginalShading ? 0.0f : 1.0f;
+        opt.rescale=ScaleRatherThanClip;
+        opt.iterations=iterations;
+        opt.convergenceTolerance=ConvergenceTolerance;
+        return CompareColourSpaces(targetname, sourcename, outputname,
+                                   ComparisonName, opt, LocalWindow,
+                                   SourceAccuracy, FastMathError,
+                                   OutputDepth, UseMachineTuning);
+    }
+
     // Declare variables
-    cv::Mat targetf, sourcef, Lab[3], sLab[3];
-    cv::Scalar tmean, tdev, smean, sdev;
-
-    // Read in the files.
-    cv::Mat target = cv::imread(targetname, 1);
-    cv::Mat source = cv::imread(sourcename, 1);
-
-
-    // Convert the images from integer to float
-    target.convertTo(targetf,CV_32FC3,1/255.0);
-    source.convertTo(sourcef,CV_32FC3,1/255.0);
-
-    // Convert the source image from the BGR colour
-    // space to the L*a*b colour space.
-    // Estimate the mean and standard deviation of
-    // colour channels. Split the source image into
-    // channels and standardise the data in the
-    // colour channels (channels a and b). The
-    // standardised data has zero mean and unit
-    // standard deviation.
-
-    cv::cvtColor(sourcef, sourcef, CV_BGR2Lab);
-    cv::meanStdDev(sourcef, smean, sdev);
-    cv::split(sourcef,sLab);
-    sLab[1]=(sLab[1]-smean[1])/sdev[1];
-    sLab[2]=(sLab[2]-smean[2])/sdev[2];
-
-    for (int i=1;i<=iterations;i++)
+    cv::Mat targetf, sourcef;
+    MappedImage mapped;
+    int targetdepth;
+    ColourStatistics sourcestats;
+    MomentAccumulator moments;
+    bool hasstats=true;
+
+    // Read in the files and convert the images to float.
+    // (A PFM target image is mapped, read only and in RGB order,
+    // rather than read.)
+    // The source image is not needed if its statistics are given.
+    targetf = ReadImageFloat(targetname, mapped, targetdepth);
+    if(UseMachineTuning &&
+       SelectTuning("CIELAB", (double)targetf.total(), tuning) &&
+       !tuning.fastMath) FastMathError=0;
+    if(SourceMomentsName.empty())
+    {
+        hasstats = ReadSourceStatistics(sourcename, JpegStatisticsError,
+                                        FastMathError, sourcestats);
+        if(!hasstats)
+        {
+            cv::Mat source = ReadSourceImage(CielabSpace(FastMathError),
+                                             sourcename, SourceAccuracy,
+                                             ReportDecodeDrift);
+            sourcef = ConvertToFloat(source);
+        }
+    }
+    else if(LoadMoments(moments, SourceMomentsName))
+    {
+        sourcestats = StatisticsFromMoments(moments);
+    }
+    else
     {
-     // Condition the target data as previously
-     // described for the source data.
-     cv::cvtColor(targetf, targetf, CV_BGR2Lab);
-     cv::meanStdDev(targetf, tmean, tdev);
-     cv::split(targetf,Lab);
-     Lab[1]=(Lab[1]-tmean[1])/tdev[1];
-     Lab[2]=(Lab[2]-tmean[2])/tdev[2];
-
-    // Implement cross covariance processing.
-    // (no effect for CrossCovarianceLimit=0)
-        float covLim=CrossCovarianceLimit*i/iterations;
-        targetf=adjust_covariance(Lab, sLab, covLim);
-        cv::split(targetf,Lab);
-
-     // Rescale the previously standardised colour channels
-     // so that the means and standard deviations now match
-     // those of the source image.
-     Lab[1]=Lab[1]*sdev[1]+smean[1];
-     Lab[2]=Lab[2]*sdev[2]+smean[2];
-
-     // If the original shading is not to be retained, then
-     // match the shading to that of the source image by
-     // standardising the data in the 'lightness' channel
-     // of the target image and then rescaling to match
-     // the corresponding channel of the source image.
-     if(!KeepOriginalShading)
-     {
-        Lab[0]=(Lab[0]-tmean[0])/tdev[0];
-        Lab[0]= Lab[0]*sdev[0]+smean[0];
-     }
-
-     cv::merge(Lab,3,targetf);
-
-     // The final image data will automatically be clipped to
-     // the range 0 to 255 (image saturation) unless rescaling
-     // is selected.
-     if(ScaleRatherThanClip){targetf=Rescale(targetf);}
-
-     // Convert the processed image back to BGR values.
-     cv::cvtColor(targetf, targetf,CV_Lab2BGR);
+        std::cout<<"Cannot read moments file "<<SourceMomentsName<<"\n";
+        return 1;
     }
-     // Convert to 8 bit format.
-     targetf.convertTo(target,CV_8UC3,255.0);
 
-     // Display and save the final image.
-     cv::imshow("processed image",target);
-     cv::imwrite("images/processed.jpg", target);
+    // Implement the colour transfer.
+    if(ReportFastMathError && FastMathError>=CielabFastError)
+        PrintFastLabError(targetname, targetf, mapped.rgb);
+    targetf = ColourTransfer(targetf, sourcef, CrossCovarianceLimit,
+                             KeepOriginalShading, ScaleRatherThanClip,
+                             iterations, ConvergenceTolerance,
+                             LocalWindow, FastMathError,
+                             hasstats ? &sourcestats : NULL,
+                             mapped.rgb);
+
+     // Save the final image in the selected bit depth.
+     if(OutputDepth==0) OutputDepth=targetdepth;
+     cv::Mat result;
+     bool written = WriteImageFloat(outputname, targetf, OutputDepth,
+                                    !mapped.image.empty(), &result);
+     if(!written) std::cout<<"Cannot write "<<outputname<<"\n";
+     UnmapImage(mapped);
+
+     // Report the memory used (if tracked).
+     PrintMemoryReport(-1, targetname);
+
+     // Display the final image.
+     cv::imshow("processed image",result);
 
     // Display images until a key is pressed.
      cv::waitKey(0);
-     return 0;
+     return written ? 0 : 1;
    }
 
-cv::Mat adjust_covariance(cv::Mat Lab[3], cv::Mat sLab[3], float covLim)
+cv::Mat ColourTransfer(cv::Mat targetf, cv::Mat sourcef,
+                       float CrossCovarianceLimit,
+                       bool  KeepOriginalShading,
+                       bool  ScaleRatherThanClip,
+                       int   iterations,
+                       float ConvergenceTolerance,
+                       int   LocalWindow,
+                       float FastMathError,
+                       const ColourStatistics *SourceStatistics,
+                       bool  RgbTarget)
 {
-        // This routine adjusts colour channels 2 and 3
-        // of the image within the L*a*b colour space.
-
-        // The channels each have zero mean and unit
-        // standard deviation but their cross correlation
-        // value will not normally be zero.
-        //
-        // The processing reduces the cross correlation between
-        // the channels to zero but then reintroduces
-        // correlation such that the new cross correlation
-        // value matches that for the source image.
-        //
-        // Throughout these manipulations the mean channel values
-        // are maintained at zero and the standard deviations are
-        // maintained as unity.
-        //
-        // The manipulations are based upon the following relationship.
-        //
-        // Let z1 and z2 be two independent (zero correlation) variables
-        // with zero means and unit standard deviations. It can be shown
-        // that variables a1 and a2 have zero means, unit standard
-        // deviations, and mutual cross correlation 'R' when:
-        //
-        // a1=sqrt((1+R)/2)*z1 + sqrt((1-R)/2)*z2
-        // a2=sqrt((1+R)/2)*z1 - sqrt((1-R)/2)*z2
-        //
-        // The above relationships are applied inversely to derive
-        // uncorrelated standardised colour channels variables from
-        // the standardised but correlated input channels.
-        //
-        // The above relationships are then applied directly to obtain
-        // standardised correlated colour channels with correlation
-        // matched to that of the source image colour channels.
-        //
-        // Original processing method attributable to Dr T E Johnson Sept 2019.
-
-        // Declare variables
-        float tcrosscorr, scrosscorr;
-        float W1, W2, norm;
-        cv::Mat temp1;
-        cv::Scalar smean, sdev, temp2;
-
-        // Compute the correlation for the target image colour channels.
-        // The correlation between the standardised variables (zero mean,
-        // unit standard deviation) can be computed as the mean cross
-        // product for the two channels.
-        cv::multiply(Lab[1],Lab[2],temp1);
-        temp2=cv::mean(temp1);
-        tcrosscorr =temp2[0];
-
-        std::cout<<tcrosscorr<<" =tcrosscorr \n";
-
-        // Compute the correlation for the source image colour channels.
-        cv::multiply(sLab[1],sLab[2],temp1);
-        temp2=cv::mean(temp1);
-        scrosscorr =temp2[0];
-        std::cout<<scrosscorr<<" =scrosscorr \n";
-
-        // Adjust the correlation between the standardised input
-        // channel values.
-        cv::Mat z1=Lab[1].clone();
-        cv::Mat z2=Lab[2].clone();
-
-        W1= 0.5*sqrt((1+scrosscorr)/(1+tcrosscorr))
-           +0.5*sqrt((1-scrosscorr)/(1-tcrosscorr));
-        W2= 0.5*sqrt((1+scrosscorr)/(1+tcrosscorr))
-           -0.5*sqrt((1-scrosscorr)/(1-tcrosscorr));
-
-        if(std::abs(W2)>covLim*std::abs(W1))
+// Implements the colour transfer for float BGR target and
+// source images in accordance with the processing options
+// described in the 'main' routine.
+//
+// The processing is carried out in the L*a*b colour space by
+// the shared transfer kernel (see 'Common/TransferKernel.hpp').
+// The colour channels (a and b) of the target are standardised
+// (zero mean and unit standard deviation), their cross
+// correlation is adjusted to match that of the source image and
+// they are then rescaled to the source means and standard
+// deviations.  Unless the original shading is to be kept, the
+// 'lightness' channel is matched to the source similarly.
+//
+// The final image data will automatically be clipped to the
+// permitted L*a*b ranges unless rescaling is selected.
+//
+// If 'ConvergenceTolerance' is greater than zero, 'iterations'
+// is the maximum number of iterations and the processing stops
+// as soon as the image statistics match those of the source
+// image to within the tolerance, or stop improving.
+//
+// If 'LocalWindow' is greater than zero, the target statistics
+// are those of the window around each pixel (and the convergence
+// tolerance does not apply).
+//
+// If 'FastMathError' is at least the error of the fast CIELAB
+// conversions (see 'Common/ColourSpace.hpp') they are used in
+// place of the exact conversions.
+//
+// If 'SourceStatistics' is given, it replaces the statistics of
+// 'sourcef' (which is then not used).
+//
+// If 'RgbTarget' is set, 'targetf' is in RGB order (a mapped PFM
+// image) and is read as such.  The result is always BGR.
+
+    MemoryScope scope("Transfer");
+
+    TransferOptions opt;
+    int used;
+
+    opt.crossCovarianceLimit=CrossCovarianceLimit;
+    opt.shaderVal=KeepOriginalShading ? 0.0f : 1.0f;
+    opt.rescale=ScaleRatherThanClip;
+    opt.iterations=iterations;
+    opt.convergenceTolerance=ConvergenceTolerance;
+    opt.rgbTarget=RgbTarget;
+
+    CielabSpace space(FastMathError);
+    ColourStatistics s = SourceStatistics ? *SourceStatistics
+                                          : ConvertForward(space, sourcef,
+                                                           NULL);
+
+    if(LocalWindow>0)
+        return LocalTransfer(space, targetf, s, LocalWindow, opt);
+
+    targetf=IterativeTransfer(space, targetf, s, opt, &used);
+
+    if(ConvergenceTolerance>0) std::cout<<"Iterations used: "<<used<<"\n";
+
+    return targetf;
+}
+
+int CompareColourSpaces(std::string targetname, std::string sourcename,
+                        std::string outputname, std::string comparisonname,
+                        const TransferOptions &opt, int LocalWindow,
+                        float SourceAccuracy, float FastMathError,
+                        int OutputDepth, bool UseMachineTuning)
+{
+// Transfers the colour of the source image to the target image in
+// the L*a*b colour space (as 'ColourTransfer' does) and in the
+// L-alpha-beta colour space (as the alternative implementation
+// does) and, if built with the colour transfer library and
+// 'COMPARE_ENHANCED' defined, by the further enhanced processing.
+//
+// The images are decoded once, and each is converted to both
+// colour spaces in a single pass, which gives the statistics for
+// both.  The converted target image is used for the first
+// iteration of each transfer.  Each result is written under
+// 'outputname' with the name of its colour space added, and the
+// target image and the results side by side to 'comparisonname'.
+// The time taken by each stage is reported.  If 'UseMachineTuning'
+// is set the tuned settings for the size of the target image are
+// used.
+// Returns the program exit code.
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point t0=Clock::now(), start=t0;
+    auto seconds=[&]()
+    {
+        double s=std::chrono::duration<double>(Clock::now()-t0).count();
+        t0=Clock::now();
+        return s;
+    };
+
+    // Read the images (the source image at reduced resolution
+    // where possible).
+    MappedImage mapped;
+    int targetdepth;
+    cv::Mat targetf=ReadImageFloat(targetname, mapped, targetdepth);
+    TuningConfig tuning;
+    if(UseMachineTuning &&
+       SelectTuning("CIELAB", (double)targetf.total(), tuning) &&
+       !tuning.fastMath) FastMathError=0;
+    cv::Mat sourcef=ConvertToFloat(ReadSourceImage(CielabSpace(FastMathError),
+                                                   sourcename,
+                                                   SourceAccuracy, false));
+    if(targetf.empty() || sourcef.empty())
+    {
+        std::cout<<"Cannot read "<<targetname<<" or "<<sourcename<<"\n";
+        UnmapImage(mapped);
+        return 1;
+    }
+    // (A PFM target is copied, in BGR order, since it is shown beside
+    // the results.)
+    targetf=CopyMappedImage(targetf, mapped);
+    if(OutputDepth==0) OutputDepth=targetdepth;
+    bool bottomUp=!mapped.image.empty();
+    printf("Decoding (shared):            %8.3f s\n", seconds());
+
+    // Convert each image to both colour spaces in one pass.
+    // (The converted target is not used for local statistics.)
+    MemoryScope scope("Transfer");
+    CielabSpace lab(FastMathError);
+    LalphabetaSpace lalphabeta(0.07f, FastMathError);
+    ConvertedImage tlab, tlalphabeta, slab, slalphabeta;
+    ConvertForwardPair(lab, lalphabeta, targetf, LocalWindow==0,
+                       tlab, tlalphabeta);
+    ConvertForwardPair(lab, lalphabeta, sourcef, false,
+                       slab, slalphabeta);
+    printf("Analysis of both spaces:      %8.3f s\n", seconds());
+
+    std::vector<std::string> names;
+    std::vector<cv::Mat> results;
+    results.push_back(targetf);
+
+    names.push_back("cielab");
+    results.push_back(LocalWindow>0
+        ? LocalTransfer(lab, targetf, slab.stats, LocalWindow, opt)
+        : IterativeTransfer(lab, targetf, slab.stats, opt, NULL, &tlab));
+    tlab.image.release();
+    printf("CIELAB transfer:              %8.3f s\n", seconds());
+
+    // (As in the alternative implementation, the output is clipped
+    // rather than rescaled.)
+    TransferOptions alphaopt=opt;
+    alphaopt.rescale=false;
+    alphaopt.clipOutput=true;
+    names.push_back("lalphabeta");
+    results.push_back(LocalWindow>0
+        ? LocalTransfer(lalphabeta, targetf, slalphabeta.stats,
+                        LocalWindow, alphaopt)
+        : IterativeTransfer(lalphabeta, targetf, slalphabeta.stats,
+                            alphaopt, NULL, &tlalphabeta));
+    tlalphabeta.image.release();
+    printf("L-alpha-beta transfer:        %8.3f s\n", seconds());
+
+#ifdef COMPARE_ENHANCED
+    // The library's default enhanced options, with the cross
+    // covariance limit and fast functions selected here.
+    CTOptions options;
+    CTDefaultOptions(&options, CT_METHOD_ENHANCED);
+    options.crossCovarianceLimit=opt.crossCovarianceLimit;
+    options.fastMathError=FastMathError;
+    cv::Mat enhanced(targetf.size(), CV_32FC3);
+    CTImage t={targetf.data, targetf.cols, targetf.rows,
+               (ptrdiff_t)targetf.step, CT_FORMAT_BGR32F};
+    CTImage s={sourcef.data, sourcef.cols, sourcef.rows,
+               (ptrdiff_t)sourcef.step, CT_FORMAT_BGR32F};
+    CTImage o={enhanced.data, enhanced.cols, enhanced.rows,
+               (ptrdiff_t)enhanced.step, CT_FORMAT_BGR32F};
+    int code=CTTransfer(&t, &s, &o, &options, NULL);
+    if(code==CT_OK)
+    {
+        names.push_back("enhanced");
+        results.push_back(enhanced);
+    }
+    else std::cout<<"Enhanced processing failed: "<<CTErrorString(code)
+                  <<"\n";
+    printf("Enhanced transfer:            %8.3f s\n", seconds());
+#endif
+
+    // Write each result, with the name of its colour space added
+    // before the extension, and then all of them side by side.
+    size_t dot=outputname.find_last_of('.');
+    if(dot==std::string::npos || dot<outputname.find_last_of("/\\"))
+        dot=outputname.size();
+    bool written=true;
+    for(size_t i=0;i<names.size();i++)
+    {
+        std::string name=outputname.substr(0, dot)+"_"+names[i]+
+                         outputname.substr(dot);
+        if(WriteImageFloat(name, results[i+1], OutputDepth, bottomUp))
+            continue;
+        std::cout<<"Cannot write "<<name<<"\n";
+        written=false;
+    }
+    cv::Mat sidebyside, result;
+    cv::hconcat(&results[0], results.size(), sidebyside);
+    if(!WriteImageFloat(comparisonname, sidebyside, OutputDepth, bottomUp,
+                        &result))
+    {
+        std::cout<<"Cannot write "<<comparisonname<<"\n";
+        written=false;
+    }
+    results.clear();
+    targetf.release();
+    UnmapImage(mapped);
+    printf("Writing:                      %8.3f s\n", seconds());
+    printf("Total:                        %8.3f s\n",
+           std::chrono::duration<double>(Clock::now()-start).count());
+
+    PrintMemoryReport(-1, targetname);
+
+    // Display the comparison until a key is pressed.
+    cv::imshow("comparison", result);
+    cv::waitKey(0);
+    return written ? 0 : 1;
+}
+
+int MomentsCommand(int argc, char *argv[])
+{
+// Computes or merges the partial statistics of a source image,
+// according to the command line arguments:
+//
+//   --moments <image> <shard> <shards> <moments file>
+//       writes the CIELAB moments of band 'shard' (0 to shards-1)
+//       of 'shards' equal bands of rows of the image.
+//
+//   --merge-moments <moments file> <partial moments file> ...
+//       merges the partial moments in the order given.
+//
+// The merged file is used by setting 'SourceMomentsName'.
+// Returns the program exit code.
+
+    std::string mode = argv[1];
+
+    if(mode=="--moments" && argc==6)
+    {
+        MappedImage mapped;
+        int depth;
+        int shard = atoi(argv[3]), shards = atoi(argv[4]);
+        cv::Mat imagef = ReadImageFloat(argv[2], mapped, depth);
+        if(imagef.empty() || shards<1 || shard<0 || shard>=shards)
+        {
+            std::cout<<"Cannot compute moments of "<<argv[2]<<"\n";
+            return 1;
+        }
+
+        // A PFM image is mapped read only and read in RGB order, so
+        // only the pages of this band are read from the file.  Other
+        // formats are decoded in full.  (The rows of a PFM image are
+        // counted from the bottom of the picture.)
+        int row0 = (int)((long long)imagef.rows*shard/shards);
+        int row1 = (int)((long long)imagef.rows*(shard+1)/shards);
+        MomentAccumulator m = mapped.rgb
+            ? AccumulateColourMoments(RgbOrder<CielabSpace>(CielabSpace()),
+                                      imagef, row0, row1)
+            : AccumulateColourMoments(CielabSpace(), imagef, row0, row1);
+        imagef.release();
+        UnmapImage(mapped);
+        if(!SaveMoments(m, argv[5]))
         {
-            W2=copysign(covLim*W1,W2);
-            norm=1.0/sqrt(W1*W1+W2*W2+2*W1*W2*tcrosscorr);
-            W1=W1*norm;
-            W2=W2*norm;
+            std::cout<<"Cannot write moments file "<<argv[5]<<"\n";
+            return 1;
         }
+        std::cout<<"Rows "<<row0<<" to "<<row1-1<<": "
+                 <<(long long)m.count<<" pixels\n";
+        return 0;
+    }
 
-        Lab[1]=W1*z1+W2*z2;
-        Lab[2]=W1*z2+W2*z1;
+    if(mode=="--merge-moments" && argc>=4)
+    {
+        MomentAccumulator total;
+        for(int i=3;i<argc;i++)
+        {
+            MomentAccumulator part;
+            if(!LoadMoments(part, argv[i]) || !MergeAccumulators(total, part))
+            {
+                std::cout<<"Cannot merge moments file "<<argv[i]<<"\n";
+                return 1;
+            }
+        }
+        if(!SaveMoments(total, argv[2]))
+        {
+            std::cout<<"Cannot write moments file "<<argv[2]<<"\n";
+            return 1;
+        }
+        ColourStatistics s = StatisticsFromMoments(total);
+        std::cout<<"Pixels:      "<<(long long)total.count<<"\n"
+                 <<"Means:       "<<s.mean[0]<<" "<<s.mean[1]<<" "
+                 <<s.mean[2]<<"\n"
+                 <<"Deviations:  "<<s.dev[0]<<" "<<s.dev[1]<<" "
+                 <<s.dev[2]<<"\n"
+                 <<"Correlation: "<<s.corr<<"\n";
+        return 0;
+    }
 
-        cv:merge(Lab,3,temp1);
-        return temp1;
+    std::cout<<"Usage: --moments <image> <shard> <shards> <file>\n"
+             <<"       --merge-moments <file> <partial file> ...\n";
+    return 1;
 }
 
-cv::Mat Rescale(cv::Mat lab_image)
+bool ReadSourceStatistics(std::string filename, float maxError,
+                          float FastMathError, ColourStatistics &stats)
 {
-// Rescales an image in L*a*b format to match
-// the permitted range representation in OpenCV
-
-    // Declare variables
-    cv::Mat Lab[3];
-    cv::Point minLoc, maxLoc;
-    double minVal, maxVal, scale=0.0, maxDev;
-
-    // Split the image into channels.
-    split(lab_image,Lab);
-
-    // The L*a*b format as implemented in OpenCV requires that
-    // the channel values lie within particular ranges. In the
-    // absence of any corrective action, values outside the range
-    // will automatically be clipped to the range limits.  This
-    // would be an arbitrary change to the data which alters its
-    // properties such that the processing as previously applied
-    // to the data no longer exactly achieves its intend outcome.
-    // This routine implements an alternative (also arbitrary)
-    // modification to the data in which the data in each channel
-    // is scaled back towards the centre of the range in order to
-    // prevent range overflow.
-    //
-    // Colour channels 'a' and 'b' are scaled jointly to ensure
-    // consistency.
-
-
-    // Express the maximum and minimum values of the 'a' colour channel
-    // as fractions of the maximum and minimum permitted values
-    // (which are 127 and -127).  Keep the largest fraction to date.
-    // A computed fractional value greater than one indicates
-    // a data value outside the permitted range
-    cv::minMaxLoc(Lab[1],&minVal, &maxVal, &minLoc, &maxLoc );
-    scale=std::max(0.0,maxVal/127);
-    scale=std::max(scale,-minVal/127);
-
-    // Process channel 'b' similarly to channel 'a'.
-    cv::minMaxLoc(Lab[2],&minVal, &maxVal, &minLoc, &maxLoc );
-    scale=std::max(scale, maxVal/127);
-    scale=std::max(scale,-minVal/127);
-
-    std::cout<<"   "<<   scale << " scale\n";
-
-    // If the largest channel excursion exceeds its permitted
-    // range, then scale both the image channels back to bring
-    // them within range.
-    if (scale>1.0) {Lab[1]=Lab[1]/scale; Lab[2]=Lab[2]/scale;}
-
-    // Express the maximum and minimum values of the 'lightness'
-    // channel as fractions of the permitted deviations.
-    // (50 +/-50 for the range 0 to 100.) A computed fractional
-    // value greater than one indicates a data value outside the
-    // permitted range, in response to which the data is rescaled.
-    cv::minMaxLoc(Lab[0],&minVal, &maxVal, &minLoc, &maxLoc );
-    scale=std::max((maxVal-50)/50, -(minVal-50)/50);
-    if(scale>1) {Lab[0]=(Lab[0]-50)/scale+50;}
-
-    merge(Lab,3,lab_image);
-
-    return lab_image;
+// Estimates the L*a*b* statistics of a JPEG source image from its
+// DCT coefficients (see 'Common/JpegStatistics.hpp') if 'maxError'
+// is greater than zero.  Returns false, so that the image is
+// decoded instead, if it is not a JPEG image of a type handled or
+// the estimated error is greater than 'maxError', or if the program
+// is built without libjpeg ('USE_LIBJPEG' not defined).
+
+    MemoryScope scope("Decode");
+
+#ifdef USE_LIBJPEG
+    float error;
+    if(maxError<=0 ||
+       !JpegStatistics(CielabSpace(FastMathError), filename, stats, error))
+        return false;
+    if(error>maxError)
+    {
+        std::cout<<"Estimated error "<<error<<" of the DCT statistics "
+                 <<"is too large, decoding the source\n";
+        return false;
+    }
+    std::cout<<"Source statistics from DCT coefficients (estimated error "
+             <<error<<")\n";
+    return true;
+#else
+    (void)filename; (void)FastMathError; (void)stats;
+    if(maxError>0)
+        std::cout<<"Built without 'USE_LIBJPEG', decoding the source\n";
+    return false;
+#endif
 }
 
 // Notes on Cross Correlation Matching.
@@ -342,4 +789,205 @@ cv::Mat Rescale(cv::Mat lab_image)
 
 // Note that when iteration is performed, the limiting for CrossCovarianceLimit
 // is relaxed progressively at each iteration.
-
+//
+// Adaptive iteration is selected by setting 'ConvergenceTolerance' to a
+// value greater than zero, when 'iterations' becomes the maximum number
+// of iterations.  At the start of each iteration the means and standard
+// deviations of the colour channels (and of the lightness channel when
+// the shading is not retained) are compared with those of the source
+// image, relative to the source standard deviations, as is the colour
+// cross correlation when CrossCovarianceLimit is 1.0.  These values come
+// from the statistics pass which the iteration needs anyway.  Processing
+// stops when the largest difference is below the tolerance (0.01 is a
+// reasonable value) or is no longer falling, but only once an
+// iteration has applied the full cross covariance limit.  The limit is
+// relaxed over the first two iterations (half of it being applied in
+// the first), so easy images finish after two iterations, or after one
+// if the limit is zero or the maximum is one.  The number of
+// iterations used is reported.
+
+
+// Notes on Deterministic Statistics.
+// ==================================
+// The means, standard deviations and mean cross products are
+// computed in parallel and the order in which partial sums are
+// added then depends upon the number of threads.  The resulting
+// tiny differences are amplified by the later processing, so that
+// output images can differ slightly between machines.  When
+// 'DeterministicStatistics' is 'true' the statistics are computed
+// over blocks of a fixed size, in double precision, and the block
+// results are combined in a fixed order.  (See 'Common/Statistics.hpp'.)
+// The output is then bit-identical regardless of the thread count,
+// at a small extra cost.
+
+
+// Notes on Memory Tracking.
+// =========================
+// When 'TrackMemory' is 'true' every cv::Mat allocation is passed
+// through a tracking allocator (see 'Common/MemoryTracker.hpp')
+// which charges it to the processing stage active on the calling
+// thread: Decode, Transfer or Encode.
+// After each image is written a table is printed giving, for each
+// stage, the numbers of allocations and releases, the total bytes
+// allocated, the peak bytes live at any one time and the bytes
+// still live.  The '(all stages)' line gives the peak memory for
+// the image as a whole, which is the figure needed to size a
+// container for a given number of concurrent images.  Memory
+// allocated by OpenCV's own worker threads is reported separately
+// ('other threads') in batch processing.  Tracking adds a lock per
+// allocation and is off by default.
+
+
+// Notes on Local Transfer.
+// ========================
+// Global statistics describe the image as a whole, so for a target
+// image with strong regional colour variation (a blue sky above
+// green fields, say) the transfer treats every region alike.  When
+// 'LocalWindow' is set, each pixel is standardised with the mean,
+// standard deviation and 'a'/'b' cross correlation of the
+// 'LocalWindow' x 'LocalWindow' neighbourhood around it, and then
+// rescaled to the global statistics of the source image.  The
+// local moments come from box filters over running sums (see
+// 'LocalTransfer' in 'Common/TransferKernel.hpp'), so the run time
+// does not depend on the window size.  The local standard
+// deviations are floored at a tenth of the global values so that
+// flat regions are not amplified into noise.  Windows of a few tens
+// to a few hundreds of pixels are suitable; a window as large as
+// the image approaches the global result.  'ScaleRatherThanClip'
+// applies as for global statistics, with one scaling for the whole
+// image, but takes a further pass over the image.
+//
+// The aim is a run time within about twice that of global
+// statistics for a 24 megapixel image.  That has NOT been verified.
+// Each iteration adds to the conversions of the global transfer
+// three box filter passes (over seven channels in all), the passes
+// which form the centred values, squares and products, and a
+// heavier pass applying the local transfer.  It also holds several
+// times as many float channels of the image at once.  Counting
+// passes suggests a ratio near two, but whether it is met depends
+// on the memory bandwidth and on OpenCV's box filter on the machine
+// concerned.  To check it, run the colour space comparison
+// ('ComparisonName') on a 24 megapixel image with 'LocalWindow' set
+// to 0 and then to (say) 101, and compare the "CIELAB transfer"
+// times which it prints.
+
+
+// Notes on Sharded Statistics.
+// ============================
+// Only the global statistics of the source image are used, so for
+// a very large source image they may be gathered in parts.  Each of
+// several processes (possibly on different machines) is run as
+//     Main --moments source.pfm <shard> <shards> part<shard>.txt
+// and computes the moments of its own band of rows.  A PFM image is
+// memory mapped read only and its pixels are converted from RGB
+// order as they are read, so each process reads only the pages of
+// its own band; other formats are decoded in full by each process.
+// A coordinator then runs
+//     Main --merge-moments source.txt part0.txt part1.txt ...
+// and 'SourceMomentsName' is set to "source.txt".  The moments
+// (counts, means and co-moments, see 'Common/Moments.hpp') are
+// merged by the pairwise method of Chan et al., so the merged
+// statistics agree with those of a single pass over the whole image
+// to rounding (and exactly, for given parts, whatever the machine).
+// The files are text with the values in hexadecimal floating point,
+// so nothing is lost in saving them, and each is written under a
+// temporary name and renamed so that a partial file is never read.
+
+
+// Notes on Machine Tuning.
+// ========================
+// The fastest number of processing threads and size of the blocks
+// in which the transfer kernel works through the image depend upon
+// the processor (its cores and caches) and upon the image size.
+// Running the program as
+//     Main --tune
+// times the colour transfer, with the selected options, of
+// synthetic images of about 0.7, 2.8, 11 and 24 megapixels, trying
+// each thread count, block size and then the fast L*a*b*
+// conversions in turn, and saves the fastest settings for each
+// size in 'ColourTransferTuning.txt' in the working directory (see
+// 'Common/Tuning.hpp').  The settings are keyed by the processor
+// model, so one file may serve a mixed fleet of machines.  (The
+// fast conversions are then used only where they are the faster
+// and 'FastMathError' permits them.)  When 'UseMachineTuning' is
+// set the settings for this machine and the target image size are
+// then used automatically.  In batch processing the block size and
+// the choice of conversions are those for the size of each image,
+// while the number of threads is left to the batch settings.  A
+// machine which has not been tuned uses the standard settings.
+// Deterministic statistics always use the standard block size, so
+// that results are the same on every machine.
+
+
+
+// Notes on Fast L*a*b* Conversion.
+// ================================
+// With the exact functions most of the processing time is spent
+// converting to and from L*a*b* (twice each with two iterations),
+// in the powers of the sRGB gamma function and the cube roots.
+// When 'FastMathError' is at least 0.1/255 these are replaced by
+// polynomial approximations (degree 5, see 'Common/ColourSpace.hpp')
+// and the conversion loops are written without branches so that
+// the compiler vectorises them (when optimising fully, for example
+// with -O3), which makes the conversions some three times faster.
+// Over the whole colour cube the fast conversion differs from the
+// exact one by at most about 0.005 delta E and a round trip changes
+// the BGR values by at most 0.1/255, so the output is unchanged at
+// 8 bit depth other than by rounding.  When 'ReportFastMathError'
+// is set, the colour difference between the fast conversion of each
+// target image and OpenCV's own conversion is reported.
+
+
+
+// Notes on JPEG Source Statistics.
+// ================================
+// Only the statistics of the source image are used, and for a JPEG
+// source image they can be estimated from the DCT coefficients,
+// which are read without the inverse DCT, upsampling and colour
+// conversion of a full decode.  For each 8x8 or 16x16 block of
+// pixels the means and (co)variances of the Y, Cb and Cr channels
+// are given by the coefficients, and these are carried into L*a*b*
+// by converting seven representative colours for each block.  The
+// estimated error, the difference between this estimate and one
+// made by linearising the conversion, is usually a few percent of
+// the standard deviations and is generally an overestimate; in
+// tests the statistics have been within 0.2 percent of those of
+// the decoded image.  The usual 4:2:0 chroma subsampling adds a
+// small error of its own, since the correlation of luminance and
+// chrominance within each block is then not known.  When
+// 'JpegStatisticsError' is greater than zero and at least the
+// estimated error, the statistics are used and the source image is
+// not decoded at all; otherwise the source image is decoded as
+// usual.  Moments files (option 10) take precedence.
+//
+// The coefficients are read with libjpeg, so the program must be
+// built with 'USE_LIBJPEG' defined and linked with '-ljpeg' for
+// this option.  Otherwise it has no effect and the source image is
+// always decoded.
+
+
+
+// Notes on Colour Space Comparison.
+// =================================
+// The CIELAB and L-alpha-beta colour spaces suit different images,
+// so the results of both are often rendered to choose between
+// them.  Run separately, the two programs each decode both images
+// and each compute the source statistics.  When 'ComparisonName'
+// is set the images are decoded once and each is converted to both
+// colour spaces in a single pass (see 'ConvertForwardPair' in
+// 'Common/TransferKernel.hpp'), so the image is read from memory
+// once for the statistics of both, and the converted target images
+// are used for the first iteration of each transfer.  The options
+// above apply to both transfers, except that the L-alpha-beta
+// output is clipped rather than rescaled, as in the alternative
+// implementation.  The results are written with '_cielab' and
+// '_lalphabeta' added to the output name, and the target image and
+// the results side by side to 'ComparisonName'.  The time taken by
+// each stage is reported.
+//
+// The further enhanced result is added when the program is built
+// with 'COMPARE_ENHANCED' defined and linked with the colour
+// transfer library (see 'Library/ColourTransfer.h'), with the
+// library's default enhanced options apart from the cross
+// covariance limit and fast functions selected here.  It is written
+// with '_enhanced' added.
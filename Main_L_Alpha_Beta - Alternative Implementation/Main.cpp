@@ -9,13 +9,26 @@
 
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/photo/photo.hpp>
+#include "../Common/Batch.hpp"
+#include "../Common/ImageIO.hpp"
+#include "../Common/Statistics.hpp"
+#include "../Common/TransferKernel.hpp"
+#include "../Common/MemoryTracker.hpp"
+#include "../Common/Tuning.hpp"
 #include <iostream>
+#include <fstream>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
 
 int main(int argc, char *argv[]);
-cv::Mat adjust_covariance(cv::Mat Lab[3], cv::Mat sLab[3],
-                          float covLim);
-cv::Mat convertTolab(cv::Mat input);
-cv::Mat convertFromlab(cv::Mat input);
+cv::Mat ColourTransfer(cv::Mat target, cv::Mat source,
+                       float CrossCovarianceLimit,
+                       bool  KeepOriginalShading,
+                       int   iterations,
+                       float ConvergenceTolerance,
+                       float FastMathError,
+                       bool  RgbTarget);
 
 
 int main(int argc, char *argv[])
@@ -41,6 +54,51 @@ int main(int argc, char *argv[])
 
 //  Option 3
 //  There is an option to iterate the processing more than once
+//  either a fixed number of times or, adaptively, until the
+//  image statistics match those of the source image.
+//  (See the note at the end of the code).
+
+//  Option 4
+//  There is an option to decode the source image at reduced
+//  resolution.  The source image contributes only its global
+//  statistics, so a large source image may be decoded at 1/2,
+//  1/4 or 1/8 scale.  The decoder averages the pixels, which
+//  lowers the standard deviations by an amount that depends on the
+//  image, so the change in the statistics may be reported.  The
+//  source image is decoded in full by default.
+//  (See the notes in 'Common/ImageIO.hpp').
+
+//  Option 5
+//  There is an option to select the bit depth of the output
+//  image (8 bit, 16 bit or 32 bit float) or to match the bit
+//  depth of the target image.  16 bit and float target images
+//  are processed at full precision.
+//  (See the notes in 'Common/ImageIO.hpp').
+
+//  Option 6
+//  There is an option to compute the image statistics
+//  deterministically, so that the output image is bit-identical
+//  whatever the number of processor threads.
+//  (See the note at the end of the code).
+
+//  Option 7
+//  There is an option to compute the logarithms and powers of ten
+//  in the L-alpha-beta transforms with fast approximations, within
+//  a specified maximum error in the output, and to report the
+//  error actually obtained.  The exact functions are the default.
+//  (See the note at the end of the code).
+
+//  Option 8
+//  There is an option to track the memory allocated for images
+//  and to report, for each image, the allocation counts and the
+//  allocated, peak and live memory of each processing stage.
+//  (See the note at the end of the code).
+
+//  Option 9
+//  There is an option to use the processing thread count, block
+//  size and choice of exact or fast functions found to be fastest
+//  for this machine and the image size, when the program has been
+//  run with the argument '--tune'.
 //  (See the note at the end of the code).
 
 
@@ -53,6 +111,20 @@ int main(int argc, char *argv[])
     float CrossCovarianceLimit     = 0.5;  // Option 1 (Default is '0.5'.)
     bool KeepOriginalShading       = true; // Option 2 (Default is 'true'.)
     int  iterations                = 2;    // Option 3 (Default is '2'.)
+    float ConvergenceTolerance     = 0.0;  // Option 3 (Default is '0.0'.)
+    float SourceAccuracy           = 0.0;  // Option 4 (Default is '0.0'.)
+    bool ReportDecodeDrift         = false;// Option 4 (Default is 'false'.)
+    // (SourceAccuracy, for example 0.001, keeps at least 1/SourceAccuracy^2
+    // pixels at reduced resolution, or 0 decodes the source image in full.)
+    int  OutputDepth               = 0;    // Option 5 (Default is '0'.)
+    // (OutputDepth may be 8, 16 or 32, or 0 to match the target image.)
+    bool DeterministicStatistics   = false;// Option 6 (Default is 'false'.)
+    float FastMathError            = 0.0;  // Option 7 (Default is '0.0'.)
+    // (FastMathError is the permitted output error in the range 0 to 1,
+    // for example 0.5/255, or 0 for the exact functions.)
+    bool ReportFastMathError       = false;// Option 7 (Default is 'false'.)
+    bool TrackMemory               = false;// Option 8 (Default is 'false'.)
+    bool UseMachineTuning          = true; // Option 9 (Default is 'true'.)
 
 
     // Specify the image files that are to be processed,
@@ -61,261 +133,220 @@ int main(int argc, char *argv[])
 
     std::string targetname = "images/Flowers_target.jpg";
     std::string sourcename = "images/Flowers_source.jpg";
+    std::string outputname = "images/processed.jpg";
+
+
+    // For batch processing, specify a list file in which each
+    // line gives a target, a source and an output file name.
+    // The files are then processed in a pipeline in which
+    // decoding, colour transfer and encoding run concurrently.
+    // (Leave 'batchname' empty to process the single image above.)
+    // (See the notes in 'Common/Batch.hpp'.)
+
+    std::string batchname = "";
+    int    DecodeThreads      = 2;     // Threads reading images.
+    int    TransferThreads    = 2;     // Threads transferring colour.
+    int    EncodeThreads      = 2;     // Threads writing images.
+    double MemoryBudgetMB     = 1024;  // Memory for images in flight.
+    bool   ShardedBatch       = false; // Share the list between processes.
+    double LeaseSeconds       = 600;   // Time before a stopped process's
+                                       // items are taken over.
+    int    ShardChunkItems    = 64;    // Items claimed at a time.
 
 // ###########################################################################
 // ###########################################################################
 // ###########################################################################
 
-    // Declare variables
-    cv::Scalar tmean, tdev, smean, sdev;
-
-    // Read in the files.
-    cv::Mat target = cv::imread(targetname, 1);
-    cv::Mat source = cv::imread(sourcename, 1);
-
-    cv::Mat targetf(target.size(),CV_32FC3);
-    cv::Mat sourcef(source.size(),CV_32FC3);
-    cv::Mat Lab[3], sLab[3];
-
+    SetDeterministicStatistics(DeterministicStatistics);
+    if(TrackMemory) EnableMemoryTracking();
 
-    // Convert the source image from the BGR colour
-    // space to the L-alpha-beta colour space.
-    // Estimate the mean and standard deviation of
-    // colour channels. Split the source image into
-    // channels and standardise the data in the
-    // colour channels (channels alpha and beta).
-    // The standardised data has zero mean and
-    // unit standard deviation.
-
-    sourcef = convertTolab(source);
+    // Tune the processing for this machine if requested.
+    if(argc>1 && std::string(argv[1])=="--tune")
+    {
+        RunTuner("L-alpha-beta",
+                 [&](const cv::Mat &t, const cv::Mat &s, bool fastMath)
+        {
+            ColourTransfer(t, s, CrossCovarianceLimit, KeepOriginalShading,
+                           iterations, ConvergenceTolerance,
+                           fastMath ? TuningFastMathError : 0.0f, false);
+        }, true);
+        return 0;
+    }
 
-    cv::meanStdDev(sourcef, smean, sdev);
-    cv::split(sourcef,sLab);
-    sLab[1]=(sLab[1]-smean[1])/sdev[1];
-    sLab[2]=(sLab[2]-smean[2])/sdev[2];
+    // The fast functions are only used (within the permitted error)
+    // if they are the faster on this machine.
+    TuningConfig tuning;
 
-    for (int i=1;i<=iterations;i++)
+    if(!batchname.empty())
     {
-     // Condition the target data as previously
-     // described for the source data.
-     targetf=convertTolab(target);
-
-     cv::meanStdDev(targetf, tmean, tdev);
-     cv::split(targetf,Lab);
-     Lab[1]=(Lab[1]-tmean[1])/tdev[1];
-     Lab[2]=(Lab[2]-tmean[2])/tdev[2];
-
-    // Implement cross covariance processing.
-    // (no effect if CrossCovarianceLimit=0)
-        float covLim=CrossCovarianceLimit*i/iterations;
-        targetf=adjust_covariance(Lab, sLab, covLim);
-        cv::split(targetf,Lab);
-
-
-     // Rescale the previously standardised colour channels
-     // so that the means and standard deviations now match
-     // those of the source image.
-     Lab[1]=Lab[1]*sdev[1]+smean[1];
-     Lab[2]=Lab[2]*sdev[2]+smean[2];
-
-     // If the original shading is not to be retained, then
-     // match the shading to that of the source image by
-     // standardising the data in the 'lightness' channel
-     // of the target image and then rescaling to match
-     // the corresponding channel of the source image.
-     if(!KeepOriginalShading)
-     {
-        Lab[0]=(Lab[0]-tmean[0])/tdev[0];
-        Lab[0]=Lab[0]*sdev[0]+smean[0];
-     }
-
-     cv::merge(Lab,3,targetf);
-
-     // Convert the processed image back to BGR values.
-     target = convertFromlab(targetf);
+        std::vector<std::string> targets, sources, outputs;
+        if(!ReadBatchList(batchname, targets, sources, outputs)) return 1;
+
+        // The tuned settings are chosen for each image's own size.
+        BatchTuning batchtuning;
+        bool tuned=UseMachineTuning && batchtuning.Load("L-alpha-beta");
+
+        BatchSettings batch;
+        batch.listname       =batchname;
+        batch.decodeThreads  =DecodeThreads;
+        batch.transferThreads=TransferThreads;
+        batch.encodeThreads  =EncodeThreads;
+        batch.memoryBudgetMB =MemoryBudgetMB;
+        batch.sharded        =ShardedBatch;
+        batch.leaseSeconds   =LeaseSeconds;
+        batch.chunkItems     =ShardChunkItems;
+        batch.tuning         =tuned ? &batchtuning : NULL;
+
+        auto decode=[&](BatchItem &item, size_t i)
+        {
+            float error=TunedFastMathError(item.tuning, FastMathError);
+            item.sourcef=ConvertToFloat(
+                         ReadSourceImage(LalphabetaSpace(0.07f, error),
+                                         sources[i], SourceAccuracy,
+                                         ReportDecodeDrift));
+            return !item.sourcef.empty();
+        };
+        auto transfer=[&](BatchItem &item)
+        {
+            float error=TunedFastMathError(item.tuning, FastMathError);
+            cv::Mat exact;
+            if(ReportFastMathError && error>0)
+                exact=ColourTransfer(item.targetf, item.sourcef,
+                                     CrossCovarianceLimit,
+                                     KeepOriginalShading,
+                                     iterations,
+                                     ConvergenceTolerance, 0.0,
+                                     item.mapped.rgb);
+            item.targetf=ColourTransfer(item.targetf, item.sourcef,
+                                        CrossCovarianceLimit,
+                                        KeepOriginalShading,
+                                        iterations,
+                                        ConvergenceTolerance, error,
+                                        item.mapped.rgb);
+            if(!exact.empty())
+                PrintFastMathError(item.outputname, exact,
+                                   item.targetf,
+                                   LalphabetaSpace(0.07f, error), error);
+        };
+        auto encode=[&](BatchItem &item)
+        {
+            WriteBatchItem(item, OutputDepth);
+        };
+
+        RunBatch<BatchItem>(batch, targets, outputs,
+                            decode, transfer, encode);
+        return 0;
     }
 
-     // Display and save the final image.
-     cv::imshow("processed image",target);
-     cv::imwrite("images/processed.jpg", target);
+    // Declare variables
+    MappedImage mapped;
+    int targetdepth;
+
+    // Read in the files and convert the images to float.
+    // (A PFM target image is mapped, read only and in RGB order,
+    // rather than read.)
+    cv::Mat target = ReadImageFloat(targetname, mapped, targetdepth);
+    if(UseMachineTuning &&
+       SelectTuning("L-alpha-beta", (double)target.total(), tuning) &&
+       !tuning.fastMath) FastMathError=0;
+    cv::Mat source = ReadSourceImage(LalphabetaSpace(0.07f, FastMathError),
+                                     sourcename, SourceAccuracy,
+                                     ReportDecodeDrift);
+
+    // Implement the colour transfer.
+    // (For the error report the exact result is computed first.)
+    cv::Mat sourcef = ConvertToFloat(source), exact;
+    if(ReportFastMathError && FastMathError>0)
+        exact = ColourTransfer(target, sourcef, CrossCovarianceLimit,
+                               KeepOriginalShading, iterations,
+                               ConvergenceTolerance, 0.0, mapped.rgb);
+    target = ColourTransfer(target, sourcef,
+                            CrossCovarianceLimit, KeepOriginalShading,
+                            iterations, ConvergenceTolerance,
+                            FastMathError, mapped.rgb);
+    if(!exact.empty())
+        PrintFastMathError(targetname, exact, target,
+                           LalphabetaSpace(0.07f, FastMathError),
+                           FastMathError);
+
+     // Save the final image in the selected bit depth.
+     if(OutputDepth==0) OutputDepth=targetdepth;
+     cv::Mat result;
+     bool written = WriteImageFloat(outputname, target, OutputDepth,
+                                    !mapped.image.empty(), &result);
+     if(!written) std::cout<<"Cannot write "<<outputname<<"\n";
+     UnmapImage(mapped);
+
+     // Report the memory used (if tracked).
+     PrintMemoryReport(-1, targetname);
+
+     // Display the final image.
+     cv::imshow("processed image",result);
 
     // Display images until a key is pressed.
      cv::waitKey(0);
-     return 0;
+     return written ? 0 : 1;
    }
 
 
 
-cv::Mat adjust_covariance(cv::Mat Lab[3], cv::Mat sLab[3], float covLim)
+cv::Mat ColourTransfer(cv::Mat target, cv::Mat source,
+                       float CrossCovarianceLimit,
+                       bool  KeepOriginalShading,
+                       int   iterations,
+                       float ConvergenceTolerance,
+                       float FastMathError,
+                       bool  RgbTarget)
 {
-        // This routine adjusts colour channels 2 and 3 of
-        // the image within the L-alpha-beta colour space.
-
-        // The channels each have zero mean and unit
-        // standard deviation but their cross correlation
-        // value will not normally be zero.
-        //
-        // The processing reduces the cross correlation between
-        // the channels to zero but then reintroduces
-        // correlation such that the new cross correlation
-        // value matches that for the source image.
-        //
-        // Throughout these manipulations the mean channel values
-        // are maintained at zero and the standard deviations are
-        // maintained as unity.
-        //
-        // The manipulations are based upon the following relationship.
-        //
-        // Let z1 and z2 be two independent (zero correlation) variables
-        // with zero means and unit standard deviations. It can be shown
-        // that variables a1 and a2 have zero means, unit standard
-        // deviations, and mutual cross correlation 'R' when:
-        //
-        // a1=sqrt((1+R)/2)*z1 + sqrt((1-R)/2)*z2
-        // a2=sqrt((1+R)/2)*z1 - sqrt((1-R)/2)*z2
-        //
-        // The above relationships are applied inversely to derive
-        // uncorrelated standardised colour channels variables from
-        // the standardised but correlated input channels.
-        //
-        // The above relationships are then applied directly to obtain
-        // standardised correlated colour channels with correlation
-        // matched to that of the source image colour channels.
-        //
-        // Original processing method attributable to Dr T E Johnson Sept 2019.
-
-        // Declare variables
-        float tcrosscorr, scrosscorr;
-        float W1, W2, norm;
-        cv::Mat temp1;
-        cv::Scalar smean, sdev, temp2;
-
-        // Compute the correlation for the target image colour channels.
-        // The correlation between the standardised variables (zero mean,
-        // unit standard deviation) can be computed as the mean cross
-        // product for the two channels.
-        cv::multiply(Lab[1],Lab[2],temp1);
-        temp2=cv::mean(temp1);
-        tcrosscorr =temp2[0];
-
-        std::cout<<tcrosscorr<<" =tcrosscorr \n";
-
-        // Compute the correlation for the source image colour channels.
-        cv::multiply(sLab[1],sLab[2],temp1);
-        temp2=cv::mean(temp1);
-        scrosscorr =temp2[0];
-        std::cout<<scrosscorr<<" =scrosscorr \n";
-
-        // Adjust the correlation between the standardised input
-        // channel values.
-        cv::Mat z1=Lab[1].clone();
-        cv::Mat z2=Lab[2].clone();
-
-        W1= 0.5*sqrt((1+scrosscorr)/(1+tcrosscorr))
-           +0.5*sqrt((1-scrosscorr)/(1-tcrosscorr));
-        W2= 0.5*sqrt((1+scrosscorr)/(1+tcrosscorr))
-           -0.5*sqrt((1-scrosscorr)/(1-tcrosscorr));
-
-        // Limit the size of W2 if required
-        if(std::abs(W2)>covLim*std::abs(W1))
-        {
-            W2=copysign(covLim*W1,W2);
-            norm=1.0/sqrt(W1*W1+W2*W2+2*W1*W2*tcrosscorr);
-            W1=W1*norm;
-            W2=W2*norm;
-        }
-
-        Lab[1]=W1*z1+W2*z2;
-        Lab[2]=W1*z2+W2*z1;
-
-        cv:merge(Lab,3,temp1);
-        return temp1;
-
-}
+// Implements the colour transfer for float BGR target and
+// source images in accordance with the processing options
+// described in the 'main' routine.
+//
+// The processing is carried out in the L-alpha-beta colour
+// space by the shared transfer kernel (see
+// 'Common/TransferKernel.hpp').  The colour channels (alpha and
+// beta) of the target are standardised (zero mean and unit
+// standard deviation), their cross correlation is adjusted to
+// match that of the source image and they are then rescaled to
+// the source means and standard deviations.  Unless the original
+// shading is to be kept, the 'lightness' channel is matched to
+// the source similarly.
+//
+// The smallest permitted LMS value before the logarithm is 0.07
+// and the output is clipped to the range 0 to 1 (as conversion
+// to integer format would) but kept at full precision.
+//
+// If 'FastMathError' is greater than zero, fast approximations
+// are used for the logarithms and powers of ten.
+//
+// If 'ConvergenceTolerance' is greater than zero, 'iterations'
+// is the maximum number of iterations and the processing stops
+// as soon as the image statistics match those of the source
+// image to within the tolerance, or stop improving.
+//
+// If 'RgbTarget' is set, 'target' is in RGB order (a mapped PFM
+// image) and is read as such.  The result is always BGR.
 
+    MemoryScope scope("Transfer");
 
+    TransferOptions opt;
+    int used;
 
-// ##########################################################################
-// ##### IMPLEMENTATION OF L-ALPHA-BETA FORWARD AND INVERSE TRANSFORMS ######
-// ##########################################################################
-// Coding taken from https://github.com/ZZPot/Color-transfer
-// Credit to 'ZZPot'.
-// I take responsibility for any issues arising my adaptation.
+    opt.crossCovarianceLimit=CrossCovarianceLimit;
+    opt.shaderVal=KeepOriginalShading ? 0.0f : 1.0f;
+    opt.clipOutput=true;
+    opt.iterations=iterations;
+    opt.convergenceTolerance=ConvergenceTolerance;
+    opt.rgbTarget=RgbTarget;
 
+    target=IterativeTransfer(LalphabetaSpace(0.07f, FastMathError),
+                             target, source, opt, &used);
 
-// Define the transformation matrices for L-alpha-beta transformation.
-cv::Mat RGB_to_LMS = (cv::Mat_<float>(3,3) <<	0.3811f, 0.5783f, 0.0402f,
-										        0.1967f, 0.7244f, 0.0782f,
-                                                0.0241f, 0.1288f, 0.8444f);
-float i3 = 1/sqrt(3), i6 = 1/sqrt(6), i2 = 1/sqrt(2);
-cv::Mat LMS_to_lab = (cv::Mat_<float>(3,3) <<	i3, i3, i3,
-										        i6, i6, -2*i6,
-                                                i2, -i2, 0);
+    if(ConvergenceTolerance>0) std::cout<<"Iterations used: "<<used<<"\n";
 
-cv::Mat convertTolab(cv::Mat input)
-{
-	cv::Mat img_RGB (input.size(),CV_8UC3);
-	cv::Mat img_RGBf(input.size(),CV_32FC3);
-    cv::Mat img_lms (input.size(),CV_32FC3);
-    cv::Mat img_lab (input.size(),CV_32FC3);
-
-	// Swap channel order (so that transformation
-	// matrices can be used in their familiar form).
-	// Then convert to float.
-	cv::cvtColor(input, img_RGB, CV_BGR2RGB);
-	img_RGB.convertTo(img_RGBf, CV_32FC3, 1.0/255.f);
-
-	// Apply stage 1 transform.
-	cv::transform(img_RGBf, img_lms, RGB_to_LMS);
-
-	// Define smallest permitted value and implement it.
-    float epsilon =0.07;
-	cv::Scalar min_scalar(epsilon, epsilon, epsilon);
-	cv::Mat min_mat = cv::Mat(input.size(), CV_32FC3, min_scalar);
-	cv::max(img_lms, min_mat, img_lms); // just before log operation.
-
-	// Compute log10(x)  as ln(x)/ln(10)
-	cv::log(img_lms,img_lms);
-	img_lms=img_lms/log(10);
-
-    // Apply stage 2 transform.
-	cv::transform(img_lms, img_lab, LMS_to_lab);
-
-	return img_lab;
+    return target;
 }
 
-cv::Mat convertFromlab(cv::Mat input)
-{
-	cv::Mat img_lms (input.size(),  CV_32FC3);
-	cv::Mat img_RGBf(input.size(),  CV_32FC3);
-	cv::Mat img_RGB (input.size(),  CV_8UC3);
-	cv::Mat img_BGR (input.size(),  CV_8UC3);
-    cv::Mat temp    (LMS_to_lab.size(),CV_32FC1);
-
-    // Apply inverse of stage 2 transformation.
-	cv::invert(LMS_to_lab,temp);
-	cv::transform(input, img_lms, temp);
-
-	// Compute 10^x as (e^x)^(ln10)
-    cv::exp(img_lms,img_lms);
-    cv::pow(img_lms,(double)log(10.0),img_lms);
-
-    // Apply inverse of stage 1 transformation.
-	cv::invert(RGB_to_LMS,temp);
-	cv::transform(img_lms, img_RGBf, temp);
-
-	// Convert to integer format and revert
-	// channel ordering to BGR.
-	img_RGBf.convertTo(img_RGB, CV_8UC3, 255.f);
-	cv::cvtColor(img_RGB, img_BGR, CV_RGB2BGR);
-
-	return img_BGR;
-}
-// ##########################################################################
-// ##########################################################################
-// ##########################################################################
-
-
 // Notes on Cross Correlation Matching.
 // ====================================
 // Cross correlation matching is performed by operations of the
@@ -355,6 +386,95 @@ cv::Mat convertFromlab(cv::Mat input)
 
 // Note that when iteration is performed, the limiting for CrossCovarianceLimit
 // is relaxed progressively at each iteration.
-
-
-
+//
+// Adaptive iteration is selected by setting 'ConvergenceTolerance' to a
+// value greater than zero, when 'iterations' becomes the maximum number
+// of iterations.  At the start of each iteration the means and standard
+// deviations of the colour channels (and of the lightness channel when
+// the shading is not retained) are compared with those of the source
+// image, relative to the source standard deviations, as is the colour
+// cross correlation when CrossCovarianceLimit is 1.0.  These values come
+// from the statistics pass which the iteration needs anyway.  Processing
+// stops when the largest difference is below the tolerance (0.01 is a
+// reasonable value) or is no longer falling, but only once an
+// iteration has applied the full cross covariance limit.  The limit is
+// relaxed over the first two iterations (half of it being applied in
+// the first), so easy images finish after two iterations, or after one
+// if the limit is zero or the maximum is one.  The number of
+// iterations used is reported.
+
+
+// Notes on Deterministic Statistics.
+// ==================================
+// The means, standard deviations and mean cross products are
+// computed in parallel and the order in which partial sums are
+// added then depends upon the number of threads.  The resulting
+// tiny differences are amplified by the later processing, so that
+// output images can differ slightly between machines.  When
+// 'DeterministicStatistics' is 'true' the statistics are computed
+// over blocks of a fixed size, in double precision, and the block
+// results are combined in a fixed order.  (See 'Common/Statistics.hpp'.)
+// The output is then bit-identical regardless of the thread count,
+// at a small extra cost.
+
+
+// Notes on Fast Approximate Transforms.
+// =====================================
+// The conversions to and from the L-alpha-beta colour space are
+// dominated by a logarithm and a power of ten per channel per
+// pixel.  When 'FastMathError' is set these are computed as
+// log2(x)*log10(2) and 2^(x*log2(10)), with the power of two part
+// handled exactly in the floating point representation and the
+// remainder by a short polynomial (see 'Common/ColourSpace.hpp').
+// The loops have no branches and are vectorised by the compiler.
+// The polynomial degree is the lowest for which a worst case bound
+// on the output error stays within 'FastMathError'.  The bound
+// allows for the gain of the transfer map of each iteration, which
+// scales the error of the forward conversion, so an image whose
+// colour is stretched strongly may be converted again with a
+// higher degree or with the exact functions.
+//
+// With 'ReportFastMathError' each image is also processed with the
+// exact functions and the largest and mean differences are
+// reported in 8 bit levels.  Run over a batch list of reference
+// images, this gives the measured error for the chosen budget.
+
+
+// Notes on Memory Tracking.
+// =========================
+// When 'TrackMemory' is 'true' every cv::Mat allocation is passed
+// through a tracking allocator (see 'Common/MemoryTracker.hpp')
+// which charges it to the processing stage active on the calling
+// thread: Decode, Transfer or Encode.
+// After each image is written a table is printed giving, for each
+// stage, the numbers of allocations and releases, the total bytes
+// allocated, the peak bytes live at any one time and the bytes
+// still live.  The '(all stages)' line gives the peak memory for
+// the image as a whole, which is the figure needed to size a
+// container for a given number of concurrent images.  Memory
+// allocated by OpenCV's own worker threads is reported separately
+// ('other threads') in batch processing.  Tracking adds a lock per
+// allocation and is off by default.
+
+
+// Notes on Machine Tuning.
+// ========================
+// The fastest number of processing threads, size of the blocks in
+// which the transfer kernel works through the image and choice
+// between the exact and the fast approximate functions depend upon
+// the processor and upon the image size.  Running the program as
+//     Main --tune
+// times the colour transfer, with the selected options, of
+// synthetic images of about 0.7, 2.8, 11 and 24 megapixels and
+// saves the fastest settings for each size in
+// 'ColourTransferTuning.txt' in the working directory (see
+// 'Common/Tuning.hpp'), keyed by the processor model.  When
+// 'UseMachineTuning' is set the settings for this machine and the
+// target image size are then used automatically.  In batch
+// processing the block size and the choice of functions are those
+// for the size of each image, while the number of threads is left
+// to the batch settings.  The fast functions are timed with an
+// error budget of 2/255 and are never used unless 'FastMathError'
+// permits them; the tuning only withdraws them on machines where
+// they are not the faster.  Deterministic statistics always use
+// the standard block size.